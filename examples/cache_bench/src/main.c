@@ -0,0 +1,267 @@
+#include <stdbool.h>
+
+#include "pl011_uart.h"
+#include "sysregs.h"
+
+#define STRINGIFY(x) #x
+
+#define cpu_read_sysreg(reg)                                             \
+  ({                                                                     \
+    uint64_t __val;                                                      \
+    __asm__ volatile("mrs %0, " STRINGIFY(reg) : "=r"(__val)::"memory"); \
+    __val;                                                               \
+  })
+
+#define cpu_write_sysreg(reg, val) \
+  ({ __asm__ volatile("msr " STRINGIFY(reg) ", %0" : : "r"(val) : "memory"); })
+
+// Roles, selected by the entry point in boot.S
+#define ROLE_PROBE 0
+#define ROLE_THRASHER 1
+
+#define CACHE_LINE 64
+
+// Buffers live past the image, in guest RAM the hypervisor backs on first
+// touch with pages of the colours of the VM.
+#define PROBE_BASE 0x01000000
+#define PROBE_SIZE (192 * 1024)
+#define THRASH_BASE 0x02000000
+#define THRASH_SIZE (4 * 1024 * 1024)
+
+// A chunk of probe loads which takes longer than this was cut by a switch
+// to another VM.
+#define SWITCH_GAP_USEC 200
+#define PROBE_CHUNK 64
+
+// Stage-1 descriptors, 4 KiB granule and 39-bit VAs starting at level 1
+#define PTE_TABLE 0x3
+#define PTE_BLOCK 0x1
+#define PTE_ATTR(idx) ((uint64_t)(idx) << 2)
+#define PTE_SH_INNER (3 << 8)
+#define PTE_AF (1 << 10)
+#define MAIR_IDX_DEVICE 0
+#define MAIR_IDX_NORMAL 1
+#define MAIR_VALUE ((0x00UL << (8 * MAIR_IDX_DEVICE)) | \
+                    (0xffUL << (8 * MAIR_IDX_NORMAL)))
+#define TCR_VALUE                                                   \
+  (25UL | (1UL << 8) | (1UL << 10) | (3UL << 12) | (1UL << 23) | \
+   (1UL << 32))
+
+static pl011_uart_regs_t* UART0 = (pl011_uart_regs_t*)UART0_BASE;
+
+static uint64_t l1_table[512] __attribute__((aligned(4096)));
+static uint64_t l2_table[512] __attribute__((aligned(4096)));
+
+static size_t putc(uint8_t c) {
+  if (c == '\n') {
+    uint8_t cc = '\r';
+    pl011_write(UART0, &cc, 1);
+  }
+  return pl011_write(UART0, &c, 1);
+}
+
+static size_t strlen(const char* s) {
+  size_t count = 0;
+  while (*s != '\0') {
+    count++;
+    s++;
+  }
+  return count;
+}
+
+static size_t puts(const char* s) {
+  size_t size = strlen(s);
+
+  while (size--) {
+    putc(*(s++));
+  }
+
+  return size;
+}
+
+static void put_u64(uint64_t val) {
+  char buf[20];
+  int len = 0;
+  do {
+    buf[len++] = '0' + val % 10;
+    val /= 10;
+  } while (val);
+  while (len--) {
+    putc(buf[len]);
+  }
+}
+
+static uint64_t read_counter() {
+  __asm__ volatile("isb" ::: "memory");
+  return cpu_read_sysreg(cntvct_el0);
+}
+
+static uint64_t ticks_to_nsec(uint64_t ticks, uint64_t count) {
+  return ticks * 1000000000UL / cpu_read_sysreg(cntfrq_el0) / count;
+}
+
+// Identity map the first GiB as write-back memory, except for the UART on
+// QEMU, and the fourth GiB, which holds the Raspberry Pi 4 peripherals, as
+// device memory. Without the stage-1 MMU every access would bypass the
+// cache.
+static void mmu_enable() {
+  for (uint64_t i = 0; i < 512; i++) {
+    const uint64_t pa = i << 21;
+    const bool device =
+        pa >= (UART0_BASE & ~0x1fffffUL) && pa < UART0_BASE + 0x200000;
+    l2_table[i] = pa | PTE_BLOCK | PTE_AF | PTE_SH_INNER |
+                  PTE_ATTR(device ? MAIR_IDX_DEVICE : MAIR_IDX_NORMAL);
+  }
+  l1_table[0] = (uint64_t)l2_table | PTE_TABLE;
+  l1_table[3] = (3UL << 30) | PTE_BLOCK | PTE_AF | PTE_ATTR(MAIR_IDX_DEVICE);
+
+  cpu_write_sysreg(mair_el1, MAIR_VALUE);
+  cpu_write_sysreg(tcr_el1, TCR_VALUE);
+  cpu_write_sysreg(ttbr0_el1, (uint64_t)l1_table);
+  __asm__ volatile("dsb sy; isb; tlbi vmalle1; dsb nsh; isb" ::: "memory");
+
+  const uint64_t sctlr = cpu_read_sysreg(sctlr_el1);
+  cpu_write_sysreg(sctlr_el1, sctlr | SCTLR_MMU_ENABLED |
+                                  SCTLR_D_CACHE_ENABLED |
+                                  SCTLR_I_CACHE_ENABLED);
+  __asm__ volatile("isb" ::: "memory");
+}
+
+// Chase pointers around a random cycle of PROBE_SIZE bytes, which fits in
+// the last-level cache but not in L1, so every load costs an L2 hit while
+// the lines stay cached and a DRAM access once another VM evicted them.
+// The first pass after each switch back to this VM is reported apart from
+// the others.
+static void run_probe() {
+  const uint64_t lines = PROBE_SIZE / CACHE_LINE;
+  const uint64_t gap =
+      cpu_read_sysreg(cntfrq_el0) / 1000000 * SWITCH_GAP_USEC;
+  uint8_t* buf = (uint8_t*)PROBE_BASE;
+
+  // Sattolo's shuffle yields a single cycle through every line.
+  uint64_t seed = 0x2545f4914f6cdd1d;
+  for (uint64_t i = 0; i < lines; i++) {
+    *(uint64_t*)(buf + i * CACHE_LINE) = i;
+  }
+  for (uint64_t i = lines - 1; i > 0; i--) {
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    const uint64_t j = seed % i;
+    uint64_t* a = (uint64_t*)(buf + i * CACHE_LINE);
+    uint64_t* b = (uint64_t*)(buf + j * CACHE_LINE);
+    const uint64_t tmp = *a;
+    *a = *b;
+    *b = tmp;
+  }
+  for (uint64_t i = 0; i < lines; i++) {
+    uint64_t* line = (uint64_t*)(buf + i * CACHE_LINE);
+    *line = (uint64_t)(buf + *line * CACHE_LINE);
+  }
+
+  puts("probe: started\n");
+  uint64_t* p = (uint64_t*)buf;
+  uint64_t warm_ticks = 0, warm_passes = 0;
+  uint64_t cold_ticks = 0, cold_passes = 0;
+  bool switched = false;
+  bool skip = false;
+  uint64_t report = read_counter();
+  while (true) {
+    // One pass loads every line once. A pass cut by a switch is dropped,
+    // and the one after it finds what the other VMs left in the cache.
+    const uint64_t start = read_counter();
+    uint64_t prev = start;
+    bool cut = false;
+    for (uint64_t n = 0; n < lines; n += PROBE_CHUNK) {
+      for (int i = 0; i < PROBE_CHUNK; i++) {
+        p = (uint64_t*)*p;
+      }
+      // Keep the compiler from dropping loads nobody reads.
+      __asm__ volatile("" : "+r"(p));
+      const uint64_t now = read_counter();
+      if (now - prev > gap) {
+        cut = true;
+        break;
+      }
+      prev = now;
+    }
+    if (cut) {
+      switched = true;
+      continue;
+    }
+    if (skip) {
+      skip = switched = false;
+      continue;
+    }
+    if (switched) {
+      cold_ticks += prev - start;
+      cold_passes++;
+    } else {
+      warm_ticks += prev - start;
+      warm_passes++;
+    }
+    switched = false;
+
+    if (prev - report < cpu_read_sysreg(cntfrq_el0) || !warm_passes) {
+      continue;
+    }
+    puts("probe: ");
+    put_u64(ticks_to_nsec(warm_ticks, warm_passes * lines));
+    puts(" ns/load warm");
+    if (cold_passes) {
+      puts(", ");
+      put_u64(ticks_to_nsec(cold_ticks, cold_passes * lines));
+      puts(" ns/load after a switch (");
+      put_u64(cold_passes);
+      puts(" switches)");
+    }
+    puts("\n");
+    warm_ticks = warm_passes = cold_ticks = cold_passes = 0;
+    // Printing traps to the hypervisor, which counts as neither.
+    skip = true;
+    report = read_counter();
+  }
+}
+
+// Write a byte to every line of THRASH_SIZE bytes, far more than the
+// last-level cache holds, so that each pass evicts every line of the page
+// colours of this VM.
+static void run_thrasher() {
+  volatile uint8_t* buf = (volatile uint8_t*)THRASH_BASE;
+  const uint64_t lines = THRASH_SIZE / CACHE_LINE;
+
+  puts("thrasher: started\n");
+  uint64_t report = read_counter();
+  uint64_t passes = 0;
+  uint8_t val = 0;
+  while (true) {
+    for (uint64_t i = 0; i < lines; i++) {
+      buf[i * CACHE_LINE] = val;
+    }
+    val++;
+    passes++;
+
+    const uint64_t now = read_counter();
+    if (now - report < cpu_read_sysreg(cntfrq_el0)) {
+      continue;
+    }
+    // Includes the time other VMs ran.
+    puts("thrasher: ");
+    put_u64(ticks_to_nsec(now - report, passes * lines));
+    puts(" ns/line\n");
+    passes = 0;
+    report = read_counter();
+  }
+}
+
+void bench_main(uint64_t role) {
+  pl011_receive_interrupt_enable(UART0);
+  pl011_uart_enable(UART0, UART_REFERENCE_CLOCK, 115200);
+
+  mmu_enable();
+  if (role == ROLE_THRASHER) {
+    run_thrasher();
+  } else {
+    run_probe();
+  }
+}
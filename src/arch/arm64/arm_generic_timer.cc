@@ -75,6 +75,10 @@ uint64_t ArmGenericTimer::GetTimerCount() {
   return READ_CPU_REG(cntpct_el0);
 }
 
+uint64_t ArmGenericTimer::CountToNsec(uint64_t count) {
+  return count * 1000000 / (GetCntfrq() / 1000);
+}
+
 uint8_t ArmGenericTimer::GetIStatus() {
   return (READ_CPU_REG(cnthp_ctl_el2) >> 2) & 0x1;
 }
@@ -24,6 +24,8 @@ class ArmGenericTimer {
   void Stop();
   void HandleIrq();
   uint64_t GetTimerCount();
+  // Convert a timer count delta to nanoseconds.
+  uint64_t CountToNsec(uint64_t count);
   uint8_t GetIStatus();
 
  private:
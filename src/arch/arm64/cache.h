@@ -0,0 +1,73 @@
+#ifndef EVISOR_ARCH_ARM64_CACHE_H_
+#define EVISOR_ARCH_ARM64_CACHE_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace evisor {
+
+// Smallest data cache line size in bytes, from CTR_EL0.DminLine.
+static inline size_t Arm64DCacheLineSize() {
+  uint64_t ctr;
+  __asm__ volatile("mrs %0, ctr_el0" : "=r"(ctr));
+  return 4UL << ((ctr >> 16) & 0xf);
+}
+
+// Run |op| on every data cache line covering [addr, addr + size), then wait
+// for the maintenance to complete.
+template <typename Op>
+static inline void Arm64DCacheRange(const void* addr, size_t size, Op op) {
+  const size_t line = Arm64DCacheLineSize();
+  const auto end = reinterpret_cast<uint64_t>(addr) + size;
+  for (auto cur = reinterpret_cast<uint64_t>(addr) & ~(line - 1); cur < end;
+       cur += line) {
+    op(cur);
+  }
+  __asm__ volatile("dsb sy" : : : "memory");
+}
+
+// Write dirty lines back to the Point of Coherency, e.g. before a device
+// reads the memory.
+static inline void Arm64CleanDCacheRange(const void* addr, size_t size) {
+  Arm64DCacheRange(addr, size, [](uint64_t va) {
+    __asm__ volatile("dc cvac, %[va]" : : [va] "r"(va) : "memory");
+  });
+}
+
+// Write dirty lines back and drop them, e.g. before a device writes the
+// memory.
+static inline void Arm64CleanInvalidateDCacheRange(const void* addr,
+                                                   size_t size) {
+  Arm64DCacheRange(addr, size, [](uint64_t va) {
+    __asm__ volatile("dc civac, %[va]" : : [va] "r"(va) : "memory");
+  });
+}
+
+// Drop lines without writing them back, e.g. after a device wrote the
+// memory. Lines only partly in the range lose the rest of their data too.
+static inline void Arm64InvalidateDCacheRange(const void* addr, size_t size) {
+  Arm64DCacheRange(addr, size, [](uint64_t va) {
+    __asm__ volatile("dc ivac, %[va]" : : [va] "r"(va) : "memory");
+  });
+}
+
+// Make a page filled by CPU stores safe to execute: clean the data cache to
+// the Point of Unification, then drop every instruction cache line, since
+// the guest may fetch through an alias. CTR_EL0.IDC and DIC tell when either
+// step is not needed.
+static inline void Arm64SyncICacheRange(const void* addr, size_t size) {
+  uint64_t ctr;
+  __asm__ volatile("mrs %0, ctr_el0" : "=r"(ctr));
+  if (!(ctr & (1UL << 28))) {
+    Arm64DCacheRange(addr, size, [](uint64_t va) {
+      __asm__ volatile("dc cvau, %[va]" : : [va] "r"(va) : "memory");
+    });
+  }
+  if (!(ctr & (1UL << 29))) {
+    __asm__ volatile("ic iallu\n\tdsb sy\n\tisb" : : : "memory");
+  }
+}
+
+}  // namespace evisor
+
+#endif  // EVISOR_ARCH_ARM64_CACHE_H_
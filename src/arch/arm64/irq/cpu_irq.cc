@@ -23,6 +23,21 @@ void CpuDisableIrq() {
   __asm__ volatile("msr daifset, #2");
 }
 
+uint64_t CpuSaveAndDisableIrq() {
+  uint64_t daif;
+  __asm__ volatile(
+      "mrs %0, daif\n"
+      "msr daifset, #2"
+      : "=r"(daif)
+      :
+      : "memory");
+  return daif;
+}
+
+void CpuRestoreIrq(uint64_t daif) {
+  __asm__ volatile("msr daif, %0" : : "r"(daif) : "memory");
+}
+
 void CpuInitIrqVectorTable() {
   __asm__ volatile(
       "adr x0, vector_table_el2\n"
@@ -18,6 +18,24 @@ void CpuEnableIrq();
 // Disable IRQ for EL2.
 void CpuDisableIrq();
 
+// Disable IRQ for EL2 and return the previous mask for CpuRestoreIrq().
+uint64_t CpuSaveAndDisableIrq();
+void CpuRestoreIrq(uint64_t daif);
+
+// Keep IRQ handlers out of a scope that updates state they share.
+class IrqSaveGuard {
+ public:
+  IrqSaveGuard() : daif_(CpuSaveAndDisableIrq()) {}
+  ~IrqSaveGuard() { CpuRestoreIrq(daif_); }
+
+  // Prevent copying.
+  IrqSaveGuard(IrqSaveGuard const&) = delete;
+  IrqSaveGuard& operator=(IrqSaveGuard const&) = delete;
+
+ private:
+  uint64_t daif_;
+};
+
 // Set vector table for EL2.
 void CpuInitIrqVectorTable();
 
@@ -34,7 +34,14 @@ class Gic {
                            uint8_t priority,
                            IrqHandler handler) = 0;
 
-  virtual void NotifyVirqSoftware() = 0;
+  // Raise |intid| in the current VM without a physical interrupt behind it.
+  virtual void NotifyVirqSoftware(uint16_t intid) = 0;
+
+  // Take the interrupt raised by NotifyVirqSoftware() off the CPU when its
+  // VM is switched out, and put it back when the VM is switched in again.
+  // Returns 0 once the guest has completed it.
+  virtual uint32_t SaveVirqSoftware() = 0;
+  virtual void RestoreVirqSoftware(uint32_t state) = 0;
 
   virtual void NotifyVirqHardware(uint16_t intid) = 0;
 
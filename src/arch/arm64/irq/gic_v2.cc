@@ -24,6 +24,7 @@ constexpr uint32_t kGichLrHw = (1 << 31);
 constexpr uint32_t kGichLrVirtualIrqGrp0 = (0 << 30);
 [[maybe_unused]] constexpr uint32_t kGichLrVirtualIrqGrp1 = (1 << 30);
 constexpr uint32_t kGichLrStatePending = (1 << 28);
+constexpr uint32_t kGichLrStateMask = (3 << 28);
 constexpr uint32_t GICH_LR_PRIORITY(uint32_t x) {
   return x << 23;
 }
@@ -34,6 +35,11 @@ constexpr uint32_t GICH_LR_VIRTUAL_ID(uint32_t x) {
   return x << 0;
 }
 
+// The list register of hardware interrupts, and the one of interrupts raised
+// by emulated devices
+constexpr int kLrHardware = 0;
+constexpr int kLrSoftware = 1;
+
 }  // namespace
 
 GicV2::GicV2() {
@@ -100,12 +106,27 @@ void GicV2::HandleIrq() {
   regs_.C->GICC_EOIR = iar;
 }
 
-void GicV2::NotifyVirqSoftware() {}
+void GicV2::NotifyVirqSoftware(uint16_t intid) {
+  regs_.H->GICH_LR[kLrSoftware] = kGichLrVirtualIrqGrp0 | kGichLrStatePending |
+                                  GICH_LR_PRIORITY(0) |
+                                  GICH_LR_VIRTUAL_ID(intid);
+}
+
+uint32_t GicV2::SaveVirqSoftware() {
+  const uint32_t lr = regs_.H->GICH_LR[kLrSoftware];
+  regs_.H->GICH_LR[kLrSoftware] = 0;
+  return (lr & kGichLrStateMask) ? lr : 0;
+}
+
+void GicV2::RestoreVirqSoftware(uint32_t state) {
+  regs_.H->GICH_LR[kLrSoftware] = state;
+}
 
 void GicV2::NotifyVirqHardware(uint16_t intid) {
-  regs_.H->GICH_LR[0] = kGichLrHw | kGichLrVirtualIrqGrp0 |
-                        kGichLrStatePending | GICH_LR_PRIORITY(0) |
-                        GICH_LR_PHYSICAL_ID(intid) | GICH_LR_VIRTUAL_ID(intid);
+  regs_.H->GICH_LR[kLrHardware] =
+      kGichLrHw | kGichLrVirtualIrqGrp0 | kGichLrStatePending |
+      GICH_LR_PRIORITY(0) | GICH_LR_PHYSICAL_ID(intid) |
+      GICH_LR_VIRTUAL_ID(intid);
 }
 
 void GicV2::NotifyIrqSoftware(uint32_t sgi_id, uint32_t cpu_id) {
@@ -28,7 +28,14 @@ class GicV2 : public Gic {
                    uint8_t priority,
                    IrqHandler handler) override;
 
-  void NotifyVirqSoftware() override;
+  // Priority of the highest active interrupt, or kIdlePriority if no
+  // interrupt is being handled.
+  uint8_t GetRunningPriority() const { return regs_.C->GICC_RPR & 0xff; }
+  static constexpr uint8_t kIdlePriority = 0xff;
+
+  void NotifyVirqSoftware(uint16_t intid) override;
+  uint32_t SaveVirqSoftware() override;
+  void RestoreVirqSoftware(uint32_t state) override;
 
   void NotifyVirqHardware(uint16_t intid) override;
 
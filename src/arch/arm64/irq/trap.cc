@@ -1,5 +1,6 @@
 #include "arch/arm64/irq/trap.h"
 
+#include "arch/arm64/cpu_regs_def.h"
 #include "common/logger.h"
 #include "common/macro.h"
 #include "kernel/sched/sched.h"
@@ -84,7 +85,7 @@ constexpr uint8_t kEsrEl2EcTrapSve = 0b011001;
 // Used for MMU faults generated by instruction accesses and
 // synchronous External aborts, including synchronous parity
 // or ECC errors. Not used for debug-related exceptions.
-[[maybe_unused]] constexpr uint8_t kEsrEl2EcInstructionAbortFromLow = 0b100000;
+constexpr uint8_t kEsrEl2EcInstructionAbortFromLow = 0b100000;
 constexpr uint8_t kEsrEl2EcDataAboartFromLow = 0b100100;
 
 constexpr uint8_t kIssTrappedMcrOrMrcAccessCp15 = 0b0010;
@@ -267,7 +268,7 @@ inline uint8_t ESR_EL2_ISS_EXCEPTION_FROM_DATA_ABORT_DFSC(uint64_t esr) {
 }
 [[maybe_unused]] constexpr uint8_t kEsrEl2DfscAddressSizeFault = 0b0000;
 constexpr uint8_t kEsrEl2DfscTranslationFault = 0b0001;
-[[maybe_unused]] constexpr uint8_t kEsrEl2DfscAccessFlagFault = 0b0010;
+constexpr uint8_t kEsrEl2DfscAccessFlagFault = 0b0010;
 constexpr uint8_t kEsrEl2DfscPermissionFault = 0b0011;
 
 /// SRT, bits [20:16]:
@@ -285,8 +286,15 @@ inline uint8_t ESR_EL2_ISS_EXCEPTION_FROM_DATA_ABORT_WNR(uint64_t esr) {
   return (esr >> 6) & 0x1;
 }
 constexpr uint8_t kEsrEl2IssExceptionFromDataAboartCausedByRead = 0;
-[[maybe_unused]] constexpr uint8_t
-    kEsrEl2IssExceptionFromDataAboartCausedByWrite = 1;
+constexpr uint8_t kEsrEl2IssExceptionFromDataAboartCausedByWrite = 1;
+
+/// The IPA of a stage-2 fault. FAR_EL2 holds the guest virtual address,
+/// which only equals the IPA while the guest runs with its MMU off.
+/// HPFAR_EL2.FIPA, bits [47:4], holds bits [51:12] of the IPA.
+inline ipa_t GetFaultIpa(uint64_t far) {
+  const uint64_t hpfar = READ_CPU_REG(hpfar_el2);
+  return ((hpfar & 0x0000'ffff'ffff'fff0) << 8) | (far & 0xfff);
+}
 
 inline bool HandleTrapMemAbort(va_t addr, uint64_t esr) {
   const auto dfsc = ESR_EL2_ISS_EXCEPTION_FROM_DATA_ABORT_DFSC(esr);
@@ -296,9 +304,16 @@ inline bool HandleTrapMemAbort(va_t addr, uint64_t esr) {
     case kEsrEl2DfscTranslationFault: {
       return evisor::HandleMmTrapMemoryAccessFault(addr);
     }
+    case kEsrEl2DfscAccessFlagFault: {
+      return evisor::HandleMmTrapAccessFlagFault(addr);
+    }
     case kEsrEl2DfscPermissionFault: {
       const uint8_t srt = ESR_EL2_ISS_EXCEPTION_FROM_DATA_ABORT_SRT(esr);
       const auto wnr = ESR_EL2_ISS_EXCEPTION_FROM_DATA_ABORT_WNR(esr);
+      if (wnr == kEsrEl2IssExceptionFromDataAboartCausedByWrite &&
+          evisor::HandleMmTrapWriteProtectFault(addr)) {
+        return true;
+      }
       return evisor::HandleMmTrapRegisterAccess(
           addr, srt, wnr == kEsrEl2IssExceptionFromDataAboartCausedByRead);
     }
@@ -310,6 +325,24 @@ inline bool HandleTrapMemAbort(va_t addr, uint64_t esr) {
   return false;
 }
 
+// Instruction fetches fault on pages not read yet or swapped out, as data
+// accesses do. IFSC uses the DFSC encoding.
+inline bool HandleTrapInstructionAbort(va_t addr, uint64_t esr) {
+  const uint8_t ifsc_without_level =
+      ESR_EL2_ISS_EXCEPTION_FROM_DATA_ABORT_DFSC(esr) >> 2;
+
+  switch (ifsc_without_level) {
+    case kEsrEl2DfscTranslationFault:
+      return evisor::HandleMmTrapMemoryAccessFault(addr);
+    case kEsrEl2DfscAccessFlagFault:
+      return evisor::HandleMmTrapAccessFlagFault(addr);
+    default:
+      LOG_WARN("Uncaught instruction abort: %d", esr & 0x3f);
+      break;
+  }
+  return false;
+}
+
 }  // namespace
 
 void TrapHandleLowerElAarch64Sync(uint64_t esr, uint64_t elr, uint64_t far,
@@ -332,8 +365,13 @@ void TrapHandleLowerElAarch64Sync(uint64_t esr, uint64_t elr, uint64_t far,
     case kEsrEl2EcTrapSve:
       PANIC("ESR_EL2_EC_TRAP_SVE has not yet been implemented.");
       break;
+    case kEsrEl2EcInstructionAbortFromLow:
+      if (!HandleTrapInstructionAbort(GetFaultIpa(far), esr)) {
+        PANIC("Failed to handle instruction abort trap");
+      }
+      break;
     case kEsrEl2EcDataAboartFromLow:
-      if (!HandleTrapMemAbort(far, esr)) {
+      if (!HandleTrapMemAbort(GetFaultIpa(far), esr)) {
         PANIC("Failed to handle memory abort trap");
       }
       break;
@@ -125,6 +125,13 @@
 #define TCR_TG0_4K                                   (0ULL << 14)
 #define TCR_TG0_64K                                  (1ULL << 14)
 #define TCR_TG0_16K                                  (2ULL << 14)
+#if (CONFIG_MMU_PAGE_SIZE_BITS == 16)
+#define TCR_TG0                                      TCR_TG0_64K
+#elif (CONFIG_MMU_PAGE_SIZE_BITS == 14)
+#define TCR_TG0                                      TCR_TG0_16K
+#else
+#define TCR_TG0                                      TCR_TG0_4K
+#endif
 #define TCR_EPD1_DISABLE                             (1ULL << 23)
 
 #define TCR_PS_BITS_4GB                              0x0ULL
@@ -155,11 +162,16 @@
 #define VTCR_NSW                                     (1 << 29)
 #define VTCR_VS                                      (0 << 19)
 #define VTCR_PS                                      (TCR_PS_BITS << 16)
-#define VTCR_TG0                                     TCR_TG0_4K
+#define VTCR_TG0                                     TCR_TG0
 #define VTCR_SH0                                     TCR_SHARED_INNER
 #define VTCR_ORGN0                                   TCR_ORGN_WBWA
 #define VTCR_IRGN0                                   TCR_IRGN_WBWA
-#define VTCR_SL0                                     (1 << 6)   // start at level1
+// SL0 encodes the start level differently for the 4KB granule.
+#if (CONFIG_MMU_PAGE_SIZE_BITS == 12)
+#define VTCR_SL0                                     ((2 - STAGE2_START_LEVEL) << 6)
+#else
+#define VTCR_SL0                                     ((3 - STAGE2_START_LEVEL) << 6)
+#endif
 #define VTCR_T0SZ                                    TCR_T0SZ(CONFIG_MMU_VA_BITS)
 
 #define VTCR_VALUE                                                 \
@@ -506,7 +518,7 @@ uint64_t Mmu::GetTcr(int el) {
   /* Translation table walk is cacheable, inner/outer WBWA and
    * inner shareable
    */
-  tcr |= TCR_TG0_4K | TCR_SHARED_INNER | TCR_ORGN_WBWA | TCR_IRGN_WBWA;
+  tcr |= TCR_TG0 | TCR_SHARED_INNER | TCR_ORGN_WBWA | TCR_IRGN_WBWA;
 
   return tcr;
 }
@@ -5,7 +5,9 @@
 // #define CONFIG_MMU_DEBUG
 
 /// The bit numbers of page table (= page size)
-/// Currently support only 4KB page table
+/// The choice could be: 12 (4KB), 14 (16KB), 16 (64KB)
+/// It is also the stage-2 translation granule, so each guest page is this
+/// size.
 #define CONFIG_MMU_PAGE_SIZE_BITS 12
 
 /// Virtual address space size
@@ -22,6 +24,11 @@
 /// The choice could be: 32, 36, 42, 48
 #define CONFIG_MMU_PA_BITS 36
 
+#if (CONFIG_MMU_PAGE_SIZE_BITS != 12) && (CONFIG_MMU_PAGE_SIZE_BITS != 14) && \
+    (CONFIG_MMU_PAGE_SIZE_BITS != 16)
+#error "CONFIG_MMU_PAGE_SIZE_BITS must be 12, 14 or 16"
+#endif
+
 /// maximum level of page table
 #define CONFIG_MMU_TABLE_LEVEL_MAX 3
 
@@ -10,7 +10,7 @@ constexpr int kMaxSize = 1024;
 }  // namespace
 
 Queue::Queue() {
-  buff_ = static_cast<uint32_t*>(kmm_malloc(kMaxSize));
+  buff_ = static_cast<uint32_t*>(kmm_malloc(kMaxSize * sizeof(uint32_t)));
   head_ = 0;
   tail_ = 0;
 }
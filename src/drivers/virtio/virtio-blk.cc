@@ -1,11 +1,17 @@
 #include "drivers/virtio/virtio-blk.h"
 
+#include <algorithm>
 #include <cstdint>
 
+#include "arch/arm64/cache.h"
+#include "arch/arm64/irq/cpu_irq.h"
+#include "arch/arm64/irq/gic_v2.h"
 #include "common/cstring.h"
 #include "common/logger.h"
 #include "common/macro.h"
+#include "kernel/sched/sched.h"
 #include "mm/uncached/kmm_uncached_malloc.h"
+#include "platforms/timer.h"
 
 // References:
 // * http://docs.oasis-open.org/virtio/virtio/v1.3/virtio-v1.3.html
@@ -31,14 +37,17 @@ constexpr uint32_t kDeviceStatusDriverOk = BIT32(2);
 constexpr uint32_t kDeviceStatusDriverFeatOk = BIT32(3);
 
 /*
- * Descriptor flags
+ * Feature bits, in words of 32 bits
  */
-// This marks a buffer as continuing via the next field.
-constexpr uint16_t kVRingDescFNext = 0x1;
-// This marks a buffer as device write-only (otherwise device read-only).
-constexpr uint16_t kVRingDescFWrite = 0x2;
-// This means the buffer contains a list of buffer descriptors.
-[[maybe_unused]] constexpr uint16_t kVRingDescFIndirect = 0x4;
+// Maximum size of any single segment is in size_max.
+constexpr uint32_t kVirtioBlkFSizeMax = BIT32(1);
+// Maximum number of segments in a request is in seg_max.
+constexpr uint32_t kVirtioBlkFSegMax = BIT32(2);
+// used_event/avail_event, or the event suppression descriptor offsets
+constexpr uint32_t kVirtioFRingEventIdx = BIT32(29);
+// Word 1: compliance with virtio 1.x, and the packed virtqueue layout
+constexpr uint32_t kVirtioFVersion1 = BIT32(32 - 32);
+constexpr uint32_t kVirtioFRingPacked = BIT32(34 - 32);
 
 /*
  * Device operation flags
@@ -53,17 +62,40 @@ constexpr uint8_t kVirtioBlkStatusOk = 0;
 [[maybe_unused]] constexpr uint8_t kVirtioBlkStatusIOError = 1;
 [[maybe_unused]] constexpr uint8_t kVirtioBlkStatusUnSupp = 2;
 
+constexpr uint8_t kVirtioBlkIrqPriority = 0x7f;
+
 }  // namespace
 
 void VirtioBlk::Init() {
+  // The device is shared by every image load, and may have requests in
+  // flight.
+  if (virtq_) {
+    return;
+  }
+
   DeviceInit();
   BlockDeviceInit();
 
-  LOG_INFO("virtio: %d bytes capacity", GetDiskCapacity());
+  LOG_INFO("virtio: %d bytes capacity, %d segments of %d bytes per request",
+           GetDiskCapacity(), max_segments_, segment_size_);
+  LOG_INFO("virtio: %s transport, %s virtqueue%s",
+           modern_ ? "modern" : "legacy", packed_ ? "packed" : "split",
+           event_idx_ ? " with event index" : "");
+
+  // Allocate a memory space for the disk requests.
+  constexpr size_t kDataSize = kVirtioBlkMaxSectors * kDiskSectorSize;
+  auto* reqs = reinterpret_cast<VirtioBlkReq*>(evisor::kmm_uncached_malloc(
+      __builtin_align_up(sizeof(VirtioBlkReq) * kVirtioBlkMaxRequests,
+                         PAGE_SIZE)));
+  auto* data = reinterpret_cast<uint8_t*>(evisor::kmm_uncached_malloc(
+      __builtin_align_up(kDataSize * kVirtioBlkMaxRequests, PAGE_SIZE)));
+  for (int i = 0; i < kVirtioBlkMaxRequests; i++) {
+    requests_[i].req = &reqs[i];
+    requests_[i].data = data + i * kDataSize;
+  }
 
-  // Allocate a memory space for a disk request.
-  virtq_->blk_req = reinterpret_cast<VirtioBlkReq*>(evisor::kmm_uncached_malloc(
-      __builtin_align_up(sizeof(VirtioBlkReq), PAGE_SIZE)));
+  GicV2::Get().RegisterIrq(VIRTIO_IRQ, 0, kVirtioBlkIrqPriority,
+                           [this]() { HandleIrq(); });
 }
 
 uint64_t VirtioBlk::GetDiskCapacity() {
@@ -71,23 +103,38 @@ uint64_t VirtioBlk::GetDiskCapacity() {
 }
 
 bool VirtioBlk::ReadDisk(void* buf, uint32_t sector_idx) {
-  return ReadWriteDisk(buf, sector_idx, false);
+  return ReadWriteDisk(buf, sector_idx, 1, false, WaitMode::kPoll);
 }
 
 bool VirtioBlk::WriteDisk(void* buf, uint32_t sector_idx) {
-  return ReadWriteDisk(buf, sector_idx, true);
+  return ReadWriteDisk(buf, sector_idx, 1, true, WaitMode::kPoll);
+}
+
+bool VirtioBlk::ReadSectors(void* buf,
+                            uint64_t sector_idx,
+                            size_t count,
+                            WaitMode mode) {
+  return ReadWriteDisk(buf, sector_idx, count, false, mode);
+}
+
+bool VirtioBlk::WriteSectors(const void* buf,
+                             uint64_t sector_idx,
+                             size_t count,
+                             WaitMode mode) {
+  return ReadWriteDisk(const_cast<void*>(buf), sector_idx, count, true, mode);
 }
 
 void VirtioBlk::DeviceInit() {
-  // Leagacy device returns 0x74726976, which means string "virt".
+  // The device returns 0x74726976, which means string "virt".
   if (regs_->MAGIC_VALUE != 0x74726976) {
     PANIC("virtio: unexpected magic value: %x", regs_->MAGIC_VALUE);
   }
 
-  // Legacy device returns value 0x1.
-  if (regs_->VERSION != 1) {
+  // Legacy device returns value 0x1, and the modern one 0x2.
+  if (regs_->VERSION != 1 && regs_->VERSION != 2) {
     PANIC("virtio: unexpected version: %x", regs_->VERSION);
   }
+  modern_ = regs_->VERSION == 2;
 
   // Device type: 1 is net, 2 is disk.
   if (regs_->DEVICE_ID != 2) {
@@ -103,6 +150,44 @@ void VirtioBlk::DeviceInit() {
   // Set DRIVER bit which states that we have a driver for the device.
   regs_->DEVICE_STATUS = regs_->DEVICE_STATUS | kDeviceStatusDriver;
 
+  // Accept the segment limits, so that a request can carry more than one data
+  // descriptor, and the event index to skip notifications and interrupts.
+  regs_->DEVICE_FEATURES_SEL = 0;
+  const uint32_t features =
+      regs_->DEVICE_FEATURES &
+      (kVirtioBlkFSizeMax | kVirtioBlkFSegMax | kVirtioFRingEventIdx);
+  regs_->DRIVER_FEATURES_SEL = 0;
+  regs_->DRIVER_FEATURES = features;
+  event_idx_ = features & kVirtioFRingEventIdx;
+
+  // A modern device must be driven as such, and may offer the packed layout.
+  if (modern_) {
+    regs_->DEVICE_FEATURES_SEL = 1;
+    const uint32_t features_hi =
+        regs_->DEVICE_FEATURES & (kVirtioFVersion1 | kVirtioFRingPacked);
+    if (!(features_hi & kVirtioFVersion1)) {
+      PANIC("virtio: VIRTIO_F_VERSION_1 is not offered");
+    }
+    regs_->DRIVER_FEATURES_SEL = 1;
+    regs_->DRIVER_FEATURES = features_hi;
+    packed_ = features_hi & kVirtioFRingPacked;
+  }
+
+  // Without VIRTIO_BLK_F_SIZE_MAX, a segment may be as large as the request.
+  constexpr uint32_t kMaxRequestSize = kVirtioBlkMaxSectors * kDiskSectorSize;
+  if (features & kVirtioBlkFSizeMax) {
+    const uint32_t size_max = regs_->CONFIG_SIZE_MAX;
+    segment_size_ = std::min(size_max, kMaxRequestSize);
+    segment_size_ = std::max<uint32_t>(
+        segment_size_ / kDiskSectorSize * kDiskSectorSize, kDiskSectorSize);
+  }
+  max_segments_ = 1;
+  if (features & kVirtioBlkFSegMax) {
+    // The header and the status take two descriptors.
+    const uint32_t seg_max = regs_->CONFIG_SEG_MAX;
+    max_segments_ = std::clamp<uint32_t>(seg_max, 1, kVirtQueueSize - 2);
+  }
+
   // Set FEATURES_OK bit.
   regs_->DEVICE_STATUS = regs_->DEVICE_STATUS | kDeviceStatusDriverFeatOk;
   if (!(regs_->DEVICE_STATUS & kDeviceStatusDriverFeatOk)) {
@@ -115,9 +200,13 @@ void VirtioBlk::BlockDeviceInit() {
   virtq_ = reinterpret_cast<Virtq*>(evisor::kmm_uncached_malloc(
       __builtin_align_up(sizeof(Virtq), PAGE_SIZE)));
 
-  // Initialize the index of the Virtqueue Used Ring.
-  virtq_->used.index = 0;
-  virtq_->last_used_index = 0;
+  if (packed_) {
+    queue_.InitPacked(virtq_->packed.descs, &virtq_->packed.driver_event,
+                      &virtq_->packed.device_event, event_idx_);
+  } else {
+    queue_.InitSplit(virtq_->split.descs, &virtq_->split.avail,
+                     &virtq_->split.used, event_idx_);
+  }
 
   // Initialize queue 0.
   {
@@ -129,13 +218,35 @@ void VirtioBlk::BlockDeviceInit() {
   }
 
   // Set queue size.
+  if (regs_->QUEUE_NUM_MAX < kVirtQueueSize) {
+    PANIC("virtio: the queue is too small: %d", regs_->QUEUE_NUM_MAX);
+  }
   regs_->QUEUE_NUM = kVirtQueueSize;
 
-  // Set the Used Ring alignment in the virtqueue.
-  regs_->QUEUE_ALIGN = PAGE_SIZE;
-
-  // Set the descriptor table head address.
-  regs_->QUEUE_PFN = reinterpret_cast<uint64_t>(virtq_->descs);
+  if (modern_) {
+    // Set the addresses of the three parts of the virtqueue.
+    const auto desc = reinterpret_cast<uint64_t>(
+        packed_ ? static_cast<void*>(virtq_->packed.descs)
+                : virtq_->split.descs);
+    const auto driver = reinterpret_cast<uint64_t>(
+        packed_ ? static_cast<void*>(&virtq_->packed.driver_event)
+                : &virtq_->split.avail);
+    const auto device = reinterpret_cast<uint64_t>(
+        packed_ ? static_cast<void*>(&virtq_->packed.device_event)
+                : &virtq_->split.used);
+    regs_->QUEUE_DESC_LOW = desc;
+    regs_->QUEUE_DESC_HIGH = desc >> 32;
+    regs_->QUEUE_DRIVER_LOW = driver;
+    regs_->QUEUE_DRIVER_HIGH = driver >> 32;
+    regs_->QUEUE_DEVICE_LOW = device;
+    regs_->QUEUE_DEVICE_HIGH = device >> 32;
+  } else {
+    // Set the Used Ring alignment in the virtqueue.
+    regs_->QUEUE_ALIGN = PAGE_SIZE;
+
+    // Set the descriptor table head address.
+    regs_->QUEUE_PFN = reinterpret_cast<uint64_t>(virtq_->split.descs);
+  }
 
   // Queue is ready.
   regs_->QUEUE_READY = 1;
@@ -144,85 +255,412 @@ void VirtioBlk::BlockDeviceInit() {
   regs_->DEVICE_STATUS = regs_->DEVICE_STATUS | kDeviceStatusDriverOk;
 }
 
-bool VirtioBlk::ReadWriteDisk(void* buf, uint32_t sector_idx, bool is_write) {
+bool VirtioBlk::ReadWriteDisk(void* buf,
+                              uint64_t sector_idx,
+                              size_t count,
+                              bool is_write,
+                              WaitMode mode) {
+  const Segment seg = {
+      .buf = static_cast<uint8_t*>(buf),
+      .size = static_cast<uint32_t>(count * kDiskSectorSize),
+  };
+  return ReadWriteSegments(&seg, 1, sector_idx, is_write, mode);
+}
+
+bool VirtioBlk::ReadPages(void* const* pages,
+                          uint64_t sector_idx,
+                          size_t count,
+                          WaitMode mode) {
+  Segment segs[kMaxRequestSegments];
+  for (size_t i = 0; i < count; i += kMaxRequestSegments) {
+    const size_t n = std::min(count - i, kMaxRequestSegments);
+    for (size_t j = 0; j < n; j++) {
+      segs[j] = {.buf = static_cast<uint8_t*>(pages[i + j]), .size = PAGE_SIZE};
+    }
+    if (!ReadWriteSegments(segs, n, sector_idx, false, mode)) {
+      return false;
+    }
+    sector_idx += n * PAGE_SIZE / kDiskSectorSize;
+  }
+  return true;
+}
+
+bool VirtioBlk::WritePages(void* const* pages,
+                           uint64_t sector_idx,
+                           size_t count,
+                           WaitMode mode) {
+  Segment segs[kMaxRequestSegments];
+  for (size_t i = 0; i < count; i += kMaxRequestSegments) {
+    const size_t n = std::min(count - i, kMaxRequestSegments);
+    for (size_t j = 0; j < n; j++) {
+      segs[j] = {.buf = static_cast<uint8_t*>(pages[i + j]), .size = PAGE_SIZE};
+    }
+    if (!ReadWriteSegments(segs, n, sector_idx, true, mode)) {
+      return false;
+    }
+    sector_idx += n * PAGE_SIZE / kDiskSectorSize;
+  }
+  return true;
+}
+
+bool VirtioBlk::ReadWriteSegments(const Segment* segs,
+                                  size_t num_segs,
+                                  uint64_t sector_idx,
+                                  bool is_write,
+                                  WaitMode mode) {
+  uint64_t count = 0;
+  for (size_t i = 0; i < num_segs; i++) {
+    count += segs[i].size / kDiskSectorSize;
+  }
   const auto sector_nums = GetDiskCapacity() / kDiskSectorSize;
-  if (sector_idx >= sector_nums) {
-    LOG_ERROR("virtio: The sector (%d) is over the capacity (%d)", sector_idx,
-              sector_nums);
+  if (sector_idx >= sector_nums || count > sector_nums - sector_idx) {
+    LOG_ERROR("virtio: The sectors (%d+%d) are over the capacity (%d)",
+              sector_idx, count, sector_nums);
     return false;
   }
 
-  // Format the three descriptors.
-  {
-    virtq_->blk_req->type = is_write ? kVirtioBlkTOut : kVirtioBlkTIn;
-    virtq_->blk_req->reserved = 0;
-    virtq_->blk_req->sector = sector_idx;
-    if (is_write) {
-      memcpy(virtq_->blk_req->data, buf, kDiskSectorSize);
+  struct Transfer {
+    uint32_t pending;
+    bool ok;
+  } transfer = {0, true};
+  auto done = [](void* arg, bool ok) {
+    auto* transfer = static_cast<Transfer*>(arg);
+    transfer->pending--;
+    transfer->ok = transfer->ok && ok;
+  };
+
+  // Keep as many requests in flight as the queue holds. Each one gathers
+  // the next segments until it is full or out of data descriptors.
+  const size_t max_sectors = GetMaxRequestSectors();
+  size_t seg = 0;
+  uint32_t off = 0;
+  while (count || transfer.pending) {
+    bool submitted = false;
+    while (count) {
+      Segment req_segs[kMaxRequestSegments];
+      size_t n = 0;
+      size_t sectors = 0;
+      uint32_t descs = 0;
+      size_t next_seg = seg;
+      uint32_t next_off = off;
+      while (next_seg < num_segs && sectors < max_sectors &&
+             descs < max_segments_) {
+        uint32_t size = std::min<uint64_t>(
+            segs[next_seg].size - next_off,
+            (max_sectors - sectors) * kDiskSectorSize);
+        size = std::min(size, (max_segments_ - descs) * segment_size_);
+        if (size) {
+          req_segs[n++] = {.buf = segs[next_seg].buf + next_off, .size = size};
+          sectors += size / kDiskSectorSize;
+          descs += (size + segment_size_ - 1) / segment_size_;
+          next_off += size;
+        }
+        if (next_off == segs[next_seg].size) {
+          next_seg++;
+          next_off = 0;
+        }
+      }
+      if (!Submit(req_segs, n, sector_idx, is_write, done, &transfer)) {
+        break;
+      }
+      transfer.pending++;
+      submitted = true;
+      seg = next_seg;
+      off = next_off;
+      sector_idx += sectors;
+      count -= sectors;
+    }
+    if (submitted) {
+      Kick();
+    }
+    if (transfer.pending) {
+      WaitForCompletion(mode, &transfer.pending);
     }
+  }
+  return transfer.ok;
+}
+
+bool VirtioBlk::SubmitRead(void* buf,
+                           uint64_t sector_idx,
+                           size_t count,
+                           Completion done,
+                           void* arg) {
+  const Segment seg = {
+      .buf = static_cast<uint8_t*>(buf),
+      .size = static_cast<uint32_t>(count * kDiskSectorSize),
+  };
+  return Submit(&seg, 1, sector_idx, false, done, arg);
+}
+
+bool VirtioBlk::SubmitWrite(const void* buf,
+                            uint64_t sector_idx,
+                            size_t count,
+                            Completion done,
+                            void* arg) {
+  const Segment seg = {
+      .buf = static_cast<uint8_t*>(const_cast<void*>(buf)),
+      .size = static_cast<uint32_t>(count * kDiskSectorSize),
+  };
+  return Submit(&seg, 1, sector_idx, true, done, arg);
+}
+
+size_t VirtioBlk::GetMaxRequestSectors() const {
+  // A request cannot carry more than its segments can hold.
+  return std::min<size_t>(kVirtioBlkMaxSectors,
+                          max_segments_ * segment_size_ / kDiskSectorSize);
+}
 
-    {
-      auto blk_req_addr = reinterpret_cast<uint64_t>(virtq_->blk_req);
+bool VirtioBlk::Submit(const Segment* segs,
+                       size_t num_segs,
+                       uint64_t sector_idx,
+                       bool is_write,
+                       Completion done,
+                       void* arg) {
+  uint32_t size = 0;
+  uint16_t num_descs = 2;
+  for (size_t i = 0; i < num_segs; i++) {
+    size += segs[i].size;
+    num_descs += (segs[i].size + segment_size_ - 1) / segment_size_;
+  }
+  const size_t count = size / kDiskSectorSize;
+  if (!count || size % kDiskSectorSize || num_segs > kMaxRequestSegments ||
+      count > GetMaxRequestSectors() ||
+      num_descs - 2U > max_segments_) {
+    LOG_ERROR("virtio: invalid request of %d sectors in %d segments", count,
+              num_segs);
+    return false;
+  }
 
-      virtq_->descs[0].addr = blk_req_addr;
-      virtq_->descs[0].len = sizeof(uint32_t) * 2 + sizeof(uint64_t);
-      virtq_->descs[0].flags = kVRingDescFNext;
-      virtq_->descs[0].next = 1;
+  // The hypervisor maps its memory 1:1, so the device can access the
+  // caller's buffer directly. A read into a buffer sharing its first or last
+  // cache line with other data would lose that data when the line is
+  // invalidated, so such buffers go through the bounce buffer.
+  const size_t line = Arm64DCacheLineSize();
+  bool bounce = false;
+  for (size_t i = 0; i < num_segs; i++) {
+    bounce = bounce ||
+             ((reinterpret_cast<uint64_t>(segs[i].buf) | segs[i].size) &
+              (line - 1));
+  }
+  if (bounce && num_segs > 1) {
+    LOG_ERROR("virtio: segments must be aligned to the cache line");
+    return false;
+  }
 
-      virtq_->descs[1].addr = blk_req_addr + offsetof(VirtioBlkReq, data);
-      virtq_->descs[1].len = kDiskSectorSize;
+  IrqSaveGuard guard;
+  Request* request = nullptr;
+  for (auto& r : requests_) {
+    if (!r.busy) {
+      request = &r;
+      break;
+    }
+  }
+  if (!request || queue_.NumFree() < num_descs) {
+    return false;
+  }
+
+  *request = {
+      .req = request->req,
+      .data = request->data,
+      .segs = {},
+      .num_segs = static_cast<uint8_t>(num_segs),
+      .size = size,
+      .is_write = is_write,
+      .bounce = bounce,
+      .busy = true,
+      .id = 0,
+      .submit_usec = Timer::GetSystemUsec(),
+      .done = done,
+      .arg = arg,
+  };
+  std::copy(segs, segs + num_segs, request->segs);
+
+  request->req->type = is_write ? kVirtioBlkTOut : kVirtioBlkTIn;
+  request->req->reserved = 0;
+  request->req->sector = sector_idx;
+  request->req->status = 0xff;  // device writes 0 on success
+  if (bounce) {
+    stat_.bounced++;
+    if (is_write) {
+      memcpy(request->data, segs[0].buf, size);
+    }
+  } else {
+    for (size_t i = 0; i < num_segs; i++) {
       if (is_write) {
-        virtq_->descs[1].flags = 0;  // device reads the data
+        Arm64CleanDCacheRange(segs[i].buf, segs[i].size);
       } else {
-        virtq_->descs[1].flags = kVRingDescFWrite;  // device writes the data
+        // No dirty line may be written back over the data from the device.
+        Arm64CleanInvalidateDCacheRange(segs[i].buf, segs[i].size);
       }
-      virtq_->descs[1].flags |= kVRingDescFNext;
-      virtq_->descs[1].next = 2;
+    }
+  }
 
-      virtq_->blk_req->status = 0xff;  // device writes 0 on success
-      virtq_->descs[2].addr = blk_req_addr + offsetof(VirtioBlkReq, status);
-      virtq_->descs[2].len = sizeof(uint8_t);
-      virtq_->descs[2].flags = kVRingDescFWrite;  // device writes the status
+  // Format the descriptors: the header, the data segments and the status.
+  const auto req_addr = reinterpret_cast<uint64_t>(request->req);
+  VirtqBuffer chain[kVirtQueueSize];
+  chain[0] = {
+      .addr = req_addr,
+      .len = sizeof(uint32_t) * 2 + sizeof(uint64_t),
+      .device_writes = false,
+  };
+  uint16_t desc = 1;
+  for (size_t i = 0; i < num_segs; i++) {
+    const auto data_addr =
+        reinterpret_cast<uint64_t>(bounce ? request->data : segs[i].buf);
+    for (uint32_t off = 0; off < segs[i].size; off += segment_size_) {
+      chain[desc++] = {
+          .addr = data_addr + off,
+          .len = std::min(segment_size_, segs[i].size - off),
+          // device reads or writes the data
+          .device_writes = !is_write,
+      };
     }
   }
+  chain[desc] = {
+      .addr = req_addr + offsetof(VirtioBlkReq, status),
+      .len = sizeof(uint8_t),
+      .device_writes = true,  // device writes the status
+  };
+
+  queue_.Add(chain, num_descs, &request->id);
+  head_requests_[request->id] = request;
+
+  inflight_++;
+  stat_.requests++;
+  stat_.max_inflight = std::max(stat_.max_inflight, inflight_);
+  return true;
+}
 
-  // Start the virtio operation
-  {
-    int desc_start_idx = 0;
+void VirtioBlk::Kick() {
+  IrqSaveGuard guard;
 
-    // Notify the device of the first index in our chain of descriptors.
-    virtq_->avail.ring[virtq_->avail.index % kVirtQueueSize] = desc_start_idx;
-    __sync_synchronize();
+  if (!queue_.NumAdded()) {
+    return;
+  }
+  const bool notify = queue_.PublishAvail();
+  if (!notify) {
+    stat_.suppressed_kicks++;
+    return;
+  }
+  regs_->QUEUE_NOTIFY = 0;
+  stat_.kicks++;
+}
 
-    // Notify the device of another avail ring entry is available.
-    virtq_->avail.index++;
-    __sync_synchronize();
+size_t VirtioBlk::Poll() {
+  IrqSaveGuard guard;
+  return HarvestUsedRing();
+}
 
-    regs_->QUEUE_NOTIFY = 0;
-    virtq_->last_used_index++;
+size_t VirtioBlk::HarvestUsedRing() {
+  // The interrupt is re-armed before the ring is found empty, so that no
+  // entry used meanwhile is left without one.
+  const size_t completed =
+      VirtqHarvest(queue_, [this](uint16_t id, uint32_t len) {
+        UNUSED(len);
+        CompleteRequest(id);
+      });
+  if (completed) {
+    stat_.batches++;
+  }
 
-    // Wait for the device to say the request has finished.
-    while (VirtqIsBusy()) {
-      ;
+  // Every waiter checks its own requests when it runs again.
+  auto& sched = Sched::Get();
+  while (completed && waiters_) {
+    const int pid = __builtin_ctz(waiters_);
+    waiters_ &= waiters_ - 1;
+    auto* tsk = sched.GetTask(pid);
+    if (tsk && tsk->state == WAITTING) {
+      tsk->state = RUNNING;
     }
-    if (virtq_->blk_req->status != kVirtioBlkStatusOk) {
-      LOG_ERROR("virtio: failed to transfor the sector (%d), status (%d)",
-                sector_idx, virtq_->blk_req->status);
-      return false;
+  }
+  return completed;
+}
+
+void VirtioBlk::CompleteRequest(uint16_t id) {
+  auto* request = id < kVirtQueueSize ? head_requests_[id] : nullptr;
+  if (!request) {
+    // Nothing is known about the chain, so the ring cannot be trusted.
+    PANIC("virtio: unexpected used descriptor (%d)", id);
+  }
+  head_requests_[id] = nullptr;
+
+  if (!request->is_write && !request->bounce) {
+    // Drop the lines fetched speculatively while the device wrote.
+    for (size_t i = 0; i < request->num_segs; i++) {
+      Arm64InvalidateDCacheRange(request->segs[i].buf, request->segs[i].size);
     }
   }
+  const uint32_t latency = Timer::GetSystemUsec() - request->submit_usec;
+  latency_usec_ = (latency_usec_ * 7 + latency) / 8;
+  const bool ok = request->req->status == kVirtioBlkStatusOk;
+  if (!ok) {
+    LOG_ERROR("virtio: failed to transfor the sectors (%d), status (%d)",
+              request->req->sector, request->req->status);
+    stat_.errors++;
+  } else if (!request->is_write && request->bounce) {
+    memcpy(request->segs[0].buf, request->data, request->size);
+  }
 
-  if (!is_write) {
-    memcpy(buf, virtq_->blk_req->data, kDiskSectorSize);
+  // The slot is free before the callback, which may submit again.
+  request->busy = false;
+  inflight_--;
+  if (request->done) {
+    request->done(request->arg, ok);
   }
+}
 
-  return true;
+void VirtioBlk::HandleIrq() {
+  regs_->INTERRUPT_ACK = regs_->INTERRUPT_STATUS;
+  stat_.irqs++;
+  HarvestUsedRing();
 }
 
-bool VirtioBlk::VirtqIsBusy() {
-  // The device will increment used.index when it adds an entry to the used
-  // ring.
-  return virtq_->last_used_index != virtq_->used.index;
+void VirtioBlk::WaitForCompletion(WaitMode mode, const uint32_t* pending) {
+  // Spinning wins when the device answers sooner than a round trip through
+  // the scheduler.
+  const bool spin =
+      mode == WaitMode::kPoll ||
+      (mode == WaitMode::kAdaptive && latency_usec_ <= kVirtioBlkMaxPollUsec);
+  const uint32_t before = *pending;
+  const auto start = Timer::GetSystemUsec();
+  while (true) {
+    Poll();
+    if (*pending != before) {
+      return;
+    }
+    if (mode == WaitMode::kPoll ||
+        (spin && Timer::GetSystemUsec() - start < kVirtioBlkMaxPollUsec)) {
+      continue;
+    }
+    if (SleepUntilCompletion(pending, before)) {
+      return;
+    }
+  }
+}
+
+bool VirtioBlk::SleepUntilCompletion(const uint32_t* pending,
+                                     uint32_t before) {
+  auto& sched = Sched::Get();
+  auto* tsk = sched.GetCurrentTask();
+  // The idle task must not sleep, and an interrupt being handled would hold
+  // back the completion interrupt until this task runs again.
+  if (!tsk->pid ||
+      GicV2::Get().GetRunningPriority() != GicV2::kIdlePriority) {
+    return false;
+  }
+
+  // With IRQs disabled, a completion is either harvested here or wakes the
+  // task once it sleeps.
+  const auto daif = CpuSaveAndDisableIrq();
+  HarvestUsedRing();
+  if (*pending == before) {
+    waiters_ |= 1U << tsk->pid;
+    tsk->state = WAITTING;
+    stat_.sleeps++;
+    sched.Schedule();
+  }
+  CpuRestoreIrq(daif);
+  return true;
 }
 
 }  // namespace evisor
@@ -1,7 +1,11 @@
 #ifndef EVISOR_DRIVERS_VIRTIO_VIRTIO_BLK_H_
 #define EVISOR_DRIVERS_VIRTIO_VIRTIO_BLK_H_
 
+#include <cstddef>
+#include <cstdint>
+
 #include "drivers/common.h"
+#include "drivers/virtio/virtqueue.h"
 #include "mm/pgtable.h"
 #include "platforms/qemu/peripheral.h"
 
@@ -11,6 +15,12 @@ namespace {
 
 constexpr int kVirtQueueSize = 16;
 constexpr int kDiskSectorSize = 512;
+// Largest transfer done by a single request.
+constexpr int kVirtioBlkMaxSectors = 32;
+// Requests in flight at once. Each takes at least three descriptors.
+constexpr int kVirtioBlkMaxRequests = 4;
+// Longest spin of the adaptive wait before the waiter sleeps.
+constexpr uint32_t kVirtioBlkMaxPollUsec = 100;
 
 }  // namespace
 
@@ -32,68 +42,140 @@ class VirtioBlk {
   void Init();
   // Get disk capacity.
   uint64_t GetDiskCapacity();
+  // How ReadSectors()/WriteSectors() wait for the device.
+  enum class WaitMode {
+    // Spin until the requests complete.
+    kPoll,
+    // Let other vCPUs run until the completion interrupt.
+    kSleep,
+    // Spin while requests have recently completed within
+    // kVirtioBlkMaxPollUsec, sleep otherwise.
+    kAdaptive,
+  };
+
   // Read data from the disk.
   bool ReadDisk(void* buf, uint32_t sector_idx);
   // Write data to the disk.
   bool WriteDisk(void* buf, uint32_t sector_idx);
+  // Read/Write |count| contiguous sectors. Buffers aligned to the cache line
+  // are transferred without a copy. Each request carries up to
+  // kVirtioBlkMaxSectors sectors, split into as many data descriptors as the
+  // device's seg_max and size_max allow.
+  //
+  // Other vCPUs run while a caller sleeps, and may fault, swap or merge
+  // pages meanwhile. A caller passing a mode other than kPoll transfers only
+  // pages no VM maps yet, or pins them first (see
+  // PgTableStage2::ReplaceWithSwapEntry()).
+  bool ReadSectors(void* buf,
+                   uint64_t sector_idx,
+                   size_t count,
+                   WaitMode mode = WaitMode::kPoll);
+  bool WriteSectors(const void* buf,
+                    uint64_t sector_idx,
+                    size_t count,
+                    WaitMode mode = WaitMode::kPoll);
+  // Read/Write |count| pages on consecutive sectors from |sector_idx| on,
+  // one page from each entry of |pages|. A request gathers as many pages as
+  // it has data descriptors for, so that pages scattered in memory still go
+  // out in few requests.
+  bool ReadPages(void* const* pages,
+                 uint64_t sector_idx,
+                 size_t count,
+                 WaitMode mode = WaitMode::kPoll);
+  bool WritePages(void* const* pages,
+                  uint64_t sector_idx,
+                  size_t count,
+                  WaitMode mode = WaitMode::kPoll);
 
- private:
-  // Virtqueue Descriptor Table.
-  struct VirtqDesc {
-    // Address (guest-physical).
-    uint64_t addr;
-    // Length.
-    uint32_t len;
-    // The flags as indicated above.
-    uint16_t flags;
-    // Next field if flags & NEXT
-    uint16_t next;
-  } __attribute__((packed));
+  /*
+   * Asynchronous requests
+   */
+  // Called from Poll() or the interrupt handler when a request has finished.
+  // |ok| is false on an I/O error.
+  using Completion = void (*)(void* arg, bool ok);
 
-  // Virtqueue Available Ring.
-  struct VirtqAvail {
-    uint16_t flags;
-    uint16_t index;
-    uint16_t ring[kVirtQueueSize];
-    uint16_t used_event; /* Only if VIRTIO_F_EVENT_IDX */
-  } __attribute__((packed));
+  struct Stat {
+    uint64_t requests;
+    uint64_t errors;
+    // Requests copied through the uncached bounce buffer
+    uint64_t bounced;
+    // Doorbell writes, the ones the device did not ask for, and Poll() calls
+    // that completed something
+    uint64_t kicks;
+    uint64_t suppressed_kicks;
+    uint64_t batches;
+    uint32_t max_inflight;
+    // Completion interrupts, and waits that slept until one
+    uint64_t irqs;
+    uint64_t sleeps;
+  };
+
+  // Queue a request of up to GetMaxRequestSectors() sectors. The device does
+  // not see it until Kick(). Returns false if no request slot or descriptor
+  // is free; Poll() frees them.
+  bool SubmitRead(void* buf,
+                  uint64_t sector_idx,
+                  size_t count,
+                  Completion done,
+                  void* arg);
+  bool SubmitWrite(const void* buf,
+                   uint64_t sector_idx,
+                   size_t count,
+                   Completion done,
+                   void* arg);
+  // Notify the device of every request queued since the last call.
+  void Kick();
+  // Complete every request the device has finished. Returns their number.
+  size_t Poll();
 
+  size_t GetMaxRequestSectors() const;
+  uint32_t GetInflight() const { return inflight_; }
+  const Stat& GetStat() const { return stat_; }
+
+ private:
   // The format of the first descriptor in a disk request.
-  // to be followed by two more descriptors containing
-  // the block, and a one-byte status.
+  // to be followed by the data descriptors containing
+  // the blocks, and a one-byte status.
   struct VirtioBlkReq {
     uint32_t type;
     uint32_t reserved;
     uint64_t sector;
-    uint8_t data[kDiskSectorSize];
     uint8_t status;
   } __attribute__((packed));
 
-  struct VirtqUsedElem {
-    // Index of start of used descriptor chain.
-    uint32_t id;
-    // Total length of the descriptor chain which was used (written to).
-    uint32_t len;
-  } __attribute__((packed));
+  // A run of the caller's memory in a request
+  struct Segment {
+    uint8_t* buf;
+    uint32_t size;
+  };
+  // The header and the status take two descriptors of a chain.
+  static constexpr size_t kMaxRequestSegments = kVirtQueueSize - 2;
 
-  // Virtqueue Used Ring.
-  struct VirtqUsed {
-    uint16_t flags;
-    uint16_t index;
-    VirtqUsedElem ring[kVirtQueueSize];
-    uint16_t avail_event; /* Only if VIRTIO_F_EVENT_IDX */
-  } __attribute__((packed));
+  // A request slot.
+  struct Request {
+    // Header and status, and the sectors, in uncached memory
+    VirtioBlkReq* req;
+    uint8_t* data;
+    // Caller's memory. The device accesses it directly unless |bounce| is
+    // set, in which case the single segment is copied through |data|.
+    Segment segs[kMaxRequestSegments];
+    uint8_t num_segs;
+    uint32_t size;
+    bool is_write;
+    bool bounce;
+    bool busy;
+    // ID of the descriptor chain, reported back when it is used
+    uint16_t id;
+    uint32_t submit_usec;
+    Completion done;
+    void* arg;
+  };
 
-  // VirtQueue info to manage the entire virtqueue.
+  // Memory of the virtqueue, in either layout
   struct Virtq {
-    VirtqDesc descs[kVirtQueueSize];
-    VirtqAvail avail;
-    VirtqUsed used __attribute__((aligned(PAGE_SIZE)));
-    VirtioBlkReq* blk_req;
-
-    // This is used to manage the index that we used last.
-    uint16_t last_used_index;
-  } __attribute__((packed));
+    VirtqSplitRing<kVirtQueueSize, PAGE_SIZE> split;
+    VirtqPackedRing<kVirtQueueSize> packed;
+  };
 
   struct Regs {
     // 0x000: Magic value (RO)
@@ -114,7 +196,7 @@ class VirtioBlk {
     reg32_t DRIVER_FEATURES;
     // 0x024: Activated (guest) features word selection (WO)
     reg32_t DRIVER_FEATURES_SEL;
-    // 0x028: Guest page size (WO)
+    // 0x028: Guest page size, legacy only (WO)
     reg32_t GUEST_PAGE_SIZE;
     reg32_t __RESERVED_1;
     // 0x030: Virtual queue index (WO)
@@ -123,9 +205,10 @@ class VirtioBlk {
     reg32_t QUEUE_NUM_MAX;
     // 0x038: Virtual queue size (WO)
     reg32_t QUEUE_NUM;
-    // 0x03c: Used Ring alignment in the virtual queue (WO)
+    // 0x03c: Used Ring alignment in the virtual queue, legacy only (WO)
     reg32_t QUEUE_ALIGN;
-    // 0x040: Guest physical page number of the virtual queue (R/W)
+    // 0x040: Guest physical page number of the virtual queue, legacy only
+    // (R/W)
     reg32_t QUEUE_PFN;
     // 0x044: Virtual queue ready bit (RW)
     reg32_t QUEUE_READY;
@@ -140,22 +223,88 @@ class VirtioBlk {
     reg32_t __RESERVED_4[2];
     // 0x070: device status (R/W)
     reg32_t DEVICE_STATUS;
-    reg32_t __RESERVED_5[35];
+    reg32_t __RESERVED_5[3];
+    // 0x080: Descriptor area address, modern only (WO)
+    reg32_t QUEUE_DESC_LOW;
+    reg32_t QUEUE_DESC_HIGH;
+    reg32_t __RESERVED_6[2];
+    // 0x090: Driver area address, modern only (WO)
+    reg32_t QUEUE_DRIVER_LOW;
+    reg32_t QUEUE_DRIVER_HIGH;
+    reg32_t __RESERVED_7[2];
+    // 0x0a0: Device area address, modern only (WO)
+    reg32_t QUEUE_DEVICE_LOW;
+    reg32_t QUEUE_DEVICE_HIGH;
+    reg32_t __RESERVED_8[21];
+    // 0x0fc: Configuration atomicity value, modern only (RO)
+    reg32_t CONFIG_GENERATION;
     // 0x100+: Configuration space (RW)
     reg32_t DEVICE_CONFIG_SPACE0;
+    reg32_t DEVICE_CONFIG_SPACE1;
+    // 0x108: Maximum segment size, if VIRTIO_BLK_F_SIZE_MAX (RO)
+    reg32_t CONFIG_SIZE_MAX;
+    // 0x10c: Maximum segments in a request, if VIRTIO_BLK_F_SEG_MAX (RO)
+    reg32_t CONFIG_SEG_MAX;
   } __attribute__((packed)) __attribute__((aligned(4)));
 
   volatile Regs* regs_ = reinterpret_cast<Regs*>(VIRTIO_BASE);
   Virtq* virtq_;
+  VirtqDriver<kVirtQueueSize> queue_;
+  // Bytes per data descriptor and data descriptors per request
+  uint32_t segment_size_ = kVirtioBlkMaxSectors * kDiskSectorSize;
+  uint32_t max_segments_ = 1;
+  // Negotiated transport and virtqueue features
+  bool modern_ = false;
+  bool packed_ = false;
+  bool event_idx_ = false;
+  Request requests_[kVirtioBlkMaxRequests] = {};
+  // Request of each chain ID
+  Request* head_requests_[kVirtQueueSize] = {};
+  uint32_t inflight_ = 0;
+  Stat stat_ = {};
+  // Average request latency, for WaitMode::kAdaptive
+  uint32_t latency_usec_ = 0;
+  // PIDs of the tasks sleeping in WaitForCompletion()
+  uint32_t waiters_ = 0;
 
   // Common initialization process for Virtio devices.
   void DeviceInit();
   // Initialization process for the Virtio block device.
   void BlockDeviceInit();
   // Read/Write to Disk device.
-  bool ReadWriteDisk(void* buf, uint32_t sector_idx, bool is_write);
-  // Returns true if the Virtqueue is busy.
-  bool VirtqIsBusy();
+  bool ReadWriteDisk(void* buf,
+                     uint64_t sector_idx,
+                     size_t count,
+                     bool is_write,
+                     WaitMode mode);
+  // Transfer |segs| to or from consecutive sectors, keeping as many requests
+  // in flight as the queue holds.
+  bool ReadWriteSegments(const Segment* segs,
+                         size_t num_segs,
+                         uint64_t sector_idx,
+                         bool is_write,
+                         WaitMode mode);
+  // Handle the completion interrupt.
+  void HandleIrq();
+  // Complete the finished requests and wake the tasks waiting for them. IRQs
+  // must be disabled.
+  size_t HarvestUsedRing();
+  // Complete the request of the used chain |id|.
+  void CompleteRequest(uint16_t id);
+  // Wait until |*pending|, the caller's count of requests in flight, drops.
+  // Whoever harvests the ring completes the requests, so the count is what
+  // tells the caller's own requests apart.
+  void WaitForCompletion(WaitMode mode, const uint32_t* pending);
+  // Sleep until |*pending| drops below |before|, if the current task may.
+  bool SleepUntilCompletion(const uint32_t* pending, uint32_t before);
+  // Queue a single request of whole sectors. More than one segment needs
+  // every segment aligned to the cache line.
+  bool Submit(const Segment* segs,
+              size_t num_segs,
+              uint64_t sector_idx,
+              bool is_write,
+              Completion done,
+              void* arg);
 };
 
 }  // namespace evisor
@@ -0,0 +1,825 @@
+#ifndef EVISOR_DRIVERS_VIRTIO_VIRTQUEUE_H_
+#define EVISOR_DRIVERS_VIRTIO_VIRTQUEUE_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+#include "common/logger.h"
+
+// References:
+// * http://docs.oasis-open.org/virtio/virtio/v1.3/virtio-v1.3.html
+
+namespace evisor {
+
+// Virtqueues shared by virtio drivers and emulated virtio devices.
+//
+// The split and the packed layouts are both implemented for the driver side
+// and the device side, with the queue size as a template parameter. The
+// caller owns the ring memory and the notification mechanism; a queue only
+// tells whether the other side asked to be notified. With the event index,
+// notifications and interrupts are only requested for the entry the other
+// side is waiting for. Queues are not thread-safe. A driver queue PANICs on a
+// used entry naming no chain in flight, since its free lists could not be
+// trusted afterwards.
+
+/*
+ * Descriptor flags
+ */
+// This marks a buffer as continuing via the next field.
+constexpr uint16_t kVirtqDescFNext = 0x1;
+// This marks a buffer as device write-only (otherwise device read-only).
+constexpr uint16_t kVirtqDescFWrite = 0x2;
+// This means the buffer contains a list of buffer descriptors.
+constexpr uint16_t kVirtqDescFIndirect = 0x4;
+// Packed ring: the descriptor is available, or used, when this bit matches
+// the wrap counter.
+constexpr uint16_t kVirtqPackedDescFAvail = 1 << 7;
+constexpr uint16_t kVirtqPackedDescFUsed = 1 << 15;
+
+/*
+ * Notification suppression
+ */
+// Split ring: the driver does not need an interrupt, and the device does
+// not need a notification.
+constexpr uint16_t kVirtqAvailFNoInterrupt = 0x1;
+constexpr uint16_t kVirtqUsedFNoNotify = 0x1;
+// Packed ring event suppression flags and the wrap counter in off_wrap
+constexpr uint16_t kVirtqEventFlagEnable = 0x0;
+constexpr uint16_t kVirtqEventFlagDisable = 0x1;
+constexpr uint16_t kVirtqEventFlagDesc = 0x2;
+constexpr uint16_t kVirtqEventWrap = 1 << 15;
+
+// Order ring accesses against the other side.
+inline void VirtqMb() {
+  __sync_synchronize();
+}
+
+// True if |event_idx| is in [old_idx, new_idx), i.e. the other side asked to
+// be told when this entry was reached.
+inline bool VirtqNeedEvent(uint16_t event_idx,
+                           uint16_t new_idx,
+                           uint16_t old_idx) {
+  return static_cast<uint16_t>(new_idx - event_idx - 1) <
+         static_cast<uint16_t>(new_idx - old_idx);
+}
+
+// A buffer of a descriptor chain.
+struct VirtqBuffer {
+  uint64_t addr;
+  uint32_t len;
+  // The device writes the buffer, otherwise it reads it.
+  bool device_writes;
+};
+
+/*
+ * Ring layouts
+ */
+// Virtqueue Descriptor Table.
+struct VirtqDesc {
+  // Address (guest-physical).
+  uint64_t addr;
+  // Length.
+  uint32_t len;
+  // The flags as indicated above.
+  uint16_t flags;
+  // Next field if flags & NEXT
+  uint16_t next;
+} __attribute__((packed));
+
+// Virtqueue Available Ring.
+template <uint16_t N>
+struct VirtqAvail {
+  uint16_t flags;
+  uint16_t index;
+  uint16_t ring[N];
+  uint16_t used_event; /* Only if VIRTIO_F_EVENT_IDX */
+} __attribute__((packed));
+
+struct VirtqUsedElem {
+  // Index of start of used descriptor chain.
+  uint32_t id;
+  // Total length of the descriptor chain which was used (written to).
+  uint32_t len;
+} __attribute__((packed));
+
+// Virtqueue Used Ring.
+template <uint16_t N>
+struct VirtqUsed {
+  uint16_t flags;
+  uint16_t index;
+  VirtqUsedElem ring[N];
+  uint16_t avail_event; /* Only if VIRTIO_F_EVENT_IDX */
+} __attribute__((packed));
+
+// Packed Virtqueue Descriptor Ring.
+struct VirtqPackedDesc {
+  uint64_t addr;
+  uint32_t len;
+  // Buffer ID, reported back when the chain is used
+  uint16_t id;
+  uint16_t flags;
+} __attribute__((packed));
+
+// Packed Virtqueue Event Suppression.
+struct VirtqEvent {
+  // Descriptor ring offset and wrap counter, if flags is DESC
+  uint16_t off_wrap;
+  uint16_t flags;
+} __attribute__((packed));
+
+// Memory of a split virtqueue. The used ring starts at the next |Align|
+// boundary, as the legacy transport expects.
+template <uint16_t N, size_t Align>
+struct VirtqSplitRing {
+  VirtqDesc descs[N];
+  VirtqAvail<N> avail;
+  VirtqUsed<N> used __attribute__((aligned(Align)));
+} __attribute__((packed));
+
+// Memory of a packed virtqueue.
+template <uint16_t N>
+struct VirtqPackedRing {
+  VirtqPackedDesc descs[N] __attribute__((aligned(16)));
+  VirtqEvent driver_event __attribute__((aligned(4)));
+  VirtqEvent device_event __attribute__((aligned(4)));
+} __attribute__((packed));
+
+/*
+ * Driver side
+ */
+// Driver side of a split virtqueue. Chain IDs are head descriptor indexes.
+template <uint16_t N>
+class VirtqSplitDriver {
+  static_assert(N && !(N & (N - 1)), "Split queue size must be a power of 2");
+
+ public:
+  void Init(VirtqDesc* descs,
+            VirtqAvail<N>* avail,
+            VirtqUsed<N>* used,
+            bool event_idx) {
+    descs_ = descs;
+    avail_ = avail;
+    used_ = used;
+    event_idx_ = event_idx;
+
+    // Chain every descriptor into the free list.
+    for (uint16_t i = 0; i < N; i++) {
+      descs_[i].next = i + 1;
+      chain_len_[i] = 0;
+    }
+    free_head_ = 0;
+    num_free_ = N;
+    num_added_ = 0;
+    last_used_ = 0;
+
+    // The device interrupts for the first used entry.
+    avail_->flags = 0;
+    avail_->index = 0;
+    avail_->used_event = 0;
+    used_->index = 0;
+  }
+
+  uint16_t NumFree() const { return num_free_; }
+  // Chains added since the last PublishAvail()
+  uint16_t NumAdded() const { return num_added_; }
+
+  // Add a chain of |n| buffers. The device does not see it until
+  // PublishAvail(). Returns false if there are not |n| free descriptors.
+  bool Add(const VirtqBuffer* bufs, uint16_t n, uint16_t* id) {
+    if (!n || n > num_free_) {
+      return false;
+    }
+
+    const uint16_t head = free_head_;
+    uint16_t idx = head;
+    for (uint16_t i = 0; i < n; i++) {
+      auto& desc = descs_[idx];
+      const uint16_t next = desc.next;
+      desc.addr = bufs[i].addr;
+      desc.len = bufs[i].len;
+      desc.flags = bufs[i].device_writes ? kVirtqDescFWrite : 0;
+      if (i != n - 1) {
+        desc.flags |= kVirtqDescFNext;
+        idx = next;
+      } else {
+        free_head_ = next;
+      }
+    }
+    num_free_ -= n;
+    chain_len_[head] = n;
+
+    avail_->ring[static_cast<uint16_t>(avail_->index + num_added_) % N] =
+        head;
+    num_added_++;
+    *id = head;
+    return true;
+  }
+
+  // Make the chains added so far visible to the device. Returns true if the
+  // device asked to be notified of them.
+  bool PublishAvail() {
+    if (!num_added_) {
+      return false;
+    }
+    // The ring entries must be visible before the index, and the index
+    // before the device's request for a notification is read.
+    VirtqMb();
+    const uint16_t old_idx = avail_->index;
+    const uint16_t new_idx = old_idx + num_added_;
+    avail_->index = new_idx;
+    num_added_ = 0;
+    VirtqMb();
+
+    if (event_idx_) {
+      return VirtqNeedEvent(used_->avail_event, new_idx, old_idx);
+    }
+    return !(used_->flags & kVirtqUsedFNoNotify);
+  }
+
+  bool HasUsed() const {
+    VirtqMb();
+    // The device will increment used.index when it adds an entry to the
+    // used ring.
+    return last_used_ != used_->index;
+  }
+
+  // Take the next used chain and free its descriptors. Returns false if
+  // there is none.
+  bool GetUsed(uint16_t* id, uint32_t* len) {
+    if (!HasUsed()) {
+      return false;
+    }
+    // Read the entry only after the index.
+    VirtqMb();
+    const auto& elem = used_->ring[last_used_ % N];
+    if (elem.id >= N || !chain_len_[elem.id]) {
+      PANIC("virtq: used chain %d is not in flight", elem.id);
+    }
+    *id = elem.id;
+    *len = elem.len;
+    last_used_++;
+
+    // Give the chain back to the free list.
+    uint16_t tail = *id;
+    uint16_t n = 1;
+    while (descs_[tail].flags & kVirtqDescFNext) {
+      tail = descs_[tail].next;
+      if (tail >= N || ++n > chain_len_[*id]) {
+        PANIC("virtq: used chain %d is malformed", *id);
+      }
+    }
+    if (n != chain_len_[*id]) {
+      PANIC("virtq: used chain %d is malformed", *id);
+    }
+    chain_len_[*id] = 0;
+    descs_[tail].next = free_head_;
+    free_head_ = *id;
+    num_free_ += n;
+    return true;
+  }
+
+  // Ask for an interrupt when the next chain is used. Returns false if one
+  // was used meanwhile, which may have raised no interrupt.
+  bool EnableInterrupt() {
+    if (event_idx_) {
+      avail_->used_event = last_used_;
+    } else {
+      avail_->flags = 0;
+    }
+    return !HasUsed();
+  }
+
+  // Interrupts are only a hint. With the event index, they stop once the
+  // used_event entry has passed.
+  void DisableInterrupt() {
+    if (!event_idx_) {
+      avail_->flags = kVirtqAvailFNoInterrupt;
+    }
+  }
+
+ private:
+  VirtqDesc* descs_ = nullptr;
+  VirtqAvail<N>* avail_ = nullptr;
+  VirtqUsed<N>* used_ = nullptr;
+  bool event_idx_ = false;
+  // Head of the free descriptor list, chained through |next|
+  uint16_t free_head_ = 0;
+  uint16_t num_free_ = 0;
+  uint16_t num_added_ = 0;
+  // This is used to manage the index that we used last.
+  uint16_t last_used_ = 0;
+  // Length of the chain headed by each descriptor in flight, or 0
+  uint16_t chain_len_[N] = {};
+};
+
+// Driver side of a packed virtqueue. Chain IDs are allocated by the queue.
+template <uint16_t N>
+class VirtqPackedDriver {
+  static_assert(N && N <= 0x8000, "Packed queue size is up to 2^15");
+
+ public:
+  void Init(VirtqPackedDesc* descs,
+            VirtqEvent* driver_event,
+            VirtqEvent* device_event,
+            bool event_idx) {
+    descs_ = descs;
+    driver_event_ = driver_event;
+    device_event_ = device_event;
+    event_idx_ = event_idx;
+
+    // Every descriptor starts owned by the driver, with both wrap counters
+    // set.
+    for (uint16_t i = 0; i < N; i++) {
+      descs_[i] = {};
+      free_ids_[i] = i;
+      chain_len_[i] = 0;
+    }
+    num_free_ids_ = N;
+    num_free_ = N;
+    num_added_ = 0;
+    next_avail_ = 0;
+    next_used_ = 0;
+    avail_wrap_ = true;
+    used_wrap_ = true;
+    *driver_event_ = {
+        .off_wrap = kVirtqEventWrap,
+        .flags = event_idx_ ? kVirtqEventFlagDesc : kVirtqEventFlagEnable,
+    };
+  }
+
+  uint16_t NumFree() const { return num_free_; }
+  // Descriptors added since the last PublishAvail()
+  uint16_t NumAdded() const { return num_added_; }
+
+  // Add a chain of |n| buffers. Its descriptors are consecutive in the ring,
+  // each marked available with the wrap counter of its own position. Returns
+  // false if there are not |n| free descriptors.
+  bool Add(const VirtqBuffer* bufs, uint16_t n, uint16_t* id) {
+    if (!n || n > num_free_ || !num_free_ids_) {
+      return false;
+    }
+
+    *id = free_ids_[--num_free_ids_];
+    chain_len_[*id] = n;
+    const uint16_t head = next_avail_;
+    uint16_t head_flags = 0;
+    for (uint16_t i = 0; i < n; i++) {
+      auto& desc = descs_[next_avail_];
+      uint16_t flags = bufs[i].device_writes ? kVirtqDescFWrite : 0;
+      if (i != n - 1) {
+        flags |= kVirtqDescFNext;
+      }
+      flags |= avail_wrap_ ? kVirtqPackedDescFAvail : kVirtqPackedDescFUsed;
+      desc.addr = bufs[i].addr;
+      desc.len = bufs[i].len;
+      desc.id = *id;
+      if (i) {
+        desc.flags = flags;
+      } else {
+        head_flags = flags;
+      }
+      if (++next_avail_ == N) {
+        next_avail_ = 0;
+        avail_wrap_ = !avail_wrap_;
+      }
+    }
+    num_free_ -= n;
+    num_added_ += n;
+
+    // The head makes the whole chain available, so it is written last.
+    VirtqMb();
+    descs_[head].flags = head_flags;
+    return true;
+  }
+
+  // The chains are already visible. Returns true if the device asked to be
+  // notified of the ones added since the last call.
+  bool PublishAvail() {
+    if (!num_added_) {
+      return false;
+    }
+    const uint16_t new_idx = next_avail_;
+    const uint16_t old_idx = new_idx - num_added_;
+    num_added_ = 0;
+    VirtqMb();
+
+    const VirtqEvent event = *device_event_;
+    if (event.flags != kVirtqEventFlagDesc) {
+      return event.flags != kVirtqEventFlagDisable;
+    }
+    // The offset is in the ring lap of its wrap counter.
+    uint16_t event_idx = event.off_wrap & ~kVirtqEventWrap;
+    if (!(event.off_wrap & kVirtqEventWrap) != !avail_wrap_) {
+      event_idx -= N;
+    }
+    return VirtqNeedEvent(event_idx, new_idx, old_idx);
+  }
+
+  bool HasUsed() const {
+    VirtqMb();
+    // The device writes a used descriptor with both flags matching its wrap
+    // counter.
+    const uint16_t flags = descs_[next_used_].flags;
+    const bool avail = flags & kVirtqPackedDescFAvail;
+    const bool used = flags & kVirtqPackedDescFUsed;
+    return avail == used && used == used_wrap_;
+  }
+
+  // Take the next used chain and free its descriptors. Returns false if
+  // there is none.
+  bool GetUsed(uint16_t* id, uint32_t* len) {
+    if (!HasUsed()) {
+      return false;
+    }
+    // Read the entry only after its flags.
+    VirtqMb();
+    *id = descs_[next_used_].id;
+    *len = descs_[next_used_].len;
+    if (*id >= N || !chain_len_[*id]) {
+      PANIC("virtq: used chain %d is not in flight", *id);
+    }
+
+    // Skip the rest of the chain.
+    const uint16_t n = chain_len_[*id];
+    chain_len_[*id] = 0;
+    next_used_ += n;
+    if (next_used_ >= N) {
+      next_used_ -= N;
+      used_wrap_ = !used_wrap_;
+    }
+    num_free_ += n;
+    free_ids_[num_free_ids_++] = *id;
+    return true;
+  }
+
+  // Ask for an interrupt when the next chain is used. Returns false if one
+  // was used meanwhile, which may have raised no interrupt.
+  bool EnableInterrupt() {
+    if (event_idx_) {
+      driver_event_->off_wrap =
+          next_used_ | (used_wrap_ ? kVirtqEventWrap : 0);
+      driver_event_->flags = kVirtqEventFlagDesc;
+    } else {
+      driver_event_->flags = kVirtqEventFlagEnable;
+    }
+    return !HasUsed();
+  }
+
+  void DisableInterrupt() { driver_event_->flags = kVirtqEventFlagDisable; }
+
+ private:
+  VirtqPackedDesc* descs_ = nullptr;
+  VirtqEvent* driver_event_ = nullptr;
+  VirtqEvent* device_event_ = nullptr;
+  bool event_idx_ = false;
+  uint16_t num_free_ = 0;
+  uint16_t num_added_ = 0;
+  // The next descriptor to make available and the next one to be used,
+  // with their wrap counters
+  uint16_t next_avail_ = 0;
+  uint16_t next_used_ = 0;
+  bool avail_wrap_ = true;
+  bool used_wrap_ = true;
+  // Free chain IDs, and the length of the chain of each ID in use. 0 means
+  // the ID is free.
+  uint16_t free_ids_[N] = {};
+  uint16_t num_free_ids_ = 0;
+  uint16_t chain_len_[N] = {};
+};
+
+// Driver side of a virtqueue whose layout is negotiated at run time.
+template <uint16_t N>
+class VirtqDriver {
+ public:
+  void InitSplit(VirtqDesc* descs,
+                 VirtqAvail<N>* avail,
+                 VirtqUsed<N>* used,
+                 bool event_idx) {
+    packed_ = false;
+    split_.Init(descs, avail, used, event_idx);
+  }
+
+  void InitPacked(VirtqPackedDesc* descs,
+                  VirtqEvent* driver_event,
+                  VirtqEvent* device_event,
+                  bool event_idx) {
+    packed_ = true;
+    packed_queue_.Init(descs, driver_event, device_event, event_idx);
+  }
+
+  bool IsPacked() const { return packed_; }
+
+  uint16_t NumFree() const {
+    return packed_ ? packed_queue_.NumFree() : split_.NumFree();
+  }
+  uint16_t NumAdded() const {
+    return packed_ ? packed_queue_.NumAdded() : split_.NumAdded();
+  }
+  bool Add(const VirtqBuffer* bufs, uint16_t n, uint16_t* id) {
+    return packed_ ? packed_queue_.Add(bufs, n, id) : split_.Add(bufs, n, id);
+  }
+  bool PublishAvail() {
+    return packed_ ? packed_queue_.PublishAvail() : split_.PublishAvail();
+  }
+  bool HasUsed() const {
+    return packed_ ? packed_queue_.HasUsed() : split_.HasUsed();
+  }
+  bool GetUsed(uint16_t* id, uint32_t* len) {
+    return packed_ ? packed_queue_.GetUsed(id, len) : split_.GetUsed(id, len);
+  }
+  bool EnableInterrupt() {
+    return packed_ ? packed_queue_.EnableInterrupt()
+                   : split_.EnableInterrupt();
+  }
+  void DisableInterrupt() {
+    packed_ ? packed_queue_.DisableInterrupt() : split_.DisableInterrupt();
+  }
+
+ private:
+  bool packed_ = false;
+  VirtqSplitDriver<N> split_;
+  VirtqPackedDriver<N> packed_queue_;
+};
+
+// Take every used chain off a driver queue in a batch and pass each to
+// |fn(id, len)|. The interrupt is re-armed before the queue is found empty.
+template <typename Queue, typename Fn>
+size_t VirtqHarvest(Queue& queue, Fn&& fn) {
+  size_t harvested = 0;
+  uint16_t id;
+  uint32_t len;
+  do {
+    while (queue.GetUsed(&id, &len)) {
+      fn(id, len);
+      harvested++;
+    }
+  } while (!queue.EnableInterrupt());
+  return harvested;
+}
+
+/*
+ * Device side
+ */
+// Device side of a split virtqueue in memory the device can access.
+template <uint16_t N>
+class VirtqSplitDevice {
+  static_assert(N && !(N & (N - 1)), "Split queue size must be a power of 2");
+
+ public:
+  void Init(VirtqDesc* descs,
+            VirtqAvail<N>* avail,
+            VirtqUsed<N>* used,
+            bool event_idx) {
+    descs_ = descs;
+    avail_ = avail;
+    used_ = used;
+    event_idx_ = event_idx;
+    last_avail_ = 0;
+    used_idx_ = used_->index;
+    num_pushed_ = 0;
+  }
+
+  bool HasAvail() const {
+    VirtqMb();
+    return last_avail_ != avail_->index;
+  }
+
+  // Take the next available chain. Returns false if there is none. |n| is
+  // the length of the chain, of which the first |max| buffers are copied
+  // into |bufs|, or 0 if the chain is malformed. Every chain taken must be
+  // pushed back.
+  bool Pop(VirtqBuffer* bufs, uint16_t max, uint16_t* n, uint16_t* id) {
+    if (!HasAvail()) {
+      return false;
+    }
+    // Read the entry only after the index.
+    VirtqMb();
+    *id = avail_->ring[last_avail_ % N];
+    last_avail_++;
+
+    *n = 0;
+    uint16_t idx = *id;
+    for (uint16_t i = 0; i < N && idx < N; i++) {
+      const auto& desc = descs_[idx];
+      if (i < max) {
+        bufs[i] = {
+            .addr = desc.addr,
+            .len = desc.len,
+            .device_writes = static_cast<bool>(desc.flags & kVirtqDescFWrite),
+        };
+      }
+      if (!(desc.flags & kVirtqDescFNext)) {
+        *n = i + 1;
+        break;
+      }
+      idx = desc.next;
+    }
+    return true;
+  }
+
+  // Give the chain |id| back with |len| bytes written. The driver does not
+  // see it until PublishUsed(). |n| is only used by the packed layout.
+  void Push(uint16_t id, uint16_t n, uint32_t len) {
+    static_cast<void>(n);
+    const uint16_t slot = used_idx_ + num_pushed_;
+    auto& elem = used_->ring[slot % N];
+    elem.id = id;
+    elem.len = len;
+    num_pushed_++;
+  }
+
+  // Make the pushed chains visible to the driver. Returns true if the
+  // driver asked for an interrupt.
+  bool PublishUsed() {
+    if (!num_pushed_) {
+      return false;
+    }
+    VirtqMb();
+    const uint16_t old_idx = used_idx_;
+    used_idx_ += num_pushed_;
+    num_pushed_ = 0;
+    used_->index = used_idx_;
+    VirtqMb();
+
+    if (event_idx_) {
+      return VirtqNeedEvent(avail_->used_event, used_idx_, old_idx);
+    }
+    return !(avail_->flags & kVirtqAvailFNoInterrupt);
+  }
+
+  // Ask for a notification when the next chain is made available. Returns
+  // false if one was made available meanwhile.
+  bool EnableNotify() {
+    if (event_idx_) {
+      used_->avail_event = last_avail_;
+    } else {
+      used_->flags = 0;
+    }
+    return !HasAvail();
+  }
+
+  void DisableNotify() {
+    if (!event_idx_) {
+      used_->flags = kVirtqUsedFNoNotify;
+    }
+  }
+
+ private:
+  VirtqDesc* descs_ = nullptr;
+  VirtqAvail<N>* avail_ = nullptr;
+  VirtqUsed<N>* used_ = nullptr;
+  bool event_idx_ = false;
+  // Next available ring index to process
+  uint16_t last_avail_ = 0;
+  // Used index published to the driver, and entries pushed after it
+  uint16_t used_idx_ = 0;
+  uint16_t num_pushed_ = 0;
+};
+
+// Device side of a packed virtqueue in memory the device can access.
+template <uint16_t N>
+class VirtqPackedDevice {
+  static_assert(N && N <= 0x8000, "Packed queue size is up to 2^15");
+
+ public:
+  void Init(VirtqPackedDesc* descs,
+            VirtqEvent* driver_event,
+            VirtqEvent* device_event,
+            bool event_idx) {
+    descs_ = descs;
+    driver_event_ = driver_event;
+    device_event_ = device_event;
+    event_idx_ = event_idx;
+    next_avail_ = 0;
+    next_used_ = 0;
+    avail_wrap_ = true;
+    used_wrap_ = true;
+    num_pushed_ = 0;
+  }
+
+  bool HasAvail() const {
+    VirtqMb();
+    const uint16_t flags = descs_[next_avail_].flags;
+    const bool avail = flags & kVirtqPackedDescFAvail;
+    const bool used = flags & kVirtqPackedDescFUsed;
+    return avail != used && avail == avail_wrap_;
+  }
+
+  // Take the next available chain. Returns false if there is none. |n| is
+  // the length of the chain, of which the first |max| buffers are copied
+  // into |bufs|. Every chain taken must be pushed back.
+  bool Pop(VirtqBuffer* bufs, uint16_t max, uint16_t* n, uint16_t* id) {
+    if (!HasAvail()) {
+      return false;
+    }
+    // Read the chain only after the head flags.
+    VirtqMb();
+
+    uint16_t count = 0;
+    bool more = true;
+    while (more && count < N) {
+      const auto& desc = descs_[next_avail_];
+      if (count < max) {
+        bufs[count] = {
+            .addr = desc.addr,
+            .len = desc.len,
+            .device_writes = static_cast<bool>(desc.flags & kVirtqDescFWrite),
+        };
+      }
+      *id = desc.id;
+      more = desc.flags & kVirtqDescFNext;
+      count++;
+      if (++next_avail_ == N) {
+        next_avail_ = 0;
+        avail_wrap_ = !avail_wrap_;
+      }
+    }
+    *n = count;
+    return true;
+  }
+
+  // Give the chain |id| of |n| descriptors back with |len| bytes written.
+  // Chains are pushed in the order they were popped.
+  void Push(uint16_t id, uint16_t n, uint32_t len) {
+    auto& desc = descs_[next_used_];
+    desc.id = id;
+    desc.len = len;
+    const uint16_t flags =
+        used_wrap_ ? kVirtqPackedDescFAvail | kVirtqPackedDescFUsed : 0;
+    if (!num_pushed_) {
+      // The first of a batch is written by PublishUsed() to publish it all.
+      first_flags_ = flags;
+      first_used_ = next_used_;
+    } else {
+      VirtqMb();
+      desc.flags = flags;
+    }
+
+    next_used_ += n;
+    if (next_used_ >= N) {
+      next_used_ -= N;
+      used_wrap_ = !used_wrap_;
+    }
+    num_pushed_ += n;
+  }
+
+  // Make the pushed chains visible to the driver. Returns true if the
+  // driver asked for an interrupt.
+  bool PublishUsed() {
+    if (!num_pushed_) {
+      return false;
+    }
+    VirtqMb();
+    descs_[first_used_].flags = first_flags_;
+    const uint16_t new_idx = next_used_;
+    const uint16_t old_idx = new_idx - num_pushed_;
+    num_pushed_ = 0;
+    VirtqMb();
+
+    const VirtqEvent event = *driver_event_;
+    if (event.flags != kVirtqEventFlagDesc) {
+      return event.flags != kVirtqEventFlagDisable;
+    }
+    uint16_t event_idx = event.off_wrap & ~kVirtqEventWrap;
+    if (!(event.off_wrap & kVirtqEventWrap) != !used_wrap_) {
+      event_idx -= N;
+    }
+    return VirtqNeedEvent(event_idx, new_idx, old_idx);
+  }
+
+  // Ask for a notification when the next chain is made available. Returns
+  // false if one was made available meanwhile.
+  bool EnableNotify() {
+    if (event_idx_) {
+      device_event_->off_wrap =
+          next_avail_ | (avail_wrap_ ? kVirtqEventWrap : 0);
+      device_event_->flags = kVirtqEventFlagDesc;
+    } else {
+      device_event_->flags = kVirtqEventFlagEnable;
+    }
+    return !HasAvail();
+  }
+
+  void DisableNotify() { device_event_->flags = kVirtqEventFlagDisable; }
+
+ private:
+  VirtqPackedDesc* descs_ = nullptr;
+  VirtqEvent* driver_event_ = nullptr;
+  VirtqEvent* device_event_ = nullptr;
+  bool event_idx_ = false;
+  // The next descriptor to take and the next one to give back, with their
+  // wrap counters
+  uint16_t next_avail_ = 0;
+  uint16_t next_used_ = 0;
+  bool avail_wrap_ = true;
+  bool used_wrap_ = true;
+  // Descriptors pushed since the last PublishUsed(), and the first of them
+  uint16_t num_pushed_ = 0;
+  uint16_t first_used_ = 0;
+  uint16_t first_flags_ = 0;
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_DRIVERS_VIRTIO_VIRTQUEUE_H_
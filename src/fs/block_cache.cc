@@ -0,0 +1,206 @@
+#include "fs/block_cache.h"
+
+#include <algorithm>
+
+#include "common/cstring.h"
+#include "common/logger.h"
+#if defined(BOARD_IS_QEMU)
+#include "drivers/virtio/virtio-blk.h"
+#else
+#include "drivers/mmc/mmc.h"
+#endif
+#include "mm/heap/kmm_malloc.h"
+
+namespace evisor {
+
+namespace {
+
+// Read |count| sectors from |lba| on with a single command.
+bool BlockCacheDeviceRead(uint8_t* buf, uint64_t lba, size_t count) {
+#if defined(BOARD_IS_QEMU)
+  auto& virtio = VirtioBlk::Get();
+  virtio.Init();
+  return virtio.ReadSectors(buf, lba, count);
+#else
+  auto& mmc = Mmc::Get();
+  return mmc.Seek(lba * BlockCache::kSectorSize) &&
+         mmc.Read(buf, count * BlockCache::kSectorSize) >= 0;
+#endif
+}
+
+inline size_t BlockCacheHash(uint64_t number, size_t buckets) {
+  return (number * 0x9e3779b97f4a7c15ULL) >> 32 & (buckets - 1);
+}
+
+}  // namespace
+
+bool BlockCache::Read(void* buf, uint64_t lba, size_t count) {
+  if (!arena_) {
+    arena_ = static_cast<uint8_t*>(kmm_malloc(kMaxBlocks * kBlockSize));
+    staging_ =
+        static_cast<uint8_t*>(kmm_malloc(kReadAheadBlocks * kBlockSize));
+    if (!arena_ || !staging_) {
+      PANIC("Failed to allocate the block cache");
+    }
+    std::fill(buckets_, buckets_ + kBuckets, kNil);
+  }
+
+  auto* cur = static_cast<uint8_t*>(buf);
+  while (count) {
+    const uint64_t number = lba / kBlockSectors;
+    const size_t first = lba % kBlockSectors;
+    const size_t n = std::min(count, kBlockSectors - first);
+
+    auto* block = Find(number);
+    if (block) {
+      stat_.hits++;
+      if (block->ahead) {
+        block->ahead = false;
+        stat_.readahead_hits++;
+      }
+      LruUnlink(block);
+      LruPushFront(block);
+    } else {
+      stat_.misses++;
+      block = Fetch(number);
+      if (!block) {
+        return false;
+      }
+    }
+    last_number_ = number;
+
+    memcpy(cur, block->data + first * kSectorSize, n * kSectorSize);
+    cur += n * kSectorSize;
+    lba += n;
+    count -= n;
+  }
+  return true;
+}
+
+bool BlockCache::ReadDirect(void* buf, uint64_t lba, size_t count) {
+  // The cache is read-only, so the device always holds the latest data.
+  auto* cur = static_cast<uint8_t*>(buf);
+  while (count) {
+    const size_t n = std::min(count, kMaxDirectSectors);
+    stat_.device_reads++;
+    if (!BlockCacheDeviceRead(cur, lba, n)) {
+      LOG_ERROR("Failed to read sectors (%d+%d)", lba, n);
+      stat_.failures++;
+      return false;
+    }
+    stat_.direct_sectors += n;
+    cur += n * kSectorSize;
+    lba += n;
+    count -= n;
+  }
+  return true;
+}
+
+BlockCache::Block* BlockCache::Find(uint64_t number) {
+  for (int16_t i = buckets_[BlockCacheHash(number, kBuckets)]; i != kNil;
+       i = blocks_[i].hash_next) {
+    if (blocks_[i].number == number) {
+      return &blocks_[i];
+    }
+  }
+  return nullptr;
+}
+
+BlockCache::Block* BlockCache::Fetch(uint64_t number) {
+  // Read ahead only while the blocks are missing, so that nothing cached is
+  // read twice.
+  size_t n = 1;
+  if (number == last_number_ + 1) {
+    while (n < kReadAheadBlocks && !Find(number + n)) {
+      n++;
+    }
+  }
+
+  // A read-ahead may run past the end of the disk, so retry the missed
+  // block alone.
+  const uint64_t lba = number * kBlockSectors;
+  stat_.device_reads++;
+  bool ok = BlockCacheDeviceRead(staging_, lba, n * kBlockSectors);
+  if (!ok && n > 1) {
+    stat_.failures++;
+    n = 1;
+    stat_.device_reads++;
+    ok = BlockCacheDeviceRead(staging_, lba, kBlockSectors);
+  }
+  if (!ok) {
+    LOG_ERROR("Failed to read block %d", number);
+    stat_.failures++;
+    return nullptr;
+  }
+
+  // The missed block goes in last, so that it is the most recently used.
+  Block* block = nullptr;
+  for (size_t i = n; i-- > 0;) {
+    block = Allocate();
+    memcpy(block->data, staging_ + i * kBlockSize, kBlockSize);
+    Insert(block, number + i);
+    block->ahead = i != 0;
+  }
+  stat_.readahead += n - 1;
+  return block;
+}
+
+BlockCache::Block* BlockCache::Allocate() {
+  Block* block;
+  if (num_blocks_ < kMaxBlocks) {
+    block = &blocks_[num_blocks_];
+    block->data = arena_ + num_blocks_ * kBlockSize;
+    num_blocks_++;
+  } else {
+    block = &blocks_[lru_tail_];
+    Remove(block);
+    stat_.evictions++;
+  }
+  return block;
+}
+
+void BlockCache::Insert(Block* block, uint64_t number) {
+  const auto idx = static_cast<int16_t>(block - blocks_);
+  auto& bucket = buckets_[BlockCacheHash(number, kBuckets)];
+  block->number = number;
+  block->hash_next = bucket;
+  bucket = idx;
+  LruPushFront(block);
+}
+
+void BlockCache::Remove(Block* block) {
+  const auto idx = static_cast<int16_t>(block - blocks_);
+  auto* link = &buckets_[BlockCacheHash(block->number, kBuckets)];
+  while (*link != idx) {
+    link = &blocks_[*link].hash_next;
+  }
+  *link = block->hash_next;
+  LruUnlink(block);
+}
+
+void BlockCache::LruUnlink(Block* block) {
+  if (block->lru_prev != kNil) {
+    blocks_[block->lru_prev].lru_next = block->lru_next;
+  } else {
+    lru_head_ = block->lru_next;
+  }
+  if (block->lru_next != kNil) {
+    blocks_[block->lru_next].lru_prev = block->lru_prev;
+  } else {
+    lru_tail_ = block->lru_prev;
+  }
+}
+
+void BlockCache::LruPushFront(Block* block) {
+  const auto idx = static_cast<int16_t>(block - blocks_);
+  block->lru_prev = kNil;
+  block->lru_next = lru_head_;
+  if (lru_head_ != kNil) {
+    blocks_[lru_head_].lru_prev = idx;
+  } else {
+    lru_tail_ = idx;
+  }
+  lru_head_ = idx;
+}
+
+}  // namespace evisor
@@ -0,0 +1,108 @@
+#ifndef EVISOR_FS_BLOCK_CACHE_H_
+#define EVISOR_FS_BLOCK_CACHE_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+namespace evisor {
+
+// Cache of disk blocks read by the filesystem, in front of the board's block
+// driver (Mmc or VirtioBlk).
+//
+// Blocks are 4 KiB and aligned to their size on the disk. They are found
+// through a hash index and evicted in LRU order. A miss right after the
+// previous block was read fetches the next few blocks with the same command.
+// The cache is read-only: the hypervisor never writes the volume it reads
+// through here.
+class BlockCache {
+ public:
+  static constexpr size_t kSectorSize = 512;
+  static constexpr size_t kBlockSize = 4096;
+  static constexpr size_t kBlockSectors = kBlockSize / kSectorSize;
+  static constexpr size_t kMaxBlocks = 64;
+  // Blocks fetched by one sequential miss, including the missed one
+  static constexpr size_t kReadAheadBlocks = 8;
+  // Sectors one uncached command carries at most (Mmc's block count field)
+  static constexpr size_t kMaxDirectSectors = 0xffff;
+
+  struct Stat {
+    uint64_t hits;
+    uint64_t misses;
+    // Blocks fetched ahead, and those of them hit later
+    uint64_t readahead;
+    uint64_t readahead_hits;
+    uint64_t evictions;
+    // Commands sent to the device, and the ones which failed
+    uint64_t device_reads;
+    uint64_t failures;
+    // Sectors read around the cache by ReadDirect()
+    uint64_t direct_sectors;
+  };
+
+  BlockCache() = default;
+  ~BlockCache() = default;
+
+  // Prevent copying.
+  BlockCache(BlockCache const&) = delete;
+  BlockCache& operator=(BlockCache const&) = delete;
+
+  static BlockCache& Get() noexcept {
+    static BlockCache instance;
+    return instance;
+  }
+
+  // Read |count| sectors from |lba| on into |buf|.
+  bool Read(void* buf, uint64_t lba, size_t count);
+  // Read |count| sectors from |lba| on straight into |buf|, one command per
+  // kMaxDirectSectors, without caching them. Meant for bulk file data, which
+  // would only evict the metadata. |buf| must be 4-byte aligned.
+  bool ReadDirect(void* buf, uint64_t lba, size_t count);
+
+  size_t GetNumBlocks() const { return num_blocks_; }
+  const Stat& GetStat() const { return stat_; }
+
+ private:
+  static constexpr size_t kBuckets = 128;
+  static constexpr int16_t kNil = -1;
+
+  struct Block {
+    // Disk block number, i.e. the first sector / kBlockSectors
+    uint64_t number;
+    uint8_t* data;
+    // Next block in the same hash bucket
+    int16_t hash_next;
+    // Neighbours in the LRU list, most recently used first
+    int16_t lru_prev;
+    int16_t lru_next;
+    // Fetched ahead and not hit yet
+    bool ahead;
+  };
+
+  // Find a cached block. Returns nullptr if it is not cached.
+  Block* Find(uint64_t number);
+  // Read a missed block, and the ones after it if the access is sequential.
+  Block* Fetch(uint64_t number);
+  // Take a free block, or evict the least recently used one.
+  Block* Allocate();
+  void Insert(Block* block, uint64_t number);
+  void Remove(Block* block);
+  void LruUnlink(Block* block);
+  void LruPushFront(Block* block);
+
+  Block blocks_[kMaxBlocks] = {};
+  size_t num_blocks_ = 0;
+  int16_t buckets_[kBuckets] = {};
+  int16_t lru_head_ = kNil;
+  int16_t lru_tail_ = kNil;
+  // Block data, and the buffer read-ahead commands land in
+  uint8_t* arena_ = nullptr;
+  uint8_t* staging_ = nullptr;
+  // The block read last, to detect sequential access
+  uint64_t last_number_ = ~0ULL;
+  Stat stat_ = {};
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_FS_BLOCK_CACHE_H_
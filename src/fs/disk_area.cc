@@ -0,0 +1,113 @@
+#include "fs/disk_area.h"
+
+#include "common/logger.h"
+#include "common/macro.h"
+#if defined(BOARD_IS_QEMU)
+#include "drivers/virtio/virtio-blk.h"
+#endif
+#include "platforms/platform_config.h"
+
+namespace evisor {
+
+#if defined(BOARD_IS_QEMU)
+static_assert(kDiskAreaSectorSize == kDiskSectorSize);
+
+uint64_t DiskAreaGetReservedSize(uint64_t capacity) {
+  const uint64_t reserved = CONFIG_SWAP_SIZE + CONFIG_SNAPSHOT_SIZE;
+  return capacity > reserved ? reserved : 0;
+}
+
+bool DiskAreaGet(DiskArea area, uint64_t* lba, uint64_t* pages) {
+  const uint64_t capacity = VirtioBlk::Get().GetDiskCapacity();
+  if (!DiskAreaGetReservedSize(capacity)) {
+    return false;
+  }
+
+  uint64_t start = capacity - CONFIG_SNAPSHOT_SIZE;
+  uint64_t size = CONFIG_SNAPSHOT_SIZE;
+  if (area == DiskArea::kSwap) {
+    start -= CONFIG_SWAP_SIZE;
+    size = CONFIG_SWAP_SIZE;
+  }
+  if (!size) {
+    return false;
+  }
+  *lba = start / kDiskAreaSectorSize;
+  *pages = size / PAGE_SIZE;
+  return true;
+}
+
+bool DiskAreaTransfer(uint64_t lba,
+                      void* buf,
+                      size_t pages,
+                      bool write,
+                      bool may_sleep) {
+  auto& virtio = VirtioBlk::Get();
+  const size_t sectors = pages * kDiskAreaSectorsPerPage;
+  const auto mode = may_sleep ? VirtioBlk::WaitMode::kAdaptive
+                              : VirtioBlk::WaitMode::kPoll;
+  const bool ok = write ? virtio.WriteSectors(buf, lba, sectors, mode)
+                        : virtio.ReadSectors(buf, lba, sectors, mode);
+  if (!ok) {
+    LOG_ERROR("Disk area I/O failed. sector: %d", lba);
+  }
+  return ok;
+}
+
+bool DiskAreaTransferPages(uint64_t lba,
+                           void* const* pages,
+                           size_t count,
+                           bool write,
+                           bool may_sleep) {
+  auto& virtio = VirtioBlk::Get();
+  const auto mode = may_sleep ? VirtioBlk::WaitMode::kAdaptive
+                              : VirtioBlk::WaitMode::kPoll;
+  const bool ok = write ? virtio.WritePages(pages, lba, count, mode)
+                        : virtio.ReadPages(pages, lba, count, mode);
+  if (!ok) {
+    LOG_ERROR("Disk area I/O failed. sector: %d", lba);
+  }
+  return ok;
+}
+#else
+// The boot storage cannot be written on this board.
+uint64_t DiskAreaGetReservedSize(uint64_t capacity) {
+  UNUSED(capacity);
+  return 0;
+}
+
+bool DiskAreaGet(DiskArea area, uint64_t* lba, uint64_t* pages) {
+  UNUSED(area);
+  UNUSED(lba);
+  UNUSED(pages);
+  return false;
+}
+
+bool DiskAreaTransfer(uint64_t lba,
+                      void* buf,
+                      size_t pages,
+                      bool write,
+                      bool may_sleep) {
+  UNUSED(lba);
+  UNUSED(buf);
+  UNUSED(pages);
+  UNUSED(write);
+  UNUSED(may_sleep);
+  return false;
+}
+
+bool DiskAreaTransferPages(uint64_t lba,
+                           void* const* pages,
+                           size_t count,
+                           bool write,
+                           bool may_sleep) {
+  UNUSED(lba);
+  UNUSED(pages);
+  UNUSED(count);
+  UNUSED(write);
+  UNUSED(may_sleep);
+  return false;
+}
+#endif
+
+}  // namespace evisor
@@ -0,0 +1,51 @@
+#ifndef EVISOR_FS_DISK_AREA_H_
+#define EVISOR_FS_DISK_AREA_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+#include "mm/pgtable.h"
+
+namespace evisor {
+
+// Areas reserved at the end of the boot disk for the hypervisor.
+//
+// The disk is laid out as:
+//  guest image | swap | snapshot
+// The size of each area is set by CONFIG_SWAP_SIZE and CONFIG_SNAPSHOT_SIZE.
+// Only boards booting from a raw virtio disk have them.
+constexpr size_t kDiskAreaSectorSize = 512;
+constexpr size_t kDiskAreaSectorsPerPage = PAGE_SIZE / kDiskAreaSectorSize;
+
+enum class DiskArea {
+  kSwap,
+  kSnapshot,
+};
+
+// Bytes at the end of a disk of |capacity| bytes that are not guest image.
+uint64_t DiskAreaGetReservedSize(uint64_t capacity);
+
+// Locate |area|. Returns false if the board or the disk has none.
+bool DiskAreaGet(DiskArea area, uint64_t* lba, uint64_t* pages);
+
+// Transfer whole pages from |lba| on. Sectors go out in ascending order, so
+// the disk sees one sequential stream. Other vCPUs may run meanwhile if
+// |may_sleep|, which only a caller whose buffers no VM can reach may allow.
+bool DiskAreaTransfer(uint64_t lba,
+                      void* buf,
+                      size_t pages,
+                      bool write,
+                      bool may_sleep);
+
+// Transfer the |count| scattered |pages| to or from consecutive pages from
+// |lba| on, in as few disk requests as the device allows.
+bool DiskAreaTransferPages(uint64_t lba,
+                           void* const* pages,
+                           size_t count,
+                           bool write,
+                           bool may_sleep);
+
+}  // namespace evisor
+
+#endif  // EVISOR_FS_DISK_AREA_H_
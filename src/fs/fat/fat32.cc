@@ -5,10 +5,8 @@
 #include "common/cstring.h"
 #include "common/logger.h"
 #include "drivers/mmc/mmc.h"
-#include "mm/new.h"
-#include "mm/pgtable_stage1.h"
-#include "mm/uncached/kmm_uncached_malloc.h"
-#include "platforms/timer.h"
+#include "fs/block_cache.h"
+#include "mm/slab/kmm_slab.h"
 
 namespace evisor {
 
@@ -21,7 +19,7 @@ constexpr uint16_t kBootSignature = 0xAA55;
 [[maybe_unused]] constexpr uint8_t kAttrReadOnly = 0x01;
 [[maybe_unused]] constexpr uint8_t kAttrHidden = 0x02;
 [[maybe_unused]] constexpr uint8_t kAttrSystem = 0x04;
-[[maybe_unused]] constexpr uint8_t kAttrVolumeId = 0x08;
+constexpr uint8_t kAttrVolumeId = 0x08;
 constexpr uint8_t kAttrLongName = 0x0f;
 constexpr uint8_t kAttrDirectory = 0x10;
 [[maybe_unused]] constexpr uint8_t kAttrArchive = 0x20;
@@ -32,13 +30,157 @@ constexpr uint8_t kDirNameRemovedEntry = 0xE5;
 
 constexpr uint8_t kLfnLastLongEntry = 0x40;
 
-[[maybe_unused]] constexpr uint32_t kUnusedCluster = 0;
+constexpr uint32_t kUnusedCluster = 0;
 [[maybe_unused]] constexpr uint32_t kReservedCluster = 1;
-constexpr uint32_t kBadCluster = 0x0FFFFFF7;
+[[maybe_unused]] constexpr uint32_t kBadCluster = 0x0FFFFFF7;
+constexpr uint32_t kEndOfChain = 0x0FFFFFF8;
+
+// FAT sectors read at once
+constexpr uint32_t kFatWindowSectors = BlockCache::kBlockSectors;
+// Extents allocated for a file at first
+constexpr uint32_t kInitialExtents = 4;
+// Entries and name bytes allocated for a directory index at first
+constexpr uint32_t kInitialDirEntries = 16;
+constexpr uint32_t kInitialDirNames = 256;
+
+inline char Fat32ToLower(char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// FNV-1a over the lowercase name
+uint32_t Fat32HashName(const char* name, uint32_t len) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t i = 0; i < len; i++) {
+    hash = (hash ^ static_cast<uint8_t>(Fat32ToLower(name[i]))) * 16777619u;
+  }
+  return hash;
+}
+
+// Move |size| bytes of a slab allocation into a new one of |new_size| bytes.
+void* Fat32Grow(void* ptr, size_t size, size_t new_size) {
+  void* result = kmm_slab_alloc(new_size);
+  if (!result) {
+    return nullptr;
+  }
+  if (size) {
+    memcpy(result, ptr, size);
+  }
+  kmm_slab_free(ptr);
+  return result;
+}
+
+bool Fat32DirIndexAdd(Fat32DirIndex* index,
+                      const char* name,
+                      uint8_t attr,
+                      uint32_t size,
+                      uint32_t cluster) {
+  if (index->num_entries == index->entries_capacity) {
+    const uint32_t capacity =
+        index->entries_capacity ? index->entries_capacity * 2
+                                : kInitialDirEntries;
+    auto* entries = static_cast<Fat32DirEntry*>(
+        Fat32Grow(index->entries, index->num_entries * sizeof(Fat32DirEntry),
+                  capacity * sizeof(Fat32DirEntry)));
+    if (!entries) {
+      return false;
+    }
+    index->entries = entries;
+    index->entries_capacity = capacity;
+  }
+
+  const auto len = static_cast<uint32_t>(evisor::strlen(name));
+  if (index->names_size + len + 1 > index->names_capacity) {
+    const uint32_t capacity =
+        std::max(index->names_capacity ? index->names_capacity * 2
+                                       : kInitialDirNames,
+                 index->names_size + len + 1);
+    auto* names = static_cast<char*>(
+        Fat32Grow(index->names, index->names_size, capacity));
+    if (!names) {
+      return false;
+    }
+    index->names = names;
+    index->names_capacity = capacity;
+  }
+
+  char* dst = index->names + index->names_size;
+  for (uint32_t i = 0; i < len; i++) {
+    dst[i] = Fat32ToLower(name[i]);
+  }
+  dst[len] = '\0';
+
+  index->entries[index->num_entries++] = {
+      .name = index->names_size,
+      .name_len = len,
+      .hash = Fat32HashName(name, len),
+      .next = -1,
+      .cluster = cluster,
+      .size = size,
+      .attr = attr,
+  };
+  index->names_size += len + 1;
+  return true;
+}
+
+// Chain the entries into hash buckets, once the directory is scanned.
+bool Fat32DirIndexBuild(Fat32DirIndex* index) {
+  uint32_t num_buckets = 1;
+  while (num_buckets < index->num_entries) {
+    num_buckets *= 2;
+  }
+  index->buckets =
+      static_cast<int32_t*>(kmm_slab_alloc(num_buckets * sizeof(int32_t)));
+  if (!index->buckets) {
+    return false;
+  }
+  index->num_buckets = num_buckets;
+  std::fill(index->buckets, index->buckets + num_buckets, -1);
+
+  // Later entries go first in the chains, so walk backwards to find the
+  // first of duplicated names.
+  for (uint32_t i = index->num_entries; i-- > 0;) {
+    auto& entry = index->entries[i];
+    auto& bucket = index->buckets[entry.hash & (num_buckets - 1)];
+    entry.next = bucket;
+    bucket = static_cast<int32_t>(i);
+  }
+  return true;
+}
+
+const Fat32DirEntry* Fat32DirIndexFind(const Fat32DirIndex* index,
+                                       const char* name,
+                                       uint32_t len) {
+  const uint32_t hash = Fat32HashName(name, len);
+  for (int32_t i = index->buckets[hash & (index->num_buckets - 1)]; i >= 0;
+       i = index->entries[i].next) {
+    const auto& entry = index->entries[i];
+    if (entry.hash != hash || entry.name_len != len) {
+      continue;
+    }
+    const char* entry_name = index->names + entry.name;
+    uint32_t j = 0;
+    while (j < len && Fat32ToLower(name[j]) == entry_name[j]) {
+      j++;
+    }
+    if (j == len) {
+      return &entry;
+    }
+  }
+  return nullptr;
+}
+
+void Fat32DirIndexFree(Fat32DirIndex* index) {
+  kmm_slab_free(index->entries);
+  kmm_slab_free(index->names);
+  kmm_slab_free(index->buckets);
+  kmm_slab_free(index);
+}
 }  // namespace
 
 bool Fat32Fs::Init() {
-  fs_.initialized = false;
+  if (fs_.initialized) {
+    return true;
+  }
 
 #ifndef BOARD_IS_QEMU
   if (!Mmc::Get().Open()) {
@@ -47,14 +189,16 @@ bool Fat32Fs::Init() {
   }
 #endif  // BOARD_IS_QEMU
 
-  uint8_t* buf = ReadSector(0, 1);
+  uint8_t* buf = sector_bufs_[0];
+  if (!ReadSector(0, 1, buf)) {
+    return false;
+  }
   {
     mbr_t* mbr = (mbr_t*)buf;
 
     // Check boot signature.
     if (mbr->MBR_Sig != kBootSignature) {
       LOG_ERROR("Invalid MBR_Sig (%x)", mbr->MBR_Sig);
-      kmm_uncached_free(buf);
       return false;
     }
 
@@ -70,7 +214,6 @@ bool Fat32Fs::Init() {
         fs_.volume[i].first_lba = mbr->MBR_Partition[0].PT_LbaOfs;
       }
     }
-    kmm_uncached_free(buf);
   }
 
   for (int i = 0; i < MAX_FAT_VOLUME_SIZE; i++) {
@@ -82,10 +225,12 @@ bool Fat32Fs::Init() {
 
     fat32_bpb_t* bpb = NULL;
     {
-      buf = ReadSector(cur->first_lba, 1);
+      if (!ReadSector(cur->first_lba, 1, buf)) {
+        cur->valid = false;
+        continue;
+      }
       cur->bpb = *(fat32_bpb_t*)buf;
       bpb = &(cur->bpb);
-      kmm_uncached_free(buf);
     }
 
     if (!CheckBpb(bpb)) {
@@ -116,7 +261,11 @@ bool Fat32Fs::Init() {
     }
 
     // Create root directory file for the user handle
-    InitFile(&cur->root, cur, kAttrDirectory, 0, cur->bpb.BPB_RootClus);
+    if (!InitFile(&cur->root, cur, kAttrDirectory, 0,
+                  cur->bpb.BPB_RootClus)) {
+      cur->valid = false;
+      continue;
+    }
 
 #ifdef ENABLE_MMU
     {
@@ -140,87 +289,51 @@ bool Fat32Fs::Open(fat32_file_t* result, const char* filename) {
 
   // Currently support only the first partition (boot).
   // TODO: implement here
-  const fat32_file_t* root = &fs_.volume[0].root;
-  if (!(root->attr & kAttrDirectory)) {
+  fat32_fat_t* fat = &fs_.volume[0];
+  if (!fat->valid) {
     return false;
   }
 
-  uint32_t cluster = root->cluster_root->val;
-  auto* cluster_list = root->cluster_root;
-  uint32_t sector = CalcSector(root->fat, cluster, 0);
-  bool found = false;
-  uint8_t* buf = NULL;
-  uint8_t* prev_buf = NULL;
-
-  // Traverse directory entries
-  while (!found && IsValidCluster(cluster)) {
-    buf = ReadSector(root->fat->first_lba + sector, 1);
-    for (uint32_t i = 0; i < kBlockSize; i += sizeof(fat32_dir_t)) {
-      fat32_dir_t* entry = (fat32_dir_t*)(buf + i);
-
-      if (entry->DIR_Name[0] == kDirNameEmptyEntry) {
-        // End of entry
-        break;
-      }
-
-      if (entry->DIR_Name[0] == kDirNameRemovedEntry) {
-        continue;
-      }
-
-      // If the entry is part of LFN, skip it since it will be checked after
-      // finding SFN
-      if (entry->DIR_Attr & kAttrLongName) {
-        continue;
-      }
-
-      // Try to find LFN
-      char* entry_filename = GetLfn(
-          entry, i,
-          // When crossing two sectors, it is necessary to refer to the previous
-          // entry.
-          prev_buf
-              ? (fat32_dir_t*)(prev_buf + (kBlockSize - sizeof(fat32_dir_t)))
-              : NULL);
-      if (entry_filename == NULL) {
-        entry_filename = GetSfn(entry);
-      }
-
-      // LOG_TRACE("Found file: %s", entry_filename);
-      if (evisor::strncmp(filename, entry_filename, kFat32MaxFileNameSize) ==
-          0) {
-        uint32_t entry_cluster =
-            ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
-        if (entry_cluster == 0) {
-          // root directory
-          entry_cluster = root->fat->bpb.BPB_RootClus;
-        }
-
-        InitFile(result, root->fat, entry->DIR_Attr, entry->DIR_FileSize,
-                 entry_cluster);
-        found = true;
-        break;
-      }
+  // Walk the path a component at a time, each looked up in the name index
+  // of its parent directory.
+  uint32_t dir_cluster = fat->bpb.BPB_RootClus;
+  const char* name = filename;
+  while (true) {
+    while (*name == '/') {
+      name++;
     }
-
-    if (prev_buf != NULL) {
-      kmm_uncached_free(prev_buf);
+    const char* name_end = name;
+    while (*name_end && *name_end != '/') {
+      name_end++;
+    }
+    const auto len = static_cast<uint32_t>(name_end - name);
+    if (len == 0 || len > kFat32MaxFileNameSize) {
+      return false;
     }
-    prev_buf = buf;
-    buf = NULL;
 
-    sector = CalcNextSector(root->fat, sector, cluster_list);
-    cluster_list = cluster_list->next;
-    cluster = cluster_list->val;
-  }
+    auto* index = GetDirIndex(fat, dir_cluster);
+    if (!index) {
+      return false;
+    }
+    const auto* entry = Fat32DirIndexFind(index, name, len);
+    if (!entry) {
+      return false;
+    }
 
-  if (prev_buf != NULL) {
-    kmm_uncached_free(prev_buf);
-  }
-  if (buf != NULL) {
-    kmm_uncached_free(buf);
+    uint32_t cluster = entry->cluster;
+    if (cluster == 0 && (entry->attr & kAttrDirectory)) {
+      // root directory
+      cluster = fat->bpb.BPB_RootClus;
+    }
+    if (*name_end == '\0') {
+      return InitFile(result, fat, entry->attr, entry->size, cluster);
+    }
+    if (!(entry->attr & kAttrDirectory)) {
+      return false;
+    }
+    dir_cluster = cluster;
+    name = name_end;
   }
-
-  return found;
 }
 
 int Fat32Fs::Read(fat32_file_t* file, void* buf, uint32_t offset, size_t len) {
@@ -234,44 +347,47 @@ int Fat32Fs::Read(fat32_file_t* file, void* buf, uint32_t offset, size_t len) {
     return 0;
   }
 
-  fat32_fat_t* fat = file->fat;
   uint32_t tail = std::min(offset + static_cast<uint32_t>(len), file->size);
   uint32_t remains = tail - offset;
 
-  uint32_t cluster = CalcCluster(fat, file->cluster_root, offset);
-  uint32_t sector = CalcSector(fat, cluster, offset);
+  uint32_t sector_idx = offset / kBlockSize;
   uint32_t sector_offset = offset % kBlockSize;
 
-  auto* cluster_list = file->cluster_root;
-  while (cluster_list->val != cluster) {
-    cluster_list = cluster_list->next;
-  }
+  while (remains > 0) {
+    uint32_t lba;
+    uint32_t run;
+    if (!MapSector(file, sector_idx, &lba, &run)) {
+      break;
+    }
 
-  while (remains > 0 && IsValidCluster(cluster)) {
-    uint8_t* read_buf;
+    uint32_t sectors;
     uint32_t copy_len;
-    const uint32_t lba = fat->first_lba + sector;
-    if (sector_offset > 0 || remains <= kBlockSize ||
-        fat->bpb.BPB_SecPerClus == 1) {
-      read_buf = ReadSector(lba, 1);
+    if (sector_offset > 0 || remains < kBlockSize) {
+      // A partial sector goes through a sector buffer.
+      sectors = 1;
       copy_len = std::min(remains, kBlockSize - sector_offset);
+      if (!ReadSector(lba, 1, sector_bufs_[0])) {
+        break;
+      }
+      memcpy(buf, sector_bufs_[0] + sector_offset, copy_len);
     } else {
-      auto read_sectors = static_cast<uint32_t>(
-          (static_cast<float>(remains) / kBlockSize) + 0.5);
-      uint32_t sector_num =
-          std::min(read_sectors, fat->bpb.BPB_SecPerClus - sector);
-      read_buf = ReadSector(lba, sector_num);
-      copy_len = std::min(remains, kBlockSize * read_sectors);
+      // Whole sectors up to the end of the extent are read in place. A run
+      // of a cache block or more is physically contiguous, so it takes one
+      // multi-block command and bypasses the cache.
+      sectors = std::min(remains / kBlockSize, run);
+      copy_len = sectors * kBlockSize;
+      const bool direct = sectors >= BlockCache::kBlockSectors &&
+                          reinterpret_cast<uintptr_t>(buf) % 4 == 0;
+      if (direct ? !BlockCache::Get().ReadDirect(buf, lba, sectors)
+                 : !ReadSector(lba, sectors, buf)) {
+        break;
+      }
     }
 
-    memcpy(buf, read_buf + sector_offset, copy_len);
-    kmm_uncached_free(read_buf);
     buf = static_cast<uint8_t*>(buf) + copy_len;
     remains -= copy_len;
     sector_offset = 0;
-
-    sector = CalcNextSector(fat, sector, cluster_list);
-    cluster_list = cluster_list->next;
+    sector_idx += sectors;
   }
 
   return tail - offset - remains;
@@ -285,20 +401,12 @@ int Fat32Fs::IsDirectory(fat32_file_t* file) {
   return (file->attr & kAttrDirectory) != 0;
 }
 
-uint8_t* Fat32Fs::ReadSector(uint32_t lba, uint32_t sector_num) {
-  auto* buf = static_cast<uint8_t*>(kmm_uncached_malloc(PAGE_SIZE));
-
-  auto& mmc = Mmc::Get();
-  mmc.Seek(kBlockSize * lba);
-  // auto start = Timer::GetSystemUsec();
-  if (mmc.Read(buf, kBlockSize * sector_num) < 0) {
-    LOG_ERROR("Failed to emmc_read");
-    return NULL;
+bool Fat32Fs::ReadSector(uint32_t lba, uint32_t sector_num, void* buf) {
+  if (!BlockCache::Get().Read(buf, lba, sector_num)) {
+    LOG_ERROR("Failed to read sectors (%d+%d)", lba, sector_num);
+    return false;
   }
-  // auto end =  Timer::GetSystemUsec();
-  // LOG_DEBUG("ReadSector: %d[msec]", (end - start) / 1000);
-
-  return buf;
+  return true;
 }
 
 bool Fat32Fs::CheckBpb(fat32_bpb_t* bpb) {
@@ -323,7 +431,7 @@ bool Fat32Fs::CheckBpb(fat32_bpb_t* bpb) {
   return true;
 }
 
-void Fat32Fs::InitFile(fat32_file_t* file,
+bool Fat32Fs::InitFile(fat32_file_t* file,
                        fat32_fat_t* fat,
                        uint8_t attr,
                        uint32_t size,
@@ -331,50 +439,198 @@ void Fat32Fs::InitFile(fat32_file_t* file,
   file->fat = fat;
   file->attr = attr;
   file->size = size;
-  file->cluster_root = new ClusterLinkedListNode();
-  file->cluster_root->val = cluster;
+  return MapClusters(file, cluster);
 }
 
-uint32_t Fat32Fs::CalcCluster(fat32_fat_t* fat,
-                              ClusterLinkedListNode* cluster_list,
-                              uint32_t offset) {
-  const fat32_bpb_t* bpb = &(fat->bpb);
-  const int max_sector = offset / (bpb->BPB_SecPerClus * bpb->BPB_BytsPerSec);
-  uint8_t* buf = nullptr;
-
-  auto cluster = cluster_list->val;
-  for (int i = 0; i < max_sector; i++) {
-    if (cluster_list->next == nullptr) {
-      uint32_t sector =
-          fat->fat_first_sector + (cluster * 4 / bpb->BPB_BytsPerSec);
-      uint32_t offset = cluster * 4 % bpb->BPB_BytsPerSec;
-
-      if (buf != nullptr) {
-        kmm_uncached_free(buf);
-        buf = nullptr;
-      }
-      buf = ReadSector(fat->first_lba + sector, 1);
+bool Fat32Fs::MapClusters(fat32_file_t* file, uint32_t cluster) {
+  fat32_fat_t* fat = file->fat;
+  const uint32_t max_clusters = fat->data_sectors / fat->bpb.BPB_SecPerClus;
+  uint32_t capacity = 0;
+  file->extents = nullptr;
+  file->num_extents = 0;
+  // An empty file has no clusters.
+  if (cluster == kUnusedCluster) {
+    return true;
+  }
 
-      cluster = *((uint32_t*)(buf + offset)) & 0x0fffffff;
-      if (!IsValidCluster(cluster)) {
-        cluster = kBadCluster;
-        break;
-      }
+  for (uint32_t file_cluster = 0; !IsEndOfChain(cluster); file_cluster++) {
+    // A free, reserved, bad or out-of-range cluster cannot be in a chain.
+    if (!IsValidCluster(cluster) || cluster - 2 >= max_clusters) {
+      LOG_ERROR("The cluster chain is broken at %x", cluster);
+      break;
+    }
+    if (file_cluster >= max_clusters) {
+      LOG_ERROR("The cluster chain has a loop");
+      break;
+    }
 
-      cluster_list->next = new ClusterLinkedListNode();
-      cluster_list = cluster_list->next;
-      cluster_list->val = cluster;
+    auto* last =
+        file->num_extents ? &file->extents[file->num_extents - 1] : nullptr;
+    if (last && last->start_cluster + last->num_clusters == cluster) {
+      last->num_clusters++;
     } else {
-      cluster_list = cluster_list->next;
-      cluster = cluster_list->val;
+      if (file->num_extents == capacity) {
+        capacity = capacity ? capacity * 2 : kInitialExtents;
+        auto* extents = static_cast<Fat32Extent*>(
+            Fat32Grow(file->extents, file->num_extents * sizeof(Fat32Extent),
+                      capacity * sizeof(Fat32Extent)));
+        if (!extents) {
+          LOG_ERROR("Failed to allocate extents");
+          break;
+        }
+        file->extents = extents;
+      }
+      file->extents[file->num_extents++] = {
+          .file_cluster = file_cluster,
+          .start_cluster = cluster,
+          .num_clusters = 1,
+      };
+    }
+    if (!ReadFatEntry(fat, cluster, &cluster)) {
+      break;
+    }
+  }
+
+  // A chain cut short would read back as a truncated file.
+  if (!IsEndOfChain(cluster)) {
+    kmm_slab_free(file->extents);
+    file->extents = nullptr;
+    file->num_extents = 0;
+    return false;
+  }
+  return true;
+}
+
+bool Fat32Fs::MapSector(fat32_file_t* file,
+                        uint32_t idx,
+                        uint32_t* lba,
+                        uint32_t* run) {
+  const uint32_t secs_per_clus = file->fat->bpb.BPB_SecPerClus;
+  const uint32_t file_cluster = idx / secs_per_clus;
+
+  // The last extent starting at or before the cluster
+  const Fat32Extent* begin = file->extents;
+  const Fat32Extent* extent = std::upper_bound(
+      begin, begin + file->num_extents, file_cluster,
+      [](uint32_t cluster, const Fat32Extent& e) {
+        return cluster < e.file_cluster;
+      });
+  if (extent == begin) {
+    return false;
+  }
+  extent--;
+
+  const uint32_t sector = idx - extent->file_cluster * secs_per_clus;
+  const uint32_t sectors = extent->num_clusters * secs_per_clus;
+  if (sector >= sectors) {
+    return false;
+  }
+  *lba = file->fat->first_lba +
+         CalcSector(file->fat, extent->start_cluster, 0) + sector;
+  *run = sectors - sector;
+  return true;
+}
+
+Fat32DirIndex* Fat32Fs::GetDirIndex(fat32_fat_t* fat, uint32_t cluster) {
+  for (auto* index = dir_indexes_; index; index = index->next) {
+    if (index->fat == fat && index->cluster == cluster) {
+      return index;
     }
   }
 
-  if (buf != nullptr) {
-    kmm_uncached_free(buf);
+  auto* index =
+      static_cast<Fat32DirIndex*>(kmm_slab_alloc(sizeof(Fat32DirIndex)));
+  if (!index) {
+    return nullptr;
   }
+  *index = {};
+  index->fat = fat;
+  index->cluster = cluster;
+
+  // The root keeps its extents. Other directories are mapped only to be
+  // scanned.
+  fat32_file_t dir;
+  fat32_file_t* file = &fat->root;
+  if (cluster != fat->bpb.BPB_RootClus) {
+    if (!InitFile(&dir, fat, kAttrDirectory, 0, cluster)) {
+      Fat32DirIndexFree(index);
+      return nullptr;
+    }
+    file = &dir;
+  }
+  const bool ok = ScanDir(file, index) && Fat32DirIndexBuild(index);
+  if (file == &dir) {
+    kmm_slab_free(dir.extents);
+  }
+  if (!ok) {
+    LOG_ERROR("Failed to index the directory at cluster %d", cluster);
+    Fat32DirIndexFree(index);
+    return nullptr;
+  }
+
+  index->next = dir_indexes_;
+  dir_indexes_ = index;
+  return index;
+}
+
+bool Fat32Fs::ScanDir(fat32_file_t* dir, Fat32DirIndex* index) {
+  uint8_t* prev_buf = NULL;
+
+  // Traverse directory entries
+  for (uint32_t idx = 0;; idx++) {
+    uint32_t lba;
+    uint32_t run;
+    if (!MapSector(dir, idx, &lba, &run)) {
+      // End of the cluster chain
+      return true;
+    }
+    uint8_t* buf =
+        prev_buf == sector_bufs_[0] ? sector_bufs_[1] : sector_bufs_[0];
+    if (!ReadSector(lba, 1, buf)) {
+      return false;
+    }
+
+    for (uint32_t i = 0; i < kBlockSize; i += sizeof(fat32_dir_t)) {
+      fat32_dir_t* entry = (fat32_dir_t*)(buf + i);
+
+      if (entry->DIR_Name[0] == kDirNameEmptyEntry) {
+        // End of entry
+        return true;
+      }
+
+      if (entry->DIR_Name[0] == kDirNameRemovedEntry) {
+        continue;
+      }
+
+      // If the entry is part of LFN, skip it since it will be checked after
+      // finding SFN. A volume label names no file.
+      if ((entry->DIR_Attr & kAttrLongName) == kAttrLongName ||
+          (entry->DIR_Attr & kAttrVolumeId)) {
+        continue;
+      }
+
+      // Try to find LFN
+      char* entry_filename = GetLfn(
+          entry, i,
+          // When crossing two sectors, it is necessary to refer to the previous
+          // entry.
+          prev_buf
+              ? (fat32_dir_t*)(prev_buf + (kBlockSize - sizeof(fat32_dir_t)))
+              : NULL);
+      if (entry_filename == NULL) {
+        entry_filename = GetSfn(entry);
+      }
 
-  return cluster;
+      const uint32_t entry_cluster =
+          ((uint32_t)entry->DIR_FstClusHI << 16) | entry->DIR_FstClusLO;
+      if (!Fat32DirIndexAdd(index, entry_filename, entry->DIR_Attr,
+                            entry->DIR_FileSize, entry_cluster)) {
+        return false;
+      }
+    }
+
+    prev_buf = buf;
+  }
 }
 
 uint8_t Fat32Fs::CreateLfnSum(fat32_dir_t* entry) {
@@ -389,14 +645,12 @@ uint8_t Fat32Fs::CreateLfnSum(fat32_dir_t* entry) {
 
 char* Fat32Fs::GetSfn(fat32_dir_t* entry) {
   static char result[13];
+  char* p_result = result;
 
-  // name
-  for (int i = 0; i < 8; i++) {
-    result[i] = entry->DIR_Name[i];
-    if (result[i] == ' ') {
-      break;
-    }
-    if (result[i] == kDirNameKanjiEntry) {
+  // name, padded with spaces
+  for (int i = 0; i < 8 && entry->DIR_Name[i] != ' '; i++) {
+    *p_result = entry->DIR_Name[i];
+    if (i == 0 && *p_result == kDirNameKanjiEntry) {
       /*
       If DIR_Name[0] == 0x05, then the actual file name character for this byte
       is 0xE5. 0xE5 is actually a valid KANJI lead byte value for the character
@@ -404,24 +658,19 @@ char* Fat32Fs::GetSfn(fat32_dir_t* entry) {
       file name case for Japan can be handled properly and not cause FAT file
       system code to think that the entry is free.
       */
-      result[i] = 0xe5;
+      *p_result = 0xe5;
     }
+    p_result++;
   }
 
   // extention
   if (entry->DIR_Name[8] != ' ') {
-    result[8] = '.';
-    for (int i = 8; i < 11; i++) {
-      result[i + 1] = entry->DIR_Name[i];
-      if (result[i + 1] == ' ') {
-        break;
-      }
-      if (result[i + 1] == kDirNameKanjiEntry) {
-        result[i + 1] = 0xe5;
-      }
+    *p_result++ = '.';
+    for (int i = 8; i < 11 && entry->DIR_Name[i] != ' '; i++) {
+      *p_result++ = entry->DIR_Name[i];
     }
   }
-  result[12] = '\0';
+  *p_result = '\0';
 
   return result;
 }
@@ -476,38 +725,27 @@ char* Fat32Fs::GetLfn(fat32_dir_t* entry,
   return result;
 }
 
-int Fat32Fs::CalcNextSector(fat32_fat_t* fat,
-                            uint32_t cur_sector,
-                            ClusterLinkedListNode* cluster_list) {
-  const uint32_t secs_per_clus = fat->bpb.BPB_SecPerClus;
-  if (cur_sector % secs_per_clus != secs_per_clus - 1) {
-    return cur_sector + 1;
-  }
-
-  // Go over a cluster boundary
-  auto next_cluster = CalcNextCluster(fat, cluster_list);
-  return CalcSector(fat, next_cluster, 0);
-}
-
-uint32_t Fat32Fs::CalcNextCluster(fat32_fat_t* fat,
-                                  ClusterLinkedListNode* cluster_list) {
+bool Fat32Fs::ReadFatEntry(fat32_fat_t* fat,
+                           uint32_t cluster,
+                           uint32_t* next) {
   const fat32_bpb_t* bpb = &(fat->bpb);
-  uint32_t sector =
-      fat->fat_first_sector + (cluster_list->val * 4 / bpb->BPB_BytsPerSec);
-  uint32_t offset = cluster_list->val * 4 % bpb->BPB_BytsPerSec;
-
-  uint32_t next_cluster;
-  if (cluster_list->next == nullptr) {
-    uint8_t* buf = ReadSector(fat->first_lba + sector, 1);
-    next_cluster = *((uint32_t*)(buf + offset)) & 0x0fffffff;
-    kmm_uncached_free(buf);
-    cluster_list->next = new ClusterLinkedListNode();
-    cluster_list->next->val = next_cluster;
-  } else {
-    next_cluster = cluster_list->next->val;
-  }
-
-  return next_cluster;
+  uint32_t sector = cluster * 4 / bpb->BPB_BytsPerSec;
+  uint32_t offset = cluster * 4 % bpb->BPB_BytsPerSec;
+
+  // A chain mostly goes forward, so the entries next to this one are read
+  // with it.
+  const uint32_t window = sector / kFatWindowSectors * kFatWindowSectors;
+  const uint32_t lba = fat->first_lba + fat->fat_first_sector + window;
+  if (lba != fat_buf_lba_) {
+    if (!ReadSector(lba, kFatWindowSectors, fat_buf_)) {
+      fat_buf_lba_ = 0;
+      return false;
+    }
+    fat_buf_lba_ = lba;
+  }
+  offset += (sector - window) * bpb->BPB_BytsPerSec;
+  *next = *((uint32_t*)(fat_buf_ + offset)) & 0x0fffffff;
+  return true;
 }
 
 uint32_t Fat32Fs::CalcSector(fat32_fat_t* fat,
@@ -532,4 +770,8 @@ inline bool Fat32Fs::IsValidCluster(uint32_t cluster) {
   return (cluster >= 0x00000002 && cluster <= 0xffffff6);
 }
 
+inline bool Fat32Fs::IsEndOfChain(uint32_t cluster) {
+  return cluster >= kEndOfChain;
+}
+
 }  // namespace evisor
@@ -5,6 +5,8 @@
 #include <cstddef>
 #include <cstdint>
 
+#include "fs/block_cache.h"
+
 // clang-format off
 #define MAX_FAT_VOLUME_SIZE        4
 // clang-format on
@@ -44,19 +46,54 @@ typedef struct {
   uint16_t BS_BootSign;
 } __attribute__((__packed__)) fat32_bpb_t;
 
-struct ClusterLinkedListNode {
-  uint32_t val;
-  ClusterLinkedListNode* prev;
-  ClusterLinkedListNode* next;
+// A run of clusters contiguous on the disk
+struct Fat32Extent {
+  // Position of the first cluster in the file, in clusters
+  uint32_t file_cluster;
+  uint32_t start_cluster;
+  uint32_t num_clusters;
 };
 
 typedef struct {
   struct fat32_fat* fat;
   uint8_t attr;
   uint32_t size;
-  ClusterLinkedListNode* cluster_root;
+  // Cluster chain, converted once into extents in file order
+  Fat32Extent* extents;
+  uint32_t num_extents;
 } fat32_file_t;
 
+// An entry in the name index of its directory
+struct Fat32DirEntry {
+  // Offset of the lowercase name in the directory's name pool
+  uint32_t name;
+  uint32_t name_len;
+  uint32_t hash;
+  // Next entry in the same hash bucket, or -1
+  int32_t next;
+  uint32_t cluster;
+  uint32_t size;
+  uint8_t attr;
+};
+
+// Name index of a directory, built by one scan when it is first searched
+struct Fat32DirIndex {
+  struct fat32_fat* fat;
+  // First cluster of the directory
+  uint32_t cluster;
+  Fat32DirEntry* entries;
+  uint32_t num_entries;
+  uint32_t entries_capacity;
+  // Names of the entries, each NUL terminated
+  char* names;
+  uint32_t names_size;
+  uint32_t names_capacity;
+  int32_t* buckets;
+  uint32_t num_buckets;
+  // Next directory indexed so far
+  Fat32DirIndex* next;
+};
+
 typedef struct fat32_fat {
   fat32_bpb_t bpb;
   fat32_file_t root;
@@ -75,7 +112,21 @@ class Fat32Fs {
   Fat32Fs() = default;
   ~Fat32Fs() = default;
 
+  // Prevent copying.
+  Fat32Fs(Fat32Fs const&) = delete;
+  Fat32Fs& operator=(Fat32Fs const&) = delete;
+
+  // The filesystem shared by every loader, so that directories are scanned
+  // once.
+  static Fat32Fs& Get() noexcept {
+    static Fat32Fs instance;
+    return instance;
+  }
+
+  // Does nothing if already initialized.
   bool Init();
+  // Open |filename|, a path from the root such as "guests/vm.img". Names are
+  // matched case-insensitively.
   bool Open(fat32_file_t* result, const char* filename);
   int Read(fat32_file_t* file, void* buf, uint32_t offset, size_t len);
   int GetFileSize(fat32_file_t* file);
@@ -130,31 +181,50 @@ class Fat32Fs {
     uint8_t LDIR_Name3[4];
   } __attribute__((__packed__)) fat32_lfn_t;
 
-  uint8_t* ReadSector(uint32_t lba, uint32_t sector_num);
+  // Read sectors through the block cache.
+  bool ReadSector(uint32_t lba, uint32_t sector_num, void* buf);
   bool CheckBpb(fat32_bpb_t* bpb);
 
-  inline void InitFile(fat32_file_t* file,
-                       fat32_fat_t* fat,
-                       uint8_t attr,
-                       uint32_t size,
-                       uint32_t cluster);
+  bool InitFile(fat32_file_t* file,
+                fat32_fat_t* fat,
+                uint8_t attr,
+                uint32_t size,
+                uint32_t cluster);
 
   char* GetLfn(fat32_dir_t* entry, size_t offset, fat32_dir_t* prev_entry);
   uint8_t CreateLfnSum(fat32_dir_t* entry);
   char* GetSfn(fat32_dir_t* entry);
 
-  uint32_t CalcCluster(fat32_fat_t* fat,
-                       ClusterLinkedListNode* cluster_list,
-                       uint32_t offset);
   uint32_t CalcSector(fat32_fat_t* fat, uint32_t cluster, size_t offset);
   inline bool IsValidCluster(uint32_t cluster);
-  int CalcNextSector(fat32_fat_t* fat,
-                     uint32_t cur_sector,
-                     ClusterLinkedListNode* cluster_list);
-  uint32_t CalcNextCluster(fat32_fat_t* fat,
-                           ClusterLinkedListNode* cluster_list);
+  inline bool IsEndOfChain(uint32_t cluster);
+  // Convert the cluster chain starting at |cluster| into extents. Fails if
+  // the chain is broken or the FAT cannot be read.
+  bool MapClusters(fat32_file_t* file, uint32_t cluster);
+  // Find the LBA of the |idx|th sector of |file|. |run| is set to the number
+  // of sectors contiguous on the disk from there.
+  bool MapSector(fat32_file_t* file,
+                 uint32_t idx,
+                 uint32_t* lba,
+                 uint32_t* run);
+  // Read the FAT entry of |cluster| into |next|. The FAT is read a window at
+  // a time. Returns false if it cannot be read.
+  bool ReadFatEntry(fat32_fat_t* fat, uint32_t cluster, uint32_t* next);
+  // Find the name index of the directory at |cluster|, scanning the directory
+  // the first time.
+  Fat32DirIndex* GetDirIndex(fat32_fat_t* fat, uint32_t cluster);
+  // Add every entry of |dir| to |index|.
+  bool ScanDir(fat32_file_t* dir, Fat32DirIndex* index);
 
   fat32_fs_t fs_;
+  // Two consecutive sectors, so that a long name crossing them can be
+  // rebuilt
+  uint8_t sector_bufs_[2][BlockCache::kSectorSize];
+  // FAT sectors last read, and the LBA of the first one
+  uint8_t fat_buf_[BlockCache::kBlockSize];
+  uint32_t fat_buf_lba_ = 0;
+  // Directories indexed so far
+  Fat32DirIndex* dir_indexes_ = nullptr;
 };
 
 }  // namespace evisor
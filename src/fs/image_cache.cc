@@ -0,0 +1,68 @@
+#include "fs/image_cache.h"
+
+#include "common/cstring.h"
+#include "common/logger.h"
+#include "mm/heap/kmm_zalloc.h"
+#include "mm/pgtable.h"
+#include "mm/user_heap/umm_malloc.h"
+
+namespace evisor {
+
+CachedImage* ImageCache::Find(const char* name, uint64_t size) {
+  for (size_t i = 0; i < count_; i++) {
+    auto& image = images_[i];
+    if (image.size == size && strncmp(image.name, name, kMaxNameLen) == 0) {
+      return &image;
+    }
+  }
+  return nullptr;
+}
+
+bool ImageCache::Add(const char* name,
+                     uint64_t size,
+                     void** pages,
+                     size_t num_pages) {
+  if (count_ >= kMaxImages) {
+    LOG_WARN("Image cache is full. %s is not shared.", name);
+    return false;
+  }
+
+  for (size_t i = 0; i < num_pages; i++) {
+    umm_page_get(pages[i]);
+  }
+  images_[count_++] = {
+      .name = name,
+      .size = size,
+      .num_pages = num_pages,
+      .pages = pages,
+      .source = nullptr,
+  };
+  return true;
+}
+
+CachedImage* ImageCache::AddOnDemand(const char* name,
+                                     uint64_t size,
+                                     void* source) {
+  if (count_ >= kMaxImages) {
+    LOG_ERROR("Image cache is full. %s cannot be loaded on demand.", name);
+    return nullptr;
+  }
+
+  const size_t num_pages = __builtin_align_up(size, PAGE_SIZE) / PAGE_SIZE;
+  auto& image = images_[count_++];
+  image = {
+      .name = name,
+      .size = size,
+      .num_pages = num_pages,
+      .pages = static_cast<void**>(kmm_zalloc(num_pages * sizeof(void*))),
+      .source = source,
+  };
+  return &image;
+}
+
+void ImageCache::SetPage(CachedImage* image, size_t idx, void* page) {
+  umm_page_get(page);
+  image->pages[idx] = page;
+}
+
+}  // namespace evisor
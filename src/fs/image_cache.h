@@ -0,0 +1,61 @@
+#ifndef EVISOR_FS_IMAGE_CACHE_H_
+#define EVISOR_FS_IMAGE_CACHE_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+namespace evisor {
+
+struct CachedImage {
+  const char* name;
+  uint64_t size;
+  size_t num_pages;
+  // Pages holding the file contents, in file order. A page which has not
+  // been read yet is nullptr while the image is loaded on demand.
+  void** pages;
+  // Owned by the loader. Set while pages are still read on demand.
+  void* source;
+};
+
+// Guest images which have already been loaded from disk, keyed by file name
+// and size. VMs booting the same image map its pages copy-on-write instead of
+// reading the file again.
+class ImageCache {
+ public:
+  static constexpr size_t kMaxImages = 4;
+  static constexpr size_t kMaxNameLen = 64;
+
+  ImageCache() = default;
+  ~ImageCache() = default;
+
+  // Prevent copying.
+  ImageCache(ImageCache const&) = delete;
+  ImageCache& operator=(ImageCache const&) = delete;
+
+  static ImageCache& Get() noexcept {
+    static ImageCache instance;
+    return instance;
+  }
+
+  // Find a loaded image. Returns nullptr if it is not cached.
+  CachedImage* Find(const char* name, uint64_t size);
+
+  // Register the pages of a fully loaded image. The cache takes a reference
+  // on every page and the ownership of |pages|.
+  bool Add(const char* name, uint64_t size, void** pages, size_t num_pages);
+
+  // Register an image whose pages are read on demand from |source|.
+  CachedImage* AddOnDemand(const char* name, uint64_t size, void* source);
+
+  // Store a page read on demand. The cache takes a reference on |page|.
+  void SetPage(CachedImage* image, size_t idx, void* page);
+
+ private:
+  CachedImage images_[kMaxImages] = {};
+  size_t count_ = 0;
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_FS_IMAGE_CACHE_H_
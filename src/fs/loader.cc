@@ -2,109 +2,275 @@
 
 #include <algorithm>
 
-#include "common/cstring.h"
+#include "arch/arm64/cache.h"
 #include "common/logger.h"
+#include "common/macro.h"
 #if defined(BOARD_IS_QEMU)
 #include "drivers/virtio/virtio-blk.h"
 #else
 #include "fs/fat/fat32.h"
 #endif
+#include "fs/disk_area.h"
+#include "fs/image_cache.h"
+#include "fs/snapshot.h"
 #include "kernel/sched/sched.h"
 #include "kernel/task/task.h"
+#include "mm/heap/kmm_malloc.h"
 #include "mm/new.h"
 #include "mm/pgtable_stage1.h"
+#include "mm/pgtable_stage2.h"
+#include "mm/user_heap/umm_malloc.h"
+#include "platforms/platform_config.h"
 #include "platforms/timer.h"
 
 namespace evisor {
 
 namespace {
 
-bool LoaderLoadFile(Tcb* tsk, const char* name, uint64_t va) {
+// Pages read and mapped per fault while an image is loaded on demand.
+constexpr size_t kLoaderReadAheadPages = 8;
+// Most pages read with one call while an image is loaded eagerly. A run of
+// physically contiguous pages takes one multi-block command.
+constexpr size_t kLoaderChunkPages =
+    std::max<size_t>(1, 128 * 1024 / PAGE_SIZE);
+
+// Where the pages of an image are read from.
+struct LoaderImageSource {
+  uint64_t size;
+#if defined(BOARD_IS_QEMU)
+  VirtioBlk* virtio;
+#else
+  Fat32Fs* fs;
+  fat32_file_t file;
+#endif
+};
+
+bool LoaderOpenImage(LoaderImageSource* source, const char* name) {
 #if defined(BOARD_IS_QEMU)
+  UNUSED(name);
+
   auto& virtio = evisor::VirtioBlk::Get();
   virtio.Init();
 
-  int64_t sector_remains = virtio.GetDiskCapacity() / kDiskSectorSize;
-  uint32_t sector_offset = 0;
+  source->virtio = &virtio;
+  // The end of the disk is kept for swap and a VM snapshot.
+  source->size = virtio.GetDiskCapacity();
+  source->size -= DiskAreaGetReservedSize(source->size);
+#else
+  // Shared by every image, so that the directories are scanned once.
+  source->fs = &Fat32Fs::Get();
+
+  if (!source->fs->Init()) {
+    LOG_ERROR("Failed to init FAT32 filesystem");
+    return false;
+  }
+
+  if (!source->fs->Open(&source->file, name)) {
+    LOG_ERROR("Failed to open %s.", name);
+    return false;
+  }
+  source->size = source->fs->GetFileSize(&source->file);
+#endif
+  return true;
+}
+
+// Read |len| bytes of the image from |offset| on into |buf|. Other vCPUs may
+// run meanwhile if |may_sleep|, which only a caller reading into pages no VM
+// maps yet may allow.
+bool LoaderReadImage(LoaderImageSource* source,
+                     uint64_t offset,
+                     size_t len,
+                     uint8_t* buf,
+                     bool may_sleep) {
+#if defined(BOARD_IS_QEMU)
+  const uint64_t sector = offset / kDiskSectorSize;
+  const auto mode = may_sleep ? VirtioBlk::WaitMode::kAdaptive
+                              : VirtioBlk::WaitMode::kPoll;
+  if (!source->virtio->ReadSectors(buf, sector, len / kDiskSectorSize,
+                                   mode)) {
+    LOG_ERROR("Failed to read. sector_offset: %d", sector);
+    return false;
+  }
+#else
+  UNUSED(may_sleep);
+  auto reads = source->fs->Read(&source->file, buf, offset, len);
+  if (static_cast<int>(len) != reads) {
+    LOG_ERROR("Failed to read. requested size: %d, actual size: %d", len,
+              reads);
+    return false;
+  }
+#endif
+  return true;
+}
+
+// Read the |idx|th page of the image into |buf|, a page no VM maps yet.
+bool LoaderReadImagePage(LoaderImageSource* source, size_t idx, uint8_t* buf) {
+  const uint64_t offset = idx * PAGE_SIZE;
+  return LoaderReadImage(source, offset,
+                         std::min<uint64_t>(PAGE_SIZE, source->size - offset),
+                         buf, true);
+}
+
+// Map every page of a cached image copy-on-write.
+void LoaderMapCachedImage(Tcb* tsk, const CachedImage& image, uint64_t va) {
   uint64_t cur = va & PAGE_MASK;
+  for (size_t i = 0; i < image.num_pages; i++) {
+    umm_page_get(image.pages[i]);
+    PgTableStage2::MapSharedPage(tsk, cur,
+                                 reinterpret_cast<pa_t>(image.pages[i]));
+    cur += PAGE_SIZE;
+  }
+}
 
-  while (sector_remains > 0) {
-    auto* buf = reinterpret_cast<uint8_t*>(PgTableStage1::PageMap(tsk, cur));
+// Read the image pages [first, first + count) straight into |pages|, which
+// are physically contiguous, and map them copy-on-write from |va| on so that
+// they stay pristine for the image cache. The pages are freed if the read
+// fails.
+bool LoaderLoadPages(Tcb* tsk,
+                     LoaderImageSource* source,
+                     void* const* pages,
+                     size_t first,
+                     size_t count,
+                     uint64_t va) {
+  const uint64_t offset = first * PAGE_SIZE;
+  const auto len = std::min<uint64_t>(count * PAGE_SIZE, source->size - offset);
+  // No VM maps the pages yet, so other vCPUs may run during the read. The
+  // tail of a partial last page stays zeroed.
+  auto* buf = static_cast<uint8_t*>(pages[first]);
+  if (!LoaderReadImage(source, offset, len, buf, true)) {
+    for (size_t i = first; i < first + count; i++) {
+      PgTableStage1::PageDeallocate(pages[i]);
+    }
+    return false;
+  }
 
-    for (int i = 0; i < PAGE_SIZE / kDiskSectorSize; i++) {
-      if (sector_remains <= 0) {
-        break;
-      }
+  Arm64SyncICacheRange(buf, count * PAGE_SIZE);
+  for (size_t i = first; i < first + count; i++) {
+    PgTableStage2::MapSharedPage(tsk, (va & PAGE_MASK) + i * PAGE_SIZE,
+                                 reinterpret_cast<pa_t>(pages[i]));
+  }
+  return true;
+}
 
-      if (!virtio.ReadDisk(buf, sector_offset)) {
-        LOG_ERROR("Failed to read. sector_offset: %d", sector_offset);
-        return false;
-      }
-      sector_remains--;
-      sector_offset++;
-      buf += kDiskSectorSize;
+// Attach an image to |tsk| without reading it. Pages are read from stage-2
+// faults by LoaderHandleImageFault().
+bool LoaderAttachImage(Tcb* tsk,
+                       const char* name,
+                       uint64_t va,
+                       CachedImage* image,
+                       const LoaderImageSource& source) {
+  if (!image) {
+    image = ImageCache::Get().AddOnDemand(name, source.size,
+                                          new LoaderImageSource(source));
+    if (!image) {
+      return false;
     }
-    cur += PAGE_SIZE;
   }
 
+  tsk->mm.image = image;
+  tsk->mm.image_ipa = va & PAGE_MASK;
   tsk->name = name;
-  LOG_INFO("Successfully loaded %s", tsk->name);
-
+  LOG_INFO("%s (%d KB) will be loaded on demand", name, source.size / 1024);
   return true;
-#else
-  Fat32Fs* fs = new Fat32Fs();
+}
 
-  if (!fs->Init()) {
-    LOG_ERROR("Failed to init FAT32 filesystem");
+bool LoaderLoadFile(Tcb* tsk,
+                    const char* name,
+                    uint64_t va,
+                    bool on_demand,
+                    bool* restored) {
+  LoaderImageSource source = {};
+  if (!LoaderOpenImage(&source, name)) {
     return false;
   }
 
-  fat32_file_t file;
-  if (!fs->Open(&file, name)) {
-    LOG_ERROR("Failed to open %s.", name);
-    return false;
+  *restored = SnapshotRestore(tsk, name);
+  if (*restored) {
+    return true;
+  }
+
+  // A coloured VM must neither map pages of other colours nor hand its own
+  // to other VMs, so it reads the whole image into pages of its own.
+  const bool shareable = !tsk->mm.colours;
+  auto& image_cache = ImageCache::Get();
+  auto* image = shareable ? image_cache.Find(name, source.size) : nullptr;
+  if (image && image->source) {
+    // Another VM is still reading it on demand. Share its pages the same way.
+    return LoaderAttachImage(tsk, name, va, image, source);
+  }
+  if (image) {
+    LoaderMapCachedImage(tsk, *image, va);
+    tsk->name = name;
+    LOG_INFO("Successfully mapped cached %s", tsk->name);
+    return true;
+  }
+  if (on_demand && shareable) {
+    return LoaderAttachImage(tsk, name, va, nullptr, source);
   }
-  int remains = fs->GetFileSize(&file);
-  int offset = 0;
-  uint64_t cur = va & PAGE_MASK;
-  const auto total_size = remains;
 
-  LOG_INFO("Start loading %s - %d KB", name, total_size / 1024);
+  const size_t num_pages =
+      __builtin_align_up(source.size, PAGE_SIZE) / PAGE_SIZE;
+  auto** pages = static_cast<void**>(kmm_malloc(num_pages * sizeof(void*)));
+
+  LOG_INFO("Start loading %s - %d KB", name, source.size / 1024);
   printf("Progress ");
-  int progress_prev = 0;
+  size_t progress = 0;
 
+  // Pages are allocated until one does not follow the run read so far, and
+  // the run is then read in place. Pages are only charged to the quota once
+  // mapped, so a run also ends where it would use up what the quota has left.
   const auto start = Timer::GetSystemUsec();
-  while (remains > 0) {
-    auto* buf = reinterpret_cast<uint8_t*>(PgTableStage1::PageMap(tsk, cur));
-    auto req_len = std::min(static_cast<int>(PAGE_SIZE), remains);
-    auto reads = fs->Read(&file, buf, offset, req_len);
-    if (req_len != reads) {
-      LOG_ERROR("Failed to read. requested size: %d, actual size: %d", req_len,
-                reads);
-      return false;
+  const auto& mm = tsk->mm;
+  size_t first = 0;
+  for (size_t i = 0; i <= num_pages; i++) {
+    const bool quota_used =
+        mm.page_quota && mm.pages + (i - first) >= mm.page_quota;
+    auto* page = i < num_pages && !quota_used
+                     ? static_cast<uint8_t*>(PgTableStage1::PageAllocate(tsk))
+                     : nullptr;
+    if (i > first &&
+        (i - first == kLoaderChunkPages ||
+         page != static_cast<uint8_t*>(pages[i - 1]) + PAGE_SIZE)) {
+      if (!LoaderLoadPages(tsk, &source, pages, first, i - first, va)) {
+        if (page) {
+          PgTableStage1::PageDeallocate(page);
+        }
+        kmm_free(pages);
+        return false;
+      }
+      first = i;
+      for (; progress < i * 10 / num_pages; progress++) {
+        printf(".");
+      }
     }
-
-    remains -= reads;
-    offset += reads;
-    cur += PAGE_SIZE;
-
-    int progress = static_cast<uint32_t>(
-        ((total_size - remains) / static_cast<float>(total_size)) * 100);
-    if (progress / 10 > progress_prev) {
-      printf(".");
-      progress_prev = progress / 10;
+    if (i == num_pages) {
+      break;
     }
+    if (!page && quota_used) {
+      // The run is charged now. This fails unless the quota has room left.
+      page = static_cast<uint8_t*>(PgTableStage1::PageAllocate(tsk));
+    }
+    if (!page) {
+      LOG_ERROR("Failed to allocate a page. ipa: %lx",
+                (va & PAGE_MASK) + i * PAGE_SIZE);
+      kmm_free(pages);
+      return false;
+    }
+    pages[i] = page;
   }
   const auto end = Timer::GetSystemUsec();
 
   printf("\n");
-  LOG_INFO("Transfer speed: %d KB/S", total_size * 1000 / (end - start));
+  LOG_INFO("Transfer speed: %d KB/S", source.size * 1000 / (end - start));
+
+  if (!shareable || !image_cache.Add(name, source.size, pages, num_pages)) {
+    kmm_free(pages);
+  }
 
   tsk->name = name;
   LOG_INFO("Successfully loaded %s", tsk->name);
 
   return true;
-#endif
 }
 
 }  // namespace
@@ -112,13 +278,67 @@ bool LoaderLoadFile(Tcb* tsk, const char* name, uint64_t va) {
 bool LoaderLoadVcpu(void* config, uint64_t* pc, uint64_t* sp) {
   auto* cfg = reinterpret_cast<LoaderVcpuConfig*>(config);
   auto* tsk = Sched::Get().GetCurrentTask();
+  tsk->mm.page_quota = cfg->mem_quota / PAGE_SIZE;
+  tsk->mm.colours = cfg->colours;
+
+  bool restored = false;
+  if (!LoaderLoadFile(tsk, cfg->filename, cfg->file_load_va,
+                      cfg->load_on_demand, &restored)) {
+    return false;
+  }
+
+  // A restored vCPU resumes where the snapshot was taken.
+  if (!restored) {
+    *pc = cfg->pc;
+    *sp = cfg->sp;
+  }
+  return true;
+}
 
-  if (!LoaderLoadFile(tsk, cfg->filename, cfg->file_load_va)) {
+bool LoaderHandleImageFault(Tcb* tsk, uint64_t ipa) {
+  auto* image = tsk->mm.image;
+  if (!image || ipa < tsk->mm.image_ipa) {
+    return false;
+  }
+  const size_t idx = (ipa - tsk->mm.image_ipa) / PAGE_SIZE;
+  if (idx >= image->num_pages) {
     return false;
   }
 
-  *pc = cfg->pc;
-  *sp = cfg->sp;
+  auto* source = static_cast<LoaderImageSource*>(image->source);
+  const size_t end = std::min(idx + kLoaderReadAheadPages, image->num_pages);
+  for (size_t i = idx; i < end; i++) {
+    const uint64_t page_ipa = tsk->mm.image_ipa + i * PAGE_SIZE;
+    if (PgTableStage2::IsMapped(tsk, page_ipa)) {
+      continue;
+    }
+
+    auto* page = image->pages[i];
+    if (!page) {
+      // Read-ahead is best effort. Only the faulting page must be loaded.
+      auto* read = PgTableStage1::PageAllocate(tsk);
+      if (!read) {
+        return i != idx;
+      }
+      if (!LoaderReadImagePage(source, i, static_cast<uint8_t*>(read))) {
+        umm_free(read);
+        return i != idx;
+      }
+      // Another VM sharing the image may have read the page while this one
+      // slept.
+      page = image->pages[i];
+      if (page) {
+        umm_free(read);
+      } else {
+        Arm64SyncICacheRange(read, PAGE_SIZE);
+        ImageCache::Get().SetPage(image, i, read);
+        page = read;
+      }
+    }
+    umm_page_get(page);
+    PgTableStage2::MapNewSharedPage(tsk, page_ipa,
+                                    reinterpret_cast<pa_t>(page));
+  }
   return true;
 }
 
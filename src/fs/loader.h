@@ -4,6 +4,8 @@
 #include <cstdbool>
 #include <cstdint>
 
+#include "kernel/task/task.h"
+
 namespace evisor {
 
 struct LoaderVcpuConfig {
@@ -11,12 +13,19 @@ struct LoaderVcpuConfig {
   uint64_t file_load_va;  // load address (virtual address) of the file
   uint64_t pc;            // Entry Point
   uint64_t sp;            // Stack Pointer
+  uint64_t mem_quota;     // Max guest memory in bytes (0: unlimited)
+  uint32_t colours;       // Page colours of guest memory (0: any)
+  bool load_on_demand;    // Read the file from stage-2 faults (colours: 0)
 };
 
 // Load VCPU with an user specified binary file and config
 bool LoaderLoadVcpu(void* config, uint64_t* pc, uint64_t* sp)
     __attribute__((visibility("hidden")));
 
+// Read and map the image pages around |ipa| for a VM whose image is loaded
+// on demand. Returns false if |ipa| is outside the image.
+bool LoaderHandleImageFault(Tcb* tsk, uint64_t ipa);
+
 }  // namespace evisor
 
 #endif  // EVISOR_FS_LOADER_H_
@@ -0,0 +1,341 @@
+#include "fs/snapshot.h"
+
+#include <algorithm>
+
+#include "arch/arm64/cache.h"
+#include "common/cstring.h"
+#include "common/logger.h"
+#include "fs/disk_area.h"
+#include "fs/image_cache.h"
+#include "fs/loader.h"
+#include "kernel/sched/sched.h"
+#include "mm/heap/kmm_malloc.h"
+#include "mm/heap/kmm_zalloc.h"
+#include "mm/new.h"
+#include "mm/pgtable_stage1.h"
+#include "mm/pgtable_stage2.h"
+#include "mm/user_heap/umm_malloc.h"
+#include "platforms/board.h"
+#include "platforms/timer.h"
+
+namespace evisor {
+
+// Page index of a snapshot a VM was restored from.
+struct Snapshot {
+  // First sector of the page data
+  uint64_t data_lba;
+  uint64_t num_pages;
+  // IPA of each page, in ascending order
+  uint64_t* ipas;
+};
+
+namespace {
+
+constexpr uint64_t kSnapshotMagic = 0x313050414e535645;  // "EVSNAP01"
+constexpr uint32_t kSnapshotVersion = 1;
+constexpr size_t kSnapshotNameLen = 64;
+constexpr size_t kSnapshotDeviceStatePages = 2;
+// Pages read and mapped per fault while a VM is restored.
+constexpr size_t kSnapshotReadAheadPages = 8;
+// Pages written per disk transfer while a snapshot is saved.
+constexpr size_t kSnapshotWritePages = 64;
+
+/*
+ * Layout of the snapshot area, in pages:
+ *  header | device state | page index (IPAs) | page data
+ * The header is written last, so a snapshot is valid only when complete.
+ */
+struct SnapshotHeader {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t device_state_size;
+  char name[kSnapshotNameLen];
+  uint64_t num_pages;
+  Sched::VCpuContext vcpu;
+  VCpuSysregs sysregs;
+};
+static_assert(sizeof(SnapshotHeader) <= PAGE_SIZE);
+
+inline uint64_t SnapshotIndexPages(uint64_t num_pages) {
+  return __builtin_align_up(num_pages * sizeof(uint64_t), PAGE_SIZE) /
+         PAGE_SIZE;
+}
+
+// Write everything but the header. |ipas| lists the pages to save.
+bool SnapshotWriteBody(Tcb* tsk,
+                       uint64_t lba,
+                       const uint64_t* ipas,
+                       uint64_t num_pages,
+                       uint32_t* device_state_size) {
+  constexpr size_t kDeviceStateSize = kSnapshotDeviceStatePages * PAGE_SIZE;
+  auto* state = static_cast<uint8_t*>(kmm_zalloc(kDeviceStateSize));
+  *device_state_size =
+      tsk->board->SaveDeviceState(tsk, state, kDeviceStateSize);
+  const bool ok =
+      *device_state_size &&
+      DiskAreaTransfer(lba + kDiskAreaSectorsPerPage, state,
+                       kSnapshotDeviceStatePages, true, false);
+  kmm_free(state);
+  if (!ok) {
+    return false;
+  }
+
+  lba += (1 + kSnapshotDeviceStatePages) * kDiskAreaSectorsPerPage;
+  const auto index_pages = SnapshotIndexPages(num_pages);
+  if (!DiskAreaTransfer(lba, const_cast<uint64_t*>(ipas), index_pages, true,
+                        false)) {
+    return false;
+  }
+
+  lba += index_pages * kDiskAreaSectorsPerPage;
+  void* pages[kSnapshotWritePages];
+  for (uint64_t i = 0; i < num_pages; i += kSnapshotWritePages) {
+    const size_t n = std::min<uint64_t>(kSnapshotWritePages, num_pages - i);
+    for (size_t j = 0; j < n; j++) {
+      const pa_t page = PgTableStage2::TranslateIpa(tsk, ipas[i + j]);
+      if (!page) {
+        return false;
+      }
+      pages[j] = reinterpret_cast<void*>(page);
+    }
+    if (!DiskAreaTransferPages(lba, pages, n, true, false)) {
+      return false;
+    }
+    lba += n * kDiskAreaSectorsPerPage;
+  }
+  return true;
+}
+
+// Read the image pages |tsk| has not touched yet. A restored VM has no image
+// to read them from.
+bool SnapshotLoadImage(Tcb* tsk) {
+  const auto* image = tsk->mm.image;
+  if (!image) {
+    return true;
+  }
+  for (size_t i = 0; i < image->num_pages; i++) {
+    const uint64_t ipa = tsk->mm.image_ipa + i * PAGE_SIZE;
+    if (!PgTableStage2::IsMapped(tsk, ipa) &&
+        !LoaderHandleImageFault(tsk, ipa)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Read every page the VMs restored from the snapshot area have not touched
+// yet, and detach them from it, since the area is about to be overwritten.
+bool SnapshotDetachAll() {
+  auto& sched = Sched::Get();
+  for (int pid = 0; pid < sched.GetTaskCount(); pid++) {
+    auto* tsk = sched.GetTask(pid);
+    auto* snapshot = tsk->mm.snapshot;
+    if (!snapshot) {
+      continue;
+    }
+    if (tsk->state != ZOMBIE) {
+      for (uint64_t i = 0; i < snapshot->num_pages; i++) {
+        if (!PgTableStage2::IsMapped(tsk, snapshot->ipas[i]) &&
+            !SnapshotHandleFault(tsk, snapshot->ipas[i])) {
+          LOG_ERROR("Failed to read the snapshot pages of %s", tsk->name);
+          return false;
+        }
+      }
+    }
+    tsk->mm.snapshot = nullptr;
+
+    // Clones share the index of the VM they were cloned from.
+    bool shared = false;
+    for (int other = 0; other < sched.GetTaskCount(); other++) {
+      shared = shared || sched.GetTask(other)->mm.snapshot == snapshot;
+    }
+    if (!shared) {
+      kmm_free(snapshot->ipas);
+      delete snapshot;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+bool SnapshotSave(Tcb* tsk) {
+  uint64_t lba;
+  uint64_t area_pages;
+  if (!DiskAreaGet(DiskArea::kSnapshot, &lba, &area_pages)) {
+    LOG_ERROR("No snapshot area on the boot storage");
+    return false;
+  }
+  // Only resident pages are saved, so read in the ones still on the disk.
+  if (!SnapshotLoadImage(tsk) || !SnapshotDetachAll()) {
+    LOG_ERROR("Failed to read in the pages of %s", tsk->name);
+    return false;
+  }
+  if (tsk->mm.swapped_pages) {
+    LOG_ERROR("%s has %d pages swapped out", tsk->name,
+              tsk->mm.swapped_pages);
+    return false;
+  }
+
+  uint64_t num_pages = 0;
+  bool shared = false;
+  for (ipa_t ipa = 0; PgTableStage2::FindNextRamPage(tsk, &ipa, &shared);
+       ipa += PAGE_SIZE) {
+    num_pages++;
+  }
+  const auto index_pages = SnapshotIndexPages(num_pages);
+  if (1 + kSnapshotDeviceStatePages + index_pages + num_pages > area_pages) {
+    LOG_ERROR("%s does not fit in the snapshot area (%d pages)", tsk->name,
+              num_pages);
+    return false;
+  }
+
+  auto* header = static_cast<SnapshotHeader*>(kmm_zalloc(PAGE_SIZE));
+  auto* ipas = static_cast<uint64_t*>(kmm_zalloc(index_pages * PAGE_SIZE));
+  uint64_t i = 0;
+  for (ipa_t ipa = 0; PgTableStage2::FindNextRamPage(tsk, &ipa, &shared);
+       ipa += PAGE_SIZE) {
+    ipas[i++] = ipa;
+  }
+
+  const auto start = Timer::GetSystemUsec();
+  // The writes poll, since the VM must not change its pages until they are
+  // all saved. Invalidate the old snapshot first, so that a partial one is
+  // never used.
+  bool ok = DiskAreaTransfer(lba, header, 1, true, false) &&
+            SnapshotWriteBody(tsk, lba, ipas, num_pages,
+                              &header->device_state_size);
+  if (ok) {
+    header->magic = kSnapshotMagic;
+    header->version = kSnapshotVersion;
+    memcpy(header->name, tsk->name,
+           std::min(strlen(tsk->name), kSnapshotNameLen - 1));
+    header->num_pages = num_pages;
+    memcpy(&header->vcpu, Sched::Get().GetVCpuRegs(tsk),
+           sizeof(Sched::VCpuContext));
+    memcpy(&header->sysregs, &tsk->vcpu_sysregs, sizeof(VCpuSysregs));
+    ok = DiskAreaTransfer(lba, header, 1, true, false);
+  }
+  const auto end = Timer::GetSystemUsec();
+
+  kmm_free(ipas);
+  kmm_free(header);
+  if (!ok) {
+    LOG_ERROR("Failed to save a snapshot of %s", tsk->name);
+    return false;
+  }
+
+  LOG_INFO("Saved %s: %d KB, %d KB/S", tsk->name,
+           num_pages * PAGE_SIZE / 1024,
+           num_pages * PAGE_SIZE * 1000 / 1024 / (end - start + 1));
+  return true;
+}
+
+bool SnapshotRestore(Tcb* tsk, const char* name) {
+  uint64_t lba;
+  uint64_t area_pages;
+  if (!DiskAreaGet(DiskArea::kSnapshot, &lba, &area_pages)) {
+    return false;
+  }
+
+  auto* header = static_cast<SnapshotHeader*>(kmm_malloc(PAGE_SIZE));
+  // |tsk| has no guest memory yet, so other vCPUs may run during the reads.
+  if (!DiskAreaTransfer(lba, header, 1, false, true) ||
+      header->magic != kSnapshotMagic || header->version != kSnapshotVersion ||
+      strncmp(header->name, name, kSnapshotNameLen) != 0 ||
+      header->device_state_size > kSnapshotDeviceStatePages * PAGE_SIZE ||
+      1 + kSnapshotDeviceStatePages + SnapshotIndexPages(header->num_pages) +
+              header->num_pages >
+          area_pages) {
+    kmm_free(header);
+    return false;
+  }
+
+  const auto num_pages = header->num_pages;
+  const auto index_pages = SnapshotIndexPages(num_pages);
+  auto* state = static_cast<uint8_t*>(
+      kmm_malloc(kSnapshotDeviceStatePages * PAGE_SIZE));
+  auto* ipas = static_cast<uint64_t*>(kmm_malloc(index_pages * PAGE_SIZE));
+  lba += kDiskAreaSectorsPerPage;
+  bool ok = DiskAreaTransfer(lba, state, kSnapshotDeviceStatePages, false,
+                             true) &&
+            tsk->board->RestoreDeviceState(tsk, state,
+                                           header->device_state_size);
+  lba += kSnapshotDeviceStatePages * kDiskAreaSectorsPerPage;
+  ok = ok && DiskAreaTransfer(lba, ipas, index_pages, false, true);
+  kmm_free(state);
+  if (!ok) {
+    LOG_ERROR("Broken snapshot of %s", name);
+    kmm_free(ipas);
+    kmm_free(header);
+    return false;
+  }
+
+  tsk->mm.snapshot = new Snapshot{
+      .data_lba = lba + index_pages * kDiskAreaSectorsPerPage,
+      .num_pages = num_pages,
+      .ipas = ipas,
+  };
+  memcpy(Sched::Get().GetVCpuRegs(tsk), &header->vcpu,
+         sizeof(Sched::VCpuContext));
+  memcpy(&tsk->vcpu_sysregs, &header->sysregs, sizeof(VCpuSysregs));
+  kmm_free(header);
+
+  tsk->name = name;
+  LOG_INFO("Resuming %s from a snapshot (%d KB)", name,
+           num_pages * PAGE_SIZE / 1024);
+  return true;
+}
+
+bool SnapshotHandleFault(Tcb* tsk, uint64_t ipa) {
+  const auto* snapshot = tsk->mm.snapshot;
+  if (!snapshot) {
+    return false;
+  }
+
+  const uint64_t* begin = snapshot->ipas;
+  const uint64_t* end = begin + snapshot->num_pages;
+  const uint64_t* found = std::lower_bound(begin, end, ipa);
+  if (found == end || *found != ipa) {
+    return false;
+  }
+
+  // Pages next in the index are next on the disk, so read the run of
+  // unmapped ones after the faulting page in one transfer. Only the faulting
+  // page must be restored.
+  const size_t idx = found - begin;
+  const size_t last =
+      std::min(idx + kSnapshotReadAheadPages, snapshot->num_pages);
+  void* pages[kSnapshotReadAheadPages];
+  size_t count = 0;
+  while (idx + count < last &&
+         !PgTableStage2::IsMapped(tsk, snapshot->ipas[idx + count])) {
+    pages[count] = PgTableStage1::PageAllocate(tsk);
+    if (!pages[count]) {
+      break;
+    }
+    count++;
+  }
+  if (!count) {
+    return PgTableStage2::IsMapped(tsk, ipa);
+  }
+
+  // The pages are mapped only once read, and the index stays until no VM
+  // sleeps on the disk, so other vCPUs may run meanwhile.
+  if (!DiskAreaTransferPages(snapshot->data_lba +
+                                 idx * kDiskAreaSectorsPerPage,
+                             pages, count, false, true)) {
+    for (size_t i = 0; i < count; i++) {
+      umm_free(pages[i]);
+    }
+    return false;
+  }
+  for (size_t i = 0; i < count; i++) {
+    Arm64SyncICacheRange(pages[i], PAGE_SIZE);
+    PgTableStage2::MapNewPage(tsk, snapshot->ipas[idx + i],
+                              reinterpret_cast<va_t>(pages[i]));
+  }
+  return true;
+}
+
+}  // namespace evisor
@@ -0,0 +1,44 @@
+#ifndef EVISOR_FS_SNAPSHOT_H_
+#define EVISOR_FS_SNAPSHOT_H_
+
+#include <cstdbool>
+#include <cstdint>
+
+#include "kernel/task/task.h"
+
+namespace evisor {
+
+// VM snapshots on the boot disk.
+//
+// A snapshot holds the resident guest RAM pages, the vCPU registers and the
+// emulated device state of one VM. A VM booting the same image resumes from
+// the snapshot instead of loading the image, and its pages are read back on
+// the first access to each of them.
+//
+// The vCPU registers include the virtual and physical timer registers of the
+// guest, but not CNTVOFF_EL2, which stays 0 for every VM. A restored guest
+// sees its clock jump to the current time, and the timers that expired in
+// between fire at once. The virtual CPU interface of the GIC (list registers,
+// GICH_VMCR and the active priorities) is not saved either: interrupts that
+// were pending or active in it are lost, except the balloon interrupt, which
+// is raised again from the device status.
+
+// Write a snapshot of |tsk|, which must be stopped in an exception while no
+// VM sleeps on the disk. Pages |tsk| has not read from its image yet are read
+// first, and so are the pages of every VM still restoring from the old
+// snapshot. The save is refused if they cannot all be read or if pages of
+// |tsk| are swapped out.
+bool SnapshotSave(Tcb* tsk);
+
+// Resume |tsk| from a snapshot of the image |name|. The vCPU registers and
+// device state are restored at once. Returns false if there is no snapshot
+// of the image.
+bool SnapshotRestore(Tcb* tsk, const char* name);
+
+// Read and map the snapshot pages around |ipa| for a restored VM. Returns
+// false if |ipa| is not in the snapshot.
+bool SnapshotHandleFault(Tcb* tsk, uint64_t ipa);
+
+}  // namespace evisor
+
+#endif  // EVISOR_FS_SNAPSHOT_H_
@@ -7,6 +7,8 @@
 #include "fs/loader.h"
 #include "kernel/sched/sched.h"
 #include "kernel/task/task.h"
+#include "mm/page_merge.h"
+#include "mm/zero_page_pool.h"
 #include "platforms/platform.h"
 #include "platforms/platform_config.h"
 
@@ -40,13 +42,22 @@ void PrintDebugInfo() {
   LOG_TRACE("------------------------------------------");
 }
 
-std::array<evisor::LoaderVcpuConfig, 1> kConfigVCPUs = {{
+#if defined(TEST_GUEST_IS_CACHE_BENCH)
+constexpr size_t kNrConfigVCPUs = 3;
+#else
+constexpr size_t kNrConfigVCPUs = 1;
+#endif
+
+std::array<evisor::LoaderVcpuConfig, kNrConfigVCPUs> kConfigVCPUs = {{
 #if defined(TEST_GUEST_IS_TEST_APP)
     {
         .filename = "test_app.bin",
         .file_load_va = 0,
         .pc = 0,
         .sp = 0x1000,
+        .mem_quota = 0,
+        .colours = 0,
+        .load_on_demand = false,
     },
 #elif defined(TEST_GUEST_IS_SERIAL)
     {
@@ -54,6 +65,39 @@ std::array<evisor::LoaderVcpuConfig, 1> kConfigVCPUs = {{
         .file_load_va = 0,
         .pc = 0,
         .sp = 0x10000,
+        .mem_quota = 0,
+        .colours = 0,
+        .load_on_demand = false,
+    },
+#elif defined(TEST_GUEST_IS_CACHE_BENCH)
+    // A latency probe in half of the page colours, the same probe in any
+    // colour, and a thrasher in the other half, entered at 0x8.
+    {
+        .filename = "cache_bench.bin",
+        .file_load_va = 0,
+        .pc = 0,
+        .sp = 0x10000,
+        .mem_quota = 0,
+        .colours = 0x00ff,
+        .load_on_demand = false,
+    },
+    {
+        .filename = "cache_bench.bin",
+        .file_load_va = 0,
+        .pc = 0,
+        .sp = 0x10000,
+        .mem_quota = 0,
+        .colours = 0,
+        .load_on_demand = false,
+    },
+    {
+        .filename = "cache_bench.bin",
+        .file_load_va = 0,
+        .pc = 0x8,
+        .sp = 0x10000,
+        .mem_quota = 0,
+        .colours = 0xff00,
+        .load_on_demand = false,
     },
 #elif defined(TEST_GUEST_IS_NUTTX)
     {
@@ -61,6 +105,9 @@ std::array<evisor::LoaderVcpuConfig, 1> kConfigVCPUs = {{
         .file_load_va = 0x40280000,
         .pc = 0x40280000,
         .sp = 0x41280000,
+        .mem_quota = 0,
+        .colours = 0,
+        .load_on_demand = false,
     },
 #else
     // Linux
@@ -69,6 +116,9 @@ std::array<evisor::LoaderVcpuConfig, 1> kConfigVCPUs = {{
         .file_load_va = 0x40000000,
         .pc = 0x40000000,
         .sp = 0x50000000,
+        .mem_quota = 0,
+        .colours = 0,
+        .load_on_demand = false,
     },
 #endif
 }};
@@ -96,6 +146,10 @@ extern "C" void KernelMain() {
 
   while (true) {
     evisor::CpuDisableIrq();
+    // Zero pages ahead of time for the page fault path.
+    evisor::ZeroPagePool::RefillAll();
+    evisor::PageMerger::Get().Scan();
+    evisor::Serial::Get().RunPendingCommands();
     sched.Schedule();
     evisor::CpuEnableIrq();
   }
@@ -41,6 +41,10 @@ class Sched {
   // Create a new task and load its binary datat
   int CreateTask(loader_func_t loader, void* arg);
 
+  // Create a new task which shares the guest memory of |src| copy-on-write and
+  // resumes from a copy of its vCPU state.
+  int CloneTask(Tcb* src);
+
   // Add a new task
   int AddTask(Tcb* tsk);
 
@@ -59,6 +63,9 @@ class Sched {
   // Get a task context block task by specified PID
   Tcb* GetTask(int pid) const;
 
+  // Get the number of tasks including the init task
+  int GetTaskCount() const;
+
   // Do context switch to next vCPU from current vCPU.
   // Re-store CPU system registers and Stage2 MMU, etc.
   void RunVcpu(Tcb* tsk);
@@ -38,6 +38,19 @@ constexpr Tcb kInitTask = {
         {
             .page_table = 0,
             .pages = 0,
+            .shared_pages = 0,
+            .page_quota = 0,
+            .colours = 0,
+            .quota_failures = 0,
+            .colour_fallbacks = 0,
+            .image = nullptr,
+            .image_ipa = 0,
+            .dirty_bitmap = nullptr,
+            .dirty_log_ipa = 0,
+            .dirty_log_pages = 0,
+            .snapshot = nullptr,
+            .swapped_pages = 0,
+            .swap_fault_ipa = 0,
         },
     .stat =
         {
@@ -47,6 +60,8 @@ constexpr Tcb kInitTask = {
             .hvc_traps = 0,
             .sysreg_traps = 0,
             .page_faults = 0,
+            .cow_faults = 0,
+            .dirty_faults = 0,
             .mmios = 0,
         },
     .board = nullptr,
@@ -54,7 +69,7 @@ constexpr Tcb kInitTask = {
 
 const char* kTaskStateNames[] = {
     "RUNNING",
-    "WAITTING"
+    "WAITTING",
     "ZOMBIE",
     "DEAD",
 };
@@ -108,16 +123,19 @@ void Sched::ExitTask(Tcb* tsk) {
 }
 
 void Sched::PrintTasks() {
-  printf("\n%3s %12s %8s %8s %7s %7s %7s %9s %7s %7s %7s\n", "PID", "NAME",
-         "STATE", "PC", "PAGES", "PF", "MEM", "WFx", "HVC", "REG", "I/O");
+  printf("\n%3s %12s %8s %8s %7s %7s %7s %7s %7s %7s %7s %9s %7s %7s %7s\n",
+         "PID", "NAME", "STATE", "PC", "PAGES", "QUOTA", "PF", "COW", "DIRTY",
+         "SWAP", "MEM", "WFx", "HVC", "REG", "I/O");
   for (auto i = 0; i < count_tsks_; i++) {
     auto* tsk = tsks_[i];
     const auto* cpu_sysregs = GetVCpuRegs(tsk);
-    printf("%3d %12s %8s %8x %7d %7d %7d %9d %7d %7d %7d\n", tsk->pid,
-           tsk->name, kTaskStateNames[tsk->state], cpu_sysregs->pc,
-           tsk->mm.pages, tsk->stat.page_faults,
-           (PAGE_SIZE * tsk->mm.pages) / 1024, tsk->stat.wfx_traps,
-           tsk->stat.hvc_traps, tsk->stat.sysreg_traps, tsk->stat.mmios);
+    printf("%3d %12s %8s %8x %7d %7d %7d %7d %7d %7d %7d %9d %7d %7d %7d\n",
+           tsk->pid, tsk->name, kTaskStateNames[tsk->state], cpu_sysregs->pc,
+           tsk->mm.pages, tsk->mm.page_quota, tsk->stat.page_faults,
+           tsk->stat.cow_faults, tsk->stat.dirty_faults, tsk->mm.swapped_pages,
+           (PAGE_SIZE * tsk->mm.pages) / 1024,
+           tsk->stat.wfx_traps, tsk->stat.hvc_traps, tsk->stat.sysreg_traps,
+           tsk->stat.mmios);
   }
 }
 
@@ -133,6 +151,10 @@ Tcb* Sched::GetTask(int pid) const {
   return tsks_[pid];
 }
 
+int Sched::GetTaskCount() const {
+  return count_tsks_;
+}
+
 void Sched::SchedTimerHandler() {
   if (--cur_tsk_->counter > 0) {
     return;
@@ -3,10 +3,12 @@
 #include "arch/kernel.h"
 #include "common/cstring.h"
 #include "common/logger.h"
+#include "common/macro.h"
 #include "common/queue.h"
 #include "kernel/sched/sched.h"
 #include "mm/heap/kmm_zalloc.h"
 #include "mm/pgtable.h"
+#include "mm/pgtable_stage2.h"
 #include "platforms/platform.h"
 
 namespace evisor {
@@ -50,6 +52,14 @@ void LoadTaskImage(loader_func_t loader, void* arg) {
   sched.RunVcpu(tsk);
 }
 
+void ResumeClonedTask(loader_func_t loader, void* arg) {
+  UNUSED(loader);
+  UNUSED(arg);
+
+  auto* tsk = Sched::Get().GetCurrentTask();
+  LOG_INFO("Cloned vCPU %s (PID: %d) started", tsk->name, tsk->pid);
+}
+
 }  // namespace
 
 int Sched::CreateTask(loader_func_t loader, void* arg) {
@@ -86,4 +96,47 @@ int Sched::CreateTask(loader_func_t loader, void* arg) {
   return pid;
 }
 
+int Sched::CloneTask(Tcb* src) {
+  if (count_tsks_ >= kNrTasks) {
+    LOG_ERROR("Too many tasks");
+    return -1;
+  }
+  if (!src->mm.page_table) {
+    LOG_ERROR("%s has no guest memory to clone", src->name);
+    return -1;
+  }
+
+  auto* tsk = static_cast<Tcb*>(kmm_zalloc(PAGE_SIZE));
+
+  tsk->name = src->name;
+  tsk->state = RUNNING;
+  tsk->priority = src->priority;
+  tsk->counter = tsk->priority;
+  tsk->mm.page_quota = src->mm.page_quota;
+  tsk->mm.colours = src->mm.colours;
+  tsk->mm.image = src->mm.image;
+  tsk->mm.image_ipa = src->mm.image_ipa;
+  tsk->mm.snapshot = src->mm.snapshot;
+  tsk->board = src->board;
+
+  // The source vCPU is stopped inside an exception, so its saved registers
+  // are the state to resume from.
+  memcpy(&tsk->vcpu_sysregs, &src->vcpu_sysregs, sizeof(VCpuSysregs));
+  auto* vcpu_context = GetVCpuRegs(tsk);
+  memcpy(vcpu_context, GetVCpuRegs(src), sizeof(VCpuContext));
+
+  PgTableStage2::CloneCopyOnWrite(tsk, src);
+
+  // The first dispatch returns straight to the guest.
+  tsk->cpu_context.x19 = reinterpret_cast<uint64_t>(ResumeClonedTask);
+  tsk->cpu_context.pc = reinterpret_cast<uint64_t>(KernelSwitchFromKThread);
+  tsk->cpu_context.sp = reinterpret_cast<uint64_t>(vcpu_context);
+
+  auto pid = AddTask(tsk);
+  if (tsk->board) {
+    tsk->board->CloneDevices(tsk, src);
+  }
+  return pid;
+}
+
 }  // namespace evisor
@@ -33,11 +33,40 @@ struct CpuContext {
   uint64_t pc;
 };
 
+namespace evisor {
+class Board;
+struct CachedImage;
+struct Snapshot;
+}  // namespace evisor
+
 struct MmContext {
   // Pointer to first page table
   uint64_t page_table;
-  // Number of pages used
+  // Number of pages charged to the quota
   uint64_t pages;
+  // Pages still shared with the VM this one was cloned from. They are
+  // charged once a write copies them.
+  uint64_t shared_pages;
+  // Maximum number of guest pages. 0 means unlimited.
+  uint64_t page_quota;
+  // Page colours backing guest RAM and stage-2 tables. 0 means any colour.
+  uint32_t colours;
+  // Number of page allocations rejected by the quota
+  uint64_t quota_failures;
+  // Number of pages allocated outside |colours|
+  uint64_t colour_fallbacks;
+  // Guest image loaded on demand and its base IPA
+  evisor::CachedImage* image;
+  uint64_t image_ipa;
+  // Dirty page log, one bit per page from dirty_log_ipa
+  uint64_t* dirty_bitmap;
+  uint64_t dirty_log_ipa;
+  uint64_t dirty_log_pages;
+  // Snapshot the VM was restored from. Its pages are read on demand.
+  evisor::Snapshot* snapshot;
+  // Number of pages swapped out, and the last page read back from swap
+  uint64_t swapped_pages;
+  uint64_t swap_fault_ipa;
 };
 
 struct TaskStat {
@@ -47,13 +76,11 @@ struct TaskStat {
   uint64_t hvc_traps;
   uint64_t sysreg_traps;
   uint64_t page_faults;
+  uint64_t cow_faults;
+  uint64_t dirty_faults;
   uint64_t mmios;
 };
 
-namespace evisor {
-class Board;
-}
-
 struct Tcb {
   const char* name;
   long pid;
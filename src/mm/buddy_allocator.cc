@@ -0,0 +1,208 @@
+#include "mm/buddy_allocator.h"
+
+#include "common/assert.h"
+#include "common/logger.h"
+#include "mm/pgtable.h"
+
+namespace evisor {
+
+namespace {
+
+/*
+ * Page info byte layout (first page of a block only)
+ *   bit[7]  : the page is the head of a block
+ *   bit[6]  : the block is free
+ *   bit[4:0]: order of the block
+ */
+constexpr uint8_t kPageInfoHead = 0x80;
+constexpr uint8_t kPageInfoFree = 0x40;
+constexpr uint8_t kPageInfoOrderMask = 0x1f;
+
+}  // namespace
+
+void BuddyAllocator::Init(uint64_t base, size_t pages, uint8_t* page_info) {
+  ASSERT((base & (PAGE_SIZE - 1)) == 0, "Region must be page aligned");
+
+  base_ = base;
+  pages_ = pages;
+  page_info_ = page_info;
+  for (auto& list : free_lists_) {
+    list = nullptr;
+  }
+  stat_ = {};
+  stat_.total_pages = pages;
+
+  for (size_t i = 0; i < pages_; i++) {
+    page_info_[i] = 0;
+  }
+
+  // Carve the region into the largest naturally aligned blocks.
+  size_t idx = 0;
+  while (idx < pages_) {
+    uint8_t order = kMaxOrder;
+    while (order > 0 && ((idx & ((1UL << order) - 1)) != 0 ||
+                         idx + (1UL << order) > pages_)) {
+      order--;
+    }
+    PushFreeBlock(idx, order);
+    stat_.free_pages += 1UL << order;
+    idx += 1UL << order;
+  }
+}
+
+void* BuddyAllocator::Allocate(size_t pages) {
+  if (pages < 1 || pages > (1UL << kMaxOrder)) {
+    stat_.failures++;
+    return nullptr;
+  }
+  return AllocateOrder(PagesToOrder(pages));
+}
+
+void* BuddyAllocator::AllocateOrder(uint8_t order) {
+  if (order > kMaxOrder) {
+    stat_.failures++;
+    return nullptr;
+  }
+
+  // Find the smallest free block that satisfies the request.
+  uint8_t cur = order;
+  while (cur <= kMaxOrder && free_lists_[cur] == nullptr) {
+    cur++;
+  }
+  if (cur > kMaxOrder) {
+    stat_.failures++;
+    return nullptr;
+  }
+
+  const size_t idx = BlockToPage(free_lists_[cur]);
+  RemoveFreeBlock(idx, cur);
+
+  // Split the block and give the upper halves back to the free lists.
+  while (cur > order) {
+    cur--;
+    PushFreeBlock(idx + (1UL << cur), cur);
+  }
+  page_info_[idx] = kPageInfoHead | order;
+
+  stat_.free_pages -= 1UL << order;
+  stat_.allocs++;
+  const size_t used = stat_.total_pages - stat_.free_pages;
+  if (used > stat_.peak_used_pages) {
+    stat_.peak_used_pages = used;
+  }
+
+  return reinterpret_cast<void*>(base_ + idx * PAGE_SIZE);
+}
+
+void BuddyAllocator::Free(void* addr) {
+  ASSERT(Contains(addr), "Address (%lx) is out of the region",
+         reinterpret_cast<uint64_t>(addr));
+
+  size_t idx = BlockToPage(addr);
+  const uint8_t info = page_info_[idx];
+  if ((info & (kPageInfoHead | kPageInfoFree)) != kPageInfoHead) {
+    LOG_ERROR("Invalid free: addr = %lx", reinterpret_cast<uint64_t>(addr));
+    return;
+  }
+
+  uint8_t order = info & kPageInfoOrderMask;
+  page_info_[idx] = 0;
+  stat_.free_pages += 1UL << order;
+  stat_.frees++;
+
+  // Coalesce with the buddy as long as it is free and of the same order.
+  while (order < kMaxOrder) {
+    const size_t buddy = idx ^ (1UL << order);
+    if (buddy >= pages_ ||
+        page_info_[buddy] != (kPageInfoHead | kPageInfoFree | order)) {
+      break;
+    }
+    RemoveFreeBlock(buddy, order);
+    page_info_[buddy] = 0;
+    idx &= ~(1UL << order);
+    order++;
+  }
+  PushFreeBlock(idx, order);
+}
+
+bool BuddyAllocator::Contains(const void* addr) const {
+  const auto va = reinterpret_cast<uint64_t>(addr);
+  return va >= base_ && va < base_ + pages_ * PAGE_SIZE;
+}
+
+size_t BuddyAllocator::GetBlockPages(const void* addr) const {
+  if (!Contains(addr)) {
+    return 0;
+  }
+  const uint8_t info = page_info_[BlockToPage(addr)];
+  if ((info & (kPageInfoHead | kPageInfoFree)) != kPageInfoHead) {
+    return 0;
+  }
+  return 1UL << (info & kPageInfoOrderMask);
+}
+
+int BuddyAllocator::GetLargestFreeOrder() const {
+  for (int order = kMaxOrder; order >= 0; order--) {
+    if (free_lists_[order]) {
+      return order;
+    }
+  }
+  return -1;
+}
+
+uint32_t BuddyAllocator::GetFragmentation() const {
+  const int order = GetLargestFreeOrder();
+  if (order < 0 || stat_.free_pages == 0) {
+    return 0;
+  }
+  const size_t largest = 1UL << order;
+  return 100 - static_cast<uint32_t>(largest * 100 / stat_.free_pages);
+}
+
+// static
+uint8_t BuddyAllocator::PagesToOrder(size_t pages) {
+  uint8_t order = 0;
+  while ((1UL << order) < pages) {
+    order++;
+  }
+  return order;
+}
+
+inline BuddyAllocator::FreeBlock* BuddyAllocator::PageToBlock(
+    size_t idx) const {
+  return reinterpret_cast<FreeBlock*>(base_ + idx * PAGE_SIZE);
+}
+
+inline size_t BuddyAllocator::BlockToPage(const void* block) const {
+  return (reinterpret_cast<uint64_t>(block) - base_) / PAGE_SIZE;
+}
+
+void BuddyAllocator::PushFreeBlock(size_t idx, uint8_t order) {
+  auto* block = PageToBlock(idx);
+  block->prev = nullptr;
+  block->next = free_lists_[order];
+  if (block->next) {
+    block->next->prev = block;
+  }
+  free_lists_[order] = block;
+
+  page_info_[idx] = kPageInfoHead | kPageInfoFree | order;
+  stat_.free_blocks[order]++;
+}
+
+void BuddyAllocator::RemoveFreeBlock(size_t idx, uint8_t order) {
+  auto* block = PageToBlock(idx);
+  if (block->prev) {
+    block->prev->next = block->next;
+  } else {
+    free_lists_[order] = block->next;
+  }
+  if (block->next) {
+    block->next->prev = block->prev;
+  }
+
+  page_info_[idx] = 0;
+  stat_.free_blocks[order]--;
+}
+
+}  // namespace evisor
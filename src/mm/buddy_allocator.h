@@ -0,0 +1,93 @@
+#ifndef EVISOR_MM_BUDDY_ALLOCATOR_H_
+#define EVISOR_MM_BUDDY_ALLOCATOR_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+namespace evisor {
+
+// Binary buddy allocator over a physically contiguous page region.
+//
+// Blocks are 2^order pages. Free blocks are kept in per-order doubly linked
+// lists whose nodes live in the free pages themselves, so the only metadata
+// is one byte per page supplied by the owner of the region.
+class BuddyAllocator {
+ public:
+  // 2^14 pages = 64 MiB with 4 KiB pages.
+  static constexpr uint8_t kMaxOrder = 14;
+
+  struct Stat {
+    size_t total_pages;
+    size_t free_pages;
+    // High watermark of the allocated pages.
+    size_t peak_used_pages;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t failures;
+    // Number of free blocks per order.
+    size_t free_blocks[kMaxOrder + 1];
+  };
+
+  BuddyAllocator() = default;
+  ~BuddyAllocator() = default;
+
+  // Prevent copying.
+  BuddyAllocator(BuddyAllocator const&) = delete;
+  BuddyAllocator& operator=(BuddyAllocator const&) = delete;
+
+  // Manage |pages| pages starting at |base|. |page_info| must have at least
+  // |pages| entries and outlive the allocator.
+  void Init(uint64_t base, size_t pages, uint8_t* page_info);
+
+  // Allocate a block large enough for |pages| pages. The block is rounded up
+  // to a power of two and aligned to its own size. Returns nullptr on failure.
+  void* Allocate(size_t pages);
+
+  // Allocate a block of 2^order pages.
+  void* AllocateOrder(uint8_t order);
+
+  // Free a block returned by Allocate().
+  void Free(void* addr);
+
+  // Returns true if |addr| is inside the managed region.
+  bool Contains(const void* addr) const;
+
+  // Number of pages backing the allocated block at |addr|.
+  size_t GetBlockPages(const void* addr) const;
+
+  const Stat& GetStat() const { return stat_; }
+
+  // Order of the largest free block, or -1 if no block is free.
+  int GetLargestFreeOrder() const;
+
+  // External fragmentation in percent: how much of the free memory is not
+  // available as the single largest free block.
+  uint32_t GetFragmentation() const;
+
+  // Smallest order that covers |pages| pages.
+  static uint8_t PagesToOrder(size_t pages);
+
+ private:
+  struct FreeBlock {
+    FreeBlock* prev;
+    FreeBlock* next;
+  };
+
+  inline FreeBlock* PageToBlock(size_t idx) const;
+  inline size_t BlockToPage(const void* block) const;
+
+  void PushFreeBlock(size_t idx, uint8_t order);
+  void RemoveFreeBlock(size_t idx, uint8_t order);
+
+  uint64_t base_ = 0;
+  size_t pages_ = 0;
+  // Per-page state. Only the first page of a block is tagged.
+  uint8_t* page_info_ = nullptr;
+  FreeBlock* free_lists_[kMaxOrder + 1] = {};
+  Stat stat_ = {};
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_MM_BUDDY_ALLOCATOR_H_
@@ -3,39 +3,59 @@
 #include <cstdbool>
 #include <cstdint>
 
+#include "arch/arm64/irq/cpu_irq.h"
 #include "arch/ld_symbols.h"
 #include "common/logger.h"
+#include "mm/buddy_allocator.h"
 #include "mm/pgtable.h"
 
-// FIXME
-/* 64MiB user space */
-#define HEAP_PAGES (static_cast<uint64_t>(1024 * 1024 * 64) / PAGE_SIZE)
-
 namespace evisor {
 
 namespace {
-bool kernelHeapMemMap[HEAP_PAGES] = {false};
+uint8_t kernelHeapPageInfo[kKmmHeapMaxPages] = {0};
+
+BuddyAllocator& GetHeap() {
+  static BuddyAllocator heap;
+  static bool initialized = false;
+  if (!initialized) {
+    const size_t pages = kHeapSize / PAGE_SIZE;
+    heap.Init(kHeapStart, pages < kKmmHeapMaxPages ? pages : kKmmHeapMaxPages,
+              kernelHeapPageInfo);
+    initialized = true;
+  }
+  return heap;
+}
 }  // namespace
 
-void* kmm_malloc([[maybe_unused]] size_t size) {
+void* kmm_malloc(size_t size) {
+  void* p = kmm_try_malloc(size);
+  if (!p && size >= 1) {
+    PANIC("No free space! (requested %d bytes)", size);
+  }
+  return p;
+}
+
+void* kmm_try_malloc(size_t size) {
   if (size < 1) {
     return nullptr;
   }
 
-  // FIXME: need to consider 'size' var
-  for (uint32_t i = 0; i < HEAP_PAGES; i++) {
-    if (!kernelHeapMemMap[i]) {
-      kernelHeapMemMap[i] = true;
-      return reinterpret_cast<uint64_t*>(kHeapStart + i * PAGE_SIZE);
-    }
-  }
-  PANIC("No free space!");
-  return nullptr;
+  const size_t pages = __builtin_align_up(size, PAGE_SIZE) / PAGE_SIZE;
+  // Slabs are refilled from here by IRQ handlers too.
+  IrqSaveGuard guard;
+  return GetHeap().Allocate(pages);
 }
 
 void kmm_free(void* va) {
-  kernelHeapMemMap[(reinterpret_cast<uint64_t>(va) - kHeapStart) / PAGE_SIZE] =
-      false;
+  if (!va) {
+    return;
+  }
+  IrqSaveGuard guard;
+  GetHeap().Free(va);
+}
+
+const BuddyAllocator& kmm_get_heap() {
+  return GetHeap();
 }
 
 }  // namespace evisor
@@ -3,11 +3,26 @@
 
 #include <cstddef>
 
+#include "mm/buddy_allocator.h"
+#include "mm/pgtable.h"
+
 namespace evisor {
 
+// 64MiB kernel heap. See .heap section in src/arch/arm64/scripts/*/linker.ld
+constexpr size_t kKmmHeapMaxPages = static_cast<size_t>(64) * 1024 * 1024 /
+                                    PAGE_SIZE;
+
+// Allocate physically contiguous pages from the kernel heap. The size is
+// rounded up to a power-of-two number of pages.
 void* kmm_malloc(size_t size);
+// Same as kmm_malloc, but returns nullptr instead of PANICking when the heap
+// is exhausted.
+void* kmm_try_malloc(size_t size);
 void kmm_free(void* va);
 
+// Get the kernel heap allocator for statistics.
+const BuddyAllocator& kmm_get_heap();
+
 }  // namespace evisor
 
 #endif  // EVISOR_MM_HEAP_KMM_MALLOC_H_
@@ -1,14 +1,27 @@
 #include "mm/heap/kmm_zalloc.h"
 
-#include "common/cstring.h"
+#include <cstdint>
+
 #include "mm/heap/kmm_malloc.h"
+#include "mm/pgtable.h"
+#include "mm/zero_page_pool.h"
 
 namespace evisor {
 
 void* kmm_zalloc(size_t size) {
-  void* alloc = evisor::kmm_malloc(size);
+  if (size < 1) {
+    return nullptr;
+  }
+  if (size <= PAGE_SIZE) {
+    return ZeroPagePool::GetKernel().Allocate();
+  }
+
+  auto* alloc = static_cast<uint8_t*>(evisor::kmm_malloc(size));
   if (alloc) {
-    memzero(alloc, size);
+    // kmm_malloc hands out whole pages.
+    for (size_t i = 0; i < size; i += PAGE_SIZE) {
+      PageZero(alloc + i);
+    }
   }
   return alloc;
 }
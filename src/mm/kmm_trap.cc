@@ -1,21 +1,71 @@
 #include "mm/kmm_trap.h"
 
+#include "arch/arm64/arm_generic_timer.h"
+#include "common/logger.h"
+#include "fs/loader.h"
+#include "fs/snapshot.h"
 #include "kernel/sched/sched.h"
+#include "mm/mm_stat.h"
+#include "mm/page_swap.h"
 #include "mm/pgtable_stage1.h"
 #include "mm/pgtable_stage2.h"
+#include "mm/zero_page_pool.h"
 
 namespace evisor {
 
 bool HandleMmTrapMemoryAccessFault(va_t addr) {
   auto& sched = Sched::Get();
   auto* tsk = sched.GetCurrentTask();
-  auto page = reinterpret_cast<va_t>(PgTableStage1::PageAllocate());
+  auto& timer = ArmGenericTimer::Get();
+  const auto& pool_stat = ZeroPagePool::GetUser().GetStat();
+  const auto start = timer.GetTimerCount();
+  const auto pool_hits = pool_stat.hits;
+
+  // Swapped-out pages come first. They may be image or snapshot pages
+  // which have been read already.
+  if (PageSwap::Get().HandleFault(tsk, addr & PAGE_MASK) ||
+      LoaderHandleImageFault(tsk, addr & PAGE_MASK) ||
+      SnapshotHandleFault(tsk, addr & PAGE_MASK)) {
+    tsk->stat.page_faults++;
+    return true;
+  }
+
+  auto page = reinterpret_cast<va_t>(PgTableStage1::PageAllocate(tsk));
   if (!page) {
     return false;
   }
 
   PgTableStage2::MapNewPage(tsk, addr, page);
   tsk->stat.page_faults++;
+
+  MmRecordFaultLatency(timer.CountToNsec(timer.GetTimerCount() - start),
+                       pool_stat.hits != pool_hits);
+  return true;
+}
+
+bool HandleMmTrapAccessFlagFault(va_t addr) {
+  auto* tsk = Sched::Get().GetCurrentTask();
+  return PgTableStage2::HandleAccessFlagFault(tsk, addr);
+}
+
+bool HandleMmTrapWriteProtectFault(va_t addr) {
+  auto* tsk = Sched::Get().GetCurrentTask();
+  auto& timer = ArmGenericTimer::Get();
+  const auto start = timer.GetTimerCount();
+  if (PgTableStage2::HandleDirtyLogFault(tsk, addr)) {
+    tsk->stat.dirty_faults++;
+    MmRecordDirtyLogLatency(timer.CountToNsec(timer.GetTimerCount() - start));
+    return true;
+  }
+
+  if (!PgTableStage2::IsCopyOnWrite(tsk, addr)) {
+    return false;
+  }
+  // Over quota, like a translation fault that finds no page.
+  if (!PgTableStage2::BreakCopyOnWrite(tsk, addr)) {
+    PANIC("%s cannot copy the page at %lx", tsk->name, addr);
+  }
+  tsk->stat.cow_faults++;
   return true;
 }
 
@@ -11,6 +11,13 @@ namespace evisor {
 // Handle memory access trap.
 bool HandleMmTrapMemoryAccessFault(va_t addr);
 
+// Handle the first access to a page aged for swap.
+bool HandleMmTrapAccessFlagFault(va_t addr);
+
+// Handle write to a copy-on-write page. Returns false if the page at |addr|
+// is not shared copy-on-write.
+bool HandleMmTrapWriteProtectFault(va_t addr);
+
 // Handle register access trap.
 bool HandleMmTrapRegisterAccess(va_t addr, uint8_t srt, bool read);
 
@@ -0,0 +1,165 @@
+#include "mm/mm_stat.h"
+
+#include "common/cstdio.h"
+#include "fs/block_cache.h"
+#include "mm/buddy_allocator.h"
+#include "mm/heap/kmm_malloc.h"
+#include "mm/page_merge.h"
+#include "mm/page_swap.h"
+#include "mm/pgtable.h"
+#include "mm/slab/kmm_slab.h"
+#include "mm/uncached/kmm_uncached_malloc.h"
+#include "mm/user_heap/umm_malloc.h"
+#include "mm/zero_page_pool.h"
+
+namespace evisor {
+
+namespace {
+
+// Log2 histogram: bucket n counts latencies in [2^(n-1), 2^n) ns.
+constexpr size_t kLatencyBuckets = 32;
+
+struct LatencyHistogram {
+  uint64_t count;
+  uint64_t max_nsec;
+  uint64_t buckets[kLatencyBuckets];
+};
+
+LatencyHistogram faultLatencyPool_ = {};
+LatencyHistogram faultLatencySync_ = {};
+LatencyHistogram faultLatencyDirtyLog_ = {};
+
+void RecordLatency(LatencyHistogram* hist, uint64_t nsec) {
+  size_t bucket = nsec ? 64 - __builtin_clzll(nsec) : 0;
+  if (bucket >= kLatencyBuckets) {
+    bucket = kLatencyBuckets - 1;
+  }
+  hist->buckets[bucket]++;
+  hist->count++;
+  if (nsec > hist->max_nsec) {
+    hist->max_nsec = nsec;
+  }
+}
+
+// Upper bound of the bucket holding the |percent| percentile.
+uint64_t GetPercentile(const LatencyHistogram& hist, uint32_t percent) {
+  const uint64_t target = (hist.count * percent + 99) / 100;
+  uint64_t sum = 0;
+  for (size_t i = 0; i < kLatencyBuckets; i++) {
+    sum += hist.buckets[i];
+    if (sum >= target) {
+      return 1ULL << i;
+    }
+  }
+  return hist.max_nsec;
+}
+
+void PrintLatency(const char* name, const LatencyHistogram& hist) {
+  if (!hist.count) {
+    printf("%10s %9d %9s %9s %9s %9s\n", name, 0, "-", "-", "-", "-");
+    return;
+  }
+  printf("%10s %9d %9d %9d %9d %9d\n", name, hist.count,
+         GetPercentile(hist, 50), GetPercentile(hist, 90),
+         GetPercentile(hist, 99), hist.max_nsec);
+}
+
+void PrintBuddyStat(const char* name, const BuddyAllocator& buddy) {
+  const auto& stat = buddy.GetStat();
+  const auto used = stat.total_pages - stat.free_pages;
+  printf("%10s %9d %9d %9d %4d%% %9d %9d %7d\n", name,
+         stat.total_pages * PAGE_SIZE / 1024, used * PAGE_SIZE / 1024,
+         stat.peak_used_pages * PAGE_SIZE / 1024, buddy.GetFragmentation(),
+         stat.allocs, stat.frees, stat.failures);
+  printf("%10s free blocks (order:count)", "");
+  for (uint8_t order = 0; order <= BuddyAllocator::kMaxOrder; order++) {
+    if (stat.free_blocks[order]) {
+      printf(" %d:%d", order, stat.free_blocks[order]);
+    }
+  }
+  printf("\n");
+}
+
+void PrintUmmStat() {
+  const auto& stat = umm_get_stat();
+  printf("%10s %9d %9d %9d %5s %9d %9d %7d\n", "user",
+         stat.total_pages * PAGE_SIZE / 1024,
+         stat.used_pages * PAGE_SIZE / 1024,
+         stat.peak_used_pages * PAGE_SIZE / 1024, "-", stat.allocs,
+         stat.frees, stat.failures);
+  printf("%10s %d page colours, %d coloured allocations fell back\n", "",
+         umm_num_colours(), stat.colour_fallbacks);
+}
+
+void PrintZeroPagePoolStat(const char* name, const ZeroPagePool& pool) {
+  const auto& stat = pool.GetStat();
+  printf("%10s %9d %9d %9d %9d\n", name, stat.free_pages * PAGE_SIZE / 1024,
+         stat.hits, stat.misses, stat.refills);
+}
+
+void PrintDmaPoolStat() {
+  const auto& stat = kmm_uncached_get_pool_stat();
+  printf("%10s %9d %9d %9d %9s\n", "dma", stat.free_pages * PAGE_SIZE / 1024,
+         stat.hits, stat.misses, "-");
+}
+
+}  // namespace
+
+void MmPrintStat() {
+  printf("\n%10s %9s %9s %9s %5s %9s %9s %7s\n", "ALLOCATOR", "TOTAL(KB)",
+         "USED(KB)", "PEAK(KB)", "FRAG", "ALLOCS", "FREES", "FAILS");
+  PrintBuddyStat("heap", kmm_get_heap());
+  PrintBuddyStat("uncached", kmm_uncached_get_region());
+  PrintUmmStat();
+
+  printf("\n%10s %9s %9s %9s %9s\n", "POOL", "FREE(KB)", "HITS", "MISSES",
+         "REFILLS");
+  PrintDmaPoolStat();
+  PrintZeroPagePoolStat("zero-kern", ZeroPagePool::GetKernel());
+  PrintZeroPagePoolStat("zero-user", ZeroPagePool::GetUser());
+
+  kmm_slab_print_stat();
+
+  const auto& merge = PageMerger::Get().GetStat();
+  printf("\n%10s %9s %9s %9s %9s %9s\n", "MERGE", "RATE", "SCANNED",
+         "ROUNDS", "SHARED", "SAVED(KB)");
+  printf("%10s %9d %9d %9d %9d %9d\n", "ksm", PageMerger::Get().GetScanRate(),
+         merge.pages_scanned, merge.full_scans, merge.pages_shared,
+         merge.pages_sharing * PAGE_SIZE / 1024);
+
+  const auto& swap = PageSwap::Get().GetStat();
+  printf("\n%10s %9s %9s %9s %9s %9s %9s %9s %7s\n", "SWAP", "TOTAL(KB)",
+         "USED(KB)", "SCANNED", "BATCHES", "OUT", "IN", "AHEAD", "FAILS");
+  printf("%10s %9d %9d %9d %9d %9d %9d %9d %7d\n", "disk",
+         swap.total_slots * PAGE_SIZE / 1024,
+         swap.used_slots * PAGE_SIZE / 1024, swap.pages_scanned,
+         swap.batches, swap.swap_outs, swap.swap_ins, swap.readahead,
+         swap.failures);
+
+  const auto& bcache = BlockCache::Get();
+  const auto& blocks = bcache.GetStat();
+  printf("\n%10s %9s %9s %9s %9s %9s %9s %9s %7s %10s\n", "BLOCK",
+         "USED(KB)", "HITS", "MISSES", "AHEAD", "AHEADHIT", "EVICTS", "READS",
+         "FAILS", "DIRECT(KB)");
+  printf("%10s %9d %9d %9d %9d %9d %9d %9d %7d %10d\n", "fs",
+         bcache.GetNumBlocks() * BlockCache::kBlockSize / 1024, blocks.hits,
+         blocks.misses, blocks.readahead, blocks.readahead_hits,
+         blocks.evictions, blocks.device_reads, blocks.failures,
+         blocks.direct_sectors * BlockCache::kSectorSize / 1024);
+
+  printf("\n%10s %9s %9s %9s %9s %9s\n", "FAULT(ns)", "COUNT", "P50", "P90",
+         "P99", "MAX");
+  PrintLatency("prezeroed", faultLatencyPool_);
+  PrintLatency("sync-zero", faultLatencySync_);
+  PrintLatency("dirty-log", faultLatencyDirtyLog_);
+}
+
+void MmRecordFaultLatency(uint64_t nsec, bool prezeroed) {
+  RecordLatency(prezeroed ? &faultLatencyPool_ : &faultLatencySync_, nsec);
+}
+
+void MmRecordDirtyLogLatency(uint64_t nsec) {
+  RecordLatency(&faultLatencyDirtyLog_, nsec);
+}
+
+}  // namespace evisor
@@ -0,0 +1,21 @@
+#ifndef EVISOR_MM_MM_STAT_H_
+#define EVISOR_MM_MM_STAT_H_
+
+#include <cstdbool>
+#include <cstdint>
+
+namespace evisor {
+
+// Print memory usage statistics of the hypervisor allocators.
+void MmPrintStat();
+
+// Record how long a guest page fault took to handle. |prezeroed| tells
+// whether the page came from the pre-zeroed page pool.
+void MmRecordFaultLatency(uint64_t nsec, bool prezeroed);
+
+// Record how long logging a write to a dirty-logged page took.
+void MmRecordDirtyLogLatency(uint64_t nsec);
+
+}  // namespace evisor
+
+#endif  // EVISOR_MM_MM_STAT_H_
@@ -1,11 +1,11 @@
 #include "mm/new.h"
 
 #include "common/assert.h"
-#include "mm/heap/kmm_malloc.h"
+#include "mm/slab/kmm_slab.h"
 
 void* operator new(std::size_t n) {
-  void* p = evisor::kmm_malloc(n);
-  ASSERT(p != nullptr, "kmm_malloc failed");
+  void* p = evisor::kmm_slab_alloc(n);
+  ASSERT(p != nullptr, "kmm_slab_alloc failed");
   return p;
 }
 
@@ -13,12 +13,12 @@ void operator delete(void* p) {
   if (!p) {
     return;
   }
-  evisor::kmm_free(p);
+  evisor::kmm_slab_free(p);
 }
 
 void operator delete(void* p, std::size_t) {
   if (!p) {
     return;
   }
-  evisor::kmm_free(p);
+  evisor::kmm_slab_free(p);
 }
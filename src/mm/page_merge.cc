@@ -0,0 +1,192 @@
+#include "mm/page_merge.h"
+
+#include "kernel/sched/sched.h"
+#include "mm/pgtable_stage2.h"
+#include "mm/user_heap/umm_malloc.h"
+
+namespace evisor {
+
+namespace {
+
+// Marks an unstable slot whose page has been merged. The probe chain goes on.
+constexpr pa_t kUnstableSlotMerged = 1;
+
+uint64_t HashPage(pa_t page) {
+  const auto* words = reinterpret_cast<const uint64_t*>(page);
+  uint64_t hash = 0;
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+    hash = (((hash << 5) | (hash >> 59)) ^ words[i]) * 0x517cc1b727220a95;
+  }
+  return hash;
+}
+
+bool IsSamePage(pa_t a, pa_t b) {
+  const auto* wa = reinterpret_cast<const uint64_t*>(a);
+  const auto* wb = reinterpret_cast<const uint64_t*>(b);
+  for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+    if (wa[i] != wb[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Redirect the mapping of |page| at |ipa| to |shared| and drop |page|.
+void ReplacePage(Tcb* tsk, ipa_t ipa, pa_t page, pa_t shared) {
+  umm_page_get(reinterpret_cast<void*>(shared));
+  PgTableStage2::ReplaceWithSharedPage(tsk, ipa, shared);
+  umm_page_put(reinterpret_cast<void*>(page));
+}
+
+}  // namespace
+
+void PageMerger::Scan() {
+  if (!scan_rate_) {
+    return;
+  }
+
+  auto& sched = Sched::Get();
+  bool merged = false;
+  for (size_t n = 0; n < scan_rate_; n++) {
+    if (cursor_pid_ >= sched.GetTaskCount()) {
+      EndRound();
+      break;
+    }
+
+    // Merging would map pages of other colours into a coloured VM, or its
+    // own pages into other VMs.
+    auto* tsk = sched.GetTask(cursor_pid_);
+    bool shared = false;
+    ipa_t ipa = cursor_ipa_;
+    const pa_t page =
+        tsk->state == RUNNING && !tsk->mm.colours
+            ? PgTableStage2::FindNextRamPage(tsk, &ipa, &shared)
+            : 0;
+    if (!page) {
+      cursor_pid_++;
+      cursor_ipa_ = 0;
+      continue;
+    }
+    cursor_ipa_ = ipa + PAGE_SIZE;
+    stat_.pages_scanned++;
+
+    if (shared) {
+      // Every mapping of a page with more than one reference is read-only.
+      if (umm_page_refs(reinterpret_cast<void*>(page)) > 1) {
+        InsertStable(page, HashPage(page));
+      }
+      continue;
+    }
+    merged |= MergePage(tsk, ipa, page);
+  }
+
+  if (merged) {
+    PgTableStage2::FlushTlbAll();
+  }
+}
+
+bool PageMerger::MergePage(Tcb* tsk, ipa_t ipa, pa_t page) {
+  const uint64_t hash = HashPage(page);
+  if (MergeWithStable(tsk, ipa, page, hash)) {
+    return true;
+  }
+  return MergeWithUnstable(tsk, ipa, page, hash);
+}
+
+bool PageMerger::MergeWithStable(Tcb* tsk,
+                                 ipa_t ipa,
+                                 pa_t page,
+                                 uint64_t hash) {
+  for (size_t i = 0; i < kTableSlots; i++) {
+    const auto& slot = stable_[(hash + i) % kTableSlots];
+    if (!slot.page) {
+      return false;
+    }
+    if (slot.hash != hash ||
+        umm_page_refs(reinterpret_cast<void*>(slot.page)) < 2 ||
+        !IsSamePage(slot.page, page)) {
+      continue;
+    }
+
+    ReplacePage(tsk, ipa, page, slot.page);
+    stat_.pages_sharing++;
+    return true;
+  }
+  return false;
+}
+
+bool PageMerger::MergeWithUnstable(Tcb* tsk,
+                                   ipa_t ipa,
+                                   pa_t page,
+                                   uint64_t hash) {
+  auto& sched = Sched::Get();
+  UnstableSlot* free_slot = nullptr;
+
+  for (size_t i = 0; i < kTableSlots; i++) {
+    auto& slot = unstable_[(hash + i) % kTableSlots];
+    if (!slot.page) {
+      free_slot = &slot;
+      break;
+    }
+    if (slot.hash != hash || slot.page == kUnstableSlotMerged) {
+      continue;
+    }
+
+    // The other page may have been written or unmapped since it was hashed.
+    auto* other = sched.GetTask(slot.pid);
+    ipa_t other_ipa = slot.ipa;
+    bool other_shared = false;
+    if (PgTableStage2::FindNextRamPage(other, &other_ipa, &other_shared) !=
+            slot.page ||
+        other_ipa != slot.ipa || other_shared || slot.page == page ||
+        !IsSamePage(slot.page, page)) {
+      continue;
+    }
+
+    PgTableStage2::ProtectCopyOnWrite(other, slot.ipa);
+    ReplacePage(tsk, ipa, page, slot.page);
+    InsertStable(slot.page, hash);
+    slot.page = kUnstableSlotMerged;
+    stat_.pages_shared++;
+    stat_.pages_sharing++;
+    return true;
+  }
+
+  if (free_slot) {
+    *free_slot = {
+        .hash = hash,
+        .page = page,
+        .pid = tsk->pid,
+        .ipa = ipa,
+    };
+  }
+  return false;
+}
+
+void PageMerger::InsertStable(pa_t page, uint64_t hash) {
+  for (size_t i = 0; i < kTableSlots; i++) {
+    auto& slot = stable_[(hash + i) % kTableSlots];
+    if (slot.page == page) {
+      return;
+    }
+    if (!slot.page) {
+      slot.hash = hash;
+      slot.page = page;
+      return;
+    }
+  }
+}
+
+void PageMerger::EndRound() {
+  for (auto& slot : stable_) {
+    slot = {};
+  }
+  for (auto& slot : unstable_) {
+    slot = {};
+  }
+  cursor_pid_ = 0;
+  cursor_ipa_ = 0;
+  stat_.full_scans++;
+}
+
+}  // namespace evisor
@@ -0,0 +1,91 @@
+#ifndef EVISOR_MM_PAGE_MERGE_H_
+#define EVISOR_MM_PAGE_MERGE_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+#include "kernel/task/task.h"
+#include "mm/pgtable.h"
+
+namespace evisor {
+
+// Same-page merging for guest RAM.
+//
+// The merger walks the stage-2 tables of every VM a few pages at a time from
+// the idle loop. Private pages are hashed and looked up in two tables:
+//  - stable: pages which are already shared copy-on-write
+//  - unstable: private pages seen earlier in the current round
+// A byte-wise compare confirms a match before the pages are merged into one
+// read-only page. Writes are handled by the copy-on-write fault path. Both
+// tables are rebuilt every round, so stale entries never accumulate.
+class PageMerger {
+ public:
+  // Scan rate steps selectable from the console (?k0 - ?k9).
+  static constexpr size_t kScanRateStep = 64;
+
+  struct Stat {
+    uint64_t pages_scanned;
+    uint64_t full_scans;
+    // Pages that became shared by merging.
+    uint64_t pages_shared;
+    // Guest mappings redirected to a shared page, i.e. pages saved.
+    uint64_t pages_sharing;
+  };
+
+  PageMerger() = default;
+  ~PageMerger() = default;
+
+  // Prevent copying.
+  PageMerger(PageMerger const&) = delete;
+  PageMerger& operator=(PageMerger const&) = delete;
+
+  static PageMerger& Get() noexcept {
+    static PageMerger instance;
+    return instance;
+  }
+
+  // Scan up to the configured number of guest pages. Called from the idle
+  // loop with IRQs disabled.
+  void Scan();
+
+  // Number of pages scanned per Scan() call. 0 disables the merger.
+  void SetScanRate(size_t pages) { scan_rate_ = pages; }
+  size_t GetScanRate() const { return scan_rate_; }
+
+  const Stat& GetStat() const { return stat_; }
+
+ private:
+  static constexpr size_t kTableSlots = 4096;
+
+  struct StableSlot {
+    uint64_t hash;
+    pa_t page;
+  };
+
+  struct UnstableSlot {
+    uint64_t hash;
+    pa_t page;
+    long pid;
+    ipa_t ipa;
+  };
+
+  bool MergePage(Tcb* tsk, ipa_t ipa, pa_t page);
+  bool MergeWithStable(Tcb* tsk, ipa_t ipa, pa_t page, uint64_t hash);
+  bool MergeWithUnstable(Tcb* tsk, ipa_t ipa, pa_t page, uint64_t hash);
+  void InsertStable(pa_t page, uint64_t hash);
+  void EndRound();
+
+  size_t scan_rate_ = 0;
+  // Scan position
+  int cursor_pid_ = 0;
+  ipa_t cursor_ipa_ = 0;
+
+  StableSlot stable_[kTableSlots] = {};
+  UnstableSlot unstable_[kTableSlots] = {};
+  Stat stat_ = {};
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_MM_PAGE_MERGE_H_
@@ -0,0 +1,278 @@
+#include "mm/page_swap.h"
+
+#include <algorithm>
+#include <iterator>
+
+#include "arch/arm64/cache.h"
+#include "common/logger.h"
+#include "fs/disk_area.h"
+#include "kernel/sched/sched.h"
+#include "mm/heap/kmm_zalloc.h"
+#include "mm/pgtable_stage1.h"
+#include "mm/pgtable_stage2.h"
+#include "mm/user_heap/umm_malloc.h"
+
+namespace evisor {
+
+void PageSwap::Reclaim() {
+  if (GetFreePages() >= kLowWatermarkPages || !Init()) {
+    return;
+  }
+
+  // Two rounds over all guest RAM at most. The first one may only clear
+  // access flags.
+  auto& sched = Sched::Get();
+  uint64_t budget = sched.GetTaskCount() + 1;
+  for (int pid = 0; pid < sched.GetTaskCount(); pid++) {
+    budget += sched.GetTask(pid)->mm.pages;
+  }
+  budget *= 2;
+
+  Victim victims[kBatchPages];
+  while (GetFreePages() < kHighWatermarkPages) {
+    const size_t count = CollectColdPages(victims, kBatchPages, &budget);
+    if (!count) {
+      stat_.failures++;
+      break;
+    }
+    if (!SwapOut(victims, count)) {
+      break;
+    }
+  }
+}
+
+bool PageSwap::HandleFault(Tcb* tsk, ipa_t ipa) {
+  if (PgTableStage2::IsSwapEntryPinned(tsk, ipa)) {
+    // Another task is still writing the page out. Let it finish, and retry
+    // the access.
+    Sched::Get().Schedule();
+    return true;
+  }
+
+  uint64_t slots[1 + kReadAheadPages];
+  if (!PgTableStage2::GetSwapEntry(tsk, ipa, &slots[0])) {
+    return false;
+  }
+
+  // Read ahead only on sequential faults. Neighbouring pages were swapped
+  // out together, so their slots are likely next to each other too, and
+  // each run of consecutive slots is read in one transfer.
+  size_t count = 1;
+  if (ipa == tsk->mm.swap_fault_ipa + PAGE_SIZE) {
+    while (count <= kReadAheadPages &&
+           PgTableStage2::GetSwapEntry(tsk, ipa + count * PAGE_SIZE,
+                                       &slots[count])) {
+      count++;
+    }
+  }
+  size_t done = 0;
+  while (done < count) {
+    size_t run = 1;
+    while (done + run < count && slots[done + run] == slots[done] + run) {
+      run++;
+    }
+    const size_t read =
+        SwapIn(tsk, ipa + done * PAGE_SIZE, slots[done], run);
+    done += read;
+    if (read < run) {
+      break;
+    }
+  }
+  if (!done) {
+    return false;
+  }
+  stat_.readahead += done - 1;
+  tsk->mm.swap_fault_ipa = ipa + (done - 1) * PAGE_SIZE;
+  return true;
+}
+
+void PageSwap::GetSlot(uint64_t slot) {
+  if (!slot_refs_[slot]++) {
+    stat_.used_slots++;
+  }
+}
+
+void PageSwap::PutSlot(uint64_t slot) {
+  if (!--slot_refs_[slot]) {
+    stat_.used_slots--;
+  }
+}
+
+bool PageSwap::Init() {
+  if (initialized_) {
+    return slot_refs_ != nullptr;
+  }
+  initialized_ = true;
+
+  uint64_t slots;
+  if (!DiskAreaGet(DiskArea::kSwap, &area_lba_, &slots)) {
+    return false;
+  }
+  slot_refs_ = static_cast<uint16_t*>(kmm_zalloc(slots * sizeof(uint16_t)));
+  if (!slot_refs_) {
+    LOG_ERROR("Failed to allocate %d swap slots", slots);
+    return false;
+  }
+  stat_.total_slots = slots;
+  LOG_INFO("Swapping guest RAM out to %d KB of disk", slots * PAGE_SIZE / 1024);
+  return true;
+}
+
+uint64_t PageSwap::GetFreePages() const {
+  const auto& stat = umm_get_stat();
+  return stat.total_pages - stat.used_pages;
+}
+
+size_t PageSwap::CollectColdPages(Victim* victims,
+                                  size_t max,
+                                  uint64_t* budget) {
+  auto& sched = Sched::Get();
+  size_t count = 0;
+  bool aged = false;
+  while (count < max && *budget) {
+    (*budget)--;
+    if (cursor_pid_ >= sched.GetTaskCount()) {
+      cursor_pid_ = 0;
+      cursor_ipa_ = 0;
+      continue;
+    }
+
+    auto* tsk = sched.GetTask(cursor_pid_);
+    bool shared = false;
+    ipa_t ipa = cursor_ipa_;
+    const pa_t page =
+        tsk->state == RUNNING ? PgTableStage2::FindNextRamPage(tsk, &ipa,
+                                                               &shared)
+                              : 0;
+    if (!page) {
+      cursor_pid_++;
+      cursor_ipa_ = 0;
+      continue;
+    }
+    cursor_ipa_ = ipa + PAGE_SIZE;
+    stat_.pages_scanned++;
+
+    // Shared pages stay resident. They are read-only, and swapping them
+    // out would save nothing until every VM using them does.
+    if (shared || umm_page_refs(reinterpret_cast<void*>(page)) != 1) {
+      continue;
+    }
+    if (PgTableStage2::TestAndClearAccessFlag(tsk, ipa)) {
+      aged = true;
+      continue;
+    }
+    victims[count++] = {.tsk = tsk, .ipa = ipa, .page = page};
+  }
+
+  // Cached translations would hide the next access otherwise.
+  if (aged) {
+    PgTableStage2::FlushTlbAll();
+  }
+  return count;
+}
+
+bool PageSwap::SwapOut(const Victim* victims, size_t count) {
+  uint64_t slots[kBatchPages];
+  size_t allocated = 0;
+  for (; allocated < std::min(count, kBatchPages); allocated++) {
+    if (!AllocSlot(&slots[allocated])) {
+      LOG_ERROR("Swap area is full");
+      stat_.failures++;
+      break;
+    }
+  }
+  if (!allocated) {
+    return false;
+  }
+
+  // The pages leave the stage-2 tables before they are written, pinned
+  // behind their swap entries, so that no VM writes, merges or releases
+  // them while this task sleeps on the disk.
+  for (size_t i = 0; i < allocated; i++) {
+    PgTableStage2::ReplaceWithSwapEntry(victims[i].tsk, victims[i].ipa,
+                                        slots[i]);
+  }
+  PgTableStage2::FlushTlbAll();
+
+  // Write each run of consecutive slots in one transfer.
+  size_t done = 0;
+  while (done < allocated) {
+    void* pages[kBatchPages];
+    size_t run = 0;
+    do {
+      pages[run] = reinterpret_cast<void*>(victims[done + run].page);
+      run++;
+    } while (done + run < allocated &&
+             slots[done + run] == slots[done] + run);
+    const uint64_t lba = area_lba_ + slots[done] * kDiskAreaSectorsPerPage;
+    if (!DiskAreaTransferPages(lba, pages, run, true, true)) {
+      break;
+    }
+    done += run;
+  }
+
+  for (size_t i = 0; i < allocated; i++) {
+    const auto& victim = victims[i];
+    if (i < done) {
+      PgTableStage2::UnpinSwapEntry(victim.tsk, victim.ipa);
+      umm_page_put(reinterpret_cast<void*>(victim.page));
+    } else {
+      // Not written. The page goes back where it was.
+      PgTableStage2::MapNewPage(victim.tsk, victim.ipa, victim.page);
+      victim.tsk->mm.swapped_pages--;
+      PutSlot(slots[i]);
+    }
+  }
+  if (!done) {
+    return false;
+  }
+  stat_.swap_outs += done;
+  stat_.batches++;
+  return done == count;
+}
+
+size_t PageSwap::SwapIn(Tcb* tsk, ipa_t ipa, uint64_t slot, size_t count) {
+  void* pages[1 + kReadAheadPages];
+  size_t n = 0;
+  for (; n < std::min(count, std::size(pages)); n++) {
+    pages[n] = PgTableStage1::PageAllocate(tsk);
+    if (!pages[n]) {
+      break;
+    }
+  }
+  // The pages are mapped only once read, and the swap entries are changed by
+  // no VM but |tsk|, so other vCPUs may run meanwhile.
+  if (n && !DiskAreaTransferPages(area_lba_ + slot * kDiskAreaSectorsPerPage,
+                                  pages, n, false, true)) {
+    for (size_t i = 0; i < n; i++) {
+      umm_free(pages[i]);
+    }
+    return 0;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    Arm64SyncICacheRange(pages[i], PAGE_SIZE);
+    PgTableStage2::MapNewPage(tsk, ipa + i * PAGE_SIZE,
+                              reinterpret_cast<va_t>(pages[i]));
+    tsk->mm.swapped_pages--;
+    PutSlot(slot + i);
+  }
+  stat_.swap_ins += n;
+  return n;
+}
+
+bool PageSwap::AllocSlot(uint64_t* slot) {
+  // Go on from the last slot, so that a batch lands on consecutive slots.
+  for (uint64_t n = 0; n < stat_.total_slots; n++) {
+    const uint64_t cur = (next_slot_ + n) % stat_.total_slots;
+    if (!slot_refs_[cur]) {
+      next_slot_ = cur + 1;
+      GetSlot(cur);
+      *slot = cur;
+      return true;
+    }
+  }
+  return false;
+}
+
+}  // namespace evisor
@@ -0,0 +1,103 @@
+#ifndef EVISOR_MM_PAGE_SWAP_H_
+#define EVISOR_MM_PAGE_SWAP_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+#include "kernel/task/task.h"
+#include "mm/pgtable.h"
+
+namespace evisor {
+
+// Guest RAM overcommit with swap to the boot disk.
+//
+// When the user region runs low on free pages, a clock hand walks the
+// stage-2 tables of every VM. The access flag of each private RAM page is
+// cleared on the first pass, and pages still not accessed on the next pass
+// are cold. Cold pages are written to the swap area in batches, and their
+// stage-2 entries are replaced with invalid entries holding the swap slot.
+// The next access to such a page faults, and the page is read back together
+// with the following swapped-out pages when the faults are sequential.
+class PageSwap {
+ public:
+  // Reclaim starts when fewer user pages than this are free, and stops when
+  // kHighWatermarkPages are free again.
+  static constexpr uint64_t kLowWatermarkPages = 256;
+  static constexpr uint64_t kHighWatermarkPages = 512;
+  // Pages written to swap at once
+  static constexpr size_t kBatchPages = 16;
+  // Pages read back per fault when faults are sequential
+  static constexpr size_t kReadAheadPages = 8;
+
+  struct Stat {
+    uint64_t total_slots;
+    uint64_t used_slots;
+    uint64_t pages_scanned;
+    uint64_t swap_outs;
+    uint64_t swap_ins;
+    // Pages read back ahead of a fault
+    uint64_t readahead;
+    uint64_t batches;
+    // Reclaims that found no cold page or no free slot
+    uint64_t failures;
+  };
+
+  PageSwap() = default;
+  ~PageSwap() = default;
+
+  // Prevent copying.
+  PageSwap(PageSwap const&) = delete;
+  PageSwap& operator=(PageSwap const&) = delete;
+
+  static PageSwap& Get() noexcept {
+    static PageSwap instance;
+    return instance;
+  }
+
+  // Swap out cold guest pages if the user region is low on free pages.
+  // Called before a guest page is allocated.
+  void Reclaim();
+
+  // Read back the swapped-out page at |ipa|. Returns false if the page is
+  // not swapped out.
+  bool HandleFault(Tcb* tsk, ipa_t ipa);
+
+  // Slot references, one per stage-2 entry recording the slot.
+  void GetSlot(uint64_t slot);
+  void PutSlot(uint64_t slot);
+
+  const Stat& GetStat() const { return stat_; }
+
+ private:
+  struct Victim {
+    Tcb* tsk;
+    ipa_t ipa;
+    pa_t page;
+  };
+
+  bool Init();
+  uint64_t GetFreePages() const;
+  size_t CollectColdPages(Victim* victims, size_t max, uint64_t* budget);
+  // Returns false if not every page could be swapped out.
+  bool SwapOut(const Victim* victims, size_t count);
+  // Read |count| pages from consecutive slots from |slot| on into
+  // consecutive IPAs from |ipa| on. Returns the number of pages read.
+  size_t SwapIn(Tcb* tsk, ipa_t ipa, uint64_t slot, size_t count);
+  bool AllocSlot(uint64_t* slot);
+
+  bool initialized_ = false;
+  // First sector of the swap area
+  uint64_t area_lba_ = 0;
+  // References to each slot. 0 means free.
+  uint16_t* slot_refs_ = nullptr;
+  uint64_t next_slot_ = 0;
+  // Clock hand
+  int cursor_pid_ = 0;
+  ipa_t cursor_ipa_ = 0;
+  Stat stat_ = {};
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_MM_PAGE_SWAP_H_
@@ -5,8 +5,22 @@
 
 // clang-format off
 #define PAGE_SIZE           (1U << CONFIG_MMU_PAGE_SIZE_BITS)
-#define PAGE_MASK           0xfffffffffffff000
+#define PAGE_MASK           (~((1ULL << CONFIG_MMU_PAGE_SIZE_BITS) - 1))
 #define PAGE_SHIFT          CONFIG_MMU_PAGE_SIZE_BITS
+
+/*
+ * Stage-2 translation geometry. The granule is the page size, and the IPA
+ * space is CONFIG_MMU_VA_BITS wide. The walk starts at the level whose
+ * table covers the rest of the IPA bits, so it fits in one page.
+ *  4KB:  3 levels (L1-L3) for 36-bit IPAs, 9 bits per level
+ *  16KB: 2 levels (L2-L3), 11 bits per level
+ *  64KB: 2 levels (L2-L3), 13 bits per level
+ */
+#define STAGE2_TABLE_SHIFT  (PAGE_SHIFT - 3)
+#define STAGE2_LEVELS                                             \
+  ((CONFIG_MMU_VA_BITS - PAGE_SHIFT + STAGE2_TABLE_SHIFT - 1) / \
+   STAGE2_TABLE_SHIFT)
+#define STAGE2_START_LEVEL  (4 - STAGE2_LEVELS)
 // clang-format on
 
 #ifndef __ASSEMBLER__
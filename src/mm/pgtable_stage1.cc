@@ -1,13 +1,43 @@
 #include "mm/pgtable_stage1.h"
 
+#include "common/logger.h"
+#include "mm/page_swap.h"
 #include "mm/pgtable_stage2.h"
 #include "mm/user_heap/umm_malloc.h"
 #include "mm/user_heap/umm_zalloc.h"
 
 namespace evisor {
 
-void* PgTableStage1::PageAllocate() {
-  return reinterpret_cast<void*>(umm_zalloc(PAGE_SIZE));
+void* PgTableStage1::PageAllocate(Tcb* tsk) {
+  if (!CanChargePage(tsk)) {
+    return nullptr;
+  }
+  PageSwap::Get().Reclaim();
+  void* page = umm_zalloc_coloured(tsk->mm.colours);
+  CheckPageColour(tsk, page);
+  return page;
+}
+
+bool PgTableStage1::CanChargePage(Tcb* tsk) {
+  if (tsk->mm.page_quota && tsk->mm.pages >= tsk->mm.page_quota) {
+    if (!tsk->mm.quota_failures++) {
+      LOG_ERROR("%s reached its page quota (%d pages)", tsk->name,
+                tsk->mm.page_quota);
+    }
+    return false;
+  }
+  return true;
+}
+
+void PgTableStage1::CheckPageColour(Tcb* tsk, const void* page) {
+  if (!page || !tsk->mm.colours ||
+      (tsk->mm.colours & (1U << umm_page_colour(page)))) {
+    return;
+  }
+  if (!tsk->mm.colour_fallbacks++) {
+    LOG_ERROR("%s got a page outside its colours %x", tsk->name,
+              tsk->mm.colours);
+  }
 }
 
 void PgTableStage1::PageDeallocate(void* page) {
@@ -15,9 +45,21 @@ void PgTableStage1::PageDeallocate(void* page) {
 }
 
 void* PgTableStage1::PageMap(Tcb* tsk, ipa_t ipa) {
-  auto page = reinterpret_cast<pa_t>(PageAllocate());
+  auto page = reinterpret_cast<pa_t>(PageAllocate(tsk));
+  if (!page) {
+    return nullptr;
+  }
   PgTableStage2::MapPageAccessible(tsk, ipa, page);
   return reinterpret_cast<void*>(page);
 }
 
+void* PgTableStage1::PageMapShared(Tcb* tsk, ipa_t ipa) {
+  auto page = reinterpret_cast<pa_t>(PageAllocate(tsk));
+  if (!page) {
+    return nullptr;
+  }
+  PgTableStage2::MapSharedPage(tsk, ipa, page);
+  return reinterpret_cast<void*>(page);
+}
+
 }  // namespace evisor
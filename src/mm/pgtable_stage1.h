@@ -8,9 +8,20 @@ namespace evisor {
 
 class PgTableStage1 {
  public:
-  static void* PageAllocate();
+  // Allocate a zeroed guest page charged to |tsk|. Returns nullptr when the
+  // task has reached its page quota.
+  static void* PageAllocate(Tcb* tsk);
+  // Whether one more page can be charged to |tsk|. Logs the first time the
+  // task is over its quota.
+  static bool CanChargePage(Tcb* tsk);
+  // Count a page given to |tsk| outside its colours, because none of them
+  // was free. Logs the first one of each task.
+  static void CheckPageColour(Tcb* tsk, const void* page);
   static void PageDeallocate(void* page);
   static void* PageMap(Tcb* tsk, ipa_t ipa);
+  // Same as PageMap, but the page is mapped copy-on-write so that it can be
+  // shared with other VMs later.
+  static void* PageMapShared(Tcb* tsk, ipa_t ipa);
 
  private:
   PgTableStage1() = default;
@@ -1,9 +1,16 @@
 #include "mm/pgtable_stage2.h"
 
+#include "arch/arm64/cache.h"
 #include "arch/arm64/mmu.h"
+#include "common/cstring.h"
 #include "common/logger.h"
 #include "kernel/sched/sched.h"
+#include "mm/heap/kmm_malloc.h"
 #include "mm/heap/kmm_zalloc.h"
+#include "mm/page_swap.h"
+#include "mm/pgtable_stage1.h"
+#include "mm/user_heap/umm_malloc.h"
+#include "mm/user_heap/umm_zalloc.h"
 #include "platforms/platform.h"
 #include "platforms/platform_config.h"
 
@@ -15,6 +22,24 @@ namespace {
 constexpr uint64_t kStage2PteTypePage = 3;
 constexpr uint64_t kStage2PteTypePageTable = 3;
 
+// Output address, bits[47:12]
+constexpr uint64_t kStage2PteAddrMask = 0x0000fffffffff000;
+
+// Reserved for software use, bits[58:55]
+// The page is shared with other VMs and is copied on the first write.
+constexpr uint64_t kStage2PteSwCow = (1ULL << 55);
+// The page is write-protected to log the first write to it.
+constexpr uint64_t kStage2PteSwDirtyLog = (1ULL << 56);
+// Invalid entry of a page swapped out. The output address field holds the
+// swap slot.
+constexpr uint64_t kStage2PteSwSwap = (1ULL << 57);
+// Set with kStage2PteSwSwap while the page is still written to its slot. The
+// hardware ignores every other bit of an invalid entry, so this one is free.
+constexpr uint64_t kStage2PteSwSwapPinned = (1ULL << 54);
+// The copy-on-write page was shared by cloning and is not charged to the
+// VM's quota yet.
+constexpr uint64_t kStage2PteSwUncharged = (1ULL << 58);
+
 // AF, bits[10]
 constexpr uint64_t kStage2PteAf = (1 << 10);
 
@@ -35,11 +60,12 @@ constexpr uint64_t kStage2PteShOuterShareable = (3 << 8);
 // No access from EL1
 constexpr uint64_t kStage2PteS2ApNone = (0 << 6);
 // RO access from EL1
-[[maybe_unused]] constexpr uint64_t kStage2PteS2ApRO = (1 << 6);
+constexpr uint64_t kStage2PteS2ApRO = (1 << 6);
 // WO access from EL1
 [[maybe_unused]] constexpr uint64_t kStage2PteS2ApWO = (2 << 6);
 // R/W Full access from EL1
 constexpr uint64_t kStage2PteS2ApRW = (3 << 6);
+constexpr uint64_t kStage2PteS2ApMask = (3 << 6);
 
 /*
  * MemAttr[3:0] , bits[5:2]
@@ -47,6 +73,7 @@ constexpr uint64_t kStage2PteS2ApRW = (3 << 6);
  */
 // Normal inner write back
 constexpr uint64_t kStage2PteMemAttrWb = (0xf << 2);
+constexpr uint64_t kStage2PteMemAttrMask = (0xf << 2);
 // DEVICE_nGnRnE
 constexpr uint64_t kStage2PteMemAttrDevice_nGnRnE = (0x0 << 2);
 
@@ -55,6 +82,11 @@ constexpr uint64_t kStage2PteDram = kStage2PteTypePage | kStage2PteAf |
                                     kStage2PteShOuterShareable |
                                     kStage2PteS2ApRW | kStage2PteMemAttrWb;
 
+// Stage2 page table entry for DRAM shared copy-on-write
+constexpr uint64_t kStage2PteDramCow =
+    kStage2PteTypePage | kStage2PteAf | kStage2PteShOuterShareable |
+    kStage2PteS2ApRO | kStage2PteMemAttrWb | kStage2PteSwCow;
+
 // Stage2 page table entry for Devie I/O (Not accessible)
 constexpr uint64_t kStage2PteDeviceNotAccessible =
     kStage2PteTypePage | kStage2PteAf | kStage2PteShNonShareable |
@@ -64,16 +96,95 @@ constexpr uint64_t kStage2PteDeviceNotAccessible =
 constexpr uint64_t kStage2PteDeviceAccessible =
     kStage2PteTypePage | kStage2PteAf | kStage2PteShNonShareable |
     kStage2PteS2ApRW | kStage2PteMemAttrDevice_nGnRnE;
+
+inline bool IsDramEntry(uint64_t entry) {
+  return (entry & kStage2PteMemAttrMask) == kStage2PteMemAttrWb;
+}
+
+inline bool IsSwapEntry(uint64_t entry) {
+  return entry & kStage2PteSwSwap;
+}
+
+inline bool IsPinnedSwapEntry(uint64_t entry) {
+  return IsSwapEntry(entry) && (entry & kStage2PteSwSwapPinned);
+}
+
+inline uint64_t GetSwapSlot(uint64_t entry) {
+  return (entry & kStage2PteAddrMask) >> PAGE_SHIFT;
+}
+
+// Clean and invalidate the cache line of a table entry. The caller issues
+// the DSB once all entries are updated.
+inline void CleanEntry(uint64_t* entry) {
+  __asm__ volatile("dc civac, %[addr]" : : [addr] "r"(entry) : "memory");
+}
+
+constexpr uint64_t kEntriesPerTable = 1ULL << STAGE2_TABLE_SHIFT;
+constexpr uint64_t kLastLevel = 3;
+constexpr uint64_t kIpaBits = CONFIG_MMU_VA_BITS;
+
+// Bits of the IPA resolved below |level|.
+constexpr uint64_t LevelShift(uint64_t level) {
+  return PAGE_SHIFT + STAGE2_TABLE_SHIFT * (kLastLevel - level);
+}
+
+inline uint64_t LevelIndex(ipa_t ipa, uint64_t level) {
+  return (ipa >> LevelShift(level)) & (kEntriesPerTable - 1);
+}
+
+static_assert(kIpaBits - LevelShift(STAGE2_START_LEVEL) <= STAGE2_TABLE_SHIFT,
+              "The first stage-2 table must fit in a page");
+
+// Call |fn| with each last-level entry mapping |from| or above, in IPA order,
+// until it returns true. Returns whether it did.
+template <typename Fn>
+bool WalkEntries(uint64_t* table,
+                 uint64_t level,
+                 ipa_t base,
+                 ipa_t from,
+                 Fn& fn) {
+  const uint64_t shift = LevelShift(level);
+  const uint64_t first = from > base ? (from - base) >> shift : 0;
+  for (uint64_t idx = first; idx < kEntriesPerTable; idx++) {
+    if (!table[idx]) {
+      continue;
+    }
+    const ipa_t ipa = base + (idx << shift);
+    if (level == kLastLevel) {
+      if (fn(&table[idx], ipa)) {
+        return true;
+      }
+      continue;
+    }
+    auto* next = reinterpret_cast<uint64_t*>(table[idx] & kStage2PteAddrMask);
+    if (WalkEntries(next, level + 1, ipa, from, fn)) {
+      return true;
+    }
+  }
+  return false;
+}
 }  // namespace
 
 void PgTableStage2::MapPageAccessible(Tcb* task, ipa_t ipa, pa_t page) {
   MapPage(task, ipa, page, kStage2PteDram);
 }
 
+void PgTableStage2::MapSharedPage(Tcb* task, ipa_t ipa, pa_t page) {
+  MapPage(task, ipa, page, kStage2PteDramCow);
+}
+
 void PgTableStage2::MapNewPage(Tcb* tsk, ipa_t ipa, va_t page) {
   auto* pte_addr = MapPage(tsk, ipa & PAGE_MASK, page, kStage2PteDram);
   FlushDCache(pte_addr);
   FlushTlbVMID();
+  MarkDirty(tsk, ipa);
+}
+
+void PgTableStage2::MapNewSharedPage(Tcb* tsk, ipa_t ipa, pa_t page) {
+  auto* pte_addr = MapPage(tsk, ipa & PAGE_MASK, page, kStage2PteDramCow);
+  FlushDCache(pte_addr);
+  FlushTlbVMID();
+  MarkDirty(tsk, ipa);
 }
 
 void PgTableStage2::MapNewDevicePage(Tcb* task,
@@ -81,7 +192,7 @@ void PgTableStage2::MapNewDevicePage(Tcb* task,
                                      pa_t page,
                                      bool accessable) {
   MapPage(
-      task, ipa & PAGE_MASK, page,
+      task, ipa & PAGE_MASK, page & PAGE_MASK,
       accessable ? kStage2PteDeviceAccessible : kStage2PteDeviceNotAccessible);
 }
 
@@ -92,33 +203,404 @@ pa_t PgTableStage2::GetIpa(va_t va) {
   return ipa;
 }
 
-// TODO: refactoring these definies.
-#define TABLE_SHIFT 9
-#define PTRS_PER_TABLE (1 << TABLE_SHIFT)
-#define LV0_SHIFT PAGE_SHIFT + 3 * TABLE_SHIFT
-#define LV1_SHIFT PAGE_SHIFT + 2 * TABLE_SHIFT
-#define LV2_SHIFT PAGE_SHIFT + 1 * TABLE_SHIFT
-#define LV3_SHIFT PAGE_SHIFT
-
 void* PgTableStage2::MapPage(Tcb* task, ipa_t ipa, pa_t page, uint64_t flags) {
   if (!task->mm.page_table) {
-    task->mm.page_table = reinterpret_cast<uint64_t>(kmm_zalloc(PAGE_SIZE));
+    task->mm.page_table = AllocateTable(task);
   }
 
-  pa_t lv1_table = task->mm.page_table;
-  pa_t lv2_table = CreatePageTable(lv1_table, LV1_SHIFT, ipa);
-  pa_t lv3_table = CreatePageTable(lv2_table, LV2_SHIFT, ipa);
+  pa_t table = task->mm.page_table;
+  for (uint64_t level = STAGE2_START_LEVEL; level < kLastLevel; level++) {
+    table = CreatePageTable(task, table, LevelShift(level), ipa);
+  }
 
   task->mm.pages++;
-  return SetPageTableEntry(lv3_table, ipa, page, flags);
+  return SetPageTableEntry(table, ipa, page, flags);
 }
 
-pa_t PgTableStage2::CreatePageTable(va_t table, uint64_t shift, ipa_t ipa) {
+uint64_t* PgTableStage2::GetPageTableEntry(Tcb* task, ipa_t ipa) {
+  if (!task->mm.page_table) {
+    return nullptr;
+  }
+
+  auto* table = reinterpret_cast<uint64_t*>(task->mm.page_table);
+  for (uint64_t level = STAGE2_START_LEVEL; level < kLastLevel; level++) {
+    const uint64_t entry = table[LevelIndex(ipa, level)];
+    if (!entry) {
+      return nullptr;
+    }
+    table = reinterpret_cast<uint64_t*>(entry & kStage2PteAddrMask);
+  }
+
+  auto* pte = &table[LevelIndex(ipa, kLastLevel)];
+  return *pte ? pte : nullptr;
+}
+
+bool PgTableStage2::IsMapped(Tcb* task, ipa_t ipa) {
+  return GetPageTableEntry(task, ipa & PAGE_MASK) != nullptr;
+}
+
+void PgTableStage2::CloneCopyOnWrite(Tcb* dst, Tcb* src) {
+  if (!src->mm.page_table) {
+    return;
+  }
+
+  auto clone = [dst](uint64_t* src_pte, ipa_t ipa) {
+    uint64_t entry = *src_pte;
+    const pa_t pa = entry & kStage2PteAddrMask;
+    if (IsDramEntry(entry)) {
+      // Write-protect the page in both VMs.
+      entry = (entry & ~kStage2PteS2ApMask) | kStage2PteS2ApRO |
+              kStage2PteSwCow;
+      *src_pte = entry;
+      CleanEntry(src_pte);
+      umm_page_get(reinterpret_cast<void*>(pa));
+      // The clone is charged for the page once it copies it.
+      entry |= kStage2PteSwUncharged;
+    }
+    auto* pte = static_cast<uint64_t*>(
+        MapPage(dst, ipa, pa, entry & ~kStage2PteAddrMask));
+    CleanEntry(pte);
+    if (IsDramEntry(entry)) {
+      dst->mm.pages--;
+      dst->mm.shared_pages++;
+    } else if (IsSwapEntry(entry)) {
+      // Both VMs read the page back from the same slot.
+      PageSwap::Get().GetSlot(GetSwapSlot(entry));
+      dst->mm.pages--;
+      dst->mm.swapped_pages++;
+    }
+    return false;
+  };
+  WalkEntries(reinterpret_cast<uint64_t*>(src->mm.page_table),
+              STAGE2_START_LEVEL, 0, 0, clone);
+
+  FlushTlbAll();
+}
+
+bool PgTableStage2::BreakCopyOnWrite(Tcb* tsk, ipa_t ipa) {
+  auto* pte = GetPageTableEntry(tsk, ipa & PAGE_MASK);
+  if (!pte || !(*pte & kStage2PteSwCow)) {
+    return false;
+  }
+
+  // A page shared by cloning is charged once it becomes private.
+  const bool charge = *pte & kStage2PteSwUncharged;
+  if (charge && !PgTableStage1::CanChargePage(tsk)) {
+    return false;
+  }
+
+  auto* page = reinterpret_cast<void*>(*pte & kStage2PteAddrMask);
+  const uint64_t flags =
+      (*pte & ~(kStage2PteAddrMask | kStage2PteS2ApMask | kStage2PteSwCow |
+                kStage2PteSwDirtyLog | kStage2PteSwUncharged)) |
+      kStage2PteS2ApRW;
+
+  // The last user of a shared page takes it over without copying.
+  if (umm_page_refs(page) > 1) {
+    PageSwap::Get().Reclaim();
+    void* copy = umm_malloc_coloured(tsk->mm.colours);
+    PgTableStage1::CheckPageColour(tsk, copy);
+    memcpy(copy, page, PAGE_SIZE);
+    Arm64SyncICacheRange(copy, PAGE_SIZE);
+    umm_page_put(page);
+    page = copy;
+  }
+
+  *pte = reinterpret_cast<pa_t>(page) | flags;
+  FlushDCache(pte);
+  FlushTlbVMID();
+  MarkDirty(tsk, ipa);
+  if (charge) {
+    tsk->mm.shared_pages--;
+    tsk->mm.pages++;
+  }
+  return true;
+}
+
+bool PgTableStage2::IsCopyOnWrite(Tcb* tsk, ipa_t ipa) {
+  const auto* pte = GetPageTableEntry(tsk, ipa & PAGE_MASK);
+  return pte && (*pte & kStage2PteSwCow);
+}
+
+pa_t PgTableStage2::FindNextRamPage(Tcb* task, ipa_t* ipa, bool* shared) {
+  if (!task->mm.page_table || (*ipa >> kIpaBits)) {
+    return 0;
+  }
+
+  pa_t page = 0;
+  auto find = [&](uint64_t* pte, ipa_t cur) {
+    if (!IsDramEntry(*pte)) {
+      return false;
+    }
+    *ipa = cur;
+    *shared = *pte & kStage2PteSwCow;
+    page = *pte & kStage2PteAddrMask;
+    return true;
+  };
+  WalkEntries(reinterpret_cast<uint64_t*>(task->mm.page_table),
+              STAGE2_START_LEVEL, 0, *ipa, find);
+  return page;
+}
+
+void PgTableStage2::ProtectCopyOnWrite(Tcb* task, ipa_t ipa) {
+  auto* pte = GetPageTableEntry(task, ipa);
+  if (!pte) {
+    return;
+  }
+  *pte = (*pte & ~kStage2PteS2ApMask) | kStage2PteS2ApRO | kStage2PteSwCow;
+  CleanEntry(pte);
+}
+
+void PgTableStage2::ReplaceWithSharedPage(Tcb* task, ipa_t ipa, pa_t page) {
+  auto* pte = GetPageTableEntry(task, ipa);
+  if (!pte) {
+    return;
+  }
+  *pte = page | kStage2PteDramCow | (*pte & kStage2PteSwUncharged);
+  CleanEntry(pte);
+}
+
+pa_t PgTableStage2::TranslateIpa(Tcb* task, ipa_t ipa) {
+  const auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  if (!pte || !IsDramEntry(*pte)) {
+    return 0;
+  }
+  return (*pte & kStage2PteAddrMask) | (ipa & ~PAGE_MASK);
+}
+
+pa_t PgTableStage2::UnmapRamPage(Tcb* task, ipa_t ipa) {
+  auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  // The swap code still owns a page being written out.
+  if (pte && IsPinnedSwapEntry(*pte)) {
+    return 0;
+  }
+  if (pte && IsSwapEntry(*pte)) {
+    PageSwap::Get().PutSlot(GetSwapSlot(*pte));
+    *pte = 0;
+    CleanEntry(pte);
+    task->mm.swapped_pages--;
+    return 0;
+  }
+  if (!pte || !IsDramEntry(*pte)) {
+    return 0;
+  }
+  const pa_t page = *pte & kStage2PteAddrMask;
+  if (*pte & kStage2PteSwUncharged) {
+    task->mm.shared_pages--;
+  } else {
+    task->mm.pages--;
+  }
+  *pte = 0;
+  CleanEntry(pte);
+  MarkDirty(task, ipa);
+  return page;
+}
+
+bool PgTableStage2::EnableDirtyLog(Tcb* task, ipa_t ipa, size_t size) {
+  if (task->mm.dirty_bitmap) {
+    return false;
+  }
+
+  const uint64_t pages = __builtin_align_up(size, PAGE_SIZE) / PAGE_SIZE;
+  const size_t bytes =
+      __builtin_align_up(pages, kDirtyLogBitsPerWord) / kDirtyLogBitsPerWord *
+      sizeof(uint64_t);
+  auto* bitmap = static_cast<uint64_t*>(kmm_zalloc(bytes));
+  if (!bitmap) {
+    return false;
+  }
+
+  task->mm.dirty_bitmap = bitmap;
+  task->mm.dirty_log_ipa = ipa & PAGE_MASK;
+  task->mm.dirty_log_pages = pages;
+
+  const ipa_t end = task->mm.dirty_log_ipa + pages * PAGE_SIZE;
+  ipa_t cur = task->mm.dirty_log_ipa;
+  bool shared = false;
+  while (FindNextRamPage(task, &cur, &shared) && cur < end) {
+    if (!shared) {
+      WriteProtectForDirtyLog(GetPageTableEntry(task, cur));
+    }
+    cur += PAGE_SIZE;
+  }
+  FlushTlbAll();
+  return true;
+}
+
+void PgTableStage2::DisableDirtyLog(Tcb* task) {
+  if (!task->mm.dirty_bitmap) {
+    return;
+  }
+
+  const ipa_t end =
+      task->mm.dirty_log_ipa + task->mm.dirty_log_pages * PAGE_SIZE;
+  ipa_t cur = task->mm.dirty_log_ipa;
+  bool shared = false;
+  while (FindNextRamPage(task, &cur, &shared) && cur < end) {
+    auto* pte = GetPageTableEntry(task, cur);
+    if (*pte & kStage2PteSwDirtyLog) {
+      *pte = (*pte & ~(kStage2PteS2ApMask | kStage2PteSwDirtyLog)) |
+             kStage2PteS2ApRW;
+      CleanEntry(pte);
+    }
+    cur += PAGE_SIZE;
+  }
+  FlushTlbAll();
+
+  kmm_free(task->mm.dirty_bitmap);
+  task->mm.dirty_bitmap = nullptr;
+  task->mm.dirty_log_ipa = 0;
+  task->mm.dirty_log_pages = 0;
+}
+
+size_t PgTableStage2::HarvestDirtyLog(Tcb* task, uint64_t* bitmap) {
+  auto* dirty = task->mm.dirty_bitmap;
+  if (!dirty) {
+    return 0;
+  }
+
+  size_t count = 0;
+  const size_t words =
+      __builtin_align_up(task->mm.dirty_log_pages, kDirtyLogBitsPerWord) /
+      kDirtyLogBitsPerWord;
+  for (size_t i = 0; i < words; i++) {
+    // Clear the word before write-protecting its pages, so that no write
+    // after the harvest goes unlogged.
+    uint64_t bits = __atomic_exchange_n(&dirty[i], 0, __ATOMIC_ACQ_REL);
+    if (bitmap) {
+      bitmap[i] = bits;
+    }
+    count += __builtin_popcountll(bits);
+
+    while (bits) {
+      const size_t bit = __builtin_ctzll(bits);
+      bits &= bits - 1;
+      const ipa_t ipa = task->mm.dirty_log_ipa +
+                        (i * kDirtyLogBitsPerWord + bit) * PAGE_SIZE;
+      WriteProtectForDirtyLog(GetPageTableEntry(task, ipa));
+    }
+  }
+  if (count) {
+    FlushTlbAll();
+  }
+  return count;
+}
+
+bool PgTableStage2::HandleDirtyLogFault(Tcb* task, ipa_t ipa) {
+  auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  // Pages shared copy-on-write are logged once they are copied.
+  if (!pte || !(*pte & kStage2PteSwDirtyLog) || (*pte & kStage2PteSwCow)) {
+    return false;
+  }
+
+  *pte = (*pte & ~(kStage2PteS2ApMask | kStage2PteSwDirtyLog)) |
+         kStage2PteS2ApRW;
+  FlushDCache(pte);
+  FlushTlbVMID();
+  MarkDirty(task, ipa);
+  return true;
+}
+
+bool PgTableStage2::TestAndClearAccessFlag(Tcb* task, ipa_t ipa) {
+  auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  if (!pte || !IsDramEntry(*pte) || !(*pte & kStage2PteAf)) {
+    return false;
+  }
+  *pte &= ~kStage2PteAf;
+  CleanEntry(pte);
+  return true;
+}
+
+bool PgTableStage2::HandleAccessFlagFault(Tcb* task, ipa_t ipa) {
+  auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  if (!pte || IsSwapEntry(*pte) || (*pte & kStage2PteAf)) {
+    return false;
+  }
+  *pte |= kStage2PteAf;
+  FlushDCache(pte);
+  return true;
+}
+
+void PgTableStage2::ReplaceWithSwapEntry(Tcb* task, ipa_t ipa, uint64_t slot) {
+  auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  if (!pte) {
+    return;
+  }
+  if (*pte & kStage2PteSwUncharged) {
+    task->mm.shared_pages--;
+  } else {
+    task->mm.pages--;
+  }
+  *pte = (slot << PAGE_SHIFT) | kStage2PteSwSwap | kStage2PteSwSwapPinned;
+  CleanEntry(pte);
+  task->mm.swapped_pages++;
+}
+
+void PgTableStage2::UnpinSwapEntry(Tcb* task, ipa_t ipa) {
+  auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  if (!pte || !IsPinnedSwapEntry(*pte)) {
+    return;
+  }
+  *pte &= ~kStage2PteSwSwapPinned;
+  CleanEntry(pte);
+}
+
+bool PgTableStage2::IsSwapEntryPinned(Tcb* task, ipa_t ipa) {
+  const auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  return pte && IsPinnedSwapEntry(*pte);
+}
+
+bool PgTableStage2::GetSwapEntry(Tcb* task, ipa_t ipa, uint64_t* slot) {
+  const auto* pte = GetPageTableEntry(task, ipa & PAGE_MASK);
+  if (!pte || !IsSwapEntry(*pte) || IsPinnedSwapEntry(*pte)) {
+    return false;
+  }
+  *slot = GetSwapSlot(*pte);
+  return true;
+}
+
+void PgTableStage2::MarkDirty(Tcb* task, ipa_t ipa) {
+  auto* dirty = task->mm.dirty_bitmap;
+  if (!dirty || ipa < task->mm.dirty_log_ipa) {
+    return;
+  }
+  const uint64_t idx = (ipa - task->mm.dirty_log_ipa) / PAGE_SIZE;
+  if (idx < task->mm.dirty_log_pages) {
+    __atomic_fetch_or(&dirty[idx / kDirtyLogBitsPerWord],
+                      1ULL << (idx % kDirtyLogBitsPerWord), __ATOMIC_RELEASE);
+  }
+}
+
+void PgTableStage2::WriteProtectForDirtyLog(uint64_t* pte) {
+  if (!pte || !IsDramEntry(*pte) ||
+      (*pte & kStage2PteS2ApMask) != kStage2PteS2ApRW) {
+    return;
+  }
+  *pte = (*pte & ~kStage2PteS2ApMask) | kStage2PteS2ApRO |
+         kStage2PteSwDirtyLog;
+  CleanEntry(pte);
+}
+
+va_t PgTableStage2::AllocateTable(Tcb* task) {
+  // Table walks go through the cache too, so coloured VMs keep their tables
+  // in their own colours.
+  if (task->mm.colours) {
+    void* table = umm_zalloc_coloured(task->mm.colours);
+    PgTableStage1::CheckPageColour(task, table);
+    return reinterpret_cast<va_t>(table);
+  }
+  return reinterpret_cast<va_t>(kmm_zalloc(PAGE_SIZE));
+}
+
+pa_t PgTableStage2::CreatePageTable(Tcb* task,
+                                    va_t table,
+                                    uint64_t shift,
+                                    ipa_t ipa) {
   uint64_t index = ipa >> shift;
-  index = index & (PTRS_PER_TABLE - 1);
+  index = index & (kEntriesPerTable - 1);
 
   if (!reinterpret_cast<uint64_t*>(table)[index]) {
-    auto next_level_table = reinterpret_cast<va_t>(kmm_zalloc(PAGE_SIZE));
+    auto next_level_table = AllocateTable(task);
     uint64_t entry = next_level_table | kStage2PteTypePageTable;
 
     reinterpret_cast<uint64_t*>(table)[index] = entry;
@@ -135,7 +617,7 @@ void* PgTableStage2::SetPageTableEntry(va_t pte,
                                        pa_t pa,
                                        uint64_t flags) {
   uint64_t index = ipa >> PAGE_SHIFT;
-  index = index & (PTRS_PER_TABLE - 1);
+  index = index & (kEntriesPerTable - 1);
 
   uint64_t entry = pa | flags;
   reinterpret_cast<uint64_t*>(pte)[index] = entry;
@@ -162,4 +644,13 @@ void PgTableStage2::FlushTlbVMID() {
   WRITE_CPU_REG(vttbr_el2, static_cast<uint64_t>(0));
 }
 
+// TODO: move this coude to arch/arm64 directory
+void PgTableStage2::FlushTlbAll() {
+  __asm__ volatile(
+      "dsb ish\n"
+      "tlbi alle1is\n"
+      "dsb ish\n"
+      "isb");
+}
+
 }  // namespace evisor
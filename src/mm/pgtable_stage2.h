@@ -10,20 +10,100 @@ namespace evisor {
 class PgTableStage2 {
  public:
   static void MapPageAccessible(Tcb* task, ipa_t ipa, pa_t page);
+  // Map a guest RAM page read-only and copy it on the first write. The
+  // caller holds a page reference on behalf of |task|.
+  static void MapSharedPage(Tcb* task, ipa_t ipa, pa_t page);
   static void MapNewPage(Tcb* tsk, ipa_t ipa, va_t page);
+  // MapSharedPage() for a fault handler. Flushes the entry and the TLB.
+  static void MapNewSharedPage(Tcb* tsk, ipa_t ipa, pa_t page);
   static void MapNewDevicePage(Tcb* task,
                                ipa_t ipa,
                                pa_t page,
                                bool accessable);
   static pa_t GetIpa(va_t va);
 
+  // Share every guest RAM page of |src| with |dst| copy-on-write, and copy
+  // the device mappings as they are. |src| must hold no pinned swap entry.
+  static void CloneCopyOnWrite(Tcb* dst, Tcb* src);
+  // Give |tsk| a private, writable copy of the copy-on-write page at |ipa|.
+  // Pages shared by cloning are charged to |tsk| then. Returns false if
+  // |ipa| is not mapped copy-on-write, or if |tsk| is at its page quota.
+  static bool BreakCopyOnWrite(Tcb* tsk, ipa_t ipa);
+  static bool IsCopyOnWrite(Tcb* tsk, ipa_t ipa);
+
+  // Whether anything is mapped at |ipa|.
+  static bool IsMapped(Tcb* task, ipa_t ipa);
+
+  // Find the first guest RAM page mapped at or above |*ipa|. Updates |*ipa|
+  // and returns the page, or returns 0 if there is none. |shared| tells
+  // whether the page is mapped copy-on-write.
+  static pa_t FindNextRamPage(Tcb* task, ipa_t* ipa, bool* shared);
+  // Write-protect the RAM page at |ipa| so that it can be shared.
+  // The caller flushes the TLB afterwards.
+  static void ProtectCopyOnWrite(Tcb* task, ipa_t ipa);
+  // Map |page| copy-on-write at |ipa| in place of the current RAM page. The
+  // caller moves page references and flushes the TLB afterwards.
+  static void ReplaceWithSharedPage(Tcb* task, ipa_t ipa, pa_t page);
+
+  // Translate |ipa| in a guest RAM page to a hypervisor address. Returns 0 if
+  // no RAM is mapped there.
+  static pa_t TranslateIpa(Tcb* task, ipa_t ipa);
+  // Remove the RAM page mapped at |ipa| and return it, or 0 if there is none.
+  // A pinned swap entry is left alone. The caller drops the page reference
+  // and flushes the TLB afterwards.
+  static pa_t UnmapRamPage(Tcb* task, ipa_t ipa);
+
+  // Dirty page logging. Writable guest RAM in [ipa, ipa + size) is
+  // write-protected, and the first write to each page sets its bit in the
+  // VM's dirty bitmap. Pages mapped or copied while logging are dirty too.
+  static constexpr size_t kDirtyLogBitsPerWord = 64;
+  static bool EnableDirtyLog(Tcb* task, ipa_t ipa, size_t size);
+  static void DisableDirtyLog(Tcb* task);
+  // Move the dirty bitmap to |bitmap| (may be nullptr) and write-protect the
+  // dirty pages again. Returns the number of dirty pages.
+  static size_t HarvestDirtyLog(Tcb* task, uint64_t* bitmap);
+  // Log a write to a page write-protected for dirty logging and make it
+  // writable. Returns false if the page is not.
+  static bool HandleDirtyLogFault(Tcb* task, ipa_t ipa);
+  // Log a write to |ipa| made by the hypervisor on behalf of the guest.
+  static void MarkDirty(Tcb* task, ipa_t ipa);
+
+  // Access flag aging for swap. Returns whether the private RAM page at |ipa|
+  // was accessed since the last call, and clears its access flag. The caller
+  // flushes the TLB afterwards.
+  static bool TestAndClearAccessFlag(Tcb* task, ipa_t ipa);
+  // Set the access flag of the page at |ipa| on its first access after
+  // aging. Returns false if the flag is already set.
+  static bool HandleAccessFlagFault(Tcb* task, ipa_t ipa);
+  // Replace the RAM page at |ipa| with an invalid entry recording the swap
+  // |slot| for its contents. The entry is pinned until UnpinSwapEntry(), so
+  // that the page can be written to the slot while other VMs run: accesses
+  // to it wait, and it is neither read back nor released. The caller flushes
+  // the TLB before the write, and drops the page reference after it.
+  static void ReplaceWithSwapEntry(Tcb* task, ipa_t ipa, uint64_t slot);
+  static void UnpinSwapEntry(Tcb* task, ipa_t ipa);
+  static bool IsSwapEntryPinned(Tcb* task, ipa_t ipa);
+  // Get the swap slot recorded at |ipa|. Returns false if the page there is
+  // not swapped out, or if its entry is still pinned.
+  static bool GetSwapEntry(Tcb* task, ipa_t ipa, uint64_t* slot);
+
+  // Flush stage-2 TLB entries of all VMs.
+  static void FlushTlbAll();
+
  private:
   PgTableStage2() = default;
   ~PgTableStage2() = default;
 
   static void* MapPage(Tcb* task, ipa_t ipa, pa_t page, uint64_t flags);
-  static pa_t CreatePageTable(va_t table, uint64_t shift, ipa_t ipa);
+  static va_t AllocateTable(Tcb* task);
+  static pa_t CreatePageTable(Tcb* task,
+                              va_t table,
+                              uint64_t shift,
+                              ipa_t ipa);
   static void* SetPageTableEntry(va_t pte, ipa_t ipa, pa_t pa, uint64_t flags);
+  // Get the last level entry for |ipa| without allocating tables.
+  static uint64_t* GetPageTableEntry(Tcb* task, ipa_t ipa);
+  static void WriteProtectForDirtyLog(uint64_t* pte);
 
   // Flush D-Cache
   static void FlushDCache(void* start);
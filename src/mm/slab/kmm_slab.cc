@@ -0,0 +1,271 @@
+#include "mm/slab/kmm_slab.h"
+
+#include <cstdbool>
+#include <cstdint>
+
+#include "arch/arm64/irq/cpu_irq.h"
+#include "arch/ld_symbols.h"
+#include "common/cstdio.h"
+#include "mm/heap/kmm_malloc.h"
+#include "mm/pgtable.h"
+
+namespace evisor {
+
+namespace {
+
+// Size classes: 16, 32, ..., 2048 bytes
+constexpr size_t kSlabMinObjectShift = 4;
+constexpr size_t kSlabMaxObjectShift = 11;
+constexpr size_t kSlabCacheNums = kSlabMaxObjectShift - kSlabMinObjectShift + 1;
+constexpr size_t kSlabMaxObjectSize = 1UL << kSlabMaxObjectShift;
+
+// A slab is made big enough to hold at least this many objects.
+constexpr uint32_t kSlabMinObjects = 8;
+// Objects are aligned to the default operator new alignment.
+constexpr size_t kSlabObjectAlign = 16;
+
+struct SlabCache;
+
+// Slab header placed at the top of the first page of each slab.
+struct Slab {
+  SlabCache* cache;
+  Slab* prev;
+  Slab* next;
+  // Free objects, linked through their first word.
+  void* free_objs;
+  uint32_t in_use;
+};
+
+struct SlabCache {
+  size_t object_size;
+  size_t slab_pages;
+  uint32_t objs_per_slab;
+
+  // Slabs which have both used and free objects.
+  Slab* partial;
+  // Slabs without any free object.
+  Slab* full;
+  // One completely free slab is kept to avoid thrashing the page allocator.
+  Slab* empty;
+
+  // Statistics
+  size_t slabs;
+  size_t objs_in_use;
+  uint64_t allocs;
+  uint64_t frees;
+};
+
+SlabCache slabCaches_[kSlabCacheNums];
+
+/*
+ * Reverse map from a heap page to its slab.
+ *  0: the page does not belong to a slab
+ *  n: the page is the (n - 1)th page of a slab
+ */
+uint8_t slabPageMap_[kKmmHeapMaxPages] = {0};
+
+inline size_t SlabHeaderSize() {
+  return __builtin_align_up(sizeof(Slab), kSlabObjectAlign);
+}
+
+void SlabCachesInit() {
+  static bool initialized = false;
+  if (initialized) {
+    return;
+  }
+
+  for (size_t i = 0; i < kSlabCacheNums; i++) {
+    auto& cache = slabCaches_[i];
+    cache = {};
+    cache.object_size = 1UL << (kSlabMinObjectShift + i);
+    cache.slab_pages = 1;
+    while ((cache.slab_pages * PAGE_SIZE - SlabHeaderSize()) /
+               cache.object_size <
+           kSlabMinObjects) {
+      cache.slab_pages <<= 1;
+    }
+    cache.objs_per_slab =
+        (cache.slab_pages * PAGE_SIZE - SlabHeaderSize()) / cache.object_size;
+  }
+  initialized = true;
+}
+
+inline size_t SizeToCacheIndex(size_t size) {
+  size_t shift = kSlabMinObjectShift;
+  while ((1UL << shift) < size) {
+    shift++;
+  }
+  return shift - kSlabMinObjectShift;
+}
+
+inline size_t HeapPageIndex(const void* va) {
+  return (reinterpret_cast<uint64_t>(va) - kHeapStart) / PAGE_SIZE;
+}
+
+// Returns the slab that owns |va| or nullptr if |va| is not a slab object.
+Slab* SlabFromObject(const void* va) {
+  const auto va_addr = reinterpret_cast<uint64_t>(va);
+  if (va_addr < kHeapStart || va_addr >= kHeapEnd) {
+    return nullptr;
+  }
+  const auto idx = HeapPageIndex(va);
+  if (idx >= kKmmHeapMaxPages || slabPageMap_[idx] == 0) {
+    return nullptr;
+  }
+  const auto page_offset = (slabPageMap_[idx] - 1) * PAGE_SIZE;
+  return reinterpret_cast<Slab*>((va_addr & PAGE_MASK) - page_offset);
+}
+
+void SlabListPush(Slab** list, Slab* slab) {
+  slab->prev = nullptr;
+  slab->next = *list;
+  if (*list) {
+    (*list)->prev = slab;
+  }
+  *list = slab;
+}
+
+void SlabListRemove(Slab** list, Slab* slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    *list = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->prev = nullptr;
+  slab->next = nullptr;
+}
+
+Slab* SlabCreate(SlabCache* cache) {
+  auto* slab = static_cast<Slab*>(kmm_malloc(cache->slab_pages * PAGE_SIZE));
+  if (!slab) {
+    return nullptr;
+  }
+
+  const auto idx = HeapPageIndex(slab);
+  for (size_t i = 0; i < cache->slab_pages; i++) {
+    slabPageMap_[idx + i] = i + 1;
+  }
+
+  slab->cache = cache;
+  slab->prev = nullptr;
+  slab->next = nullptr;
+  slab->in_use = 0;
+  slab->free_objs = nullptr;
+
+  // Build the free list so that objects are handed out in address order.
+  auto* objs = reinterpret_cast<uint8_t*>(slab) + SlabHeaderSize();
+  for (uint32_t i = cache->objs_per_slab; i > 0; i--) {
+    auto* obj = objs + (i - 1) * cache->object_size;
+    *reinterpret_cast<void**>(obj) = slab->free_objs;
+    slab->free_objs = obj;
+  }
+
+  cache->slabs++;
+  return slab;
+}
+
+void SlabDestroy(SlabCache* cache, Slab* slab) {
+  const auto idx = HeapPageIndex(slab);
+  for (size_t i = 0; i < cache->slab_pages; i++) {
+    slabPageMap_[idx + i] = 0;
+  }
+  kmm_free(slab);
+  cache->slabs--;
+}
+
+void* SlabAllocObject(SlabCache* cache) {
+  Slab* slab = cache->partial;
+  if (!slab) {
+    if (cache->empty) {
+      slab = cache->empty;
+      cache->empty = nullptr;
+    } else {
+      slab = SlabCreate(cache);
+      if (!slab) {
+        return nullptr;
+      }
+    }
+    SlabListPush(&cache->partial, slab);
+  }
+
+  void* obj = slab->free_objs;
+  slab->free_objs = *static_cast<void**>(obj);
+  slab->in_use++;
+  cache->objs_in_use++;
+
+  if (slab->in_use == cache->objs_per_slab) {
+    SlabListRemove(&cache->partial, slab);
+    SlabListPush(&cache->full, slab);
+  }
+  return obj;
+}
+
+void SlabFreeObject(Slab* slab, void* obj) {
+  auto* cache = slab->cache;
+
+  if (slab->in_use == cache->objs_per_slab) {
+    SlabListRemove(&cache->full, slab);
+    SlabListPush(&cache->partial, slab);
+  }
+
+  *static_cast<void**>(obj) = slab->free_objs;
+  slab->free_objs = obj;
+  slab->in_use--;
+  cache->objs_in_use--;
+
+  if (slab->in_use == 0) {
+    SlabListRemove(&cache->partial, slab);
+    if (!cache->empty) {
+      cache->empty = slab;
+    } else {
+      SlabDestroy(cache, slab);
+    }
+  }
+}
+
+}  // namespace
+
+void* kmm_slab_alloc(size_t size) {
+  if (size > kSlabMaxObjectSize) {
+    return kmm_malloc(size);
+  }
+
+  // The caches are also used from IRQ handlers, e.g. virtio completions.
+  IrqSaveGuard guard;
+  SlabCachesInit();
+  auto* cache = &slabCaches_[SizeToCacheIndex(size)];
+  cache->allocs++;
+  return SlabAllocObject(cache);
+}
+
+void kmm_slab_free(void* va) {
+  if (!va) {
+    return;
+  }
+
+  IrqSaveGuard guard;
+  auto* slab = SlabFromObject(va);
+  if (!slab) {
+    kmm_free(va);
+    return;
+  }
+  slab->cache->frees++;
+  SlabFreeObject(slab, va);
+}
+
+void kmm_slab_print_stat() {
+  SlabCachesInit();
+
+  printf("\n%10s %6s %6s %9s %9s %9s %9s\n", "SLAB", "PAGES", "SLABS",
+         "OBJS", "INUSE", "ALLOCS", "FREES");
+  for (auto& cache : slabCaches_) {
+    printf("%10d %6d %6d %9d %9d %9d %9d\n", cache.object_size,
+           cache.slab_pages, cache.slabs, cache.slabs * cache.objs_per_slab,
+           cache.objs_in_use, cache.allocs, cache.frees);
+  }
+}
+
+}  // namespace evisor
@@ -0,0 +1,18 @@
+#ifndef EVISOR_MM_SLAB_KMM_SLAB_H_
+#define EVISOR_MM_SLAB_KMM_SLAB_H_
+
+#include <cstddef>
+
+namespace evisor {
+
+// Allocate a small kernel object from the size-class slab caches (16 B to
+// 2 KiB). Bigger requests are passed through to kmm_malloc.
+void* kmm_slab_alloc(size_t size);
+// Free memory returned by kmm_slab_alloc.
+void kmm_slab_free(void* va);
+// Print usage statistics of each slab cache.
+void kmm_slab_print_stat();
+
+}  // namespace evisor
+
+#endif  // EVISOR_MM_SLAB_KMM_SLAB_H_
@@ -1,28 +1,91 @@
 #include "mm/uncached/kmm_uncached_malloc.h"
 
 #include <cstdbool>
+#include <cstdint>
 
 #include "arch/ld_symbols.h"
 #include "common/assert.h"
 #include "common/logger.h"
-#include "mm/mm_local.h"
+#include "mm/buddy_allocator.h"
 #include "mm/pgtable.h"
 
 namespace evisor {
 
 namespace {
 
-// TODO: use `kUserSize` variable
-const size_t kRegionPageNums = static_cast<size_t>(1) * 1024 * 1024 / PAGE_SIZE;
-PageBlock kernelUncachedMemoryRegionMap_[kRegionPageNums] = {};
+// 1MiB uncached region. See .uncached section in
+// src/arch/arm64/scripts/*/linker.ld
+constexpr size_t kRegionPageNums =
+    static_cast<size_t>(1) * 1024 * 1024 / PAGE_SIZE;
+uint8_t kernelUncachedPageInfo[kRegionPageNums] = {0};
 
-bool kmm_is_spaces_available(size_t start, size_t num_pages) {
-  for (size_t i = 0; i < num_pages; i++) {
-    if (kernelUncachedMemoryRegionMap_[start + i].ref_count != 0) {
-      return false;
-    }
+// One-page DMA bounce buffers are served from a small fixed pool so that the
+// hot sector read path never touches the buddy lists. The pool is sized in
+// bytes, so that larger pages leave the rest of the region to the buddy
+// allocator: 16 pages of 4 KiB, 4 of 16 KiB, or a single 64 KiB page.
+constexpr size_t kDmaPoolSize = 64 * 1024;
+constexpr size_t kDmaPoolPages =
+    kDmaPoolSize > PAGE_SIZE ? kDmaPoolSize / PAGE_SIZE : 1;
+constexpr uint8_t kDmaPoolOrder = __builtin_ctzl(kDmaPoolPages);
+static_assert((1UL << kDmaPoolOrder) == kDmaPoolPages);
+static_assert(kDmaPoolPages <= 32, "Pool bitmap is a single 32-bit word");
+static_assert(kDmaPoolPages <= kRegionPageNums / 4,
+              "Pool takes at most a quarter of the region");
+
+struct DmaPool {
+  uint64_t base;
+  // 1: the page is free
+  uint32_t free_map;
+};
+
+BuddyAllocator uncachedRegion_;
+DmaPool dmaPool_ = {};
+KmmUncachedPoolStat poolStat_ = {};
+
+void UncachedInit() {
+  static bool initialized = false;
+  if (initialized) {
+    return;
+  }
+
+  const size_t pages = kUncachedSize / PAGE_SIZE;
+  uncachedRegion_.Init(kUncachedStart,
+                       pages < kRegionPageNums ? pages : kRegionPageNums,
+                       kernelUncachedPageInfo);
+
+  dmaPool_.base =
+      reinterpret_cast<uint64_t>(uncachedRegion_.AllocateOrder(kDmaPoolOrder));
+  if (dmaPool_.base) {
+    dmaPool_.free_map = static_cast<uint32_t>((1ULL << kDmaPoolPages) - 1);
+    poolStat_.pages = kDmaPoolPages;
+    poolStat_.free_pages = kDmaPoolPages;
+  }
+  initialized = true;
+}
+
+inline bool IsDmaPoolPage(uint64_t addr) {
+  return dmaPool_.base && addr >= dmaPool_.base &&
+         addr < dmaPool_.base + kDmaPoolPages * PAGE_SIZE;
+}
+
+void* DmaPoolAllocate() {
+  if (!dmaPool_.free_map) {
+    return nullptr;
+  }
+  const auto idx = __builtin_ctz(dmaPool_.free_map);
+  dmaPool_.free_map &= ~(1U << idx);
+  poolStat_.free_pages--;
+  return reinterpret_cast<void*>(dmaPool_.base + idx * PAGE_SIZE);
+}
+
+void DmaPoolFree(uint64_t addr) {
+  const auto idx = (addr - dmaPool_.base) / PAGE_SIZE;
+  // Kept in release builds: a double free would hand one page out twice.
+  if (dmaPool_.free_map & (1U << idx)) {
+    PANIC("Double free in the DMA pool: addr = %lx", addr);
   }
-  return true;
+  dmaPool_.free_map |= 1U << idx;
+  poolStat_.free_pages++;
 }
 
 }  // namespace
@@ -30,36 +93,46 @@ bool kmm_is_spaces_available(size_t start, size_t num_pages) {
 void* kmm_uncached_malloc(size_t size) {
   ASSERT(size >= 1, "The size value should be 1 or more");
 
-  const size_t aligned_size = __builtin_align_up(size, PAGE_SIZE);
-  const size_t num_pages = aligned_size / PAGE_SIZE;
-
-  for (size_t i = 0; i < kRegionPageNums; i++) {
-    const uint64_t paddr = kUncachedStart + i * PAGE_SIZE;
-    if (kmm_is_spaces_available(i, num_pages)) {
-      for (size_t j = 0; j < num_pages; j++) {
-        auto& page = kernelUncachedMemoryRegionMap_[i + j];
-        page.ref_count++;
-        page.size = num_pages;
-      }
-      return reinterpret_cast<uint64_t*>(paddr);
+  UncachedInit();
+
+  if (size <= PAGE_SIZE) {
+    void* p = DmaPoolAllocate();
+    if (p) {
+      poolStat_.hits++;
+      return p;
     }
+    poolStat_.misses++;
   }
 
-  PANIC("No free space!");
-  return nullptr;
+  const size_t num_pages = __builtin_align_up(size, PAGE_SIZE) / PAGE_SIZE;
+  void* p = uncachedRegion_.Allocate(num_pages);
+  if (!p) {
+    PANIC("No free space! (requested %d pages)", num_pages);
+  }
+  return p;
 }
 
 void kmm_uncached_free(void* va) {
   ASSERT(va != nullptr, "Address must not be null");
 
-  const auto page_idx =
-      (reinterpret_cast<uint64_t>(va) - kUncachedStart) / PAGE_SIZE;
-  const size_t page_len = kernelUncachedMemoryRegionMap_[page_idx].size;
-  for (size_t i = 0; i < page_len; i++) {
-    auto& page = kernelUncachedMemoryRegionMap_[page_idx];
-    page.size = 0;
-    page.ref_count--;
+  UncachedInit();
+
+  const auto addr = reinterpret_cast<uint64_t>(va);
+  if (IsDmaPoolPage(addr)) {
+    DmaPoolFree(addr);
+    return;
   }
+  uncachedRegion_.Free(va);
+}
+
+const BuddyAllocator& kmm_uncached_get_region() {
+  UncachedInit();
+  return uncachedRegion_;
+}
+
+const KmmUncachedPoolStat& kmm_uncached_get_pool_stat() {
+  UncachedInit();
+  return poolStat_;
 }
 
 }  // namespace evisor
@@ -2,14 +2,30 @@
 #define EVISOR_MM_UNCACHED_KMM_UNCACHED_MALLOC_H_
 
 #include <cstddef>
+#include <cstdint>
+
+#include "mm/buddy_allocator.h"
 
 namespace evisor {
 
-// Allocate kernel memory in the uncached memory space.
+struct KmmUncachedPoolStat {
+  size_t pages;
+  size_t free_pages;
+  // One-page requests served by / missed in the DMA pool.
+  uint64_t hits;
+  uint64_t misses;
+};
+
+// Allocate kernel memory in the uncached memory space. Requests up to a page
+// are served from a fixed pool of DMA bounce buffers first.
 void* kmm_uncached_malloc(size_t size);
 // Free kernel memory in the uncached memory space.
 void kmm_uncached_free(void* va);
 
+// Get the uncached region allocator and the DMA pool for statistics.
+const BuddyAllocator& kmm_uncached_get_region();
+const KmmUncachedPoolStat& kmm_uncached_get_pool_stat();
+
 }  // namespace evisor
 
 #endif  // EVISOR_MM_UNCACHED_KMM_UNCACHED_MALLOC_H_
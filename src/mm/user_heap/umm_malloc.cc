@@ -1,25 +1,218 @@
 #include "mm/user_heap/umm_malloc.h"
 
+#include <algorithm>
 #include <cstdbool>
 #include <cstdint>
 
 #include "arch/ld_symbols.h"
+#include "common/assert.h"
 #include "common/logger.h"
 #include "mm/pgtable.h"
+#include "platforms/platform_config.h"
 
 namespace evisor {
 
 namespace {
-// FIXME: use kUserSize
-constexpr uint32_t kPagingPages =
+// 2GiB user space. See .user_space section in
+// src/arch/arm64/scripts/*/linker.ld
+constexpr size_t kPagingPages =
     static_cast<uint64_t>(1024) * 1024 * 1024 * 2 / PAGE_SIZE;
-[[maybe_unused]] constexpr uint32_t kMemMapSize = kPagingPages / 8;
+constexpr size_t kBitsPerWord = 64;
+constexpr size_t kMapWords = kPagingPages / kBitsPerWord;
+constexpr size_t kSummaryWords = kMapWords / kBitsPerWord;
+constexpr uint64_t kFullWord = ~static_cast<uint64_t>(0);
+// Pages of one colour are a way size apart. A page as large as a way
+// leaves a single colour.
+constexpr uint32_t kColours =
+    CONFIG_CACHE_WAY_SIZE > PAGE_SIZE ? CONFIG_CACHE_WAY_SIZE / PAGE_SIZE : 1;
+static_assert(kColours && kColours <= kUmmMaxColours &&
+              kBitsPerWord % kColours == 0);
+constexpr uint32_t kAllColours =
+    static_cast<uint32_t>((1ULL << kColours) - 1);
 
-uint8_t userMemoryRegionMap_[kPagingPages] = {0};
-uint32_t nextFreeSpaceIndex = 0;
-}  // namespace
+// 1: the page is in use
+uint64_t userMemoryRegionMap_[kMapWords] = {0};
+// 1: the page is the first page of an allocation
+uint64_t userMemoryRegionStartMap_[kMapWords] = {0};
+// 1: the page is the last page of an allocation
+uint64_t userMemoryRegionEndMap_[kMapWords] = {0};
+// 1: all pages of the corresponding userMemoryRegionMap_ word are in use
+uint64_t userMemoryRegionFullMap_[kSummaryWords] = {0};
+// No free page exists below this word.
+size_t nextFreeWordHint_ = 0;
 
-void* umm_malloc(size_t size) {
+// Extra references on single pages shared between VMs. A saturated count
+// pins the page.
+constexpr uint16_t kPageRefsMax = 0xffff;
+uint16_t userPageExtraRefs_[kPagingPages] = {0};
+
+UmmStat stat_ = {};
+
+inline uint64_t BitMask(size_t from, size_t to) {
+  // Bits [from, to) of a word. 0 <= from < to <= 64
+  const uint64_t upper = (to == kBitsPerWord) ? kFullWord : (1ULL << to) - 1;
+  return upper & ~((1ULL << from) - 1);
+}
+
+inline void UpdateFullMap(size_t w) {
+  const uint64_t bit = 1ULL << (w % kBitsPerWord);
+  if (userMemoryRegionMap_[w] == kFullWord) {
+    userMemoryRegionFullMap_[w / kBitsPerWord] |= bit;
+  } else {
+    userMemoryRegionFullMap_[w / kBitsPerWord] &= ~bit;
+  }
+}
+
+void SetRange(size_t start, size_t num, bool used) {
+  const size_t end = start + num;
+  for (size_t i = start; i < end;) {
+    const size_t w = i / kBitsPerWord;
+    const size_t to = std::min(end - w * kBitsPerWord, kBitsPerWord);
+    const uint64_t mask = BitMask(i % kBitsPerWord, to);
+    if (used) {
+      userMemoryRegionMap_[w] |= mask;
+    } else {
+      userMemoryRegionMap_[w] &= ~mask;
+    }
+    UpdateFullMap(w);
+    i = (w + 1) * kBitsPerWord;
+  }
+}
+
+void InitMap() {
+  static bool initialized = false;
+  if (initialized) {
+    return;
+  }
+
+  // Never hand out pages beyond the linker-defined region.
+  const size_t pages = std::min(kUserSize / PAGE_SIZE, kPagingPages);
+  if (pages < kPagingPages) {
+    SetRange(pages, kPagingPages - pages, true);
+  }
+  stat_.total_pages = pages;
+  initialized = true;
+}
+
+// Find the first free page at or after |from|. Returns kPagingPages if none.
+size_t FindFreePage(size_t from) {
+  if (from >= kPagingPages) {
+    return kPagingPages;
+  }
+
+  size_t w = from / kBitsPerWord;
+  uint64_t free_bits =
+      ~userMemoryRegionMap_[w] & BitMask(from % kBitsPerWord, kBitsPerWord);
+  if (free_bits) {
+    return w * kBitsPerWord + __builtin_ctzll(free_bits);
+  }
+
+  // Skip full words using the summary map.
+  w++;
+  while (w < kMapWords) {
+    const size_t s = w / kBitsPerWord;
+    const uint64_t not_full =
+        ~userMemoryRegionFullMap_[s] & BitMask(w % kBitsPerWord, kBitsPerWord);
+    if (not_full) {
+      w = s * kBitsPerWord + __builtin_ctzll(not_full);
+      return w * kBitsPerWord + __builtin_ctzll(~userMemoryRegionMap_[w]);
+    }
+    w = (s + 1) * kBitsPerWord;
+  }
+  return kPagingPages;
+}
+
+// Find the last used page in [start, start + num). Returns -1 if all free.
+int64_t FindLastUsedPage(size_t start, size_t num) {
+  const size_t end = start + num;
+  size_t w = (end - 1) / kBitsPerWord;
+  while (true) {
+    const size_t from = (w * kBitsPerWord > start) ? 0 : start % kBitsPerWord;
+    const size_t to = std::min(end - w * kBitsPerWord, kBitsPerWord);
+    const uint64_t used = userMemoryRegionMap_[w] & BitMask(from, to);
+    if (used) {
+      return w * kBitsPerWord + (kBitsPerWord - 1 - __builtin_clzll(used));
+    }
+    if (w * kBitsPerWord <= start) {
+      return -1;
+    }
+    w--;
+  }
+}
+
+// Find |num| free pages whose first page is physically aligned to |align|
+// pages.
+size_t FindFreeRange(size_t num, size_t align) {
+  const size_t base = kUserStart / PAGE_SIZE;
+  size_t pos = nextFreeWordHint_ * kBitsPerWord;
+  while (true) {
+    pos = FindFreePage(pos);
+    pos = __builtin_align_up(base + pos, align) - base;
+    if (pos + num > kPagingPages) {
+      return kPagingPages;
+    }
+    const int64_t used = FindLastUsedPage(pos, num);
+    if (used < 0) {
+      return pos;
+    }
+    pos = used + 1;
+  }
+}
+
+// Bits of a map word that belong to pages of |colours|. Every word starts
+// at the same colour, since a word spans a multiple of the colours.
+uint64_t ColourPattern(uint32_t colours) {
+  const size_t base = (kUserStart / PAGE_SIZE) % kColours;
+  uint64_t pattern = 0;
+  for (size_t bit = 0; bit < kBitsPerWord; bit++) {
+    if (colours & (1U << ((base + bit) % kColours))) {
+      pattern |= 1ULL << bit;
+    }
+  }
+  return pattern;
+}
+
+// Find the first free page matching |pattern|. Returns kPagingPages if none.
+size_t FindFreeColouredPage(uint64_t pattern) {
+  size_t w = nextFreeWordHint_;
+  while (w < kMapWords) {
+    if (userMemoryRegionFullMap_[w / kBitsPerWord] == kFullWord) {
+      w = (w / kBitsPerWord + 1) * kBitsPerWord;
+      continue;
+    }
+    const uint64_t free_bits = ~userMemoryRegionMap_[w] & pattern;
+    if (free_bits) {
+      return w * kBitsPerWord + __builtin_ctzll(free_bits);
+    }
+    w++;
+  }
+  return kPagingPages;
+}
+
+// Mark |num_pages| pages from |start| as one allocation.
+void* AllocateRange(size_t start, size_t num_pages) {
+  SetRange(start, num_pages, true);
+  userMemoryRegionStartMap_[start / kBitsPerWord] |=
+      1ULL << (start % kBitsPerWord);
+  const size_t last = start + num_pages - 1;
+  userMemoryRegionEndMap_[last / kBitsPerWord] |= 1ULL << (last % kBitsPerWord);
+
+  // Advance the hint past words that have just become full.
+  while (nextFreeWordHint_ < kMapWords &&
+         userMemoryRegionMap_[nextFreeWordHint_] == kFullWord) {
+    nextFreeWordHint_++;
+  }
+
+  stat_.allocs++;
+  stat_.used_pages += num_pages;
+  if (stat_.used_pages > stat_.peak_used_pages) {
+    stat_.peak_used_pages = stat_.used_pages;
+  }
+
+  return reinterpret_cast<uint64_t*>(kUserStart + start * PAGE_SIZE);
+}
+
+void* Memalign(size_t alignment, size_t size, bool must_succeed) {
   if (size < PAGE_SIZE) {
     LOG_ERROR("Requested size (%d) is less than page size(%d)", size,
               PAGE_SIZE);
@@ -32,27 +225,134 @@ void* umm_malloc(size_t size) {
     return nullptr;
   }
 
-  for (uint32_t i = nextFreeSpaceIndex; i < kPagingPages; i++) {
-    const uint32_t j = i / 8;
-    const uint8_t bit = 1 << (i % 8);
-    if ((userMemoryRegionMap_[j] & bit) == 0) {
-      userMemoryRegionMap_[j] |= bit;
-      nextFreeSpaceIndex = i + 1;
-      auto* page = reinterpret_cast<uint64_t*>(kUserStart + i * PAGE_SIZE);
-      return page;
+  if (alignment < PAGE_SIZE || (alignment & (alignment - 1)) != 0) {
+    LOG_ERROR("Invalid alignment (%d)", alignment);
+    return nullptr;
+  }
+
+  InitMap();
+
+  const size_t num_pages = size / PAGE_SIZE;
+  const size_t align_pages = alignment / PAGE_SIZE;
+  const size_t start = FindFreeRange(num_pages, align_pages);
+  if (start >= kPagingPages) {
+    stat_.failures++;
+    if (must_succeed) {
+      PANIC("No free pages in user memory region!");
     }
+    return nullptr;
   }
+  return AllocateRange(start, num_pages);
+}
 
-  PANIC("No free pages in user memory region!");
-  return nullptr;
+}  // namespace
+
+void* umm_malloc(size_t size) {
+  return umm_memalign(PAGE_SIZE, size);
+}
+
+void* umm_try_malloc(size_t size) {
+  return Memalign(PAGE_SIZE, size, false);
+}
+
+void* umm_memalign(size_t alignment, size_t size) {
+  return Memalign(alignment, size, true);
+}
+
+void* umm_malloc_coloured(uint32_t colours) {
+  colours &= kAllColours;
+  if (!colours || colours == kAllColours) {
+    return umm_malloc(PAGE_SIZE);
+  }
+
+  InitMap();
+  const size_t page = FindFreeColouredPage(ColourPattern(colours));
+  if (page >= kPagingPages) {
+    stat_.colour_fallbacks++;
+    return umm_malloc(PAGE_SIZE);
+  }
+  return AllocateRange(page, 1);
 }
 
 void umm_free(void* va) {
-  const uint32_t page =
-      (reinterpret_cast<uint64_t>(va) - kUserStart) / PAGE_SIZE;
-  const uint32_t i = page / 8;
-  const uint8_t bit = 1 << (page % 8);
-  userMemoryRegionMap_[i] &= ~bit;
+  const auto addr = reinterpret_cast<uint64_t>(va);
+  const size_t start = (addr - kUserStart) / PAGE_SIZE;
+  const uint64_t start_bit = 1ULL << (start % kBitsPerWord);
+  // Only the first page of a live allocation can be freed. Anything else
+  // is a double free or a free from the middle, which would release a
+  // neighbouring allocation.
+  if (addr % PAGE_SIZE != 0 || start >= kPagingPages ||
+      !(userMemoryRegionStartMap_[start / kBitsPerWord] & start_bit)) {
+    PANIC("Invalid free: addr = %lx", addr);
+  }
+  userMemoryRegionStartMap_[start / kBitsPerWord] &= ~start_bit;
+
+  // Walk up to the end marker of the allocation.
+  size_t end = start;
+  while (true) {
+    const size_t w = end / kBitsPerWord;
+    const uint64_t marks = userMemoryRegionEndMap_[w] &
+                           BitMask(end % kBitsPerWord, kBitsPerWord);
+    if (marks) {
+      end = w * kBitsPerWord + __builtin_ctzll(marks);
+      userMemoryRegionEndMap_[w] &= ~(1ULL << (end % kBitsPerWord));
+      break;
+    }
+    end = (w + 1) * kBitsPerWord;
+    if (end >= kPagingPages) {
+      LOG_ERROR("Invalid free: addr = %lx", reinterpret_cast<uint64_t>(va));
+      return;
+    }
+  }
+
+  const size_t num_pages = end - start + 1;
+  SetRange(start, num_pages, false);
+  if (start / kBitsPerWord < nextFreeWordHint_) {
+    nextFreeWordHint_ = start / kBitsPerWord;
+  }
+
+  stat_.frees++;
+  stat_.used_pages -= num_pages;
+}
+
+void umm_page_get(void* va) {
+  const size_t idx = (reinterpret_cast<uint64_t>(va) - kUserStart) / PAGE_SIZE;
+  ASSERT(idx < kPagingPages, "Invalid page");
+  if (userPageExtraRefs_[idx] != kPageRefsMax) {
+    userPageExtraRefs_[idx]++;
+  }
+}
+
+void umm_page_put(void* va) {
+  const size_t idx = (reinterpret_cast<uint64_t>(va) - kUserStart) / PAGE_SIZE;
+  ASSERT(idx < kPagingPages, "Invalid page");
+  if (userPageExtraRefs_[idx] == kPageRefsMax) {
+    return;
+  }
+  if (userPageExtraRefs_[idx] > 0) {
+    userPageExtraRefs_[idx]--;
+    return;
+  }
+  umm_free(va);
+}
+
+uint32_t umm_page_refs(const void* va) {
+  const size_t idx = (reinterpret_cast<uint64_t>(va) - kUserStart) / PAGE_SIZE;
+  ASSERT(idx < kPagingPages, "Invalid page");
+  return userPageExtraRefs_[idx] + 1;
+}
+
+uint32_t umm_num_colours() {
+  return kColours;
+}
+
+uint32_t umm_page_colour(const void* va) {
+  return (reinterpret_cast<uint64_t>(va) / PAGE_SIZE) % kColours;
+}
+
+const UmmStat& umm_get_stat() {
+  InitMap();
+  return stat_;
 }
 
 }  // namespace evisor
@@ -2,12 +2,54 @@
 #define EVISOR_MM_USER_HEAP_UMM_MALLOC_H_
 
 #include <cstddef>
+#include <cstdint>
 
 namespace evisor {
 
+struct UmmStat {
+  size_t total_pages;
+  size_t used_pages;
+  // High watermark of the used pages.
+  size_t peak_used_pages;
+  uint64_t allocs;
+  uint64_t frees;
+  uint64_t failures;
+  // Coloured allocations served with a page of another colour
+  uint64_t colour_fallbacks;
+};
+
+// Page colours. The colour of a page is its physical page number modulo
+// umm_num_colours(), the cache way size in pages, so pages of different
+// colours never share a set of the last-level cache. A colour set is a
+// bitmask of colours, and 0 means any colour.
+constexpr uint32_t kUmmMaxColours = 32;
+uint32_t umm_num_colours();
+uint32_t umm_page_colour(const void* va);
+
+// Allocate physically contiguous pages in the user memory region. |size| must
+// be a multiple of the page size.
 void* umm_malloc(size_t size);
+// Same as umm_malloc, but returns nullptr instead of PANICking when the
+// region is exhausted.
+void* umm_try_malloc(size_t size);
+// Same as umm_malloc, but the first page is aligned to |alignment| bytes
+// (a power of two, at least the page size).
+void* umm_memalign(size_t alignment, size_t size);
+// Allocate a single page of a colour in |colours|. Falls back to any colour
+// when none of them is free.
+void* umm_malloc_coloured(uint32_t colours);
+// Free the whole allocation starting at |va|.
 void umm_free(void* va);
 
+// Reference counting for single pages shared between VMs. A page returned by
+// umm_malloc(PAGE_SIZE) starts with one reference, and umm_page_put() frees it
+// when the last reference is dropped.
+void umm_page_get(void* va);
+void umm_page_put(void* va);
+uint32_t umm_page_refs(const void* va);
+
+const UmmStat& umm_get_stat();
+
 }  // namespace evisor
 
 #endif  // EVISOR_MM_USER_HEAP_UMM_MALLOC_H_
@@ -1,16 +1,37 @@
 #include "mm/user_heap/umm_zalloc.h"
 
-#include "common/cstring.h"
+#include <cstdint>
+
+#include "mm/pgtable.h"
 #include "mm/user_heap/umm_malloc.h"
+#include "mm/zero_page_pool.h"
 
 namespace evisor {
 
 void* umm_zalloc(size_t size) {
-  void* alloc = evisor::umm_malloc(size);
+  if (size == PAGE_SIZE) {
+    return ZeroPagePool::GetUser().Allocate();
+  }
+
+  auto* alloc = static_cast<uint8_t*>(evisor::umm_malloc(size));
   if (alloc) {
-    memzero(alloc, size);
+    for (size_t i = 0; i < size; i += PAGE_SIZE) {
+      PageZero(alloc + i);
+    }
   }
   return alloc;
 }
 
+void* umm_zalloc_coloured(uint32_t colours) {
+  if (!colours) {
+    return umm_zalloc(PAGE_SIZE);
+  }
+
+  auto* page = umm_malloc_coloured(colours);
+  if (page) {
+    PageZero(page);
+  }
+  return page;
+}
+
 }  // namespace evisor
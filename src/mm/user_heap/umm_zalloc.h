@@ -2,10 +2,14 @@
 #define EVISOR_MM_USER_EAP_UMM_ZALLOC_H_
 
 #include <cstddef>
+#include <cstdint>
 
 namespace evisor {
 
 void* umm_zalloc(size_t size);
+// Zeroed umm_malloc_coloured(). Pages of any colour come from the pre-zeroed
+// page pool.
+void* umm_zalloc_coloured(uint32_t colours);
 
 }  // namespace evisor
 
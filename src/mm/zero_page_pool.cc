@@ -0,0 +1,103 @@
+#include "mm/zero_page_pool.h"
+
+#include <cstdbool>
+
+#include "arch/arm64/cpu_regs.h"
+#include "common/logger.h"
+#include "common/macro.h"
+#include "mm/heap/kmm_malloc.h"
+#include "mm/pgtable.h"
+#include "mm/user_heap/umm_malloc.h"
+
+namespace evisor {
+
+namespace {
+
+constexpr size_t kKernelPoolPages = 16;
+
+#ifdef ENABLE_MMU
+// Size of the block zeroed by one DC ZVA, or 0 if DC ZVA must not be used.
+size_t GetDcZvaBlockSize() {
+  static bool initialized = false;
+  static size_t block_size = 0;
+  if (!initialized) {
+    /*
+     * DCZID_EL0
+     *  DZP, bit [4]: DC ZVA is prohibited
+     *  BS, bits [3:0]: log2 of the block size in words
+     */
+    const uint64_t dczid = READ_CPU_REG(dczid_el0);
+    if (!(dczid & BIT64(4))) {
+      block_size = sizeof(uint32_t) << (dczid & 0xf);
+    }
+    initialized = true;
+  }
+  return block_size;
+}
+#endif  // ENABLE_MMU
+
+}  // namespace
+
+void PageZero(void* page) {
+  auto addr = reinterpret_cast<uint64_t>(page);
+  const auto end = addr + PAGE_SIZE;
+
+#ifdef ENABLE_MMU
+  // DC ZVA needs Normal memory, so it is only used with the MMU enabled.
+  const auto block_size = GetDcZvaBlockSize();
+  if (block_size && block_size <= PAGE_SIZE) {
+    for (; addr < end; addr += block_size) {
+      __asm__ volatile("dc zva, %0" : : "r"(addr) : "memory");
+    }
+    return;
+  }
+#endif  // ENABLE_MMU
+
+  for (; addr < end; addr += sizeof(uint64_t)) {
+    *reinterpret_cast<volatile uint64_t*>(addr) = 0;
+  }
+}
+
+ZeroPagePool& ZeroPagePool::GetUser() noexcept {
+  static ZeroPagePool instance(umm_try_malloc, kMaxPages);
+  return instance;
+}
+
+ZeroPagePool& ZeroPagePool::GetKernel() noexcept {
+  static ZeroPagePool instance(kmm_try_malloc, kKernelPoolPages);
+  return instance;
+}
+
+void ZeroPagePool::RefillAll() {
+  GetKernel().Refill(kRefillBatch);
+  GetUser().Refill(kRefillBatch);
+}
+
+void* ZeroPagePool::Allocate() {
+  if (stat_.free_pages > 0) {
+    stat_.hits++;
+    return pages_[--stat_.free_pages];
+  }
+
+  stat_.misses++;
+  void* page = alloc_(PAGE_SIZE);
+  if (!page) {
+    PANIC("No free page to zero");
+  }
+  PageZero(page);
+  return page;
+}
+
+void ZeroPagePool::Refill(size_t max_pages) {
+  for (size_t i = 0; i < max_pages && stat_.free_pages < max_pages_; i++) {
+    void* page = alloc_(PAGE_SIZE);
+    if (!page) {
+      return;
+    }
+    PageZero(page);
+    pages_[stat_.free_pages++] = page;
+    stat_.refills++;
+  }
+}
+
+}  // namespace evisor
@@ -0,0 +1,67 @@
+#ifndef EVISOR_MM_ZERO_PAGE_POOL_H_
+#define EVISOR_MM_ZERO_PAGE_POOL_H_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace evisor {
+
+// Zero a page-aligned page, using DC ZVA cache-line zeroing when available.
+void PageZero(void* page);
+
+// Pool of pre-zeroed pages. The pool is refilled from the idle loop so that
+// the page fault path only pops a ready page.
+class ZeroPagePool {
+ public:
+  static constexpr size_t kMaxPages = 64;
+  // Pages zeroed per Refill() call, to bound the time spent in the idle loop.
+  static constexpr size_t kRefillBatch = 8;
+
+  struct Stat {
+    size_t free_pages;
+    // Allocations served from / missed in the pool.
+    uint64_t hits;
+    uint64_t misses;
+    // Pages zeroed ahead of time.
+    uint64_t refills;
+  };
+
+  // Returns nullptr when out of pages, so that a refill stops early instead
+  // of PANICking.
+  using AllocFunc = void* (*)(size_t);
+
+  explicit ZeroPagePool(AllocFunc alloc, size_t max_pages)
+      : alloc_(alloc), max_pages_(max_pages) {}
+  ~ZeroPagePool() = default;
+
+  // Prevent copying.
+  ZeroPagePool(ZeroPagePool const&) = delete;
+  ZeroPagePool& operator=(ZeroPagePool const&) = delete;
+
+  // Pool for guest pages, backed by umm_malloc.
+  static ZeroPagePool& GetUser() noexcept;
+  // Pool for stage-2 page tables and other kernel pages, backed by kmm_malloc.
+  static ZeroPagePool& GetKernel() noexcept;
+
+  // Refill every pool by up to kRefillBatch pages. Called with IRQs disabled.
+  static void RefillAll();
+
+  // Get a zeroed page. Falls back to allocating and zeroing synchronously
+  // when the pool is empty, and PANICs if no page is left.
+  void* Allocate();
+
+  // Zero up to |max_pages| pages ahead of time.
+  void Refill(size_t max_pages);
+
+  const Stat& GetStat() const { return stat_; }
+
+ private:
+  AllocFunc alloc_;
+  size_t max_pages_;
+  void* pages_[kMaxPages] = {};
+  Stat stat_ = {};
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_MM_ZERO_PAGE_POOL_H_
@@ -28,6 +28,8 @@ void BoardBcm2711::Init(Tcb* tsk) {
   }
 
   // Map CPU interface to Virual CPU interface.
+  static_assert(GIC_V2_VIRTUAL_CPU_BASE % PAGE_SIZE == 0,
+                "The virtual CPU interface must be page aligned");
   start = GIC_V2_VIRTUAL_CPU_BASE;
   end = GIC_V2_VIRTUAL_CPU_BASE + 0x2000;
   for (uint64_t pa = start; pa < end; pa += PAGE_SIZE) {
@@ -101,4 +103,34 @@ void BoardBcm2711::MmioWrite(Tcb* tsk, uint64_t addr, uint64_t val) {
 #endif
 }
 
+size_t BoardBcm2711::SaveDeviceState(Tcb* tsk, uint8_t* buf, size_t size) {
+  UNUSED(tsk);
+
+  const size_t gic_size = virtio_gic_.GetStateSize();
+  const size_t uart_size = virtio_uart_.GetStateSize();
+  if (gic_size + uart_size > size) {
+    return 0;
+  }
+
+  virtio_gic_.SaveState(buf);
+  virtio_uart_.SaveState(buf + gic_size);
+  return gic_size + uart_size;
+}
+
+bool BoardBcm2711::RestoreDeviceState(Tcb* tsk,
+                                      const uint8_t* buf,
+                                      size_t size) {
+  UNUSED(tsk);
+
+  const size_t gic_size = virtio_gic_.GetStateSize();
+  const size_t uart_size = virtio_uart_.GetStateSize();
+  if (gic_size + uart_size != size) {
+    return false;
+  }
+
+  virtio_gic_.RestoreState(buf);
+  virtio_uart_.RestoreState(buf + gic_size);
+  return true;
+}
+
 }  // namespace evisor
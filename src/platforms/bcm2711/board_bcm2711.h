@@ -24,6 +24,8 @@ class BoardBcm2711 : public Board {
   void Init(Tcb* tsk) override;
   uint64_t MmioRead(Tcb* tsk, uint64_t addr) override;
   void MmioWrite(Tcb* tsk, uint64_t addr, uint64_t val) override;
+  size_t SaveDeviceState(Tcb* tsk, uint8_t* buf, size_t size) override;
+  bool RestoreDeviceState(Tcb* tsk, const uint8_t* buf, size_t size) override;
 
  private:
   VirtioGic virtio_gic_;
@@ -9,6 +9,11 @@
 #define CONFIG_DEVICEIO_BASEADDR 0xFC000000
 #define CONFIG_DEVICEIO_SIZE MB(64)
 
+// Way size of the last-level cache, which sets the number of page colours:
+// the 1 MiB, 16-way L2 of the Cortex-A72 has 64 KiB ways, i.e. 16 colours
+// of 4 KiB pages.
+#define CONFIG_CACHE_WAY_SIZE KB(64)
+
 //#define CONFIG_MMU_DEBUG
 
 #endif  // EVISOR_PLATFORMS_PLATFORM_BCM2711_CONFIG_H_
@@ -1,6 +1,7 @@
 #ifndef EVISOR_PLATFORMS_BOARD_H_
 #define EVISOR_PLATFORMS_BOARD_H_
 
+#include <cstddef>
 #include <cstdint>
 
 #include "common/macro.h"
@@ -36,6 +37,29 @@ class Board {
 
   virtual void MmioWrite(Tcb* tsk, uint64_t addr, uint64_t val) = 0;
 
+  // Ask the guest to give |pages| pages back through its balloon device.
+  // Returns false if the board has no balloon device.
+  virtual bool SetBalloonTarget(Tcb* tsk, uint32_t pages) {
+    UNUSED(tsk);
+    UNUSED(pages);
+    return false;
+  }
+
+  // Save the emulated device state of |tsk| to |buf| for a VM snapshot.
+  // Returns the number of bytes written, or 0 if |size| is too small.
+  virtual size_t SaveDeviceState(Tcb* tsk, uint8_t* buf, size_t size) = 0;
+
+  // Restore the device state saved by SaveDeviceState().
+  virtual bool RestoreDeviceState(Tcb* tsk,
+                                  const uint8_t* buf,
+                                  size_t size) = 0;
+
+  // Copy the per-VM device state of |src| to its clone |dst|.
+  virtual void CloneDevices(Tcb* dst, Tcb* src) {
+    UNUSED(dst);
+    UNUSED(src);
+  }
+
   void VmEnter(Tcb* tsk) {
     if (!console_->in->Empty()) {
       // TODO: Check if GIC corresponding IRQ is enabled
@@ -43,9 +67,10 @@ class Board {
     } else {
       tsk->stat.irq_pending = false;
     }
+    RestoreDeviceIrqs(tsk);
   }
 
-  void VmLeave(Tcb* tsk) { UNUSED(tsk); }
+  void VmLeave(Tcb* tsk) { SaveDeviceIrqs(tsk); }
 
   int IsIrqAsserted(Tcb* tsk) { return tsk->stat.irq_pending; }
 
@@ -53,6 +78,12 @@ class Board {
 
   void debug(Tcb* tsk) { UNUSED(tsk); }
 
+ protected:
+  // Emulated devices of the VM raise their interrupts through the virtual
+  // GIC. The interrupt in flight is switched out and in with the VM.
+  virtual void RestoreDeviceIrqs(Tcb* tsk) { UNUSED(tsk); }
+  virtual void SaveDeviceIrqs(Tcb* tsk) { UNUSED(tsk); }
+
  private:
   Console* console_ = nullptr;
 };
@@ -3,6 +3,7 @@
 #include <cstdint>
 
 #include "arch/arm64/cpu_regs.h"
+#include "arch/arm64/irq/gic_v2.h"
 #include "common/logger.h"
 #include "mm/pgtable_stage2.h"
 #include "platforms/platform.h"
@@ -13,6 +14,18 @@
 
 namespace evisor {
 
+namespace {
+
+// Guest address of the balloon device: the last virtio-mmio slot of the QEMU
+// virt machine.
+constexpr uint64_t kVirtioBalloonBase = 0x0A00'3E00;
+constexpr uint64_t kVirtioBalloonSize = 0x200;
+// Each virtio-mmio slot has its own SPI, counted from the first slot's.
+constexpr uint16_t kVirtioBalloonIntId =
+    VIRTIO_IRQ + (kVirtioBalloonBase - VIRTIO_BASE) / kVirtioBalloonSize;
+
+}  // namespace
+
 void BoardQemu::Init(Tcb* tsk) {
   Board::Init(tsk);
 
@@ -24,6 +37,8 @@ void BoardQemu::Init(Tcb* tsk) {
   }
 
   // Map CPU interface to Virual CPU interface.
+  static_assert(GIC_V2_VIRTUAL_CPU_BASE % PAGE_SIZE == 0,
+                "The virtual CPU interface must be page aligned");
   start = GIC_V2_VIRTUAL_CPU_BASE;
   end = GIC_V2_VIRTUAL_CPU_BASE + 0x2000;
   for (uint64_t pa = start; pa < end; pa += PAGE_SIZE) {
@@ -36,13 +51,16 @@ void BoardQemu::Init(Tcb* tsk) {
   for (uint64_t pa = start; pa < end; pa += PAGE_SIZE) {
     PgTableStage2::MapNewDevicePage(tsk, pa, pa, false);
   }
+
+  const uint64_t balloon = kVirtioBalloonBase & PAGE_MASK;
+  PgTableStage2::MapNewDevicePage(tsk, balloon, balloon, false);
 }
 
 uint64_t BoardQemu::MmioRead(Tcb* tsk, uint64_t addr) {
-  UNUSED(tsk);
-
   const uint32_t base_addr = addr & 0xFFFFF000;
-  if (base_addr == UART0_BASE) {
+  if (addr - kVirtioBalloonBase < kVirtioBalloonSize) {
+    return virtio_balloons_[tsk->pid].Read(tsk, addr - kVirtioBalloonBase);
+  } else if (base_addr == UART0_BASE) {
     return virtio_uart_.Read(addr & 0xFFF);
   } else if (base_addr == GIC_V2_DISTRIBUTOR_BASE) {
     return virtio_gic_.Read(addr & 0xFFF);
@@ -53,10 +71,10 @@ uint64_t BoardQemu::MmioRead(Tcb* tsk, uint64_t addr) {
 }
 
 void BoardQemu::MmioWrite(Tcb* tsk, uint64_t addr, uint64_t val) {
-  UNUSED(tsk);
-
   const uint32_t base_addr = addr & 0xFFFFF000;
-  if (base_addr == UART0_BASE) {
+  if (addr - kVirtioBalloonBase < kVirtioBalloonSize) {
+    virtio_balloons_[tsk->pid].Write(tsk, addr - kVirtioBalloonBase, val);
+  } else if (base_addr == UART0_BASE) {
     virtio_uart_.Write(addr & 0xFFF, val);
   } else if (base_addr == GIC_V2_DISTRIBUTOR_BASE) {
     virtio_gic_.Write(addr & 0xFFF, val);
@@ -65,4 +83,60 @@ void BoardQemu::MmioWrite(Tcb* tsk, uint64_t addr, uint64_t val) {
   }
 }
 
+size_t BoardQemu::SaveDeviceState(Tcb* tsk, uint8_t* buf, size_t size) {
+  const auto& balloon = virtio_balloons_[tsk->pid];
+  const size_t gic_size = virtio_gic_.GetStateSize();
+  const size_t uart_size = virtio_uart_.GetStateSize();
+  if (gic_size + uart_size + balloon.GetStateSize() > size) {
+    return 0;
+  }
+
+  virtio_gic_.SaveState(buf);
+  virtio_uart_.SaveState(buf + gic_size);
+  balloon.SaveState(buf + gic_size + uart_size);
+  return gic_size + uart_size + balloon.GetStateSize();
+}
+
+bool BoardQemu::RestoreDeviceState(Tcb* tsk,
+                                   const uint8_t* buf,
+                                   size_t size) {
+  auto& balloon = virtio_balloons_[tsk->pid];
+  const size_t gic_size = virtio_gic_.GetStateSize();
+  const size_t uart_size = virtio_uart_.GetStateSize();
+  if (gic_size + uart_size + balloon.GetStateSize() != size) {
+    return false;
+  }
+
+  virtio_gic_.RestoreState(buf);
+  virtio_uart_.RestoreState(buf + gic_size);
+  balloon.RestoreState(buf + gic_size + uart_size);
+  return true;
+}
+
+bool BoardQemu::SetBalloonTarget(Tcb* tsk, uint32_t pages) {
+  virtio_balloons_[tsk->pid].SetTarget(pages);
+  return true;
+}
+
+void BoardQemu::CloneDevices(Tcb* dst, Tcb* src) {
+  virtio_balloons_[dst->pid] = virtio_balloons_[src->pid];
+  balloon_virqs_[dst->pid] = 0;
+}
+
+void BoardQemu::RestoreDeviceIrqs(Tcb* tsk) {
+  auto& gic = GicV2::Get();
+  const uint32_t virq = balloon_virqs_[tsk->pid];
+  // The interrupt is level triggered: raise it again while the interrupt
+  // status is set and the guest is not handling it already.
+  if (!virq && virtio_balloons_[tsk->pid].IsIrqPending()) {
+    gic.NotifyVirqSoftware(kVirtioBalloonIntId);
+  } else {
+    gic.RestoreVirqSoftware(virq);
+  }
+}
+
+void BoardQemu::SaveDeviceIrqs(Tcb* tsk) {
+  balloon_virqs_[tsk->pid] = GicV2::Get().SaveVirqSoftware();
+}
+
 }  // namespace evisor
@@ -1,7 +1,11 @@
 #ifndef EVISOR_PLATFORMS_QEMU_BOARD_QEMU_H_
 #define EVISOR_PLATFORMS_QEMU_BOARD_QEMU_H_
 
+#include <array>
+
+#include "kernel/sched/sched.h"
 #include "platforms/board.h"
+#include "platforms/virtio/virtio_balloon.h"
 #include "platforms/virtio/virtio_gic.h"
 #include "platforms/virtio/virtio_pl011_uart.h"
 
@@ -24,10 +28,22 @@ class BoardQemu : public Board {
   void Init(Tcb* tsk) override;
   uint64_t MmioRead(Tcb* tsk, uint64_t addr) override;
   void MmioWrite(Tcb* tsk, uint64_t addr, uint64_t val) override;
+  size_t SaveDeviceState(Tcb* tsk, uint8_t* buf, size_t size) override;
+  bool RestoreDeviceState(Tcb* tsk, const uint8_t* buf, size_t size) override;
+  bool SetBalloonTarget(Tcb* tsk, uint32_t pages) override;
+  void CloneDevices(Tcb* dst, Tcb* src) override;
+
+ protected:
+  void RestoreDeviceIrqs(Tcb* tsk) override;
+  void SaveDeviceIrqs(Tcb* tsk) override;
 
  private:
   VirtioGic virtio_gic_;
   VirtioPl011Uart virtio_uart_;
+  // The balloon gives back guest memory, so each VM has its own.
+  std::array<VirtioBalloon, kNrTasks> virtio_balloons_;
+  // Balloon interrupt of each VM while it is switched out
+  std::array<uint32_t, kNrTasks> balloon_virqs_ = {};
 };
 
 }  // namespace evisor
@@ -9,6 +9,17 @@
 #define CONFIG_DEVICEIO_BASEADDR 0x08000000
 #define CONFIG_DEVICEIO_SIZE MB(512)
 
+// Space reserved at the end of the boot disk for a VM snapshot. 0 disables
+// snapshots. The guest image is the rest of the disk.
+#define CONFIG_SNAPSHOT_SIZE MB(0)
+// Space reserved before the snapshot area for swapping out guest RAM. 0
+// disables swap, and guests cannot use more RAM than the user region holds.
+#define CONFIG_SWAP_SIZE MB(0)
+
+// Way size of the last-level cache, which sets the number of page colours.
+// Same as a Cortex-A72 with a 1 MiB, 16-way L2.
+#define CONFIG_CACHE_WAY_SIZE KB(64)
+
 //#define CONFIG_MMU_DEBUG
 
 #endif  // EVISOR_PLATFORMS_PLATFORM_QEMU_CONFIG_H_
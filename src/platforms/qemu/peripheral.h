@@ -10,6 +10,7 @@
 #define UART0_BASE                 (PERIPHERAL_BASE + 0x0100'0000)
 #define GPIO_BASE                  (PERIPHERAL_BASE + 0x0103'0000)
 #define VIRTIO_BASE                0x0A00'0000
+#define VIRTIO_IRQ                 48  // SPI 16, virtio-mmio-bus.0
 #define EMMC2_BASE                 0xFFFF'FFFF  // dummy define
 #define MAILBOX_BASE               0xFFFF'FFFF  // dummy define
 
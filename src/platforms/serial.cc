@@ -1,17 +1,182 @@
 #include "platforms/serial.h"
 
+#include <algorithm>
+
 #include "arch/arm64/irq/gic_v2.h"
 #include "common/cctype.h"
 #include "common/logger.h"
+#if defined(BOARD_IS_QEMU)
+#include "drivers/virtio/virtio-blk.h"
+#endif
+#include "fs/snapshot.h"
 #include "kernel/sched/sched.h"
+#include "mm/mm_stat.h"
+#include "mm/page_merge.h"
+#include "mm/pgtable_stage2.h"
+#include "mm/user_heap/umm_malloc.h"
+#include "platforms/board.h"
 #include "platforms/platform.h"
+#include "platforms/timer.h"
 
 namespace evisor {
 
 namespace {
 constexpr char kHypervisorCommandStart = '?';
 constexpr char kHypervisorCommandShowTaskList = 'l';
+constexpr char kHypervisorCommandShowMemoryStat = 'm';
 constexpr char kHypervisorCommandSwitchTaskConsole = 's';
+constexpr char kHypervisorCommandCloneTask = 'c';
+constexpr char kHypervisorCommandSetMergeRate = 'k';
+constexpr char kHypervisorCommandSetBalloon = 'b';
+// Balloon target steps selectable from the console (?b0 - ?b9), 16 MiB each
+constexpr uint32_t kBalloonStepPages = 4096;
+constexpr char kHypervisorCommandDirtyLog = 'd';
+constexpr char kHypervisorCommandSaveSnapshot = 'w';
+constexpr char kHypervisorCommandSetColours = 'p';
+// Cache partitions selectable from the console (?p1 - ?p4). ?p0 lifts the
+// partition.
+constexpr uint32_t kColourPartitions = 4;
+constexpr char kHypervisorCommandDiskBench = 'i';
+
+// Start dirty logging over the guest RAM mapped so far, or harvest the pages
+// written since the last call.
+void DirtyLogCommand(Tcb* tsk) {
+  if (tsk->mm.dirty_bitmap) {
+    const auto pages = PgTableStage2::HarvestDirtyLog(tsk, nullptr);
+    LOG_INFO("%s: %d pages dirty", tsk->name, pages);
+    return;
+  }
+
+  ipa_t first = 0;
+  bool shared = false;
+  if (!PgTableStage2::FindNextRamPage(tsk, &first, &shared)) {
+    LOG_ERROR("%s has no guest memory", tsk->name);
+    return;
+  }
+  ipa_t last = first;
+  for (ipa_t cur = first; PgTableStage2::FindNextRamPage(tsk, &cur, &shared);
+       cur += PAGE_SIZE) {
+    last = cur;
+  }
+
+  if (!PgTableStage2::EnableDirtyLog(tsk, first, last + PAGE_SIZE - first)) {
+    LOG_ERROR("Failed to start dirty logging for %s", tsk->name);
+    return;
+  }
+  LOG_INFO("Dirty logging for %s: %lx - %lx", tsk->name, first,
+           last + PAGE_SIZE);
+}
+
+// Back the guest RAM allocated from now on with the |partition|th share of
+// the page colours. Pages already mapped keep their colour.
+void SetColoursCommand(Tcb* tsk, uint32_t partition) {
+  if (!partition) {
+    tsk->mm.colours = 0;
+    LOG_INFO("%s may use any page colour", tsk->name);
+    return;
+  }
+  if (partition > kColourPartitions) {
+    LOG_ERROR("Cache partition %d is invalid", partition);
+    return;
+  }
+
+  const uint32_t width = umm_num_colours() / kColourPartitions;
+  if (!width) {
+    LOG_ERROR("%d page colours cannot be partitioned", umm_num_colours());
+    return;
+  }
+  tsk->mm.colours = ((1U << width) - 1) << ((partition - 1) * width);
+  LOG_INFO("%s uses page colours %x", tsk->name, tsk->mm.colours);
+}
+
+#if defined(BOARD_IS_QEMU)
+// Measure 4 KiB read IOPS of the boot disk, sequential and random, with one
+// request in flight and with a full queue, then the sequential throughput of
+// each request size.
+void DiskBenchCommand() {
+  constexpr uint32_t kBenchRequests = 1024;
+  constexpr uint32_t kBenchSectors = 4096 / kDiskSectorSize;
+
+  auto& virtio = VirtioBlk::Get();
+  virtio.Init();
+  const uint64_t sectors = virtio.GetDiskCapacity() / kDiskSectorSize;
+  if (sectors <= kBenchSectors ||
+      virtio.GetMaxRequestSectors() < kBenchSectors) {
+    return;
+  }
+  // Every request reads into the same buffer. Only the timing matters.
+  alignas(PAGE_SIZE) static uint8_t buf[kBenchSectors * kDiskSectorSize];
+
+  // Sequential then random, each with a depth of one and a full queue.
+  for (int pass = 0; pass < 4; pass++) {
+    const bool random = pass >= 2;
+    const uint32_t depth = pass % 2 ? kVirtioBlkMaxRequests : 1;
+    uint32_t submitted = 0;
+    uint32_t completed = 0;
+    uint64_t seed = 0x2545f4914f6cdd1d;
+    auto done = [](void* arg, bool ok) {
+      UNUSED(ok);
+      (*static_cast<uint32_t*>(arg))++;
+    };
+
+    const auto start = Timer::GetSystemUsec();
+    while (completed < kBenchRequests) {
+      while (submitted < kBenchRequests && virtio.GetInflight() < depth) {
+        uint64_t sector = submitted * kBenchSectors;
+        if (random) {
+          seed ^= seed << 13;
+          seed ^= seed >> 7;
+          seed ^= seed << 17;
+          sector = seed;
+        }
+        sector = sector % (sectors - kBenchSectors) / kBenchSectors *
+                 kBenchSectors;
+        if (!virtio.SubmitRead(buf, sector, kBenchSectors, done,
+                               &completed)) {
+          break;
+        }
+        submitted++;
+      }
+      virtio.Kick();
+      virtio.Poll();
+    }
+    const auto end = Timer::GetSystemUsec();
+
+    LOG_INFO("disk: %s 4 KiB reads, depth %d: %d IOPS",
+             random ? "random" : "sequential", depth,
+             kBenchRequests * 1000000ULL / (end - start + 1));
+  }
+
+  // Sequential throughput by request size, from one sector up to the
+  // largest request the device takes.
+  constexpr uint64_t kThroughputBytes = 1024 * 1024;
+  alignas(PAGE_SIZE) static uint8_t
+      large_buf[kVirtioBlkMaxSectors * kDiskSectorSize];
+  const uint32_t max_sectors = std::min<uint64_t>(
+      virtio.GetMaxRequestSectors(), kThroughputBytes / kDiskSectorSize);
+  for (uint32_t count = 1; count <= max_sectors && count < sectors;
+       count *= 2) {
+    bool ok = true;
+    const auto start = Timer::GetSystemUsec();
+    for (uint64_t sector = 0; ok && sector < kThroughputBytes / kDiskSectorSize;
+         sector += count) {
+      ok = virtio.ReadSectors(large_buf, sector % (sectors - count), count);
+    }
+    const auto end = Timer::GetSystemUsec();
+    LOG_INFO("disk: sequential %d-sector reads: %d KB/S%s", count,
+             kThroughputBytes * 1000000 / 1024 / (end - start + 1),
+             ok ? "" : " (failed)");
+  }
+
+  const auto& stat = virtio.GetStat();
+  LOG_INFO("disk: %d requests, %d errors, %d bounced, %d batches",
+           stat.requests, stat.errors, stat.bounced, stat.batches);
+  LOG_INFO("disk: %d kicks, %d suppressed", stat.kicks,
+           stat.suppressed_kicks);
+  LOG_INFO("disk: max depth %d, %d irqs, %d sleeps", stat.max_inflight,
+           stat.irqs, stat.sleeps);
+}
+#endif
 }  // namespace
 
 Serial::~Serial() {
@@ -23,31 +188,90 @@ void Serial::Init() {
   uart_.Init(UART0_BASE);
   uart_.EnableReceiveIrq([](uint8_t c) {
     static bool hypervisor_command_comming = false;
-    static bool hypervisor_command_switch_req = false;
+    // Command waiting for its PID argument
+    static char hypervisor_command_pid_req = 0;
+    static bool hypervisor_command_merge_rate_req = false;
+    static bool hypervisor_command_balloon_req = false;
+    static bool hypervisor_command_colours_req = false;
     auto& sched = Sched::Get();
 
     if (hypervisor_command_comming) {
-      if (hypervisor_command_switch_req) {
+      if (hypervisor_command_pid_req) {
         if (isdigit(c)) {
           auto pid = c - '0';
           auto tsk = sched.GetTask(pid);
-          if (tsk) {
+          if (!tsk) {
+            LOG_ERROR("PID %d is invalid or not running.", pid);
+          } else if (hypervisor_command_pid_req ==
+                     kHypervisorCommandSwitchTaskConsole) {
             sched.ConsoleSwitchTo(pid);
             LOG_INFO("Console is assigned to %s (PID: %d)", tsk->name, pid);
             if (tsk->state == RUNNING) {
               sched.FlushConsole(tsk);
             }
+          } else if (hypervisor_command_pid_req ==
+                     kHypervisorCommandCloneTask) {
+            Get().clone_pid_ = pid;
+          }
+        }
+        hypervisor_command_pid_req = 0;
+        hypervisor_command_comming = false;
+      } else if (hypervisor_command_merge_rate_req) {
+        if (isdigit(c)) {
+          auto& merger = PageMerger::Get();
+          merger.SetScanRate((c - '0') * PageMerger::kScanRateStep);
+          LOG_INFO("Page merging scan rate: %d pages", merger.GetScanRate());
+        }
+        hypervisor_command_merge_rate_req = false;
+        hypervisor_command_comming = false;
+      } else if (hypervisor_command_balloon_req) {
+        auto* tsk = sched.GetTask(sched.GetCurrentPidUsingConsole());
+        if (isdigit(c) && tsk && tsk->board) {
+          const uint32_t pages = (c - '0') * kBalloonStepPages;
+          if (tsk->board->SetBalloonTarget(tsk, pages)) {
+            LOG_INFO("Balloon target of %s: %d pages", tsk->name, pages);
           } else {
-            LOG_ERROR("PID %d is invalid or not running.", pid);
+            LOG_ERROR("%s has no balloon device", tsk->name);
           }
         }
-        hypervisor_command_switch_req = false;
+        hypervisor_command_balloon_req = false;
+        hypervisor_command_comming = false;
+      } else if (hypervisor_command_colours_req) {
+        auto* tsk = sched.GetTask(sched.GetCurrentPidUsingConsole());
+        if (isdigit(c) && tsk) {
+          SetColoursCommand(tsk, c - '0');
+        }
+        hypervisor_command_colours_req = false;
         hypervisor_command_comming = false;
-      } else if (c == kHypervisorCommandSwitchTaskConsole) {
-        hypervisor_command_switch_req = true;
+      } else if (c == kHypervisorCommandSwitchTaskConsole ||
+                 c == kHypervisorCommandCloneTask) {
+        hypervisor_command_pid_req = c;
+      } else if (c == kHypervisorCommandSetMergeRate) {
+        hypervisor_command_merge_rate_req = true;
+      } else if (c == kHypervisorCommandSetBalloon) {
+        hypervisor_command_balloon_req = true;
+      } else if (c == kHypervisorCommandSetColours) {
+        hypervisor_command_colours_req = true;
       } else if (c == kHypervisorCommandShowTaskList) {
         sched.PrintTasks();
         hypervisor_command_comming = false;
+      } else if (c == kHypervisorCommandDirtyLog) {
+        auto* tsk = sched.GetTask(sched.GetCurrentPidUsingConsole());
+        if (tsk && tsk->state == RUNNING) {
+          DirtyLogCommand(tsk);
+        }
+        hypervisor_command_comming = false;
+      } else if (c == kHypervisorCommandSaveSnapshot) {
+        Get().save_pid_ = sched.GetCurrentPidUsingConsole();
+        hypervisor_command_comming = false;
+      } else if (c == kHypervisorCommandShowMemoryStat) {
+        MmPrintStat();
+        hypervisor_command_comming = false;
+#if defined(BOARD_IS_QEMU)
+      } else if (c == kHypervisorCommandDiskBench) {
+        Get().disk_bench_ = true;
+        hypervisor_command_comming = false;
+#endif
       } else {
         // do nothing
       }
@@ -73,4 +297,40 @@ size_t Serial::Send(uint8_t* buf, size_t size) {
   return uart_.Write(buf, size);
 }
 
+void Serial::RunPendingCommands() {
+  auto& sched = Sched::Get();
+  // A VM asleep on the disk may have pinned pages of any VM, and reads into
+  // pages it is about to map. Cloning and saving wait until it wakes up.
+  for (int pid = 0; pid < sched.GetTaskCount(); pid++) {
+    if (sched.GetTask(pid)->state == WAITTING) {
+      return;
+    }
+  }
+
+  if (clone_pid_ >= 0) {
+    const int pid = clone_pid_;
+    clone_pid_ = -1;
+    auto* tsk = sched.GetTask(pid);
+    const int new_pid = tsk ? sched.CloneTask(tsk) : -1;
+    if (new_pid < 0) {
+      LOG_ERROR("Failed to clone PID %d", pid);
+    } else {
+      LOG_INFO("Cloned %s (PID: %d) to PID %d", tsk->name, pid, new_pid);
+    }
+  }
+  if (save_pid_ >= 0) {
+    auto* tsk = sched.GetTask(save_pid_);
+    save_pid_ = -1;
+    if (tsk && tsk->state == RUNNING) {
+      SnapshotSave(tsk);
+    }
+  }
+#if defined(BOARD_IS_QEMU)
+  if (disk_bench_) {
+    disk_bench_ = false;
+    DiskBenchCommand();
+  }
+#endif
+}
+
 }  // namespace evisor
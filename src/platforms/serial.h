@@ -24,9 +24,17 @@ class Serial {
 
   void Init();
   size_t Send(uint8_t* buf, size_t size);
+  // Run the console commands too slow for the receive interrupt, which only
+  // records them. Called from the idle loop.
+  void RunPendingCommands();
 
  private:
   Pl011Uart uart_;
+  // PID of the task to clone, or -1
+  int clone_pid_ = -1;
+  // PID of the task to save a snapshot of, or -1
+  int save_pid_ = -1;
+  bool disk_bench_ = false;
 };
 
 }  // namespace evisor
@@ -0,0 +1,266 @@
+#include "platforms/virtio/virtio_balloon.h"
+
+#include "common/logger.h"
+#include "common/macro.h"
+#include "mm/pgtable.h"
+#include "mm/pgtable_stage2.h"
+#include "mm/user_heap/umm_malloc.h"
+
+namespace evisor {
+
+namespace {
+
+constexpr uint32_t kVirtioMagicValue = 0x74726976;  // "virt"
+constexpr uint32_t kVirtioLegacyVersion = 1;
+constexpr uint32_t kVirtioDeviceIdBalloon = 5;
+constexpr uint32_t kVirtioVendorId = 0x554d4551;  // "QEMU"
+
+// Interrupt status bits
+constexpr uint32_t kVirtioIntUsedRing = (1 << 0);
+constexpr uint32_t kVirtioIntConfigChange = (1 << 1);
+
+// Device status bits
+constexpr uint32_t kVirtioStatusDriverOk = (1 << 2);
+
+// Virtqueue descriptor flags
+constexpr uint16_t kVirtqDescFlagNext = 1;
+
+// Balloon PFNs are always in 4 KiB units.
+constexpr uint32_t kVirtioBalloonPfnShift = 12;
+
+// Access guest RAM at |ipa|. The page is made private first when it is
+// written, since it may be shared copy-on-write, and is logged as dirty.
+template <typename T>
+T* GuestRam(Tcb* tsk, uint64_t ipa, bool write) {
+  if (!write) {
+    return reinterpret_cast<T*>(PgTableStage2::TranslateIpa(tsk, ipa));
+  }
+  // Over quota, the shared page must not be written in place.
+  if (PgTableStage2::IsCopyOnWrite(tsk, ipa) &&
+      !PgTableStage2::BreakCopyOnWrite(tsk, ipa)) {
+    LOG_ERROR("%s cannot copy the page at %lx", tsk->name, ipa);
+    return nullptr;
+  }
+  auto* ram = reinterpret_cast<T*>(PgTableStage2::TranslateIpa(tsk, ipa));
+  if (ram) {
+    PgTableStage2::MarkDirty(tsk, ipa);
+  }
+  return ram;
+}
+
+}  // namespace
+
+uint32_t VirtioBalloon::Read(Tcb* tsk, uint16_t addr) {
+  UNUSED(tsk);
+
+  uint32_t res = 0;
+  switch (addr) {
+    case 0x000:
+      res = kVirtioMagicValue;
+      break;
+    case 0x004:
+      res = kVirtioLegacyVersion;
+      break;
+    case 0x008:
+      res = kVirtioDeviceIdBalloon;
+      break;
+    case 0x00c:
+      res = kVirtioVendorId;
+      break;
+    case 0x010:
+      // No optional features
+      res = 0;
+      break;
+    case 0x034:
+      res = queue_sel_ < kNrQueues ? kQueueNumMax : 0;
+      break;
+    case 0x040:
+      res = queue_sel_ < kNrQueues ? queues_[queue_sel_].pfn : 0;
+      break;
+    case 0x060:
+      res = interrupt_status_;
+      break;
+    case 0x070:
+      res = status_;
+      break;
+    case 0x100:
+      res = stat_.target_pages;
+      break;
+    case 0x104:
+      res = stat_.actual_pages;
+      break;
+    default:
+      LOG_ERROR("Unexpected read: addr = %04x", addr);
+      break;
+  }
+  return res;
+}
+
+void VirtioBalloon::Write(Tcb* tsk, uint32_t addr, uint32_t data) {
+  auto* queue = queue_sel_ < kNrQueues ? &queues_[queue_sel_] : nullptr;
+  switch (addr) {
+    case 0x014:  // HostFeaturesSel
+    case 0x020:  // GuestFeatures
+    case 0x024:  // GuestFeaturesSel
+      break;
+    case 0x028:
+      guest_page_size_ = data;
+      break;
+    case 0x030:
+      queue_sel_ = data;
+      break;
+    case 0x038:
+      if (queue) {
+        queue->num = data <= kQueueNumMax ? data : kQueueNumMax;
+      }
+      break;
+    case 0x03c:
+      if (queue) {
+        queue->align = data;
+      }
+      break;
+    case 0x040:
+      if (queue) {
+        queue->pfn = data;
+        queue->last_avail = 0;
+      }
+      break;
+    case 0x050:
+      if (data < kNrQueues) {
+        ProcessQueue(tsk, data);
+      }
+      break;
+    case 0x064:
+      interrupt_status_ &= ~data;
+      break;
+    case 0x070:
+      status_ = data;
+      if (!status_) {
+        Reset();
+      }
+      break;
+    case 0x104:
+      stat_.actual_pages = data;
+      break;
+    default:
+      LOG_WARN("Unexpected write: addr = %04x, data = %04x", addr, data);
+      break;
+  }
+}
+
+void VirtioBalloon::SetTarget(uint32_t pages) {
+  stat_.target_pages = pages;
+  if (status_ & kVirtioStatusDriverOk) {
+    interrupt_status_ |= kVirtioIntConfigChange;
+  }
+}
+
+void VirtioBalloon::Reset() {
+  for (auto& queue : queues_) {
+    queue = {};
+  }
+  queue_sel_ = 0;
+  guest_page_size_ = 0;
+  interrupt_status_ = 0;
+  stat_.actual_pages = 0;
+}
+
+void VirtioBalloon::ProcessQueue(Tcb* tsk, uint32_t idx) {
+  auto& queue = queues_[idx];
+  if (!queue.pfn || !queue.num || !queue.align) {
+    return;
+  }
+
+  // Legacy layout: descriptor table, available ring, then the used ring at
+  // the next |align| boundary.
+  const uint64_t desc = static_cast<uint64_t>(queue.pfn) * guest_page_size_;
+  const uint64_t avail = desc + 16 * queue.num;
+  const uint64_t used =
+      __builtin_align_up(avail + 6 + 2 * queue.num, queue.align);
+
+  auto* avail_idx = GuestRam<uint16_t>(tsk, avail + 2, false);
+  if (!avail_idx) {
+    LOG_ERROR("Virtqueue %d is not in guest RAM", idx);
+    return;
+  }
+
+  bool released = false;
+  while (queue.last_avail != *avail_idx) {
+    const uint16_t slot = queue.last_avail % queue.num;
+    auto* head = GuestRam<uint16_t>(tsk, avail + 4 + 2 * slot, false);
+    if (!head) {
+      break;
+    }
+
+    // Read it now. The guest may give up the page holding the ring.
+    const uint16_t head_id = *head;
+    uint16_t i = head_id;
+    for (uint32_t n = 0; n < queue.num; n++) {
+      const uint64_t d = desc + 16 * (i % queue.num);
+      auto* addr = GuestRam<uint64_t>(tsk, d, false);
+      auto* len = GuestRam<uint32_t>(tsk, d + 8, false);
+      auto* flags = GuestRam<uint16_t>(tsk, d + 12, false);
+      auto* next = GuestRam<uint16_t>(tsk, d + 14, false);
+      if (!addr || !len || !flags || !next) {
+        break;
+      }
+      if (idx == kInflateQueue) {
+        ReleasePages(tsk, *addr, *len);
+        released = true;
+      }
+      if (!(*flags & kVirtqDescFlagNext)) {
+        break;
+      }
+      i = *next;
+    }
+
+    auto* used_idx = GuestRam<uint16_t>(tsk, used + 2, true);
+    if (!used_idx) {
+      break;
+    }
+    const uint64_t elem = used + 4 + 8 * (*used_idx % queue.num);
+    auto* elem_id = GuestRam<uint32_t>(tsk, elem, true);
+    auto* elem_len = GuestRam<uint32_t>(tsk, elem + 4, true);
+    if (!elem_id || !elem_len) {
+      break;
+    }
+    *elem_id = head_id;
+    *elem_len = 0;
+    (*used_idx)++;
+
+    queue.last_avail++;
+    interrupt_status_ |= kVirtioIntUsedRing;
+  }
+
+  if (released) {
+    PgTableStage2::FlushTlbAll();
+  }
+}
+
+void VirtioBalloon::ReleasePages(Tcb* tsk, uint64_t addr, uint32_t len) {
+  // With 16 KiB and 64 KiB granules, the rest of the stage-2 page holding a
+  // balloon page may still be in use, so nothing is released.
+  if (PAGE_SHIFT != kVirtioBalloonPfnShift) {
+    return;
+  }
+
+  for (uint32_t off = 0; off + sizeof(uint32_t) <= len;
+       off += sizeof(uint32_t)) {
+    auto* pfn = GuestRam<uint32_t>(tsk, addr + off, false);
+    if (!pfn) {
+      return;
+    }
+
+    // The stale TLB entry is gone before the guest runs again, and nothing
+    // else runs in between, so the page can be freed right away.
+    const uint64_t ipa = static_cast<uint64_t>(*pfn)
+                         << kVirtioBalloonPfnShift;
+    const pa_t page = PgTableStage2::UnmapRamPage(tsk, ipa);
+    if (page) {
+      umm_page_put(reinterpret_cast<void*>(page));
+      stat_.released_pages++;
+    }
+  }
+}
+
+}  // namespace evisor
@@ -0,0 +1,79 @@
+#ifndef EVISOR_PLATFORMS_VIRTIO_VIRTIO_BALLOON_H_
+#define EVISOR_PLATFORMS_VIRTIO_VIRTIO_BALLOON_H_
+
+#include <cstdbool>
+#include <cstddef>
+#include <cstdint>
+
+#include "common/cstring.h"
+#include "kernel/task/task.h"
+
+namespace evisor {
+
+// Emulated virtio-balloon device (legacy virtio-mmio transport).
+//
+// The hypervisor sets a target number of pages. The guest driver then gives
+// pages back through the inflate queue, and their stage-2 entries are removed
+// and the pages are returned to the user page allocator. Pages taken back by
+// the guest through the deflate queue are mapped again on their next access.
+//
+// Registers are expected to be accessed with 32-bit loads and stores,
+// including the configuration space.
+class VirtioBalloon {
+ public:
+  struct Stat {
+    // Pages the guest is asked to give up
+    uint32_t target_pages;
+    // Pages the guest reports as given up
+    uint32_t actual_pages;
+    // Pages unmapped and returned to the allocator
+    uint64_t released_pages;
+  };
+
+  VirtioBalloon() = default;
+  ~VirtioBalloon() = default;
+
+  uint32_t Read(Tcb* tsk, uint16_t addr);
+  void Write(Tcb* tsk, uint32_t addr, uint32_t data);
+
+  // Ask the guest to inflate or deflate the balloon to |pages|.
+  void SetTarget(uint32_t pages);
+
+  bool IsIrqPending() const { return interrupt_status_ != 0; }
+
+  const Stat& GetStat() const { return stat_; }
+
+  // Device state saved in VM snapshots
+  size_t GetStateSize() const { return sizeof(*this); }
+  void SaveState(void* buf) const { memcpy(buf, this, sizeof(*this)); }
+  void RestoreState(const void* buf) { memcpy(this, buf, sizeof(*this)); }
+
+ private:
+  static constexpr uint32_t kQueueNumMax = 64;
+  static constexpr uint32_t kInflateQueue = 0;
+  static constexpr uint32_t kDeflateQueue = 1;
+  static constexpr uint32_t kNrQueues = 2;
+
+  struct Queue {
+    uint32_t num;
+    uint32_t align;
+    uint32_t pfn;
+    // Next available ring index to process
+    uint16_t last_avail;
+  };
+
+  void Reset();
+  void ProcessQueue(Tcb* tsk, uint32_t idx);
+  void ReleasePages(Tcb* tsk, uint64_t addr, uint32_t len);
+
+  Queue queues_[kNrQueues] = {};
+  uint32_t queue_sel_ = 0;
+  uint32_t guest_page_size_ = 0;
+  uint32_t status_ = 0;
+  uint32_t interrupt_status_ = 0;
+  Stat stat_ = {};
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_PLATFORMS_VIRTIO_VIRTIO_BALLOON_H_
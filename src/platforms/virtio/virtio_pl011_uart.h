@@ -1,8 +1,11 @@
 #ifndef EVISOR_PLATFORMS_VIRTIO_VIRTIO_PL011_UART_H_
 #define EVISOR_PLATFORMS_VIRTIO_VIRTIO_PL011_UART_H_
 
+#include <cstddef>
 #include <cstdint>
 
+#include "common/cstring.h"
+
 namespace evisor {
 
 class VirtioPl011Uart {
@@ -13,6 +16,11 @@ class VirtioPl011Uart {
   uint32_t Read(uint16_t addr);
   void Write(uint32_t addr, uint32_t data);
 
+  // Register state saved in VM snapshots
+  size_t GetStateSize() const { return sizeof(regs_); }
+  void SaveState(void* buf) const { memcpy(buf, &regs_, sizeof(regs_)); }
+  void RestoreState(const void* buf) { memcpy(&regs_, buf, sizeof(regs_)); }
+
  private:
   struct Regs {
     uint32_t UARTDR;
@@ -0,0 +1,231 @@
+// Randomized stress test of BuddyAllocator, and a benchmark against the
+// linear page-map scan kmm_malloc used before it.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+#include "mm/buddy_allocator.h"
+#include "mm/pgtable.h"
+#include "test_util.h"
+
+using evisor::BuddyAllocator;
+using evisor_test::NowNsec;
+
+namespace {
+
+// The kernel heap size
+constexpr size_t kPages = 64 * 1024 * 1024 / PAGE_SIZE;
+
+// The previous kmm_malloc: one page per call, found by a scan from the start
+class LinearHeap {
+ public:
+  explicit LinearHeap(uint64_t base) : base_(base), used_(kPages, false) {}
+
+  void* Allocate() {
+    for (size_t i = 0; i < kPages; i++) {
+      if (!used_[i]) {
+        used_[i] = true;
+        return reinterpret_cast<void*>(base_ + i * PAGE_SIZE);
+      }
+    }
+    return nullptr;
+  }
+
+  void Free(void* va) {
+    used_[(reinterpret_cast<uint64_t>(va) - base_) / PAGE_SIZE] = false;
+  }
+
+ private:
+  uint64_t base_;
+  std::vector<bool> used_;
+};
+
+struct Live {
+  uint8_t* addr;
+  size_t pages;
+  uint8_t tag;
+};
+
+void Tag(const Live& a) {
+  for (size_t i = 0; i < a.pages; i++) {
+    uint8_t* page = a.addr + i * PAGE_SIZE;
+    memset(page, a.tag, 16);
+    memset(page + PAGE_SIZE - 16, a.tag, 16);
+  }
+}
+
+bool IsTagged(const Live& a) {
+  for (size_t i = 0; i < a.pages; i++) {
+    const uint8_t* page = a.addr + i * PAGE_SIZE;
+    for (size_t j = 0; j < 16; j++) {
+      if (page[j] != a.tag || page[PAGE_SIZE - 16 + j] != a.tag) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+size_t SumFreeBlocks(const BuddyAllocator& heap) {
+  size_t pages = 0;
+  for (size_t order = 0; order <= BuddyAllocator::kMaxOrder; order++) {
+    pages += heap.GetStat().free_blocks[order] << order;
+  }
+  return pages;
+}
+
+void StressTest(uint8_t* region) {
+  static uint8_t page_info[kPages];
+  BuddyAllocator heap;
+  heap.Init(reinterpret_cast<uint64_t>(region), kPages, page_info);
+  CHECK_EQ(heap.GetStat().free_pages, kPages);
+  CHECK_EQ(heap.GetLargestFreeOrder(), BuddyAllocator::kMaxOrder);
+
+  std::mt19937 rng(1);
+  std::vector<Live> live;
+  std::vector<int32_t> owner(kPages, -1);
+  size_t used = 0;
+  size_t peak = 0;
+  size_t failures = 0;
+
+  for (int op = 0; op < 200000; op++) {
+    if (live.empty() || rng() % 100 < 55) {
+      const size_t pages =
+          rng() % 4 == 0 ? 1 + rng() % 256 : 1 + rng() % 4;
+      const uint8_t order = BuddyAllocator::PagesToOrder(pages);
+      auto* p = static_cast<uint8_t*>(heap.Allocate(pages));
+      if (!p) {
+        // Only fails when no block of the order is left.
+        CHECK(heap.GetLargestFreeOrder() < order);
+        failures++;
+        continue;
+      }
+
+      const size_t block = 1UL << order;
+      const size_t idx = (p - region) / PAGE_SIZE;
+      CHECK_EQ(idx % block, 0u);
+      CHECK_EQ(heap.GetBlockPages(p), block);
+      for (size_t i = idx; i < idx + block; i++) {
+        CHECK_EQ(owner[i], -1);
+        owner[i] = op;
+      }
+
+      Live a = {p, block, static_cast<uint8_t>(rng())};
+      Tag(a);
+      live.push_back(a);
+      used += block;
+      peak = std::max(peak, used);
+    } else {
+      const size_t i = rng() % live.size();
+      const Live a = live[i];
+      live[i] = live.back();
+      live.pop_back();
+
+      // Nothing else wrote into the block while it was allocated.
+      CHECK(IsTagged(a));
+      const size_t idx = (a.addr - region) / PAGE_SIZE;
+      for (size_t j = idx; j < idx + a.pages; j++) {
+        owner[j] = -1;
+      }
+      heap.Free(a.addr);
+      used -= a.pages;
+    }
+
+    if (op % 997 == 0) {
+      CHECK_EQ(heap.GetStat().free_pages, kPages - used);
+      CHECK_EQ(SumFreeBlocks(heap), kPages - used);
+      CHECK(heap.GetFragmentation() <= 100);
+    }
+  }
+  CHECK_EQ(heap.GetStat().peak_used_pages, peak);
+  CHECK_EQ(heap.GetStat().failures, failures);
+
+  // A bad or repeated free is refused without touching the accounting.
+  if (!live.empty()) {
+    const Live a = live.back();
+    if (a.pages > 1) {
+      heap.Free(a.addr + PAGE_SIZE);
+      CHECK_EQ(heap.GetStat().free_pages, kPages - used);
+    }
+  }
+
+  for (const auto& a : live) {
+    CHECK(IsTagged(a));
+    heap.Free(a.addr);
+  }
+  heap.Free(live.empty() ? region : live.front().addr);
+  CHECK_EQ(heap.GetStat().free_pages, kPages);
+
+  // Everything coalesced back into the single top block.
+  CHECK_EQ(heap.GetLargestFreeOrder(), BuddyAllocator::kMaxOrder);
+  CHECK_EQ(heap.GetStat().free_blocks[BuddyAllocator::kMaxOrder], 1u);
+  CHECK_EQ(heap.GetFragmentation(), 0u);
+
+  printf("stress: %zu live at the end, peak %zu pages, %zu failures\n",
+         live.size(), peak, failures);
+}
+
+// Time one-page allocate/free pairs with |fill| of the heap in use.
+template <typename Heap>
+double TimePair(Heap& heap, size_t fill) {
+  std::vector<void*> held;
+  for (size_t i = 0; i < fill; i++) {
+    held.push_back(heap.Allocate(1));
+  }
+  constexpr int kIters = 20000;
+  const double start = NowNsec();
+  for (int i = 0; i < kIters; i++) {
+    heap.Free(heap.Allocate(1));
+  }
+  const double ns = (NowNsec() - start) / kIters;
+  for (auto* p : held) {
+    heap.Free(p);
+  }
+  return ns;
+}
+
+void Benchmark(uint8_t* region) {
+  static uint8_t page_info[kPages];
+  BuddyAllocator buddy;
+  buddy.Init(reinterpret_cast<uint64_t>(region), kPages, page_info);
+
+  struct LinearAdapter {
+    LinearHeap heap;
+    void* Allocate(size_t) { return heap.Allocate(); }
+    void Free(void* p) { heap.Free(p); }
+  } linear{LinearHeap(reinterpret_cast<uint64_t>(region))};
+
+  printf("%8s %14s %14s\n", "USED(%)", "LINEAR(ns)", "BUDDY(ns)");
+  for (int percent : {0, 25, 50, 90, 99}) {
+    const size_t fill = kPages * percent / 100;
+    printf("%8d %14.1f %14.1f\n", percent, TimePair(linear, fill),
+           TimePair(buddy, fill));
+  }
+
+  // Multi-page blocks, which the linear scheme could not serve at all
+  constexpr int kIters = 20000;
+  std::mt19937 rng(2);
+  const double start = NowNsec();
+  for (int i = 0; i < kIters; i++) {
+    buddy.Free(buddy.Allocate(1 + rng() % 64));
+  }
+  printf("buddy 1-64 pages: %.1f ns per allocate/free\n",
+         (NowNsec() - start) / kIters);
+}
+
+}  // namespace
+
+int main() {
+  auto* region = static_cast<uint8_t*>(
+      std::aligned_alloc(PAGE_SIZE, kPages * PAGE_SIZE));
+  CHECK(region != nullptr);
+
+  StressTest(region);
+  Benchmark(region);
+
+  std::free(region);
+  return 0;
+}
@@ -0,0 +1,310 @@
+// Tests of the block cache and the FAT32 filesystem on a disk image built by
+// make_fat32_image.py, which the Mmc stub reads as the card. The cache is
+// checked for LRU eviction and read-ahead, files for their extents and data,
+// and paths for nested, mixed-case and ".." lookups. A benchmark counts the
+// card commands of opening and reading files.
+//
+// Usage: fat32_test <image>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "drivers/mmc/mmc.h"
+#include "fs/block_cache.h"
+#include "fs/fat/fat32.h"
+#include "test_util.h"
+
+using evisor::BlockCache;
+using evisor::Fat32Fs;
+using evisor::fat32_file_t;
+using evisor::Mmc;
+using evisor_test::NowNsec;
+
+namespace {
+
+constexpr size_t kBlockSize = BlockCache::kBlockSize;
+constexpr size_t kSectorSize = BlockCache::kSectorSize;
+
+// A file as the image generator describes it in the manifest
+struct ManifestEntry {
+  std::string path;
+  size_t size;
+  uint32_t extents;
+  uint32_t crc;
+};
+
+std::vector<uint8_t> disk;
+std::vector<ManifestEntry> manifest;
+
+uint64_t Commands() {
+  return Mmc::Get().GetStat().commands;
+}
+
+uint32_t Crc32(const uint8_t* data, size_t size) {
+  uint32_t crc = ~0U;
+  for (size_t i = 0; i < size; i++) {
+    crc ^= data[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+    }
+  }
+  return ~crc;
+}
+
+void LoadImage(const char* path) {
+  FILE* image = std::fopen(path, "rb");
+  CHECK(image);
+  std::fseek(image, 0, SEEK_END);
+  disk.resize(std::ftell(image));
+  std::fseek(image, 0, SEEK_SET);
+  CHECK_EQ(std::fread(disk.data(), 1, disk.size(), image), disk.size());
+  Mmc::Get().SetImage(image);
+
+  FILE* list = std::fopen((std::string(path) + ".manifest").c_str(), "r");
+  CHECK(list);
+  char name[256];
+  size_t size;
+  uint32_t extents;
+  uint32_t crc;
+  while (std::fscanf(list, "%255s %zu %u %x", name, &size, &extents, &crc) ==
+         4) {
+    manifest.push_back({name, size, extents, crc});
+  }
+  std::fclose(list);
+  CHECK(!manifest.empty());
+}
+
+const ManifestEntry& Find(const std::string& path) {
+  for (const auto& entry : manifest) {
+    if (entry.path == path) {
+      return entry;
+    }
+  }
+  std::fprintf(stderr, "%s is not in the manifest\n", path.c_str());
+  std::exit(1);
+}
+
+// Read |number| through |cache| and compare it with the image.
+void ReadBlock(BlockCache* cache, uint64_t number) {
+  static uint8_t buf[kBlockSize];
+  CHECK(cache->Read(buf, number * BlockCache::kBlockSectors,
+                    BlockCache::kBlockSectors));
+  CHECK(!std::memcmp(buf, &disk[number * kBlockSize], kBlockSize));
+}
+
+void TestLruEviction() {
+  auto* cache = new BlockCache();
+  const auto& stat = cache->GetStat();
+
+  // Fill the cache with every other block, so that nothing is read ahead.
+  for (uint64_t i = 1; i <= BlockCache::kMaxBlocks; i++) {
+    ReadBlock(cache, i * 2);
+  }
+  CHECK_EQ(cache->GetNumBlocks(), BlockCache::kMaxBlocks);
+  CHECK_EQ(stat.misses, BlockCache::kMaxBlocks);
+  CHECK_EQ(stat.readahead, 0U);
+  CHECK_EQ(stat.evictions, 0U);
+
+  // Block 2 is the least recently used until it is read again, which makes
+  // block 4 the victim of the next miss.
+  ReadBlock(cache, 2);
+  CHECK_EQ(stat.hits, 1U);
+  ReadBlock(cache, 1001);
+  CHECK_EQ(stat.evictions, 1U);
+  ReadBlock(cache, 2);
+  CHECK_EQ(stat.hits, 2U);
+  const uint64_t misses = stat.misses;
+  ReadBlock(cache, 4);
+  CHECK_EQ(stat.misses, misses + 1);
+  CHECK_EQ(stat.evictions, 2U);
+
+  // A sector range across blocks is read in one call.
+  static uint8_t buf[3 * kBlockSize];
+  CHECK(cache->Read(buf, 13, 17));
+  CHECK(!std::memcmp(buf, &disk[13 * kSectorSize], 17 * kSectorSize));
+  delete cache;
+}
+
+void TestReadAhead() {
+  auto* cache = new BlockCache();
+  const auto& stat = cache->GetStat();
+
+  // The second of two consecutive misses fetches the blocks after it too,
+  // with one command.
+  ReadBlock(cache, 300);
+  const uint64_t commands = Commands();
+  ReadBlock(cache, 301);
+  CHECK_EQ(Commands(), commands + 1);
+  CHECK_EQ(stat.readahead, BlockCache::kReadAheadBlocks - 1);
+  for (uint64_t i = 302; i < 301 + BlockCache::kReadAheadBlocks; i++) {
+    ReadBlock(cache, i);
+  }
+  CHECK_EQ(Commands(), commands + 1);
+  CHECK_EQ(stat.readahead_hits, BlockCache::kReadAheadBlocks - 1);
+
+  // A read-ahead stops at the first block already cached.
+  ReadBlock(cache, 312);
+  ReadBlock(cache, 308);
+  ReadBlock(cache, 309);
+  CHECK_EQ(stat.readahead, BlockCache::kReadAheadBlocks - 1 + 2);
+
+  // A read-ahead past the end of the disk falls back to the missed block.
+  const uint64_t last = disk.size() / kBlockSize - 1;
+  ReadBlock(cache, last - 1);
+  ReadBlock(cache, last);
+  CHECK_EQ(stat.failures, 1U);
+  delete cache;
+}
+
+// Read every file of the manifest whole and in pieces.
+void TestReadFiles() {
+  auto& fs = Fat32Fs::Get();
+  std::mt19937 rng(3);
+  for (const auto& entry : manifest) {
+    fat32_file_t file;
+    CHECK(fs.Open(&file, entry.path.c_str()));
+    CHECK_EQ(static_cast<size_t>(fs.GetFileSize(&file)), entry.size);
+    CHECK(!fs.IsDirectory(&file));
+
+    std::vector<uint8_t> data(entry.size);
+    CHECK_EQ(fs.Read(&file, data.data(), 0, entry.size),
+             static_cast<int>(entry.size));
+    CHECK_EQ(Crc32(data.data(), entry.size), entry.crc);
+
+    // Unaligned pieces, some of which cross extents
+    std::vector<uint8_t> piece(9000);
+    for (int i = 0; i < 50 && entry.size; i++) {
+      const size_t offset = rng() % entry.size;
+      const size_t len =
+          1 + rng() % std::min(piece.size(), entry.size - offset);
+      CHECK_EQ(fs.Read(&file, piece.data(), offset, len),
+               static_cast<int>(len));
+      CHECK(!std::memcmp(piece.data(), &data[offset], len));
+    }
+  }
+}
+
+// Files must map to as many extents as the generator laid them out in, and
+// a whole-file read take one command per extent, plus one for a partial
+// last sector.
+void TestExtents() {
+  auto& fs = Fat32Fs::Get();
+  for (const char* path : {"kernel.img", "frag.bin", "guests/vm1.img"}) {
+    const auto& entry = Find(path);
+    fat32_file_t file;
+    CHECK(fs.Open(&file, path));
+    CHECK_EQ(file.num_extents, entry.extents);
+    std::vector<uint8_t> data(entry.size);
+    const uint64_t commands = Commands();
+    CHECK_EQ(fs.Read(&file, data.data(), 0, entry.size),
+             static_cast<int>(entry.size));
+    CHECK(Commands() - commands <= entry.extents + 1);
+    CHECK_EQ(Crc32(data.data(), entry.size), entry.crc);
+  }
+  CHECK_EQ(Find("kernel.img").extents, 1U);
+  CHECK(Find("frag.bin").extents > 100);
+
+  // An empty file has no clusters at all.
+  fat32_file_t file;
+  CHECK(fs.Open(&file, "empty.cfg"));
+  CHECK_EQ(file.num_extents, 0U);
+  CHECK_EQ(fs.GetFileSize(&file), 0);
+
+  // A broken chain fails the open rather than truncating the file.
+  CHECK(!fs.Open(&file, "broken.bin"));
+}
+
+void TestPathLookup() {
+  auto& fs = Fat32Fs::Get();
+  const struct {
+    const char* path;
+    const char* file;
+  } found[] = {
+      {"KERNEL.IMG", "kernel.img"},
+      {"Small.Txt", "small.txt"},
+      {"/guests/linux-guest.img", "guests/Linux-Guest.IMG"},
+      {"GUESTS/CFG/VM.CFG", "guests/cfg/vm.cfg"},
+      {"guests//vm1.img", "guests/vm1.img"},
+      {"guests/./cfg/vm.cfg", "guests/cfg/vm.cfg"},
+      {"guests/cfg/../vm1.img", "guests/vm1.img"},
+      {"guests/cfg/../../kernel.img", "kernel.img"},
+  };
+  for (const auto& f : found) {
+    fat32_file_t file;
+    CHECK(fs.Open(&file, f.path));
+    CHECK_EQ(static_cast<size_t>(fs.GetFileSize(&file)), Find(f.file).size);
+  }
+
+  fat32_file_t dir;
+  CHECK(fs.Open(&dir, "guests/cfg"));
+  CHECK(fs.IsDirectory(&dir));
+
+  for (const char* path : {"", "missing.bin", "guests/missing",
+                           "guests/cfg/vm.cfgx", "kernel.img/x", "small.txt/",
+                           "guests/", "filler_120.dat"}) {
+    fat32_file_t file;
+    CHECK(!fs.Open(&file, path));
+  }
+}
+
+void Benchmark() {
+  // A filesystem of its own, with no directory indexed yet
+  auto* fs = new Fat32Fs();
+  CHECK(fs->Init());
+  printf("%-28s %10s %12s\n", "OPERATION", "COMMANDS", "TIME(us)");
+
+  // Opening every filler scans the root directory once, the first time.
+  for (const char* pass : {"open 120 files (1st)", "open 120 files (2nd)"}) {
+    const uint64_t commands = Commands();
+    const double start = NowNsec();
+    for (int i = 0; i < 120; i++) {
+      char path[32];
+      snprintf(path, sizeof(path), "Filler_%03d.DAT", i);
+      fat32_file_t file;
+      CHECK(fs->Open(&file, path));
+    }
+    printf("%-28s %10lu %12.1f\n", pass, Commands() - commands,
+           (NowNsec() - start) / 1000);
+  }
+
+  const auto& entry = Find("kernel.img");
+  std::vector<uint8_t> data(entry.size);
+  fat32_file_t file;
+  CHECK(fs->Open(&file, "kernel.img"));
+  for (size_t chunk : {size_t{4096}, size_t{128 * 1024}}) {
+    const uint64_t commands = Commands();
+    const double start = NowNsec();
+    for (size_t offset = 0; offset < entry.size; offset += chunk) {
+      const size_t len = std::min(chunk, entry.size - offset);
+      CHECK_EQ(fs->Read(&file, &data[offset], offset, len),
+               static_cast<int>(len));
+    }
+    char label[64];
+    snprintf(label, sizeof(label), "read 3 MiB in %zu KiB chunks",
+             chunk / 1024);
+    printf("%-28s %10lu %12.1f\n", label, Commands() - commands,
+           (NowNsec() - start) / 1000);
+  }
+  CHECK_EQ(Crc32(data.data(), entry.size), entry.crc);
+  delete fs;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  CHECK_EQ(argc, 2);
+  LoadImage(argv[1]);
+  TestLruEviction();
+  TestReadAhead();
+  CHECK(Fat32Fs::Get().Init());
+  TestExtents();
+  TestReadFiles();
+  TestPathLookup();
+  Benchmark();
+  return 0;
+}
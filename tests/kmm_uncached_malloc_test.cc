@@ -0,0 +1,184 @@
+// Tests of the uncached region allocator, and a benchmark against the
+// first-fit scan it replaced. Fat32Fs used to allocate and free a one-page
+// bounce buffer from this region for every sector it read.
+
+#include <cstdint>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "mm/pgtable.h"
+#include "mm/uncached/kmm_uncached_malloc.h"
+#include "test_util.h"
+
+using evisor_test::Dies;
+using evisor_test::NowNsec;
+
+// The 1 MiB uncached region, backed by host memory set up in main()
+uint64_t kUncachedStart;
+uint64_t kUncachedSize = 1024 * 1024;
+uint64_t kUncachedEnd;
+
+namespace {
+
+constexpr size_t kPages = 1024 * 1024 / PAGE_SIZE;
+
+// The previous allocator: a first-fit scan over per-page reference counts.
+// Its free only cleared the first page of a run, so multi-page runs leaked.
+class FirstFitRegion {
+ public:
+  void* Allocate(size_t size) {
+    const size_t num_pages = __builtin_align_up(size, PAGE_SIZE) / PAGE_SIZE;
+    for (size_t i = 0; i < kPages; i++) {
+      if (IsAvailable(i, num_pages)) {
+        for (size_t j = 0; j < num_pages; j++) {
+          pages_[i + j].ref_count++;
+          pages_[i + j].size = num_pages;
+        }
+        return reinterpret_cast<void*>(kUncachedStart + i * PAGE_SIZE);
+      }
+    }
+    return nullptr;
+  }
+
+  void Free(void* va) {
+    const auto idx = (reinterpret_cast<uint64_t>(va) - kUncachedStart) /
+                     PAGE_SIZE;
+    const size_t len = pages_[idx].size;
+    for (size_t i = 0; i < len; i++) {
+      pages_[idx].size = 0;
+      pages_[idx].ref_count--;
+    }
+  }
+
+ private:
+  struct Page {
+    uint32_t ref_count;
+    uint32_t size;
+  };
+
+  bool IsAvailable(size_t start, size_t num_pages) {
+    for (size_t i = 0; i < num_pages; i++) {
+      if (start + i >= kPages || pages_[start + i].ref_count != 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Page pages_[kPages] = {};
+};
+
+void TestAllocations() {
+  struct Live {
+    uint8_t* va;
+    size_t size;
+  };
+  std::mt19937 rng(4);
+  std::vector<Live> live;
+  std::vector<bool> used(kPages, false);
+
+  for (int op = 0; op < 50000; op++) {
+    if (live.size() < 24 && (live.empty() || rng() % 2)) {
+      const size_t size = rng() % 4 ? 1 + rng() % PAGE_SIZE
+                                    : (1 + rng() % 4) * PAGE_SIZE;
+      auto* p = static_cast<uint8_t*>(evisor::kmm_uncached_malloc(size));
+      const size_t idx = (reinterpret_cast<uint64_t>(p) - kUncachedStart) /
+                         PAGE_SIZE;
+      const size_t pages = __builtin_align_up(size, PAGE_SIZE) / PAGE_SIZE;
+      CHECK(idx + pages <= kPages);
+      for (size_t i = idx; i < idx + pages; i++) {
+        CHECK(!used[i]);
+        used[i] = true;
+      }
+      live.push_back({p, size});
+    } else {
+      const size_t i = rng() % live.size();
+      const Live a = live[i];
+      live[i] = live.back();
+      live.pop_back();
+      const size_t idx = (reinterpret_cast<uint64_t>(a.va) - kUncachedStart) /
+                         PAGE_SIZE;
+      const size_t pages = __builtin_align_up(a.size, PAGE_SIZE) / PAGE_SIZE;
+      for (size_t j = idx; j < idx + pages; j++) {
+        used[j] = false;
+      }
+      evisor::kmm_uncached_free(a.va);
+    }
+  }
+  for (const auto& a : live) {
+    evisor::kmm_uncached_free(a.va);
+  }
+
+  // Every page came back: the pool is full and the rest coalesced.
+  const auto& pool = evisor::kmm_uncached_get_pool_stat();
+  CHECK_EQ(pool.free_pages, pool.pages);
+  const auto& region = evisor::kmm_uncached_get_region();
+  CHECK_EQ(region.GetStat().free_pages + pool.pages, kPages);
+  CHECK(pool.hits > 0);
+
+  // A pool page freed twice
+  CHECK(Dies([] {
+    void* p = evisor::kmm_uncached_malloc(512);
+    evisor::kmm_uncached_free(p);
+    evisor::kmm_uncached_free(p);
+  }));
+}
+
+// Time the allocate/free pair of a sector read, with |held| one-page
+// buffers allocated for good beforehand, e.g. virtqueue rings.
+template <typename Alloc, typename Free>
+double TimeSectorBuffer(size_t held, Alloc alloc, Free free) {
+  std::vector<void*> keep;
+  for (size_t i = 0; i < held; i++) {
+    keep.push_back(alloc(PAGE_SIZE));
+  }
+  constexpr int kIters = 100000;
+  const double start = NowNsec();
+  for (int i = 0; i < kIters; i++) {
+    free(alloc(512));
+  }
+  const double ns = (NowNsec() - start) / kIters;
+  for (auto* p : keep) {
+    free(p);
+  }
+  return ns;
+}
+
+void Benchmark() {
+  static FirstFitRegion first_fit;
+  printf("%6s %14s %14s\n", "HELD", "FIRST-FIT(ns)", "POOL(ns)");
+  for (size_t held : {0, 8, 64, 192}) {
+    const double old_ns = TimeSectorBuffer(
+        held, [](size_t size) { return first_fit.Allocate(size); },
+        [](void* p) { first_fit.Free(p); });
+    const double new_ns = TimeSectorBuffer(
+        held, [](size_t size) { return evisor::kmm_uncached_malloc(size); },
+        [](void* p) { evisor::kmm_uncached_free(p); });
+    printf("%6zu %14.1f %14.1f\n", held, old_ns, new_ns);
+  }
+
+  // Two-page runs leaked on every free in the old scheme.
+  size_t runs = 0;
+  while (void* p = first_fit.Allocate(2 * PAGE_SIZE)) {
+    first_fit.Free(p);
+    runs++;
+  }
+  printf("first-fit: region exhausted after %zu two-page alloc/free pairs\n",
+         runs);
+}
+
+}  // namespace
+
+int main() {
+  auto* region = std::aligned_alloc(1024 * 1024, kUncachedSize);
+  CHECK(region != nullptr);
+  kUncachedStart = reinterpret_cast<uint64_t>(region);
+  kUncachedEnd = kUncachedStart + kUncachedSize;
+
+  TestAllocations();
+  Benchmark();
+
+  std::free(region);
+  return 0;
+}
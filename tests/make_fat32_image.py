@@ -0,0 +1,211 @@
+#!/usr/bin/env python3
+"""Build the FAT32 disk image the Fat32Fs host test reads.
+
+The image has an MBR with one FAT32 (LBA) partition of 512-byte clusters:
+
+  /kernel.img             3 MiB, contiguous
+  /frag.bin               700 KiB, fragmented
+  /small.txt, /empty.cfg
+  /filler_000.dat ...     120 small files, so that the root directory spans
+                          several fragmented clusters and long names cross
+                          sector boundaries
+  /guests/vm1.img         fragmented
+  /guests/Linux-Guest.IMG mixed-case long name
+  /guests/cfg/vm.cfg      nested directory
+  /broken.bin             cluster chain cut short by a free cluster
+
+Every name gets long name entries. A manifest next to the image lists each
+file as "<path> <size> <extents> <crc32>".
+
+Usage: make_fat32_image.py <image>
+"""
+
+import random
+import struct
+import sys
+import zlib
+
+SECTOR = 512
+PART_LBA = 2048
+# Just above the FAT32 minimum of 65525 clusters
+CLUSTERS = 70000
+RESERVED = 32
+NUM_FATS = 2
+FAT_SECTORS = (CLUSTERS + 2) * 4 // SECTOR + 1
+DATA_FIRST = RESERVED + NUM_FATS * FAT_SECTORS
+TOTAL_SECTORS = DATA_FIRST + CLUSTERS
+ROOT_CLUSTER = 2
+
+ATTR_DIR = 0x10
+ATTR_ARCHIVE = 0x20
+ATTR_LFN = 0x0f
+END_OF_CHAIN = 0x0fffffff
+
+
+class Image:
+    def __init__(self):
+        self.data = bytearray((PART_LBA + TOTAL_SECTORS) * SECTOR)
+        self.fat = [0] * (CLUSTERS + 2)
+        self.fat[0] = 0x0ffffff8
+        self.fat[1] = END_OF_CHAIN
+        self.fat[ROOT_CLUSTER] = END_OF_CHAIN
+        self.next_free = ROOT_CLUSTER + 1
+        self.short_names = 0
+        self.manifest = []
+
+    def alloc(self, count, fragmented):
+        """Chain |count| free clusters, skipping a few now and then."""
+        clusters = []
+        while len(clusters) < count:
+            if fragmented and random.random() < 0.3:
+                self.next_free += random.randint(1, 5)
+            clusters.append(self.next_free)
+            self.next_free += 1
+        for cur, nxt in zip(clusters, clusters[1:]):
+            self.fat[cur] = nxt
+        self.fat[clusters[-1]] = END_OF_CHAIN
+        return clusters
+
+    def write(self, clusters, payload):
+        for i, cluster in enumerate(clusters):
+            chunk = payload[i * SECTOR:(i + 1) * SECTOR]
+            offset = (PART_LBA + DATA_FIRST + cluster - 2) * SECTOR
+            self.data[offset:offset + len(chunk)] = chunk
+
+    def add_file(self, path, size, fragmented=False, listed=True):
+        payload = random.randbytes(size)
+        clusters = self.alloc(-(-size // SECTOR), fragmented) if size else []
+        self.write(clusters, payload)
+        extents = sum(1 for i, c in enumerate(clusters)
+                      if i == 0 or c != clusters[i - 1] + 1)
+        if listed:
+            self.manifest.append('%s %d %d %08x' %
+                                 (path, size, extents, zlib.crc32(payload)))
+        return clusters[0] if clusters else 0
+
+    def entries(self, name, attr, cluster, size):
+        """Long name entries followed by the short entry of |name|."""
+        self.short_names += 1
+        suffix = '~%d' % self.short_names
+        stem, _, ext = name.partition('.')
+        short = ((stem.upper()[:8 - len(suffix)] + suffix).ljust(8) +
+                 ext.upper()[:3].ljust(3)).encode()
+        checksum = 0
+        for byte in short:
+            checksum = (((checksum & 1) << 7) + (checksum >> 1) + byte) & 0xff
+
+        chars = [ord(ch) for ch in name] + [0]
+        while len(chars) % 13:
+            chars.append(0xffff)
+        parts = [chars[i:i + 13] for i in range(0, len(chars), 13)]
+        result = []
+        for seq in range(len(parts), 0, -1):
+            part = parts[seq - 1]
+            order = seq | (0x40 if seq == len(parts) else 0)
+            units = [struct.pack('<H', ch) for ch in part]
+            result.append(struct.pack('<B10sBBB12sH4s', order,
+                                      b''.join(units[0:5]), ATTR_LFN, 0,
+                                      checksum, b''.join(units[5:11]), 0,
+                                      b''.join(units[11:13])))
+        result.append(short_entry(short, attr, cluster, size))
+        return result
+
+    def add_dir(self, entries, fragmented=True, clusters=None):
+        """Write a directory, allocating its clusters unless given."""
+        raw = b''.join(entries)
+        if clusters is None:
+            clusters = self.alloc(-(-len(raw) // SECTOR) + 1, fragmented)
+        self.write(clusters, raw + bytes(len(clusters) * SECTOR - len(raw)))
+        return clusters
+
+    def finish(self, path):
+        table = b''.join(struct.pack('<I', v) for v in self.fat)
+        for i in range(NUM_FATS):
+            offset = (PART_LBA + RESERVED + i * FAT_SECTORS) * SECTOR
+            self.data[offset:offset + len(table)] = table
+
+        bpb = bytearray(SECTOR)
+        struct.pack_into('<3s8sHBHBHHBHHHIIIHHIHH12sBBBI11s8s', bpb, 0,
+                         b'\xeb\x58\x90', b'MSWIN4.1', SECTOR, 1, RESERVED,
+                         NUM_FATS, 0, 0, 0xf8, 0, 63, 255, PART_LBA,
+                         TOTAL_SECTORS, FAT_SECTORS, 0, 0, ROOT_CLUSTER, 1,
+                         6, bytes(12), 0x80, 0, 0x29, 0x1234, b'EVISORTEST ',
+                         b'FAT32   ')
+        struct.pack_into('<H', bpb, 510, 0xaa55)
+        self.data[PART_LBA * SECTOR:(PART_LBA + 1) * SECTOR] = bpb
+
+        mbr = bytearray(SECTOR)
+        struct.pack_into('<B3sB3sII', mbr, 446, 0x80, b'\0\0\0', 0x0c,
+                         b'\0\0\0', PART_LBA, TOTAL_SECTORS)
+        struct.pack_into('<H', mbr, 510, 0xaa55)
+        self.data[0:SECTOR] = mbr
+
+        with open(path, 'wb') as f:
+            f.write(self.data)
+        with open(path + '.manifest', 'w') as f:
+            f.write('\n'.join(self.manifest) + '\n')
+
+
+def short_entry(name, attr, cluster, size):
+    return struct.pack('<11sBBBHHHHHHHI', name, attr, 0, 0, 0, 0, 0,
+                       cluster >> 16, 0, 0, cluster & 0xffff, size)
+
+
+def dot_entries(own, parent):
+    return [short_entry(b'.          ', ATTR_DIR, own, 0),
+            short_entry(b'..         ', ATTR_DIR, parent, 0)]
+
+
+def main():
+    random.seed(7)
+    image = Image()
+
+    root = []
+    for name, size, fragmented in [('kernel.img', 3 * 1024 * 1024 + 123,
+                                    False),
+                                   ('frag.bin', 700 * 1024 + 5, True),
+                                   ('small.txt', 100, False),
+                                   ('empty.cfg', 0, False)]:
+        cluster = image.add_file(name, size, fragmented)
+        root += image.entries(name, ATTR_ARCHIVE, cluster, size)
+    for i in range(120):
+        name = 'filler_%03d.dat' % i
+        cluster = image.add_file(name, 600 + i)
+        root += image.entries(name, ATTR_ARCHIVE, cluster, 600 + i)
+
+    # A chain cut short by a free cluster, left out of the manifest
+    cluster = image.add_file('broken.bin', 3 * SECTOR, listed=False)
+    image.fat[image.fat[cluster]] = 0
+    root += image.entries('broken.bin', ATTR_ARCHIVE, cluster, 3 * SECTOR)
+
+    guests = []
+    for name, size in [('vm1.img', 200 * 1024 + 7),
+                       ('Linux-Guest.IMG', 4097)]:
+        cluster = image.add_file('guests/' + name, size, True)
+        guests.append((name, cluster, size))
+    cfg_cluster = image.add_file('guests/cfg/vm.cfg', 321)
+
+    # Directories point at each other, so their clusters come first.
+    guests_clusters = image.alloc(2, True)
+    cfg_clusters = image.alloc(1, False)
+    entries = dot_entries(guests_clusters[0], 0)
+    for name, cluster, size in guests:
+        entries += image.entries(name, ATTR_ARCHIVE, cluster, size)
+    entries += image.entries('cfg', ATTR_DIR, cfg_clusters[0], 0)
+    image.add_dir(entries, clusters=guests_clusters)
+    entries = dot_entries(cfg_clusters[0], guests_clusters[0])
+    entries += image.entries('vm.cfg', ATTR_ARCHIVE, cfg_cluster, 321)
+    image.add_dir(entries, clusters=cfg_clusters)
+    root += image.entries('guests', ATTR_DIR, guests_clusters[0], 0)
+
+    # The root directory continues in fragmented clusters after cluster 2.
+    needed = -(-len(b''.join(root)) // SECTOR)
+    rest = image.alloc(needed - 1, True)
+    image.fat[ROOT_CLUSTER] = rest[0]
+    image.add_dir(root, clusters=[ROOT_CLUSTER] + rest)
+
+    image.finish(sys.argv[1])
+
+
+if __name__ == '__main__':
+    main()
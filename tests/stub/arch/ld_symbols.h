@@ -0,0 +1,20 @@
+#ifndef EVISOR_TESTS_STUB_ARCH_LD_SYMBOLS_H_
+#define EVISOR_TESTS_STUB_ARCH_LD_SYMBOLS_H_
+
+#include <cstdint>
+
+// Host replacement for src/arch/ld_symbols.h. The regions are variables, set
+// by each test before the code under test first uses them.
+extern uint64_t kHeapStart;
+extern uint64_t kHeapEnd;
+extern uint64_t kHeapSize;
+
+extern uint64_t kUncachedStart;
+extern uint64_t kUncachedEnd;
+extern uint64_t kUncachedSize;
+
+extern uint64_t kUserStart;
+extern uint64_t kUserEnd;
+extern uint64_t kUserSize;
+
+#endif  // EVISOR_TESTS_STUB_ARCH_LD_SYMBOLS_H_
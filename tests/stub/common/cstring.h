@@ -0,0 +1,22 @@
+#ifndef EVISOR_TESTS_STUB_COMMON_CSTRING_H_
+#define EVISOR_TESTS_STUB_COMMON_CSTRING_H_
+
+// Host replacement for src/common/cstring.h, whose memcpy() returns void and
+// clashes with the C library's.
+
+#include <cstring>
+
+namespace evisor {
+
+using ::memcpy;
+using ::memset;
+using ::strlen;
+using ::strncmp;
+
+inline void memzero(void* buf, size_t n) {
+  ::memset(buf, 0, n);
+}
+
+}  // namespace evisor
+
+#endif  // EVISOR_TESTS_STUB_COMMON_CSTRING_H_
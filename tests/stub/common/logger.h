@@ -0,0 +1,29 @@
+#ifndef EVISOR_TESTS_STUB_COMMON_LOGGER_H_
+#define EVISOR_TESTS_STUB_COMMON_LOGGER_H_
+
+// Host replacement for src/common/logger.h. Logs go to stderr, and PANIC
+// aborts so that a test fails instead of spinning.
+
+#include <cstdio>
+#include <cstdlib>
+
+#define _LOG_COMMON(level, format, ...)                              \
+  {                                                                  \
+    std::fprintf(stderr, "%s[%s(%d)] " format "\n", (level), __FILE__, \
+                 __LINE__, ##__VA_ARGS__);                           \
+  }
+
+#define PANIC(format, ...)                                 \
+  {                                                        \
+    _LOG_COMMON("[eVisor][PANIC]", format, ##__VA_ARGS__); \
+    std::abort();                                          \
+  }
+#define LOG_ERROR(format, ...) \
+  _LOG_COMMON("[eVisor][ERROR]", format, ##__VA_ARGS__)
+#define LOG_WARN(format, ...) \
+  _LOG_COMMON("[eVisor][WARN]", format, ##__VA_ARGS__)
+#define LOG_INFO(format, ...)
+#define LOG_DEBUG(format, ...)
+#define LOG_TRACE(format, ...)
+
+#endif  // EVISOR_TESTS_STUB_COMMON_LOGGER_H_
@@ -0,0 +1,51 @@
+#ifndef EVISOR_TESTS_STUB_DRIVERS_MMC_MMC_H_
+#define EVISOR_TESTS_STUB_DRIVERS_MMC_MMC_H_
+
+// Host replacement for src/drivers/mmc/mmc.h. The card is a disk image file
+// the test opens, and every read counts as one command.
+
+#include <cstdint>
+#include <cstdio>
+
+namespace evisor {
+
+class Mmc {
+ public:
+  struct Stat {
+    uint64_t commands;
+    uint64_t bytes;
+  };
+
+  static Mmc& Get() {
+    static Mmc instance;
+    return instance;
+  }
+
+  // Use |image| as the card. Must be called before Open().
+  void SetImage(FILE* image) { image_ = image; }
+  const Stat& GetStat() const { return stat_; }
+
+  bool Open() { return image_; }
+  bool Seek(uint64_t offset) {
+    offset_ = offset;
+    return true;
+  }
+  int Read(uint8_t* buf, uint32_t size) {
+    stat_.commands++;
+    stat_.bytes += size;
+    if (std::fseek(image_, static_cast<long>(offset_), SEEK_SET) ||
+        std::fread(buf, 1, size, image_) != size) {
+      return -1;
+    }
+    return static_cast<int>(size);
+  }
+
+ private:
+  FILE* image_ = nullptr;
+  uint64_t offset_ = 0;
+  Stat stat_ = {};
+};
+
+}  // namespace evisor
+
+#endif  // EVISOR_TESTS_STUB_DRIVERS_MMC_MMC_H_
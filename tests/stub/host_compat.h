@@ -0,0 +1,9 @@
+#ifndef EVISOR_TESTS_STUB_HOST_COMPAT_H_
+#define EVISOR_TESTS_STUB_HOST_COMPAT_H_
+
+// Clang builtins the kernel uses which the host compiler may lack.
+#if !__has_builtin(__builtin_align_up)
+#define __builtin_align_up(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#endif
+
+#endif  // EVISOR_TESTS_STUB_HOST_COMPAT_H_
@@ -0,0 +1,24 @@
+// The kernel heap and slab caches on top of the C library, for code which
+// allocates its buffers itself.
+
+#include <cstdlib>
+
+namespace evisor {
+
+void* kmm_malloc(size_t size) {
+  return std::aligned_alloc(4096, (size + 4095) & ~static_cast<size_t>(4095));
+}
+
+void kmm_free(void* va) {
+  std::free(va);
+}
+
+void* kmm_slab_alloc(size_t size) {
+  return std::malloc(size);
+}
+
+void kmm_slab_free(void* va) {
+  std::free(va);
+}
+
+}  // namespace evisor
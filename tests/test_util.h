@@ -0,0 +1,49 @@
+#ifndef EVISOR_TESTS_TEST_UTIL_H_
+#define EVISOR_TESTS_TEST_UTIL_H_
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+// Minimal checks for the host tests. A failed CHECK exits with an error, so
+// that ctest reports the test as failed.
+#define CHECK(cond)                                                        \
+  do {                                                                     \
+    if (!(cond)) {                                                         \
+      std::fprintf(stderr, "%s:%d: CHECK failed: %s\n", __FILE__, __LINE__, \
+                   #cond);                                                 \
+      std::exit(1);                                                        \
+    }                                                                      \
+  } while (0)
+
+#define CHECK_EQ(a, b) CHECK((a) == (b))
+
+namespace evisor_test {
+
+// Returns true if |fn| aborts, e.g. through PANIC.
+template <typename Fn>
+bool Dies(Fn fn) {
+  const pid_t pid = fork();
+  if (pid == 0) {
+    // Keep the expected panic message out of the test log.
+    freopen("/dev/null", "w", stderr);
+    fn();
+    std::_Exit(0);
+  }
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFSIGNALED(status);
+}
+
+inline double NowNsec() {
+  return std::chrono::duration<double, std::nano>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+}  // namespace evisor_test
+
+#endif  // EVISOR_TESTS_TEST_UTIL_H_
@@ -0,0 +1,144 @@
+// Tests of the user-page allocator: physical alignment, frees that must be
+// refused, and allocation cost as the region fills up.
+
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "mm/pgtable.h"
+#include "mm/user_heap/umm_malloc.h"
+#include "test_util.h"
+
+using evisor_test::Dies;
+using evisor_test::NowNsec;
+
+// The region starts one page past a 2 MiB boundary, so that an index
+// aligned within the region is not aligned physically. The allocator only
+// keeps bitmaps, so the region is never touched.
+uint64_t kUserStart = 0x4020'0000 + PAGE_SIZE;
+uint64_t kUserSize = 512 * 1024 * 1024;
+uint64_t kUserEnd = kUserStart + kUserSize;
+
+namespace {
+
+constexpr size_t kPages = 512 * 1024 * 1024 / PAGE_SIZE;
+
+size_t PageIndex(const void* va) {
+  return (reinterpret_cast<uint64_t>(va) - kUserStart) / PAGE_SIZE;
+}
+
+void TestAlignment() {
+  // Leave an odd page in use, so that the next free page is misaligned.
+  void* odd = evisor::umm_malloc(PAGE_SIZE);
+  for (size_t align = PAGE_SIZE; align <= 2 * 1024 * 1024; align *= 2) {
+    void* p = evisor::umm_memalign(align, 3 * PAGE_SIZE);
+    CHECK(p != nullptr);
+    CHECK_EQ(reinterpret_cast<uint64_t>(p) % align, 0u);
+    evisor::umm_free(p);
+  }
+  evisor::umm_free(odd);
+  CHECK_EQ(evisor::umm_get_stat().used_pages, 0u);
+}
+
+void TestBadFrees() {
+  auto* p = static_cast<uint8_t*>(evisor::umm_malloc(4 * PAGE_SIZE));
+  auto* q = static_cast<uint8_t*>(evisor::umm_malloc(PAGE_SIZE));
+
+  // From the middle of a run, unaligned, outside the region, and twice
+  CHECK(Dies([&] { evisor::umm_free(p + PAGE_SIZE); }));
+  CHECK(Dies([&] { evisor::umm_free(p + 8); }));
+  CHECK(Dies([&] { evisor::umm_free(p + kUserSize); }));
+  CHECK(Dies([&] {
+    evisor::umm_free(q);
+    evisor::umm_free(q);
+  }));
+
+  evisor::umm_free(p);
+  evisor::umm_free(q);
+  CHECK_EQ(evisor::umm_get_stat().used_pages, 0u);
+}
+
+void TestStress() {
+  struct Live {
+    void* va;
+    size_t pages;
+  };
+  std::mt19937 rng(3);
+  std::vector<Live> live;
+  std::vector<bool> used(kPages, false);
+  size_t used_pages = 0;
+
+  for (int op = 0; op < 100000; op++) {
+    if (live.empty() || (rng() % 100 < 60 && used_pages < kPages / 2)) {
+      const size_t pages = 1 + rng() % 16;
+      const size_t align = PAGE_SIZE << (rng() % 5);
+      void* p = evisor::umm_memalign(align, pages * PAGE_SIZE);
+      CHECK_EQ(reinterpret_cast<uint64_t>(p) % align, 0u);
+      for (size_t i = PageIndex(p); i < PageIndex(p) + pages; i++) {
+        CHECK(!used[i]);
+        used[i] = true;
+      }
+      live.push_back({p, pages});
+      used_pages += pages;
+    } else {
+      const size_t i = rng() % live.size();
+      const Live a = live[i];
+      live[i] = live.back();
+      live.pop_back();
+      for (size_t j = PageIndex(a.va); j < PageIndex(a.va) + a.pages; j++) {
+        used[j] = false;
+      }
+      evisor::umm_free(a.va);
+      used_pages -= a.pages;
+    }
+    CHECK_EQ(evisor::umm_get_stat().used_pages, used_pages);
+  }
+  for (const auto& a : live) {
+    evisor::umm_free(a.va);
+  }
+  CHECK_EQ(evisor::umm_get_stat().used_pages, 0u);
+}
+
+void TestColours() {
+  const uint32_t colours = evisor::umm_num_colours();
+  std::vector<void*> pages;
+  for (uint32_t c = 0; c < colours; c++) {
+    void* p = evisor::umm_malloc_coloured(1U << c);
+    CHECK_EQ(evisor::umm_page_colour(p), c);
+    pages.push_back(p);
+  }
+  for (auto* p : pages) {
+    evisor::umm_free(p);
+  }
+}
+
+// Time single-page allocate/free pairs as the region fills up.
+void Benchmark() {
+  std::vector<void*> held;
+  printf("%8s %12s\n", "USED(%)", "ALLOC(ns)");
+  for (int percent : {0, 25, 50, 75, 90, 99}) {
+    while (held.size() < kPages * percent / 100) {
+      held.push_back(evisor::umm_malloc(PAGE_SIZE));
+    }
+    constexpr int kIters = 20000;
+    const double start = NowNsec();
+    for (int i = 0; i < kIters; i++) {
+      evisor::umm_free(evisor::umm_malloc(PAGE_SIZE));
+    }
+    printf("%8d %12.1f\n", percent, (NowNsec() - start) / kIters);
+  }
+  for (auto* p : held) {
+    evisor::umm_free(p);
+  }
+}
+
+}  // namespace
+
+int main() {
+  TestAlignment();
+  TestBadFrees();
+  TestStress();
+  TestColours();
+  Benchmark();
+  return 0;
+}
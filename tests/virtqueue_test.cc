@@ -0,0 +1,336 @@
+// Tests of the virtqueue library: a driver queue and a device queue share
+// one ring in host memory. Chains are checked on both sides, bad used
+// entries must PANIC, and a benchmark times request round trips of the
+// split and the packed layouts.
+
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "drivers/virtio/virtqueue.h"
+#include "test_util.h"
+
+using evisor::VirtqBuffer;
+using evisor_test::Dies;
+using evisor_test::NowNsec;
+
+namespace {
+
+constexpr uint16_t kQueueSize = 16;
+constexpr uint16_t kMaxChain = 4;
+
+struct SplitQueue {
+  using Ring = evisor::VirtqSplitRing<kQueueSize, 4096>;
+  static constexpr bool kInOrder = false;
+
+  explicit SplitQueue(bool event_idx) {
+    driver.Init(ring.descs, &ring.avail, &ring.used, event_idx);
+    device.Init(ring.descs, &ring.avail, &ring.used, event_idx);
+  }
+
+  Ring ring = {};
+  evisor::VirtqSplitDriver<kQueueSize> driver;
+  evisor::VirtqSplitDevice<kQueueSize> device;
+};
+
+struct PackedQueue {
+  using Ring = evisor::VirtqPackedRing<kQueueSize>;
+  // The packed device gives chains back in the order it took them.
+  static constexpr bool kInOrder = true;
+
+  explicit PackedQueue(bool event_idx) {
+    driver.Init(ring.descs, &ring.driver_event, &ring.device_event,
+                event_idx);
+    device.Init(ring.descs, &ring.driver_event, &ring.device_event,
+                event_idx);
+  }
+
+  Ring ring = {};
+  evisor::VirtqPackedDriver<kQueueSize> driver;
+  evisor::VirtqPackedDevice<kQueueSize> device;
+};
+
+struct Chain {
+  bool in_flight;
+  uint16_t n;
+  VirtqBuffer bufs[kMaxChain];
+};
+
+// Random chains through the queue, many times around the ring, with the
+// device giving some of them back late and, where allowed, out of order.
+template <typename Queue>
+void TestLoopback(bool event_idx, uint32_t seed) {
+  auto* q = new Queue(event_idx);
+  std::mt19937 rng(seed);
+  Chain chains[kQueueSize] = {};
+  struct Popped {
+    uint16_t id;
+    uint16_t n;
+    uint32_t len;
+  };
+  std::vector<Popped> popped;
+  uint64_t next_addr = 0x1000;
+  size_t added = 0;
+  size_t used = 0;
+
+  for (int round = 0; round < 20000; round++) {
+    // Driver: add chains while descriptors are free.
+    const int to_add = rng() % 4;
+    for (int i = 0; i < to_add; i++) {
+      const uint16_t n = 1 + rng() % kMaxChain;
+      VirtqBuffer bufs[kMaxChain];
+      for (uint16_t j = 0; j < n; j++) {
+        bufs[j] = {.addr = next_addr,
+                   .len = static_cast<uint32_t>(1 + rng() % 4096),
+                   .device_writes = static_cast<bool>(rng() % 2)};
+        next_addr += 0x1000;
+      }
+      const uint16_t free_before = q->driver.NumFree();
+      uint16_t id;
+      if (!q->driver.Add(bufs, n, &id)) {
+        CHECK(free_before < n);
+        break;
+      }
+      CHECK(id < kQueueSize);
+      CHECK(!chains[id].in_flight);
+      CHECK_EQ(q->driver.NumFree(), free_before - n);
+      chains[id] = {.in_flight = true, .n = n, .bufs = {}};
+      std::copy(bufs, bufs + n, chains[id].bufs);
+      added++;
+    }
+    q->driver.PublishAvail();
+
+    // Device: take every available chain and check it.
+    VirtqBuffer bufs[kQueueSize];
+    uint16_t n;
+    uint16_t id;
+    while (q->device.Pop(bufs, kQueueSize, &n, &id)) {
+      CHECK(id < kQueueSize);
+      const Chain& chain = chains[id];
+      CHECK(chain.in_flight);
+      CHECK_EQ(n, chain.n);
+      uint32_t len = 0;
+      for (uint16_t j = 0; j < n; j++) {
+        CHECK_EQ(bufs[j].addr, chain.bufs[j].addr);
+        CHECK_EQ(bufs[j].len, chain.bufs[j].len);
+        CHECK_EQ(bufs[j].device_writes, chain.bufs[j].device_writes);
+        len += bufs[j].device_writes ? bufs[j].len : 0;
+      }
+      popped.push_back({id, n, len});
+    }
+
+    // Give back some of them.
+    if (!Queue::kInOrder) {
+      std::shuffle(popped.begin(), popped.end(), rng);
+    }
+    const size_t to_push = popped.empty() ? 0 : rng() % (popped.size() + 1);
+    for (size_t i = 0; i < to_push; i++) {
+      q->device.Push(popped[i].id, popped[i].n, popped[i].len);
+    }
+    popped.erase(popped.begin(), popped.begin() + to_push);
+    q->device.PublishUsed();
+
+    // Driver: harvest, checking each chain was in flight.
+    evisor::VirtqHarvest(q->driver, [&](uint16_t id, uint32_t len) {
+      CHECK(id < kQueueSize);
+      Chain& chain = chains[id];
+      CHECK(chain.in_flight);
+      uint32_t expected = 0;
+      for (uint16_t j = 0; j < chain.n; j++) {
+        expected += chain.bufs[j].device_writes ? chain.bufs[j].len : 0;
+      }
+      CHECK_EQ(len, expected);
+      chain.in_flight = false;
+      used++;
+    });
+  }
+
+  // Drain the rest.
+  for (const auto& p : popped) {
+    q->device.Push(p.id, p.n, p.len);
+  }
+  q->device.PublishUsed();
+  evisor::VirtqHarvest(q->driver, [&](uint16_t id, uint32_t) {
+    CHECK(chains[id].in_flight);
+    chains[id].in_flight = false;
+    used++;
+  });
+  CHECK_EQ(used, added);
+  CHECK_EQ(q->driver.NumFree(), kQueueSize);
+  delete q;
+}
+
+// Make one chain of three buffers go through the device, and return its ID.
+template <typename Queue>
+uint16_t RoundTrip(Queue* q) {
+  const VirtqBuffer bufs[3] = {
+      {.addr = 0x1000, .len = 16, .device_writes = false},
+      {.addr = 0x2000, .len = 512, .device_writes = true},
+      {.addr = 0x3000, .len = 1, .device_writes = true},
+  };
+  uint16_t id;
+  CHECK(q->driver.Add(bufs, 3, &id));
+  q->driver.PublishAvail();
+  VirtqBuffer popped[3];
+  uint16_t n;
+  uint16_t dev_id;
+  CHECK(q->device.Pop(popped, 3, &n, &dev_id));
+  CHECK_EQ(dev_id, id);
+  q->device.Push(dev_id, n, 513);
+  q->device.PublishUsed();
+  uint32_t len;
+  CHECK(q->driver.GetUsed(&dev_id, &len));
+  CHECK_EQ(dev_id, id);
+  return id;
+}
+
+void TestBadUsedEntries() {
+  // Split: an ID past the descriptor table
+  CHECK(Dies([] {
+    auto* q = new SplitQueue(false);
+    RoundTrip(q);
+    const VirtqBuffer buf = {.addr = 0x1000, .len = 1, .device_writes = true};
+    uint16_t id;
+    q->driver.Add(&buf, 1, &id);
+    q->driver.PublishAvail();
+    q->ring.used.ring[1] = {.id = kQueueSize + 3, .len = 0};
+    q->ring.used.index = 2;
+    uint32_t len;
+    q->driver.GetUsed(&id, &len);
+  }));
+
+  // Split: an ID used twice, which used to be spliced onto the free list
+  // again
+  CHECK(Dies([] {
+    auto* q = new SplitQueue(false);
+    const uint16_t id = RoundTrip(q);
+    q->ring.used.ring[1] = {.id = id, .len = 0};
+    q->ring.used.index = 2;
+    uint32_t len;
+    uint16_t used_id;
+    q->driver.GetUsed(&used_id, &len);
+  }));
+
+  // Split: an ID in range that heads no chain in flight
+  CHECK(Dies([] {
+    auto* q = new SplitQueue(false);
+    const VirtqBuffer buf = {.addr = 0x1000, .len = 1, .device_writes = true};
+    uint16_t id;
+    q->driver.Add(&buf, 1, &id);
+    q->driver.PublishAvail();
+    q->ring.used.ring[0] = {.id = static_cast<uint32_t>(id + 1), .len = 0};
+    q->ring.used.index = 1;
+    uint32_t len;
+    q->driver.GetUsed(&id, &len);
+  }));
+
+  // Split: a chain looping on itself
+  CHECK(Dies([] {
+    auto* q = new SplitQueue(false);
+    const VirtqBuffer bufs[2] = {
+        {.addr = 0x1000, .len = 1, .device_writes = false},
+        {.addr = 0x2000, .len = 1, .device_writes = true},
+    };
+    uint16_t id;
+    q->driver.Add(bufs, 2, &id);
+    q->driver.PublishAvail();
+    const uint16_t second = q->ring.descs[id].next;
+    q->ring.descs[second].flags |= evisor::kVirtqDescFNext;
+    q->ring.descs[second].next = id;
+    q->ring.used.ring[0] = {.id = id, .len = 1};
+    q->ring.used.index = 1;
+    uint32_t len;
+    q->driver.GetUsed(&id, &len);
+  }));
+
+  // Packed: an ID past the queue size, which used to be left in the ring
+  // with GetUsed() failing on it forever
+  CHECK(Dies([] {
+    auto* q = new PackedQueue(false);
+    const VirtqBuffer buf = {.addr = 0x1000, .len = 1, .device_writes = true};
+    uint16_t id;
+    q->driver.Add(&buf, 1, &id);
+    q->driver.PublishAvail();
+    VirtqBuffer popped;
+    uint16_t n;
+    q->device.Pop(&popped, 1, &n, &id);
+    q->device.Push(kQueueSize, n, 1);
+    q->device.PublishUsed();
+    evisor::VirtqHarvest(q->driver, [](uint16_t, uint32_t) {});
+  }));
+
+  // Packed: an ID used twice
+  CHECK(Dies([] {
+    auto* q = new PackedQueue(false);
+    const uint16_t id = RoundTrip(q);
+    q->device.Push(id, 1, 1);
+    q->device.PublishUsed();
+    evisor::VirtqHarvest(q->driver, [](uint16_t, uint32_t) {});
+  }));
+
+  // A well-behaved round trip does not die.
+  CHECK(!Dies([] {
+    auto* q = new PackedQueue(true);
+    RoundTrip(q);
+    delete q;
+  }));
+}
+
+// Time request round trips: |batch| chains of three buffers, like a block
+// request, are added, taken by the device, given back and harvested.
+template <typename Queue>
+double TimeRoundTrips(bool event_idx, uint16_t batch) {
+  auto* q = new Queue(event_idx);
+  const VirtqBuffer bufs[3] = {
+      {.addr = 0x1000, .len = 16, .device_writes = false},
+      {.addr = 0x2000, .len = 4096, .device_writes = true},
+      {.addr = 0x3000, .len = 1, .device_writes = true},
+  };
+  constexpr int kRequests = 1000000;
+  size_t harvested = 0;
+  const double start = NowNsec();
+  for (int done = 0; done < kRequests; done += batch) {
+    uint16_t id;
+    for (uint16_t i = 0; i < batch; i++) {
+      q->driver.Add(bufs, 3, &id);
+    }
+    q->driver.PublishAvail();
+    VirtqBuffer popped[3];
+    uint16_t n;
+    while (q->device.Pop(popped, 3, &n, &id)) {
+      q->device.Push(id, n, 4097);
+    }
+    q->device.PublishUsed();
+    harvested +=
+        evisor::VirtqHarvest(q->driver, [](uint16_t, uint32_t) {});
+  }
+  const double ns = (NowNsec() - start) / harvested;
+  CHECK_EQ(q->driver.NumFree(), kQueueSize);
+  delete q;
+  return ns;
+}
+
+void Benchmark() {
+  printf("%6s %10s %14s %14s\n", "BATCH", "EVENT_IDX", "SPLIT(ns)",
+         "PACKED(ns)");
+  for (uint16_t batch : {1, 5}) {
+    for (bool event_idx : {false, true}) {
+      printf("%6u %10s %14.1f %14.1f\n", batch, event_idx ? "yes" : "no",
+             TimeRoundTrips<SplitQueue>(event_idx, batch),
+             TimeRoundTrips<PackedQueue>(event_idx, batch));
+    }
+  }
+}
+
+}  // namespace
+
+int main() {
+  for (bool event_idx : {false, true}) {
+    TestLoopback<SplitQueue>(event_idx, 5);
+    TestLoopback<PackedQueue>(event_idx, 6);
+  }
+  TestBadUsedEntries();
+  Benchmark();
+  return 0;
+}
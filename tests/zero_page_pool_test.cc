@@ -0,0 +1,76 @@
+// Tests of ZeroPagePool with an allocator that runs out of pages.
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include "mm/pgtable.h"
+#include "mm/zero_page_pool.h"
+#include "test_util.h"
+
+using evisor::ZeroPagePool;
+using evisor_test::Dies;
+
+namespace {
+
+size_t pagesLeft = 0;
+
+void* TryAlloc(size_t size) {
+  if (pagesLeft == 0) {
+    return nullptr;
+  }
+  pagesLeft--;
+  void* page = std::aligned_alloc(PAGE_SIZE, size);
+  memset(page, 0xa5, size);
+  return page;
+}
+
+bool IsZero(const void* page) {
+  const auto* p = static_cast<const uint8_t*>(page);
+  for (size_t i = 0; i < PAGE_SIZE; i++) {
+    if (p[i]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+}  // namespace
+
+int main() {
+  ZeroPagePool pool(TryAlloc, 16);
+
+  // A refill with memory nearly full stops early rather than PANICking.
+  pagesLeft = 3;
+  pool.Refill(ZeroPagePool::kRefillBatch);
+  CHECK_EQ(pool.GetStat().free_pages, 3u);
+  CHECK_EQ(pool.GetStat().refills, 3u);
+  pool.Refill(ZeroPagePool::kRefillBatch);
+  CHECK_EQ(pool.GetStat().free_pages, 3u);
+
+  for (int i = 0; i < 3; i++) {
+    void* page = pool.Allocate();
+    CHECK(IsZero(page));
+    std::free(page);
+  }
+  CHECK_EQ(pool.GetStat().hits, 3u);
+
+  // An empty pool zeroes synchronously, and only PANICs without any page.
+  pagesLeft = 1;
+  void* page = pool.Allocate();
+  CHECK(IsZero(page));
+  std::free(page);
+  CHECK_EQ(pool.GetStat().misses, 1u);
+  CHECK(Dies([&] { pool.Allocate(); }));
+
+  // The refill never goes beyond the pool size.
+  pagesLeft = 100;
+  for (int i = 0; i < 4; i++) {
+    pool.Refill(ZeroPagePool::kRefillBatch);
+  }
+  CHECK_EQ(pool.GetStat().free_pages, 16u);
+  while (pool.GetStat().free_pages) {
+    std::free(pool.Allocate());
+  }
+  return 0;
+}